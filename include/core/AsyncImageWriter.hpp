@@ -0,0 +1,209 @@
+#ifndef ASYNCIMAGEWRITER_HPP
+#define ASYNCIMAGEWRITER_HPP
+
+#include <condition_variable>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "FrameSaver.hpp"
+
+// Encodes and writes FrameSnapshots on a thread of its own, so the render loop only pays for the copy.
+//
+// Queued snapshots are limited in number of jobs and in bytes, a snapshot shared by several jobs
+// counting once. A job that does not fit either blocks the caller until the writer catches up
+// (Overflow::Block), or pushes the oldest queued jobs out (Overflow::DropOldest), which suits
+// progress snapshots that a newer one makes stale anyway. Neither the job being written nor the other
+// jobs of the snapshot being queued are dropped, and their bytes still count, so DropOldest may go over
+// the cap by that much rather than stall.
+//
+// Flush() waits for the queue to drain and tells whether every job since the last Flush() was written;
+// the destructor flushes, so nothing queued is lost at shutdown.
+class AsyncImageWriter
+{
+public:
+    enum class Overflow
+    {
+        Block,
+        DropOldest
+    };
+
+    AsyncImageWriter(size_t memoryCap, size_t maxJobs, Overflow overflow = Overflow::Block);
+    ~AsyncImageWriter();
+
+    void SaveImage(std::shared_ptr<const FrameSnapshot> snapshot, const std::string &fileName, Global::ImageType type, bool withAovs = false);
+    void SaveAov(std::shared_ptr<const FrameSnapshot> snapshot, const std::string &fileName, FrameSaver::Aov aov, Global::ImageType type);
+
+    // Blocks until every queued job is written. False when a job since the last call failed, dropped jobs aside.
+    bool Flush();
+
+    size_t QueuedBytes() const;
+    size_t Dropped() const;
+
+private:
+    struct Job
+    {
+        std::shared_ptr<const FrameSnapshot> Snapshot;
+        std::string FileName;
+        Global::ImageType Type;
+        bool IsAov;
+        FrameSaver::Aov Aov;
+        bool WithAovs;
+    };
+
+    size_t memoryCap;
+    size_t maxJobs;
+    Overflow overflow;
+
+    std::deque<Job> jobs;
+    std::map<const FrameSnapshot *, unsigned int> snapshotJobs; // jobs queued or running per snapshot
+    size_t queuedBytes = 0;
+    size_t dropped = 0;
+    size_t failed = 0; // since the last Flush()
+    bool writing = false;
+    bool stopping = false;
+
+    mutable std::mutex mutex;
+    std::condition_variable jobAdded;
+    std::condition_variable jobDone;
+    std::thread writer;
+
+    void Submit(Job job);
+    void Release(const FrameSnapshot *snapshot);
+    bool Fits(const Job &job) const;
+    void WriterLoop();
+};
+
+AsyncImageWriter::AsyncImageWriter(size_t memoryCap, size_t maxJobs, Overflow overflow)
+    : memoryCap(memoryCap), maxJobs(std::max<size_t>(maxJobs, 1)), overflow(overflow)
+{
+    writer = std::thread(&AsyncImageWriter::WriterLoop, this);
+}
+
+AsyncImageWriter::~AsyncImageWriter()
+{
+    Flush();
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    jobAdded.notify_all();
+    writer.join();
+}
+
+void AsyncImageWriter::SaveImage(std::shared_ptr<const FrameSnapshot> snapshot, const std::string &fileName, Global::ImageType type, bool withAovs)
+{
+    if (snapshot)
+        Submit({std::move(snapshot), fileName, type, false, FrameSaver::Aov::Albedo, withAovs});
+}
+
+void AsyncImageWriter::SaveAov(std::shared_ptr<const FrameSnapshot> snapshot, const std::string &fileName, FrameSaver::Aov aov, Global::ImageType type)
+{
+    if (snapshot)
+        Submit({std::move(snapshot), fileName, type, true, aov, false});
+}
+
+bool AsyncImageWriter::Flush()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    jobDone.wait(lock, [this] { return jobs.empty() && !writing; });
+    bool written = failed == 0;
+    failed = 0;
+    return written;
+}
+
+size_t AsyncImageWriter::QueuedBytes() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return queuedBytes;
+}
+
+size_t AsyncImageWriter::Dropped() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return dropped;
+}
+
+bool AsyncImageWriter::Fits(const Job &job) const
+{
+    // a snapshot already queued costs nothing more, and an empty queue takes anything
+    size_t bytes = snapshotJobs.count(job.Snapshot.get()) ? 0 : job.Snapshot->Bytes();
+    if (jobs.empty() && !writing)
+        return true;
+    return jobs.size() < maxJobs && queuedBytes + bytes <= memoryCap;
+}
+
+void AsyncImageWriter::Submit(Job job)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+
+    if (overflow == Overflow::Block)
+        jobDone.wait(lock, [&] { return Fits(job); });
+    else
+    {
+        // the other outputs of the same snapshot are as new as this one, they stay
+        auto oldest = jobs.begin();
+        while (!Fits(job))
+        {
+            while (oldest != jobs.end() && oldest->Snapshot == job.Snapshot)
+                ++oldest;
+            if (oldest == jobs.end())
+                break;
+
+            std::cout << "AsyncImageWriter: dropped " << oldest->FileName << std::endl;
+            Release(oldest->Snapshot.get());
+            oldest = jobs.erase(oldest);
+            dropped++;
+        }
+    }
+
+    if (snapshotJobs[job.Snapshot.get()]++ == 0)
+        queuedBytes += job.Snapshot->Bytes();
+    jobs.push_back(std::move(job));
+    lock.unlock();
+    jobAdded.notify_one();
+}
+
+// Called with the lock held, when a job is done with its snapshot.
+void AsyncImageWriter::Release(const FrameSnapshot *snapshot)
+{
+    auto entry = snapshotJobs.find(snapshot);
+    if (--entry->second == 0)
+    {
+        queuedBytes -= snapshot->Bytes();
+        snapshotJobs.erase(entry);
+    }
+}
+
+void AsyncImageWriter::WriterLoop()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true)
+    {
+        jobAdded.wait(lock, [this] { return stopping || !jobs.empty(); });
+        if (jobs.empty())
+            return;
+
+        Job job = std::move(jobs.front());
+        jobs.pop_front();
+        writing = true;
+        lock.unlock();
+
+        bool written = job.IsAov ? FrameSaver::WriteAov(*job.Snapshot, job.FileName.c_str(), job.Aov, job.Type)
+                                 : FrameSaver::WriteImage(*job.Snapshot, job.FileName.c_str(), job.Type, job.WithAovs);
+        if (!written)
+            std::cout << "ERROR::ASYNCIMAGEWRITER:: Failed to write " << job.FileName << std::endl;
+
+        lock.lock();
+        failed += written ? 0 : 1;
+        writing = false;
+        Release(job.Snapshot.get());
+        jobDone.notify_all();
+    }
+}
+
+#endif
@@ -0,0 +1,1068 @@
+#ifndef BVH_HPP
+#define BVH_HPP
+
+#include <glm/glm.hpp>
+
+#include <vector>
+#include <algorithm>
+#include <numeric>
+#include <atomic>
+#include <cstdint>
+#include <cfloat>
+#include <functional>
+
+#include "ThreadPool.hpp"
+
+// Axis aligned bounding box--------------------------------------------------------------------------
+struct Aabb
+{
+    glm::vec3 Min = glm::vec3(FLT_MAX);
+    glm::vec3 Max = glm::vec3(-FLT_MAX);
+
+    void Grow(const glm::vec3 &p)
+    {
+        Min = glm::min(Min, p);
+        Max = glm::max(Max, p);
+    }
+
+    void Grow(const Aabb &box)
+    {
+        Min = glm::min(Min, box.Min);
+        Max = glm::max(Max, box.Max);
+    }
+
+    bool Empty() const { return Min.x > Max.x; }
+
+    glm::vec3 Centroid() const { return (Min + Max) * 0.5f; }
+
+    float Area() const
+    {
+        if (Empty())
+            return 0.0f;
+        glm::vec3 e = Max - Min;
+        return 2.0f * (e.x * e.y + e.y * e.z + e.z * e.x);
+    }
+
+    // Bounds of the box after an affine transform.
+    Aabb Transform(const glm::mat4 &m) const
+    {
+        Aabb box;
+        if (Empty())
+            return box;
+        for (int i = 0; i < 8; i++)
+        {
+            glm::vec3 corner = glm::vec3(i & 1 ? Max.x : Min.x, i & 2 ? Max.y : Min.y, i & 4 ? Max.z : Min.z);
+            box.Grow(glm::vec3(m * glm::vec4(corner, 1.0f)));
+        }
+        return box;
+    }
+};
+
+// Slab test, returns the entry distance or FLT_MAX on a miss.
+inline float IntersectAabb(const glm::vec3 &origin, const glm::vec3 &invDir, const glm::vec3 &min, const glm::vec3 &max, float tMax)
+{
+    glm::vec3 t0 = (min - origin) * invDir;
+    glm::vec3 t1 = (max - origin) * invDir;
+    glm::vec3 tNear = glm::min(t0, t1);
+    glm::vec3 tFar = glm::max(t0, t1);
+
+    float enter = std::max(std::max(tNear.x, tNear.y), std::max(tNear.z, 0.0f));
+    float exit = std::min(std::min(tFar.x, tFar.y), std::min(tFar.z, tMax));
+
+    return enter <= exit ? enter : FLT_MAX;
+}
+
+// Bounding volume hierarchy node, 32 bytes.
+// Interior nodes: Count == 0, children are LeftFirst and LeftFirst + 1.
+// Leaves:         Count  > 0, primitives are PrimIndices[LeftFirst, LeftFirst + Count).
+struct BvhNode
+{
+    glm::vec3 Min;
+    unsigned int LeftFirst;
+    glm::vec3 Max;
+    unsigned int Count;
+
+    bool IsLeaf() const { return Count > 0; }
+};
+
+// Nearest child first traversal of the node array rooted at nodes[0]; StackSize must cover its depth.
+// Calls leaf(node, tMax) for every leaf the ray reaches, which may lower tMax to cull the remaining nodes.
+template <int StackSize, typename F>
+void TraverseNodes(const BvhNode *nodes, const glm::vec3 &origin, const glm::vec3 &direction, float &tMax, F leaf)
+{
+    glm::vec3 invDir = 1.0f / direction;
+
+    unsigned int stack[StackSize];
+    int top = 0;
+    stack[top++] = 0;
+
+    while (top > 0)
+    {
+        const BvhNode &node = nodes[stack[--top]];
+        if (IntersectAabb(origin, invDir, node.Min, node.Max, tMax) == FLT_MAX)
+            continue;
+
+        if (node.IsLeaf())
+        {
+            leaf(node, tMax);
+            continue;
+        }
+
+        const BvhNode &left = nodes[node.LeftFirst];
+        const BvhNode &right = nodes[node.LeftFirst + 1];
+        float tLeft = IntersectAabb(origin, invDir, left.Min, left.Max, tMax);
+        float tRight = IntersectAabb(origin, invDir, right.Min, right.Max, tMax);
+
+        // push the far child first so the near one is visited next
+        if (tLeft <= tRight)
+        {
+            if (tRight != FLT_MAX)
+                stack[top++] = node.LeftFirst + 1;
+            if (tLeft != FLT_MAX)
+                stack[top++] = node.LeftFirst;
+        }
+        else
+        {
+            if (tLeft != FLT_MAX)
+                stack[top++] = node.LeftFirst;
+            stack[top++] = node.LeftFirst + 1;
+        }
+    }
+}
+
+// Sah     : binned SAH, slower to build, faster to trace.
+// Linear  : LBVH, primitives sorted along a Morton curve and split at the highest differing bit.
+//           Several times faster to build, usually somewhat slower to trace.
+// Spatial : SBVH, binned SAH that may also cut primitives at a plane and reference them from both
+//           sides. Tightest boxes around long, thin triangles; needs BuildSpatial().
+enum class BvhBuildMode
+{
+    Sah,
+    Linear,
+    Spatial
+};
+
+inline const char *BvhBuildModeName(BvhBuildMode mode)
+{
+    return mode == BvhBuildMode::Linear ? "LBVH" : mode == BvhBuildMode::Spatial ? "SBVH" : "SAH";
+}
+
+// Binary BVH over a list of primitive bounds.
+// Used for the triangles of a mesh (bottom level) and for the instances of a scene (top level).
+// Both builders hand subtrees and node passes above ParallelThreshold primitives to the thread pool.
+class Bvh
+{
+public:
+    static const int BinCount = 16;
+    static const int MaxDepth = 64;          // matches the traversal stack in the shader
+    static const unsigned int MaxLeafSize = 4;
+    static const unsigned int LinearLeafSize = 2; // LBVH splits have no cost model, so they go deeper
+    static const unsigned int ParallelThreshold = 4096;
+    static constexpr float RebuildThreshold = 1.5f;  // refit SAH cost over build SAH cost that asks for a rebuild
+    static constexpr float SpatialSplitAlpha = 1e-5f; // child overlap over root area that makes spatial splits worth trying
+    static constexpr float DuplicationBudget = 0.3f;  // extra references a spatial split build may add, per primitive
+
+    // split(prim, axis, position, left, right) returns the bounds of the parts of a primitive on
+    // either side of an axis aligned plane. Empty boxes are fine.
+    typedef std::function<void(unsigned int, int, float, Aabb &, Aabb &)> SplitFunction;
+
+    std::vector<BvhNode> Nodes;
+    std::vector<unsigned int> PrimIndices; // a primitive may appear in several leaves after a spatial split build
+
+    // BvhBuildMode::Spatial needs the primitive geometry and builds as Sah here.
+    void Build(const std::vector<Aabb> &primBounds, BvhBuildMode mode = BvhBuildMode::Sah);
+
+    void BuildSpatial(const std::vector<Aabb> &primBounds, const SplitFunction &split, float duplicationBudget = DuplicationBudget);
+
+    // Recomputes the bounds of the leaves holding the given primitives, then walks up to the root,
+    // stopping early where a node's bounds did not change. Leaves of a spatial split build grow to
+    // the whole primitive, which stays conservative. primBounds(prim) returns the new bounds
+    // of a primitive. Every node whose bounds changed is appended to touchedNodes.
+    template <typename F>
+    void Refit(const std::vector<unsigned int> &prims, F primBounds, std::vector<unsigned int> &touchedNodes);
+
+    // True once refits have made the tree noticeably worse than a fresh build.
+    bool Degraded() const { return RefitCost() > buildCost * RebuildThreshold; }
+
+    bool Empty() const { return Nodes.empty(); }
+
+    Aabb Bounds() const;
+
+    // SAH cost relative to the root area, with unit traversal and intersection costs.
+    float SahCost() const;
+
+    // Same as SahCost(), but kept up to date by Refit() instead of walking every node.
+    float RefitCost() const;
+
+    size_t MemoryUsage() const { return Nodes.size() * sizeof(BvhNode) + PrimIndices.size() * sizeof(unsigned int); }
+
+    // Calls intersect(primIndex, tMax) for every primitive whose leaf the ray reaches, nearest child first.
+    // intersect may lower tMax to cull the remaining nodes.
+    template <typename F>
+    void Traverse(const glm::vec3 &origin, const glm::vec3 &direction, float &tMax, F intersect) const;
+
+private:
+    static const unsigned int NoParent = 0xFFFFFFFFu;
+
+    // a primitive, or the part of it inside a spatial split node
+    struct Reference
+    {
+        Aabb box;
+        unsigned int prim;
+    };
+
+    // shared by the workers of one build, Nodes is presized to the worst case of 2n - 1 nodes
+    struct BuildState
+    {
+        const std::vector<Aabb> *primBounds;
+        std::vector<glm::vec3> centroids;
+        std::vector<uint32_t> mortonCodes; // Linear only, in PrimIndices order
+
+        // Spatial only: references of every pending node and leaf, until they are flattened
+        const SplitFunction *split = nullptr;
+        std::vector<std::vector<Reference>> references;
+        std::atomic<unsigned int> duplicates{0};
+        unsigned int maxDuplicates = 0;
+        float rootArea = 0.0f;
+
+        std::atomic<unsigned int> nodeCount{1};
+    };
+
+    struct Bins
+    {
+        Aabb boxes[3][BinCount];
+        unsigned int counts[3][BinCount] = {};
+    };
+
+    // refit bookkeeping, built by the first Refit(); the leaves of prim p are
+    // primLeaves[primLeafStart[p], primLeafStart[p + 1])
+    std::vector<unsigned int> parents;
+    std::vector<unsigned int> primLeafStart;
+    std::vector<unsigned int> primLeaves;
+    unsigned int primCount = 0;
+    float weightedArea = 0.0f;
+    float buildCost = 0.0f;
+
+    void Reset(unsigned int count);
+    void FinishBuild();
+
+    void BuildRefitLinks();
+    bool SetBounds(unsigned int nodeIndex, const Aabb &box);
+    static float NodeArea(const BvhNode &node);
+
+    unsigned int AllocateChildren(BuildState &state, unsigned int nodeIndex, unsigned int leftCount);
+    void BuildChildren(BuildState &state, unsigned int left, int depth, void (Bvh::*subdivide)(BuildState &, unsigned int, int));
+
+    void SubdivideSah(BuildState &state, unsigned int nodeIndex, int depth);
+    void SubdivideLinear(BuildState &state, unsigned int nodeIndex, int depth);
+    void SubdivideSpatial(BuildState &state, unsigned int nodeIndex, int depth);
+    bool FindSpatialSplit(const BuildState &state, const std::vector<Reference> &refs, const Aabb &box,
+                          float &cost, int &axis, float &position) const;
+    static void SplitReference(const BuildState &state, const Reference &ref, int axis, float position, Reference &left, Reference &right);
+    void SortMortonCodes(BuildState &state);
+
+    void UpdateBounds(BuildState &state, unsigned int nodeIndex, Aabb &centroidBounds);
+    bool FindSplit(const BuildState &state, const BvhNode &node, const Aabb &centroidBounds, int &axis, float &position) const;
+
+    static uint32_t ExpandBits(uint32_t v);
+    static uint32_t MortonCode(const glm::vec3 &p);
+};
+
+void Bvh::Build(const std::vector<Aabb> &primBounds, BvhBuildMode mode)
+{
+    Reset((unsigned int)primBounds.size());
+    if (primBounds.empty())
+        return;
+
+    BuildState state;
+    state.primBounds = &primBounds;
+    state.centroids.resize(primCount);
+    ThreadPool::Instance().ParallelFor(0, primCount, ParallelThreshold, [&](size_t i) { state.centroids[i] = primBounds[i].Centroid(); });
+
+    Nodes.resize(2 * (size_t)primCount - 1);
+    Nodes[0] = {glm::vec3(0.0f), 0, glm::vec3(0.0f), primCount};
+
+    if (mode == BvhBuildMode::Linear)
+    {
+        SortMortonCodes(state);
+        SubdivideLinear(state, 0, 0);
+    }
+    else
+        SubdivideSah(state, 0, 0);
+
+    Nodes.resize(state.nodeCount.load());
+    Nodes.shrink_to_fit();
+    FinishBuild();
+}
+
+void Bvh::BuildSpatial(const std::vector<Aabb> &primBounds, const SplitFunction &split, float duplicationBudget)
+{
+    Reset((unsigned int)primBounds.size());
+    if (primBounds.empty())
+        return;
+
+    BuildState state;
+    state.primBounds = &primBounds;
+    state.split = &split;
+    state.maxDuplicates = (unsigned int)(primCount * duplicationBudget);
+
+    size_t maxNodes = 2 * ((size_t)primCount + state.maxDuplicates) - 1;
+    Nodes.resize(maxNodes);
+    state.references.resize(maxNodes);
+
+    std::vector<Reference> &refs = state.references[0];
+    refs.resize(primCount);
+    Aabb rootBounds;
+    for (unsigned int i = 0; i < primCount; i++)
+    {
+        refs[i] = {primBounds[i], i};
+        rootBounds.Grow(primBounds[i]);
+    }
+    state.rootArea = rootBounds.Area();
+
+    Nodes[0] = {glm::vec3(0.0f), 0, glm::vec3(0.0f), primCount};
+    SubdivideSpatial(state, 0, 0);
+
+    // flatten the leaf references into PrimIndices
+    Nodes.resize(state.nodeCount.load());
+    Nodes.shrink_to_fit();
+    PrimIndices.clear();
+    PrimIndices.reserve(primCount + state.duplicates.load());
+    for (size_t i = 0; i < Nodes.size(); i++)
+    {
+        if (!Nodes[i].IsLeaf())
+            continue;
+
+        Nodes[i].LeftFirst = (unsigned int)PrimIndices.size();
+        for (const Reference &ref : state.references[i])
+            PrimIndices.push_back(ref.prim);
+    }
+
+    FinishBuild();
+}
+
+void Bvh::Reset(unsigned int count)
+{
+    Nodes.clear();
+    PrimIndices.resize(count);
+    std::iota(PrimIndices.begin(), PrimIndices.end(), 0);
+
+    primCount = count;
+    parents.clear();
+    primLeafStart.clear();
+    primLeaves.clear();
+    weightedArea = 0.0f;
+    buildCost = 0.0f;
+}
+
+void Bvh::FinishBuild()
+{
+    for (const BvhNode &node : Nodes)
+        weightedArea += NodeArea(node) * (node.IsLeaf() ? (float)node.Count : 1.0f);
+    buildCost = RefitCost();
+}
+
+// Turns a node into an interior node over two fresh siblings and returns the left one.
+unsigned int Bvh::AllocateChildren(BuildState &state, unsigned int nodeIndex, unsigned int leftCount)
+{
+    BvhNode &node = Nodes[nodeIndex];
+    unsigned int left = state.nodeCount.fetch_add(2);
+
+    Nodes[left] = {glm::vec3(0.0f), node.LeftFirst, glm::vec3(0.0f), leftCount};
+    Nodes[left + 1] = {glm::vec3(0.0f), node.LeftFirst + leftCount, glm::vec3(0.0f), node.Count - leftCount};
+
+    node.LeftFirst = left;
+    node.Count = 0;
+
+    return left;
+}
+
+// Large sibling pairs are built concurrently. ParallelFor runs one of them on the calling thread,
+// so a worker waiting here never blocks the pool.
+void Bvh::BuildChildren(BuildState &state, unsigned int left, int depth, void (Bvh::*subdivide)(BuildState &, unsigned int, int))
+{
+    if (Nodes[left].Count + Nodes[left + 1].Count > ParallelThreshold)
+        ThreadPool::Instance().ParallelFor(0, 2, 1, [&](size_t i) { (this->*subdivide)(state, left + (unsigned int)i, depth); });
+    else
+    {
+        (this->*subdivide)(state, left, depth);
+        (this->*subdivide)(state, left + 1, depth);
+    }
+}
+
+void Bvh::SubdivideSah(BuildState &state, unsigned int nodeIndex, int depth)
+{
+    Aabb centroidBounds;
+    UpdateBounds(state, nodeIndex, centroidBounds);
+
+    BvhNode node = Nodes[nodeIndex];
+    if (node.Count <= 1 || depth + 1 >= MaxDepth)
+        return;
+
+    // primitives that binning cannot separate are halved, so leaves stay small
+    unsigned int leftCount = node.Count / 2;
+
+    int axis;
+    float position;
+    if (FindSplit(state, node, centroidBounds, axis, position))
+    {
+        // partition the primitives around the split plane
+        const std::vector<glm::vec3> &centroids = state.centroids;
+        unsigned int *first = PrimIndices.data() + node.LeftFirst;
+        unsigned int *last = first + node.Count;
+        unsigned int *middle = std::partition(first, last, [&](unsigned int p) { return centroids[p][axis] < position; });
+
+        if (middle != first && middle != last)
+            leftCount = (unsigned int)(middle - first);
+    }
+    else if (node.Count <= MaxLeafSize)
+        return;
+
+    unsigned int left = AllocateChildren(state, nodeIndex, leftCount);
+    BuildChildren(state, left, depth + 1, &Bvh::SubdivideSah);
+}
+
+// Splits the Morton sorted range at its highest differing bit, so every child is a cell of the
+// implicit octree. Ranges sharing one code are halved.
+void Bvh::SubdivideLinear(BuildState &state, unsigned int nodeIndex, int depth)
+{
+    BvhNode node = Nodes[nodeIndex];
+    if (node.Count <= LinearLeafSize || depth + 1 >= MaxDepth)
+    {
+        Aabb centroidBounds;
+        UpdateBounds(state, nodeIndex, centroidBounds);
+        return;
+    }
+
+    const uint32_t *codes = state.mortonCodes.data() + node.LeftFirst;
+    uint32_t difference = codes[0] ^ codes[node.Count - 1];
+
+    unsigned int leftCount = node.Count / 2;
+    if (difference != 0)
+    {
+        int bit = 31;
+        while (!(difference >> bit))
+            bit--;
+        leftCount = (unsigned int)(std::partition_point(codes, codes + node.Count, [bit](uint32_t code) { return !((code >> bit) & 1u); }) - codes);
+    }
+
+    unsigned int left = AllocateChildren(state, nodeIndex, leftCount);
+    BuildChildren(state, left, depth + 1, &Bvh::SubdivideLinear);
+
+    // bounds are merged bottom up once both subtrees are done
+    BvhNode &merged = Nodes[nodeIndex];
+    merged.Min = glm::min(Nodes[left].Min, Nodes[left + 1].Min);
+    merged.Max = glm::max(Nodes[left].Max, Nodes[left + 1].Max);
+}
+
+// Binned SAH over references, extended with the spatial splits of Stich et al. 2009: when the
+// children of the best object split overlap, cutting references at bin planes is tried as well.
+// Straddling references go to both children while the duplication budget lasts.
+void Bvh::SubdivideSpatial(BuildState &state, unsigned int nodeIndex, int depth)
+{
+    std::vector<Reference> refs = std::move(state.references[nodeIndex]);
+    unsigned int count = (unsigned int)refs.size();
+
+    Aabb box, centroidBounds;
+    for (const Reference &ref : refs)
+    {
+        box.Grow(ref.box);
+        centroidBounds.Grow(ref.box.Centroid());
+    }
+
+    BvhNode &node = Nodes[nodeIndex];
+    node.Min = box.Min;
+    node.Max = box.Max;
+    node.Count = count;
+
+    if (count <= 1 || depth + 1 >= MaxDepth)
+    {
+        state.references[nodeIndex] = std::move(refs);
+        return;
+    }
+
+    // object split, keeping the children bounds to measure their overlap
+    float objectCost = FLT_MAX;
+    int objectAxis = 0;
+    float objectPosition = 0.0f;
+    Aabb objectLeft, objectRight;
+
+    for (int a = 0; a < 3; a++)
+    {
+        float lo = centroidBounds.Min[a];
+        float hi = centroidBounds.Max[a];
+        if (hi <= lo)
+            continue;
+
+        Aabb bins[BinCount];
+        unsigned int counts[BinCount] = {0};
+        float scale = BinCount / (hi - lo);
+        for (const Reference &ref : refs)
+        {
+            int b = std::min(BinCount - 1, (int)((ref.box.Centroid()[a] - lo) * scale));
+            bins[b].Grow(ref.box);
+            counts[b]++;
+        }
+
+        Aabb rightBoxes[BinCount - 1];
+        unsigned int rightCount[BinCount - 1];
+        Aabb right;
+        unsigned int rightTotal = 0;
+        for (int i = BinCount - 1; i > 0; i--)
+        {
+            right.Grow(bins[i]);
+            rightTotal += counts[i];
+            rightBoxes[i - 1] = right;
+            rightCount[i - 1] = rightTotal;
+        }
+
+        Aabb left;
+        unsigned int leftTotal = 0;
+        for (int i = 0; i < BinCount - 1; i++)
+        {
+            left.Grow(bins[i]);
+            leftTotal += counts[i];
+            float cost = leftTotal * left.Area() + rightCount[i] * rightBoxes[i].Area();
+            if (cost < objectCost)
+            {
+                objectCost = cost;
+                objectAxis = a;
+                objectPosition = lo + (i + 1) / scale;
+                objectLeft = left;
+                objectRight = rightBoxes[i];
+            }
+        }
+    }
+
+    Aabb overlap;
+    overlap.Min = glm::max(objectLeft.Min, objectRight.Min);
+    overlap.Max = glm::min(objectLeft.Max, objectRight.Max);
+    bool overlapping = objectCost != FLT_MAX && glm::all(glm::lessThanEqual(overlap.Min, overlap.Max));
+
+    float spatialCost = FLT_MAX;
+    int spatialAxis = 0;
+    float spatialPosition = 0.0f;
+    if ((objectCost == FLT_MAX || (overlapping && overlap.Area() > SpatialSplitAlpha * state.rootArea)) &&
+        state.duplicates.load() < state.maxDuplicates)
+        FindSpatialSplit(state, refs, box, spatialCost, spatialAxis, spatialPosition);
+
+    float leafCost = count * box.Area();
+    float bestCost = std::min(objectCost, spatialCost);
+    if ((bestCost == FLT_MAX || box.Area() + bestCost >= leafCost) && count <= MaxLeafSize)
+    {
+        state.references[nodeIndex] = std::move(refs);
+        return;
+    }
+
+    std::vector<Reference> leftRefs, rightRefs;
+    unsigned int claimed = 0;
+    if (spatialCost < objectCost)
+    {
+        unsigned int straddling = 0;
+        for (const Reference &ref : refs)
+            if (ref.box.Min[spatialAxis] < spatialPosition && ref.box.Max[spatialAxis] > spatialPosition)
+                straddling++;
+
+        // claim the duplicates up front, another subtree may be spending the same budget
+        if (state.duplicates.fetch_add(straddling) + straddling <= state.maxDuplicates)
+        {
+            for (const Reference &ref : refs)
+            {
+                if (ref.box.Max[spatialAxis] <= spatialPosition)
+                    leftRefs.push_back(ref);
+                else if (ref.box.Min[spatialAxis] >= spatialPosition)
+                    rightRefs.push_back(ref);
+                else
+                {
+                    Reference left, right;
+                    SplitReference(state, ref, spatialAxis, spatialPosition, left, right);
+                    if (!left.box.Empty())
+                        leftRefs.push_back(left);
+                    if (!right.box.Empty())
+                        rightRefs.push_back(right);
+                }
+            }
+
+            // a reference clipped away on one side was not duplicated after all
+            size_t kept = leftRefs.size() + rightRefs.size();
+            claimed = kept > count ? (unsigned int)(kept - count) : 0;
+        }
+        state.duplicates.fetch_sub(straddling - claimed);
+    }
+
+    if (leftRefs.empty() || rightRefs.empty())
+    {
+        // nothing went to one side, the references are not split after all
+        state.duplicates.fetch_sub(claimed);
+        leftRefs.clear();
+        rightRefs.clear();
+        if (objectCost != FLT_MAX)
+            for (const Reference &ref : refs)
+                (ref.box.Centroid()[objectAxis] < objectPosition ? leftRefs : rightRefs).push_back(ref);
+
+        if (leftRefs.empty() || rightRefs.empty())
+        {
+            if (count <= MaxLeafSize)
+            {
+                state.references[nodeIndex] = std::move(refs);
+                return;
+            }
+
+            leftRefs.assign(refs.begin(), refs.begin() + count / 2);
+            rightRefs.assign(refs.begin() + count / 2, refs.end());
+        }
+    }
+
+    node.Count = (unsigned int)(leftRefs.size() + rightRefs.size());
+    unsigned int left = AllocateChildren(state, nodeIndex, (unsigned int)leftRefs.size());
+    state.references[left] = std::move(leftRefs);
+    state.references[left + 1] = std::move(rightRefs);
+
+    BuildChildren(state, left, depth + 1, &Bvh::SubdivideSpatial);
+}
+
+// Bins the node bounds evenly and chops every reference into the bins it spans. A reference
+// enters the SAH sweep in its first bin and leaves it in its last.
+bool Bvh::FindSpatialSplit(const BuildState &state, const std::vector<Reference> &refs, const Aabb &box,
+                           float &cost, int &axis, float &position) const
+{
+    for (int a = 0; a < 3; a++)
+    {
+        float lo = box.Min[a];
+        float width = (box.Max[a] - lo) / BinCount;
+        if (width <= 0.0f)
+            continue;
+
+        Aabb bins[BinCount];
+        unsigned int entries[BinCount] = {0};
+        unsigned int exits[BinCount] = {0};
+
+        for (const Reference &ref : refs)
+        {
+            int first = glm::clamp((int)((ref.box.Min[a] - lo) / width), 0, BinCount - 1);
+            int last = glm::clamp((int)((ref.box.Max[a] - lo) / width), first, BinCount - 1);
+
+            Reference rest = ref;
+            for (int b = first; b < last; b++)
+            {
+                Reference inside, outside;
+                SplitReference(state, rest, a, lo + width * (b + 1), inside, outside);
+                bins[b].Grow(inside.box);
+                rest = outside;
+            }
+            bins[last].Grow(rest.box);
+            entries[first]++;
+            exits[last]++;
+        }
+
+        float rightArea[BinCount - 1];
+        unsigned int rightCount[BinCount - 1];
+        Aabb right;
+        unsigned int rightTotal = 0;
+        for (int i = BinCount - 1; i > 0; i--)
+        {
+            right.Grow(bins[i]);
+            rightTotal += exits[i];
+            rightArea[i - 1] = right.Area();
+            rightCount[i - 1] = rightTotal;
+        }
+
+        Aabb left;
+        unsigned int leftTotal = 0;
+        for (int i = 0; i < BinCount - 1; i++)
+        {
+            left.Grow(bins[i]);
+            leftTotal += entries[i];
+            if (leftTotal == 0 || rightCount[i] == 0)
+                continue;
+
+            float planeCost = leftTotal * left.Area() + rightCount[i] * rightArea[i];
+            if (planeCost < cost)
+            {
+                cost = planeCost;
+                axis = a;
+                position = lo + width * (i + 1);
+            }
+        }
+    }
+
+    return cost != FLT_MAX;
+}
+
+// The parts of the primitive on each side of the plane, clipped to the reference.
+void Bvh::SplitReference(const BuildState &state, const Reference &ref, int axis, float position, Reference &left, Reference &right)
+{
+    Aabb primLeft, primRight;
+    (*state.split)(ref.prim, axis, position, primLeft, primRight);
+
+    primLeft.Max[axis] = std::min(primLeft.Max[axis], position);
+    primRight.Min[axis] = std::max(primRight.Min[axis], position);
+
+    left.prim = right.prim = ref.prim;
+    left.box.Min = glm::max(primLeft.Min, ref.box.Min);
+    left.box.Max = glm::min(primLeft.Max, ref.box.Max);
+    right.box.Min = glm::max(primRight.Min, ref.box.Min);
+    right.box.Max = glm::min(primRight.Max, ref.box.Max);
+
+    if (glm::any(glm::greaterThan(left.box.Min, left.box.Max)))
+        left.box = Aabb();
+    if (glm::any(glm::greaterThan(right.box.Min, right.box.Max)))
+        right.box = Aabb();
+}
+
+// Sorts PrimIndices by the 30 bit Morton code of the centroids with an 8 bit LSD radix sort.
+// Each pass histograms and scatters blocks of primitives in parallel; scattering stays stable
+// because every block writes to its own offsets, computed from the histograms in block order.
+void Bvh::SortMortonCodes(BuildState &state)
+{
+    ThreadPool &pool = ThreadPool::Instance();
+    size_t primCount = PrimIndices.size();
+
+    Aabb centroidBounds;
+    UpdateBounds(state, 0, centroidBounds);
+
+    glm::vec3 extent = glm::max(centroidBounds.Max - centroidBounds.Min, glm::vec3(FLT_MIN));
+    std::vector<uint32_t> codes(primCount);
+    pool.ParallelFor(0, primCount, ParallelThreshold, [&](size_t i) {
+        codes[i] = MortonCode((state.centroids[i] - centroidBounds.Min) / extent);
+    });
+
+    const size_t blockSize = 4 * ParallelThreshold;
+    size_t blockCount = (primCount + blockSize - 1) / blockSize;
+    std::vector<unsigned int> histograms(blockCount * 256);
+
+    std::vector<uint32_t> sortedCodes(primCount);
+    std::vector<unsigned int> sortedPrims(primCount);
+
+    for (int shift = 0; shift < 30; shift += 8)
+    {
+        std::fill(histograms.begin(), histograms.end(), 0);
+        pool.ParallelFor(0, blockCount, 1, [&](size_t block) {
+            unsigned int *histogram = histograms.data() + block * 256;
+            size_t last = std::min(primCount, (block + 1) * blockSize);
+            for (size_t i = block * blockSize; i < last; i++)
+                histogram[(codes[i] >> shift) & 0xFF]++;
+        });
+
+        // a digit shared by every code leaves the order unchanged
+        bool skip = false;
+        unsigned int offset = 0;
+        for (int digit = 0; digit < 256; digit++)
+        {
+            unsigned int digitStart = offset;
+            for (size_t block = 0; block < blockCount; block++)
+            {
+                unsigned int count = histograms[block * 256 + digit];
+                histograms[block * 256 + digit] = offset;
+                offset += count;
+            }
+            skip = skip || offset - digitStart == primCount;
+        }
+        if (skip)
+            continue;
+
+        pool.ParallelFor(0, blockCount, 1, [&](size_t block) {
+            unsigned int *next = histograms.data() + block * 256;
+            size_t last = std::min(primCount, (block + 1) * blockSize);
+            for (size_t i = block * blockSize; i < last; i++)
+            {
+                unsigned int slot = next[(codes[i] >> shift) & 0xFF]++;
+                sortedCodes[slot] = codes[i];
+                sortedPrims[slot] = PrimIndices[i];
+            }
+        });
+
+        codes.swap(sortedCodes);
+        PrimIndices.swap(sortedPrims);
+    }
+
+    state.mortonCodes = std::move(codes);
+}
+
+// Writes the node bounds and returns the bounds of its primitive centroids.
+// Nodes above ParallelThreshold primitives reduce over chunks in parallel.
+void Bvh::UpdateBounds(BuildState &state, unsigned int nodeIndex, Aabb &centroidBounds)
+{
+    BvhNode &node = Nodes[nodeIndex];
+    const unsigned int *prims = PrimIndices.data() + node.LeftFirst;
+
+    auto grow = [&](size_t first, size_t last, Aabb &box, Aabb &centroidBox) {
+        for (size_t i = first; i < last; i++)
+        {
+            box.Grow((*state.primBounds)[prims[i]]);
+            centroidBox.Grow(state.centroids[prims[i]]);
+        }
+    };
+
+    Aabb box;
+    if (node.Count <= ParallelThreshold)
+        grow(0, node.Count, box, centroidBounds);
+    else
+    {
+        size_t chunkCount = (node.Count + ParallelThreshold - 1) / ParallelThreshold;
+        std::vector<Aabb> boxes(chunkCount);
+        std::vector<Aabb> centroidBoxes(chunkCount);
+        ThreadPool::Instance().ParallelFor(0, chunkCount, 1, [&](size_t chunk) {
+            grow(chunk * ParallelThreshold, std::min<size_t>(node.Count, (chunk + 1) * ParallelThreshold), boxes[chunk], centroidBoxes[chunk]);
+        });
+
+        for (size_t chunk = 0; chunk < chunkCount; chunk++)
+        {
+            box.Grow(boxes[chunk]);
+            centroidBounds.Grow(centroidBoxes[chunk]);
+        }
+    }
+
+    node.Min = box.Min;
+    node.Max = box.Max;
+}
+
+// Returns false when keeping the node as a leaf is cheaper than the best split, or when the
+// centroids all coincide.
+// All three axes are binned in one pass over the primitives, in parallel chunks for large nodes.
+bool Bvh::FindSplit(const BuildState &state, const BvhNode &node, const Aabb &centroidBounds, int &axis, float &position) const
+{
+    const unsigned int *prims = PrimIndices.data() + node.LeftFirst;
+
+    glm::vec3 lo = centroidBounds.Min;
+    glm::vec3 extent = centroidBounds.Max - centroidBounds.Min;
+    glm::vec3 scale;
+    for (int a = 0; a < 3; a++)
+        scale[a] = extent[a] > 0.0f ? BinCount / extent[a] : 0.0f;
+
+    auto bin = [&](size_t first, size_t last, Bins &bins) {
+        for (size_t i = first; i < last; i++)
+        {
+            unsigned int p = prims[i];
+            glm::vec3 c = state.centroids[p];
+            for (int a = 0; a < 3; a++)
+            {
+                int b = std::min(BinCount - 1, (int)((c[a] - lo[a]) * scale[a]));
+                bins.boxes[a][b].Grow((*state.primBounds)[p]);
+                bins.counts[a][b]++;
+            }
+        }
+    };
+
+    Bins bins;
+    if (node.Count <= ParallelThreshold)
+        bin(0, node.Count, bins);
+    else
+    {
+        size_t chunkCount = (node.Count + ParallelThreshold - 1) / ParallelThreshold;
+        std::vector<Bins> chunkBins(chunkCount);
+        ThreadPool::Instance().ParallelFor(0, chunkCount, 1, [&](size_t chunk) {
+            bin(chunk * ParallelThreshold, std::min<size_t>(node.Count, (chunk + 1) * ParallelThreshold), chunkBins[chunk]);
+        });
+
+        for (const Bins &partial : chunkBins)
+            for (int a = 0; a < 3; a++)
+                for (int b = 0; b < BinCount; b++)
+                {
+                    bins.boxes[a][b].Grow(partial.boxes[a][b]);
+                    bins.counts[a][b] += partial.counts[a][b];
+                }
+    }
+
+    float bestCost = FLT_MAX;
+
+    for (int a = 0; a < 3; a++)
+    {
+        if (scale[a] == 0.0f)
+            continue;
+
+        // sweep from the right, then evaluate every plane sweeping from the left
+        float rightArea[BinCount - 1];
+        unsigned int rightCount[BinCount - 1];
+        Aabb box;
+        unsigned int count = 0;
+        for (int i = BinCount - 1; i > 0; i--)
+        {
+            box.Grow(bins.boxes[a][i]);
+            count += bins.counts[a][i];
+            rightArea[i - 1] = box.Area();
+            rightCount[i - 1] = count;
+        }
+
+        box = Aabb();
+        count = 0;
+        for (int i = 0; i < BinCount - 1; i++)
+        {
+            box.Grow(bins.boxes[a][i]);
+            count += bins.counts[a][i];
+            float cost = count * box.Area() + rightCount[i] * rightArea[i];
+            if (cost < bestCost)
+            {
+                bestCost = cost;
+                axis = a;
+                position = lo[a] + (i + 1) / scale[a];
+            }
+        }
+    }
+
+    if (bestCost == FLT_MAX)
+        return false;
+
+    Aabb nodeBounds;
+    nodeBounds.Min = node.Min;
+    nodeBounds.Max = node.Max;
+    float leafCost = node.Count * nodeBounds.Area();
+    float splitCost = nodeBounds.Area() + bestCost;
+
+    return splitCost < leafCost || node.Count > MaxLeafSize;
+}
+
+// Spreads the low 10 bits of v so there are two zero bits between each.
+uint32_t Bvh::ExpandBits(uint32_t v)
+{
+    v = (v * 0x00010001u) & 0xFF0000FFu;
+    v = (v * 0x00000101u) & 0x0F00F00Fu;
+    v = (v * 0x00000011u) & 0xC30C30C3u;
+    v = (v * 0x00000005u) & 0x49249249u;
+    return v;
+}
+
+// p in [0, 1]^3.
+uint32_t Bvh::MortonCode(const glm::vec3 &p)
+{
+    glm::vec3 cell = glm::clamp(p * 1024.0f, glm::vec3(0.0f), glm::vec3(1023.0f));
+    return ExpandBits((uint32_t)cell.x) * 4 + ExpandBits((uint32_t)cell.y) * 2 + ExpandBits((uint32_t)cell.z);
+}
+
+Aabb Bvh::Bounds() const
+{
+    Aabb box;
+    if (!Nodes.empty())
+    {
+        box.Min = Nodes[0].Min;
+        box.Max = Nodes[0].Max;
+    }
+    return box;
+}
+
+float Bvh::NodeArea(const BvhNode &node)
+{
+    Aabb box;
+    box.Min = node.Min;
+    box.Max = node.Max;
+    return box.Area();
+}
+
+float Bvh::SahCost() const
+{
+    float rootArea = Bounds().Area();
+    if (rootArea <= 0.0f)
+        return 0.0f;
+
+    float cost = 0.0f;
+    for (const BvhNode &node : Nodes)
+        cost += NodeArea(node) * (node.IsLeaf() ? (float)node.Count : 1.0f);
+
+    return cost / rootArea;
+}
+
+float Bvh::RefitCost() const
+{
+    float rootArea = Nodes.empty() ? 0.0f : NodeArea(Nodes[0]);
+    return rootArea > 0.0f ? weightedArea / rootArea : 0.0f;
+}
+
+void Bvh::BuildRefitLinks()
+{
+    parents.assign(Nodes.size(), (unsigned int)NoParent);
+    primLeafStart.assign(primCount + 1, 0);
+    primLeaves.resize(PrimIndices.size());
+
+    for (unsigned int prim : PrimIndices)
+        primLeafStart[prim + 1]++;
+    std::partial_sum(primLeafStart.begin(), primLeafStart.end(), primLeafStart.begin());
+
+    std::vector<unsigned int> next(primLeafStart.begin(), primLeafStart.end() - 1);
+    for (unsigned int i = 0; i < Nodes.size(); i++)
+    {
+        const BvhNode &node = Nodes[i];
+        if (node.IsLeaf())
+        {
+            for (unsigned int k = 0; k < node.Count; k++)
+                primLeaves[next[PrimIndices[node.LeftFirst + k]]++] = i;
+        }
+        else
+        {
+            parents[node.LeftFirst] = i;
+            parents[node.LeftFirst + 1] = i;
+        }
+    }
+}
+
+// Returns false when the bounds are unchanged.
+bool Bvh::SetBounds(unsigned int nodeIndex, const Aabb &box)
+{
+    BvhNode &node = Nodes[nodeIndex];
+    if (node.Min == box.Min && node.Max == box.Max)
+        return false;
+
+    float weight = node.IsLeaf() ? (float)node.Count : 1.0f;
+    weightedArea -= NodeArea(node) * weight;
+    node.Min = box.Min;
+    node.Max = box.Max;
+    weightedArea += NodeArea(node) * weight;
+
+    return true;
+}
+
+template <typename F>
+void Bvh::Refit(const std::vector<unsigned int> &prims, F primBounds, std::vector<unsigned int> &touchedNodes)
+{
+    if (Nodes.empty())
+        return;
+
+    if (parents.size() != Nodes.size())
+        BuildRefitLinks();
+
+    std::vector<unsigned int> leaves;
+    leaves.reserve(prims.size());
+    for (unsigned int prim : prims)
+        for (unsigned int k = primLeafStart[prim]; k < primLeafStart[prim + 1]; k++)
+            leaves.push_back(primLeaves[k]);
+    std::sort(leaves.begin(), leaves.end());
+    leaves.erase(std::unique(leaves.begin(), leaves.end()), leaves.end());
+
+    for (unsigned int leaf : leaves)
+    {
+        const BvhNode &node = Nodes[leaf];
+        Aabb box;
+        for (unsigned int k = 0; k < node.Count; k++)
+            box.Grow(primBounds(PrimIndices[node.LeftFirst + k]));
+
+        if (!SetBounds(leaf, box))
+            continue;
+        touchedNodes.push_back(leaf);
+
+        for (unsigned int parent = parents[leaf]; parent != NoParent; parent = parents[parent])
+        {
+            const BvhNode &left = Nodes[Nodes[parent].LeftFirst];
+            const BvhNode &right = Nodes[Nodes[parent].LeftFirst + 1];
+            Aabb merged;
+            merged.Min = glm::min(left.Min, right.Min);
+            merged.Max = glm::max(left.Max, right.Max);
+
+            if (!SetBounds(parent, merged))
+                break;
+            touchedNodes.push_back(parent);
+        }
+    }
+}
+
+template <typename F>
+void Bvh::Traverse(const glm::vec3 &origin, const glm::vec3 &direction, float &tMax, F intersect) const
+{
+    if (Nodes.empty())
+        return;
+
+    TraverseNodes<MaxDepth>(Nodes.data(), origin, direction, tMax, [&](const BvhNode &leaf, float &tLeaf) {
+        for (unsigned int i = 0; i < leaf.Count; i++)
+            intersect(PrimIndices[leaf.LeftFirst + i], tLeaf);
+    });
+}
+
+#endif
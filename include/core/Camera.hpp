@@ -30,6 +30,9 @@ public:
     float MovementSpeed;
     float MouseSensitivity;
 
+    // Bumped whenever ProcessKeyboard(), ProcessMouseMovement() or SetView() changes the view.
+    unsigned int ViewVersion;
+
     float *vertices;
 
     Camera(glm::vec3 position = Global::CameraPos,
@@ -40,12 +43,27 @@ public:
 
     void GenerateRay();
 
+    // Same rays for a width x height grid over the same field of view, 5 floats per point.
+    static void GenerateRay(float *vertices, unsigned int width, unsigned int height);
+
     glm::mat4 GetRotateMatrix();
 
+    // Camera space direction through a window pixel, before RayRotateMatrix. Window pixels count from the
+    // lower left, and SimplePathTracing.vs mirrors the rays of GenerateRay() horizontally.
+    static glm::vec3 PixelDirection(float column, float row);
+    // Same for a width x height image with the vertical field of view of the window and square pixels.
+    static glm::vec3 PixelDirection(float column, float row, unsigned int width, unsigned int height);
+
+    // Inverse of PixelDirection(), for any camera space direction. False when it points behind the camera.
+    static bool ProjectDirection(const glm::vec3 &direction, float &column, float &row);
+
     void ProcessKeyboard(CameraMovement direction, float deltaTime);
 
     void ProcessMouseMovement(float xoffset, float yoffset, bool constrainPitch = true);
 
+    // Puts the camera at position, looking along yaw and pitch in degrees, as a resumed render found it.
+    void SetView(const glm::vec3 &position, float yaw, float pitch);
+
 private:
     void UpdateCameraVectors();
 };
@@ -60,7 +78,8 @@ Camera::Camera(glm::vec3 position,
       Pitch(0.0f),
       //Roll(0.0f),
       MovementSpeed(Global::CameraSpeed),
-      MouseSensitivity(Global::CameraSensitivity)
+      MouseSensitivity(Global::CameraSensitivity),
+      ViewVersion(0)
 {
     vertices = new float[Global::PixelCount * 5];
 }
@@ -71,15 +90,20 @@ Camera::~Camera()
 }
 
 void Camera::GenerateRay()
+{
+    GenerateRay(vertices, Global::WindowWidth, Global::WindowHeight);
+}
+
+void Camera::GenerateRay(float *vertices, unsigned int width, unsigned int height)
 {
     int counter = 0;
 
-    for (int j = 0; j < Global::WindowHeight; ++j)
+    for (int j = 0; j < (int)height; ++j)
     {
-        for (int i = 0; i < Global::WindowWidth; ++i)
+        for (int i = 0; i < (int)width; ++i)
         {
-            float worldSpaceCoordX = 2 * ((float)i + 0.5) / (float)Global::WindowWidth - 1;
-            float worldSpaceCoordY = 2 * ((float)j + 0.5) / (float)Global::WindowHeight - 1; // OpenGL 屏幕坐标原点在左下角
+            float worldSpaceCoordX = 2 * ((float)i + 0.5) / (float)width - 1;
+            float worldSpaceCoordY = 2 * ((float)j + 0.5) / (float)height - 1; // OpenGL 屏幕坐标原点在左下角
 
             float x = worldSpaceCoordX * Global::ImageAspectRatio * Global::Scale;
             float y = worldSpaceCoordY * Global::Scale;
@@ -103,9 +127,35 @@ glm::mat4 Camera::GetRotateMatrix()
     return rotate;
 }
 
+glm::vec3 Camera::PixelDirection(float column, float row)
+{
+    return PixelDirection(column, row, Global::WindowWidth, Global::WindowHeight);
+}
+
+glm::vec3 Camera::PixelDirection(float column, float row, unsigned int width, unsigned int height)
+{
+    float x = -(2 * (column + 0.5f) / width - 1) * (width / (float)height) * Global::Scale;
+    float y = (2 * (row + 0.5f) / height - 1) * Global::Scale;
+    return glm::normalize(glm::vec3(x, y, 1));
+}
+
+bool Camera::ProjectDirection(const glm::vec3 &direction, float &column, float &row)
+{
+    if (direction.z <= 0.0f)
+        return false;
+
+    float x = -direction.x / direction.z / (Global::ImageAspectRatio * Global::Scale);
+    float y = direction.y / direction.z / Global::Scale;
+    column = (x + 1) * Global::WindowWidth / 2 - 0.5f;
+    row = (y + 1) * Global::WindowHeight / 2 - 0.5f;
+    return true;
+}
+
 void Camera::ProcessKeyboard(CameraMovement direction, float deltaTime)
 {
     float velocity = MovementSpeed * deltaTime;
+    if (velocity != 0.0f)
+        ViewVersion++;
     if (direction == FORWARD)
         Position += Front * velocity;
     if (direction == BACKWARD)
@@ -121,6 +171,9 @@ void Camera::ProcessMouseMovement(float xoffset, float yoffset, bool constrainPi
     xoffset *= MouseSensitivity;
     yoffset *= MouseSensitivity;
 
+    float oldYaw = Yaw;
+    float oldPitch = Pitch;
+
     Yaw -= xoffset;
     Pitch += yoffset;
 
@@ -133,10 +186,24 @@ void Camera::ProcessMouseMovement(float xoffset, float yoffset, bool constrainPi
             Pitch = -89.0f;
     }
 
+    // a clamped pitch does not move the view
+    if (Yaw == oldYaw && Pitch == oldPitch)
+        return;
+    ViewVersion++;
+
     // update Front, Right and Up Vectors using the updated Euler angles
     UpdateCameraVectors();
 }
 
+void Camera::SetView(const glm::vec3 &position, float yaw, float pitch)
+{
+    Position = position;
+    Yaw = yaw;
+    Pitch = pitch;
+    ViewVersion++;
+    UpdateCameraVectors();
+}
+
 void Camera::UpdateCameraVectors()
 {
     glm::vec3 front;
@@ -0,0 +1,223 @@
+#ifndef CHECKPOINT_HPP
+#define CHECKPOINT_HPP
+
+#include <zlib.h>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#endif
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "Camera.hpp"
+#include "FrameSaver.hpp"
+#include "Scene.hpp"
+
+// Saves a render in progress, and picks it up again after a crash or a restart.
+//
+// A checkpoint holds what the next frame depends on: the float accumulation of FrameSaver with its
+// sample counts, second moments and the frame count the per-frame seeds follow from, the camera, and
+// the generator they are drawn with. Nothing is rounded on the way, so a resumed render goes on with the same buffers
+// and the same seed stream, and converges to the same image, noise included, as one that never
+// stopped (the GPU itself is not bit reproducible).
+//
+// The file is a small header followed by the state, zlib compressed; the header carries the
+// resolution and triangle count, and Load() refuses a checkpoint of another frame or scene. Save()
+// writes next to the file and renames over it, so a crash while saving leaves the last checkpoint;
+// should the rename itself be cut short, Load() falls back to the file written next to it.
+class Checkpoint
+{
+public:
+    static const uint32_t Version = 1;
+
+    static bool Save(const std::string &fileName, const FrameSaver &image, const Camera &camera,
+                     const std::mt19937 &sampler, const Scene &scene);
+    // Leaves everything as it was when it fails.
+    static bool Load(const std::string &fileName, FrameSaver &image, Camera &camera,
+                     std::mt19937 &sampler, const Scene &scene);
+
+    static bool Exists(const std::string &fileName) { return !Existing(fileName).empty(); }
+    // Deletes the checkpoint and the file Save() writes next to it, once the render they hold is written out.
+    static void Remove(const std::string &fileName);
+
+private:
+    struct Header
+    {
+        char Magic[4];
+        uint32_t Version;
+        uint32_t Width;
+        uint32_t Height;
+        uint64_t Triangles;
+        uint64_t RawBytes;
+        uint64_t PackedBytes;
+        uint32_t Adler;
+        uint32_t Reserved;
+    };
+
+    // std::mt19937 saves its state as decimal words, each at most ten digits and a separator
+    static const size_t SamplerTextBytes = (std::mt19937::state_size + 1) * 11;
+
+    // The checkpoint, or the one Save() wrote next to it when it is missing; empty when there is none.
+    static std::string Existing(const std::string &fileName);
+};
+
+std::string Checkpoint::Existing(const std::string &fileName)
+{
+    if (std::ifstream(fileName, std::ios::binary).is_open())
+        return fileName;
+    if (std::ifstream(fileName + ".part", std::ios::binary).is_open())
+        return fileName + ".part";
+    return std::string();
+}
+
+void Checkpoint::Remove(const std::string &fileName)
+{
+    std::remove(fileName.c_str());
+    std::remove((fileName + ".part").c_str());
+}
+
+bool Checkpoint::Save(const std::string &fileName, const FrameSaver &image, const Camera &camera,
+                      const std::mt19937 &sampler, const Scene &scene)
+{
+    std::ostringstream state(std::ios::binary);
+    state << sampler << '\n';
+    state.write((const char *)&camera.Position[0], sizeof(camera.Position));
+    state.write((const char *)&camera.Yaw, sizeof(camera.Yaw));
+    state.write((const char *)&camera.Pitch, sizeof(camera.Pitch));
+    image.WriteState(state);
+    std::string raw = state.str();
+
+    // the accumulation is mostly float noise, the fastest level packs it nearly as well as the best
+    uLongf packedBytes = compressBound((uLong)raw.size());
+    std::vector<unsigned char> packed(packedBytes);
+    if (compress2(packed.data(), &packedBytes, (const Bytef *)raw.data(), (uLong)raw.size(), Z_BEST_SPEED) != Z_OK)
+    {
+        std::cout << "ERROR::CHECKPOINT:: Compression failed for " << fileName << std::endl;
+        return false;
+    }
+
+    Header header;
+    std::memcpy(header.Magic, "SPTK", 4);
+    header.Version = Version;
+    header.Width = Global::WindowWidth;
+    header.Height = Global::WindowHeight;
+    header.Triangles = scene.InstancedTriangleCount();
+    header.RawBytes = raw.size();
+    header.PackedBytes = packedBytes;
+    header.Adler = (uint32_t)adler32(adler32(0L, Z_NULL, 0), (const Bytef *)raw.data(), (uInt)raw.size());
+    header.Reserved = 0;
+
+    std::string partName = fileName + ".part";
+    {
+        std::ofstream outStream(partName, std::ios::binary);
+        if (!outStream.is_open())
+        {
+            std::cout << "ERROR::CHECKPOINT:: Failed to open " << partName << std::endl;
+            return false;
+        }
+        outStream.write((const char *)&header, sizeof(header));
+        outStream.write((const char *)packed.data(), packedBytes);
+        if (!outStream.good())
+        {
+            std::cout << "ERROR::CHECKPOINT:: Failed to write " << partName << std::endl;
+            return false;
+        }
+    }
+
+    // both replace the old checkpoint in one step, rename() does not on Windows
+#ifdef _WIN32
+    bool renamed = MoveFileExA(partName.c_str(), fileName.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+    bool renamed = std::rename(partName.c_str(), fileName.c_str()) == 0;
+#endif
+    if (!renamed)
+    {
+        std::cout << "ERROR::CHECKPOINT:: Failed to rename " << partName << " to " << fileName << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool Checkpoint::Load(const std::string &checkpointName, FrameSaver &image, Camera &camera,
+                      std::mt19937 &sampler, const Scene &scene)
+{
+    std::string fileName = Existing(checkpointName);
+    std::ifstream inStream(fileName, std::ios::binary);
+    if (fileName.empty() || !inStream.is_open())
+    {
+        std::cout << "ERROR::CHECKPOINT:: Failed to open " << checkpointName << std::endl;
+        return false;
+    }
+
+    Header header;
+    inStream.read((char *)&header, sizeof(header));
+    if (!inStream || std::memcmp(header.Magic, "SPTK", 4) != 0 || header.Version != Version)
+    {
+        std::cout << "ERROR::CHECKPOINT:: " << fileName << " is not a checkpoint of this version" << std::endl;
+        return false;
+    }
+    if (header.Width != Global::WindowWidth || header.Height != Global::WindowHeight ||
+        header.Triangles != scene.InstancedTriangleCount())
+    {
+        std::cout << "ERROR::CHECKPOINT:: " << fileName << " is a " << header.Width << "x" << header.Height << " render of "
+                  << header.Triangles << " triangles" << std::endl;
+        return false;
+    }
+
+    // both sizes are checked before anything is allocated from them
+    size_t stateBytes = sizeof(glm::vec3) + 2 * sizeof(float) + FrameSaver::StateBytes();
+    std::streamoff packedStart = inStream.tellg();
+    inStream.seekg(0, std::ios::end);
+    uint64_t fileBytes = (uint64_t)inStream.tellg();
+    inStream.seekg(packedStart);
+    if (header.RawBytes <= stateBytes || header.RawBytes > stateBytes + SamplerTextBytes ||
+        header.PackedBytes != fileBytes - (uint64_t)packedStart)
+    {
+        std::cout << "ERROR::CHECKPOINT:: " << fileName << " is damaged" << std::endl;
+        return false;
+    }
+
+    std::vector<unsigned char> packed(header.PackedBytes);
+    inStream.read((char *)packed.data(), packed.size());
+    std::string raw(header.RawBytes, '\0');
+    uLongf rawBytes = (uLongf)raw.size();
+    if (!inStream || uncompress((Bytef *)&raw[0], &rawBytes, packed.data(), (uLong)packed.size()) != Z_OK ||
+        rawBytes != header.RawBytes ||
+        adler32(adler32(0L, Z_NULL, 0), (const Bytef *)raw.data(), (uInt)raw.size()) != header.Adler)
+    {
+        std::cout << "ERROR::CHECKPOINT:: " << fileName << " is damaged" << std::endl;
+        return false;
+    }
+
+    std::istringstream state(raw, std::ios::binary);
+    std::mt19937 savedSampler;
+    glm::vec3 position;
+    float yaw, pitch;
+    state >> savedSampler;
+    state.get(); // the newline after the generator
+    state.read((char *)&position[0], sizeof(position));
+    state.read((char *)&yaw, sizeof(yaw));
+    state.read((char *)&pitch, sizeof(pitch));
+    if (!state || !image.ReadState(state))
+    {
+        std::cout << "ERROR::CHECKPOINT:: " << fileName << " is damaged" << std::endl;
+        return false;
+    }
+
+    sampler = savedSampler;
+    camera.SetView(position, yaw, pitch);
+    return true;
+}
+
+#endif
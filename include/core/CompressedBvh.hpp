@@ -0,0 +1,437 @@
+#ifndef COMPRESSEDBVH_HPP
+#define COMPRESSEDBVH_HPP
+
+#include <glm/glm.hpp>
+
+#include <vector>
+#include <array>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+
+#include "Bvh.hpp"
+
+// 8 wide BVH node with quantized child bounds, 80 bytes, 5 RGBA32UI texels in the shader.
+// Child boxes are 8 bit offsets in the frame of the node: min = Origin + QuantizedMin * 2^Exponent, per axis.
+// Interior children are stored contiguously from ChildBase, in slot order. Leaf children list their
+// primitives contiguously from PrimBase, in slot order, with the primitive count in Meta.
+struct CompressedBvhNode
+{
+    glm::vec3 Origin;
+    uint8_t Exponent[3];  // biased by 127, so the scale is the float with this exponent and no mantissa
+    uint8_t InteriorMask; // bit i is set when slot i is an interior child
+    uint32_t ChildBase;
+    uint32_t PrimBase;
+    uint8_t Meta[8];      // primitive count of a leaf slot, 0 for empty slots
+    uint8_t QuantizedMin[3][8];
+    uint8_t QuantizedMax[3][8];
+};
+
+static_assert(sizeof(CompressedBvhNode) == 80, "CompressedBvhNode must match the shader layout");
+
+// Wide, quantized copy of a binary Bvh, for tracing only. Every node collapses up to 8 binary
+// subtrees, which takes about a third of the binary node count at 2.5 times the size, and packs
+// the 8 child boxes into the cache lines of one node.
+class CompressedBvh
+{
+public:
+    static const int Width = 8;
+    static const unsigned int MaxLeafCount = 255; // primitives in one leaf slot, larger leaves are split
+    static const int MaxSplitDepth = 8;           // split levels with interior slots a leaf of 2^32 primitives needs
+
+    // A path of wide nodes rooted at binary interior nodes is at most Bvh::MaxDepth long, and split
+    // leaves add MaxSplitDepth levels below it. Every node on the path leaves at most Width - 1
+    // siblings on the stack. The shader's MESH_STACK_SIZE defaults to it, a host that knows its scene
+    // compiles the shader with the StackSize its trees need instead (see SceneBuffer::MeshStackSize()).
+    static const int MaxStackSize = (Bvh::MaxDepth + MaxSplitDepth) * (Width - 1);
+
+    std::vector<CompressedBvhNode> Nodes;
+    std::vector<unsigned int> PrimIndices; // leaf order of the wide tree, may differ from the binary one
+    int StackSize = 0;                     // deepest traversal stack the tree can need
+
+    // Fails, leaving the tree empty, when it would need more than MaxStackSize.
+    bool Build(const Bvh &bvh);
+
+    // Re-quantizes the nodes holding the given binary nodes after a Bvh::Refit(), appending them to
+    // touchedNodes. The binary tree must have the topology it had in Build().
+    void Refit(const Bvh &bvh, const std::vector<unsigned int> &binaryNodes, std::vector<unsigned int> &touchedNodes);
+
+    bool Empty() const { return Nodes.empty(); }
+
+    size_t MemoryUsage() const { return Nodes.size() * sizeof(CompressedBvhNode) + PrimIndices.size() * sizeof(unsigned int); }
+
+    // Same contract as Bvh::Traverse().
+    template <typename F>
+    void Traverse(const glm::vec3 &origin, const glm::vec3 &direction, float &tMax, F intersect) const;
+
+    static Aabb ChildBounds(const CompressedBvhNode &node, int slot);
+
+private:
+    static const unsigned int NoNode = 0xFFFFFFFFu;
+
+    // A run of the primitives of a binary leaf.
+    struct PrimRange
+    {
+        unsigned int First;
+        unsigned int Count;
+    };
+
+    // binary nodes of each wide node: its subtree root and its slots. A binary leaf with more than
+    // MaxLeafCount primitives is an interior slot, rooting wide nodes whose slots are all that leaf,
+    // each with a run of its primitives; rootRanges holds the run of such a wide node.
+    std::vector<unsigned int> rootNodes;
+    std::vector<PrimRange> rootRanges;
+    std::vector<std::array<unsigned int, Width>> slotNodes;
+
+    // refit bookkeeping, built by the first Refit(): the wide node holding a binary node in a slot,
+    // and the wide node a binary node is the root of
+    std::vector<unsigned int> owners;
+    std::vector<unsigned int> roots;
+
+    int Collapse(const Bvh &bvh, unsigned int root, std::array<unsigned int, Width> &slots) const;
+    static int SplitLeaf(unsigned int leaf, PrimRange range, std::array<unsigned int, Width> &slots, std::array<PrimRange, Width> &ranges);
+    int NeededStack(unsigned int wideIndex) const;
+    void Encode(unsigned int wideIndex, const Bvh &bvh);
+    void BuildRefitLinks(const Bvh &bvh);
+
+    static float Scale(uint8_t exponent);
+};
+
+static_assert(CompressedBvh::MaxStackSize == 504, "CompressedBvh::MaxStackSize must match the default MESH_STACK_SIZE in the shader");
+
+// Nodes are emitted breadth first, so the interior children of a node end up contiguous.
+bool CompressedBvh::Build(const Bvh &bvh)
+{
+    Nodes.clear();
+    PrimIndices.clear();
+    rootNodes.clear();
+    rootRanges.clear();
+    slotNodes.clear();
+    owners.clear();
+    roots.clear();
+    StackSize = 0;
+
+    if (bvh.Empty())
+        return true;
+
+    rootNodes.reserve(bvh.Nodes.size() / (Width / 2) + 1);
+    slotNodes.reserve(rootNodes.capacity());
+    PrimIndices.reserve(bvh.PrimIndices.size());
+    rootNodes.push_back(0);
+    rootRanges.push_back({bvh.Nodes[0].LeftFirst, bvh.Nodes[0].Count});
+
+    for (size_t wide = 0; wide < rootNodes.size(); wide++)
+    {
+        std::array<unsigned int, Width> slots;
+        std::array<PrimRange, Width> ranges;
+        unsigned int root = rootNodes[wide];
+        int count = bvh.Nodes[root].IsLeaf() ? SplitLeaf(root, rootRanges[wide], slots, ranges) : Collapse(bvh, root, slots);
+        for (int i = count; i < Width; i++)
+            slots[i] = NoNode;
+
+        CompressedBvhNode node = {};
+        node.ChildBase = (unsigned int)rootNodes.size();
+        node.PrimBase = (unsigned int)PrimIndices.size();
+
+        for (int i = 0; i < count; i++)
+        {
+            const BvhNode &child = bvh.Nodes[slots[i]];
+            if (!bvh.Nodes[root].IsLeaf())
+                ranges[i] = {child.LeftFirst, child.Count};
+
+            if (!child.IsLeaf() || ranges[i].Count > MaxLeafCount)
+            {
+                node.InteriorMask |= 1 << i;
+                rootNodes.push_back(slots[i]);
+                rootRanges.push_back(ranges[i]);
+                continue;
+            }
+
+            node.Meta[i] = (uint8_t)ranges[i].Count;
+            PrimIndices.insert(PrimIndices.end(), bvh.PrimIndices.begin() + ranges[i].First,
+                               bvh.PrimIndices.begin() + ranges[i].First + ranges[i].Count);
+        }
+
+        Nodes.push_back(node);
+        slotNodes.push_back(slots);
+        Encode((unsigned int)wide, bvh);
+    }
+
+    StackSize = std::max(NeededStack(0), 1);
+    if (StackSize > MaxStackSize)
+    {
+        std::cout << "ERROR::COMPRESSEDBVH:: The tree needs a traversal stack of " << StackSize << ", more than "
+                  << MaxStackSize << std::endl;
+        Nodes.clear();
+        PrimIndices.clear();
+        return false;
+    }
+    return true;
+}
+
+// Cuts a run of leaf primitives into at most Width even slots. Slots above MaxLeafCount become
+// interior and are cut again one level down.
+int CompressedBvh::SplitLeaf(unsigned int leaf, PrimRange range, std::array<unsigned int, Width> &slots, std::array<PrimRange, Width> &ranges)
+{
+    unsigned int count = std::min<unsigned int>(Width, std::max(1u, (range.Count + MaxLeafCount - 1) / MaxLeafCount));
+    unsigned int size = (range.Count + count - 1) / count;
+
+    int used = 0;
+    for (unsigned int first = 0; first < range.Count; first += size)
+    {
+        slots[used] = leaf;
+        ranges[used++] = {range.First + first, std::min(size, range.Count - first)};
+    }
+    if (used == 0)
+    {
+        slots[0] = leaf;
+        ranges[used++] = range;
+    }
+    return used;
+}
+
+// Entries on the stack while the subtree of a node is traversed, after the node is popped: its
+// interior children, then the first of them to be popped with its siblings still below it.
+int CompressedBvh::NeededStack(unsigned int wideIndex) const
+{
+    const CompressedBvhNode &node = Nodes[wideIndex];
+    int children = 0;
+    for (int i = 0; i < Width; i++)
+        children += (node.InteriorMask >> i) & 1;
+
+    int needed = children;
+    for (int i = 0; i < children; i++)
+        needed = std::max(needed, children - 1 + NeededStack(node.ChildBase + i));
+    return needed;
+}
+
+// Opens the interior slot with the largest box until the node is full. A leaf root is its own slot.
+int CompressedBvh::Collapse(const Bvh &bvh, unsigned int root, std::array<unsigned int, Width> &slots) const
+{
+    const BvhNode &rootNode = bvh.Nodes[root];
+    if (rootNode.IsLeaf())
+    {
+        slots[0] = root;
+        return 1;
+    }
+
+    slots[0] = rootNode.LeftFirst;
+    slots[1] = rootNode.LeftFirst + 1;
+    int count = 2;
+
+    while (count < Width)
+    {
+        int largest = -1;
+        float largestArea = -1.0f;
+        for (int i = 0; i < count; i++)
+        {
+            const BvhNode &node = bvh.Nodes[slots[i]];
+            if (node.IsLeaf())
+                continue;
+
+            Aabb box;
+            box.Min = node.Min;
+            box.Max = node.Max;
+            if (box.Area() > largestArea)
+            {
+                largestArea = box.Area();
+                largest = i;
+            }
+        }
+
+        if (largest < 0)
+            break;
+
+        unsigned int opened = bvh.Nodes[slots[largest]].LeftFirst;
+        slots[largest] = opened;
+        slots[count++] = opened + 1;
+    }
+
+    return count;
+}
+
+// Picks the smallest power of two scale per axis that spans the node in 255 steps, then rounds
+// every child box outwards, checking the decoded value so the shader never sees a shrunk box.
+void CompressedBvh::Encode(unsigned int wideIndex, const Bvh &bvh)
+{
+    CompressedBvhNode &node = Nodes[wideIndex];
+    const std::array<unsigned int, Width> &slots = slotNodes[wideIndex];
+
+    Aabb frame;
+    for (unsigned int slot : slots)
+        if (slot != NoNode)
+        {
+            frame.Grow(bvh.Nodes[slot].Min);
+            frame.Grow(bvh.Nodes[slot].Max);
+        }
+
+    node.Origin = frame.Min;
+
+    for (int a = 0; a < 3; a++)
+    {
+        float extent = frame.Max[a] - frame.Min[a];
+        int exponent = extent > 0.0f ? (int)std::ceil(std::log2(extent / 255.0f)) : -126;
+        exponent = std::max(exponent, -126);
+        while (exponent < 127 && node.Origin[a] + 255.0f * std::ldexp(1.0f, exponent) < frame.Max[a])
+            exponent++;
+        node.Exponent[a] = (uint8_t)(exponent + 127);
+
+        float scale = Scale(node.Exponent[a]);
+        for (int i = 0; i < Width; i++)
+        {
+            if (slots[i] == NoNode)
+            {
+                node.QuantizedMin[a][i] = 0;
+                node.QuantizedMax[a][i] = 0;
+                continue;
+            }
+
+            const BvhNode &child = bvh.Nodes[slots[i]];
+            int lo = glm::clamp((int)std::floor((child.Min[a] - node.Origin[a]) / scale), 0, 255);
+            int hi = glm::clamp((int)std::ceil((child.Max[a] - node.Origin[a]) / scale), 0, 255);
+            while (lo > 0 && node.Origin[a] + lo * scale > child.Min[a])
+                lo--;
+            while (hi < 255 && node.Origin[a] + hi * scale < child.Max[a])
+                hi++;
+
+            node.QuantizedMin[a][i] = (uint8_t)lo;
+            node.QuantizedMax[a][i] = (uint8_t)hi;
+        }
+    }
+}
+
+void CompressedBvh::BuildRefitLinks(const Bvh &bvh)
+{
+    owners.assign(bvh.Nodes.size(), (unsigned int)NoNode);
+    roots.assign(bvh.Nodes.size(), (unsigned int)NoNode);
+
+    // a split leaf is in the slots of its parent and of the nodes it roots, the first is the parent
+    for (unsigned int wide = 0; wide < Nodes.size(); wide++)
+    {
+        if (roots[rootNodes[wide]] == NoNode)
+            roots[rootNodes[wide]] = wide;
+        for (unsigned int slot : slotNodes[wide])
+            if (slot != NoNode && owners[slot] == NoNode)
+                owners[slot] = wide;
+    }
+}
+
+// A changed binary node moves a child box of the node that holds it, and the frame of the node it roots.
+void CompressedBvh::Refit(const Bvh &bvh, const std::vector<unsigned int> &binaryNodes, std::vector<unsigned int> &touchedNodes)
+{
+    if (Nodes.empty())
+        return;
+
+    if (owners.size() != bvh.Nodes.size())
+        BuildRefitLinks(bvh);
+
+    size_t first = touchedNodes.size();
+    for (unsigned int binary : binaryNodes)
+    {
+        if (owners[binary] != NoNode)
+            touchedNodes.push_back(owners[binary]);
+        if (roots[binary] == NoNode)
+            continue;
+
+        // the nodes a split leaf roots are the subtree of the first one
+        std::vector<unsigned int> pending(1, roots[binary]);
+        while (!pending.empty())
+        {
+            const CompressedBvhNode &node = Nodes[pending.back()];
+            touchedNodes.push_back(pending.back());
+            pending.pop_back();
+            if (!bvh.Nodes[binary].IsLeaf())
+                continue;
+            for (int i = 0, child = 0; i < Width; i++)
+                if ((node.InteriorMask >> i) & 1)
+                    pending.push_back(node.ChildBase + child++);
+        }
+    }
+
+    std::sort(touchedNodes.begin() + first, touchedNodes.end());
+    touchedNodes.erase(std::unique(touchedNodes.begin() + first, touchedNodes.end()), touchedNodes.end());
+
+    for (size_t i = first; i < touchedNodes.size(); i++)
+        Encode(touchedNodes[i], bvh);
+}
+
+float CompressedBvh::Scale(uint8_t exponent)
+{
+    return std::ldexp(1.0f, (int)exponent - 127);
+}
+
+Aabb CompressedBvh::ChildBounds(const CompressedBvhNode &node, int slot)
+{
+    Aabb box;
+    for (int a = 0; a < 3; a++)
+    {
+        float scale = Scale(node.Exponent[a]);
+        box.Min[a] = node.Origin[a] + node.QuantizedMin[a][slot] * scale;
+        box.Max[a] = node.Origin[a] + node.QuantizedMax[a][slot] * scale;
+    }
+    return box;
+}
+
+// Leaf slots are intersected as they are met, interior hits are pushed far to near.
+template <typename F>
+void CompressedBvh::Traverse(const glm::vec3 &origin, const glm::vec3 &direction, float &tMax, F intersect) const
+{
+    if (Nodes.empty())
+        return;
+
+    glm::vec3 invDir = 1.0f / direction;
+
+    unsigned int stack[MaxStackSize];
+    int top = 0;
+    stack[top++] = 0;
+
+    while (top > 0)
+    {
+        const CompressedBvhNode &node = Nodes[stack[--top]];
+
+        unsigned int child = node.ChildBase;
+        unsigned int prim = node.PrimBase;
+
+        unsigned int hitNodes[Width];
+        float hitDistances[Width];
+        int hitCount = 0;
+
+        for (int slot = 0; slot < Width; slot++)
+        {
+            bool interior = (node.InteriorMask >> slot) & 1;
+            if (!interior && node.Meta[slot] == 0)
+                continue;
+
+            Aabb box = ChildBounds(node, slot);
+            float t = IntersectAabb(origin, invDir, box.Min, box.Max, tMax);
+
+            if (interior)
+            {
+                if (t != FLT_MAX)
+                {
+                    int j = hitCount++;
+                    for (; j > 0 && hitDistances[j - 1] < t; j--)
+                    {
+                        hitDistances[j] = hitDistances[j - 1];
+                        hitNodes[j] = hitNodes[j - 1];
+                    }
+                    hitDistances[j] = t;
+                    hitNodes[j] = child;
+                }
+                child++;
+                continue;
+            }
+
+            if (t != FLT_MAX)
+                for (unsigned int i = 0; i < node.Meta[slot]; i++)
+                    intersect(PrimIndices[prim + i], tMax);
+            prim += node.Meta[slot];
+        }
+
+        for (int i = 0; i < hitCount; i++)
+            stack[top++] = hitNodes[i];
+    }
+}
+
+#endif
@@ -1,6 +1,8 @@
 #ifndef CORNELBOX_HPP
 #define CORNELBOX_HPP
 
+#include "Geometry.hpp"
+
 const float triangleVertices[416] =
 {
     // floor
@@ -202,4 +204,37 @@ const float triangleVertices[416] =
     0.0f
 };
 
+// Each triangle is 13 floats: v0, v1, v2, Kd and the light flag.
+// Splits the array into the hot/cold trace streams, sharing one material per distinct Kd.
+void LoadCornellBox(TraceGeometry &geometry, std::vector<Material> &materials)
+{
+    const int stride = 13;
+    const int triangleCount = sizeof(triangleVertices) / sizeof(float) / stride;
+
+    geometry.Reserve(geometry.VertexCount() + triangleCount * 3, geometry.TriangleCount() + triangleCount);
+
+    for (int i = 0; i < triangleCount; i++)
+    {
+        const float *t = triangleVertices + i * stride;
+
+        glm::vec3 v0 = glm::vec3(t[0], t[1], t[2]);
+        glm::vec3 v1 = glm::vec3(t[3], t[4], t[5]);
+        glm::vec3 v2 = glm::vec3(t[6], t[7], t[8]);
+        Material material = {glm::vec3(t[9], t[10], t[11]), t[12]};
+
+        unsigned int materialID = 0;
+        while (materialID < materials.size() &&
+               (materials[materialID].Kd != material.Kd || materials[materialID].Emission != material.Emission))
+            materialID++;
+        if (materialID == materials.size())
+            materials.push_back(material);
+
+        glm::vec3 normal = glm::normalize(glm::cross(v1 - v0, v2 - v0));
+        unsigned int a = geometry.AddVertex(v0, normal, glm::vec2(0.0f));
+        unsigned int b = geometry.AddVertex(v1, normal, glm::vec2(0.0f));
+        unsigned int c = geometry.AddVertex(v2, normal, glm::vec2(0.0f));
+        geometry.AddTriangle(a, b, c, materialID);
+    }
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,308 @@
+#ifndef CPUPATHTRACER_HPP
+#define CPUPATHTRACER_HPP
+
+#include <glm/glm.hpp>
+
+#include <cstdint>
+#include <vector>
+
+#include "Global.hpp"
+#include "Camera.hpp"
+#include "Scene.hpp"
+#include "ThreadPool.hpp"
+#include "Tile.hpp"
+
+// Random numbers of one path, a splitmix64 stream keyed by seed, pixel and sample index, so any
+// sample of any pixel can be traced again, on any thread or process, without state carried over.
+class PathSampler
+{
+public:
+    PathSampler(uint32_t seed, uint32_t pixel, uint32_t sample)
+        : state(((uint64_t)seed << 32 ^ pixel) * 0x9E3779B97F4A7C15ull ^ (uint64_t)sample * 0xD1B54A32D192ED03ull)
+    {
+    }
+
+    // [0, 1)
+    float Next()
+    {
+        state += 0x9E3779B97F4A7C15ull;
+        uint64_t z = state;
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        z ^= z >> 31;
+        return (float)(z >> 40) / 16777216.0f;
+    }
+
+private:
+    uint64_t state;
+};
+
+// The path tracer of SimplePathTracing.fs on the CPU, over Scene::Intersect() and ThreadPool, for
+// machines or processes without the GL context. Shade() follows the shader step for step, light
+// sampling, Russian roulette and the way the bounces are summed up included, so the images of
+// both backends converge to the same picture and may be averaged together. Only the random
+// numbers differ (PathSampler instead of RandXY).
+//
+// Streamed meshes are traced, but only resident emitters are lights.
+class CpuPathTracer
+{
+public:
+    // One path through a pixel, and the primary hit it started with.
+    struct PathSample
+    {
+        glm::vec3 Color = glm::vec3(0.0f);
+        glm::vec3 Albedo = glm::vec3(0.0f);
+        glm::vec3 Normal = glm::vec3(0.0f);
+        float Distance = 0.0f; // zero when the primary ray hits nothing
+        unsigned int Rays = 0; // rays cast for the path, primary and shadow rays included
+    };
+
+    explicit CpuPathTracer(const Scene &scene);
+
+    size_t LightCount() const { return lights.size(); }
+
+    // Traces the pixel center of pixel (column, row) of a width x height image, the window by default,
+    // camera space rays turned by rayRotateMatrix.
+    PathSample Trace(unsigned int column, unsigned int row, const glm::vec3 &eye, const glm::mat4 &rayRotateMatrix,
+                     PathSampler &sampler, unsigned int width = Global::WindowWidth,
+                     unsigned int height = Global::WindowHeight) const;
+
+    // Fills result with the average of its samples for every pixel of its region, rows in parallel.
+    // The region is taken from a width x height image.
+    void Render(TileResult &result, const glm::vec3 &eye, const glm::mat4 &rayRotateMatrix,
+                unsigned int width = Global::WindowWidth, unsigned int height = Global::WindowHeight) const;
+
+private:
+    struct Light
+    {
+        glm::vec3 V0, V1, V2;
+        float Area;
+    };
+
+    static const int MaxBounceTerms = 20; // colorBuffer in the shader
+
+    const Scene &scene;
+    std::vector<Light> lights;
+    float lightArea = 0.0f;
+
+    glm::vec3 Shade(const Ray &ray, const Hit &primary, const SurfacePoint &surface, PathSampler &sampler,
+                    unsigned int &rays) const;
+    // Picks a light by area and a point on it; pdfLight accumulates like the global of the shader.
+    bool SampleLight(PathSampler &sampler, glm::vec3 &coords, glm::vec3 &normal, float &pdfLight) const;
+
+    static glm::vec3 BRDF(const glm::vec3 &wi, const glm::vec3 &wo, const glm::vec3 &N, const glm::vec3 &Kd);
+    static float PDFHemisphere(const glm::vec3 &wi, const glm::vec3 &wo, const glm::vec3 &N);
+    static glm::vec3 SampleHemisphere(const glm::vec3 &N, PathSampler &sampler);
+};
+
+CpuPathTracer::CpuPathTracer(const Scene &scene) : scene(scene)
+{
+    for (const Instance &instance : scene.Instances)
+    {
+        const TraceGeometry &geometry = scene.Meshes[instance.Mesh];
+        for (size_t i = 0; i < geometry.TriangleCount(); i++)
+        {
+            if (scene.Materials[geometry.MaterialIDs[i]].Emission <= 0.0f)
+                continue;
+
+            Light light;
+            light.V0 = glm::vec3(instance.ToWorld * glm::vec4(geometry.Positions[geometry.Indices[i].x], 1.0f));
+            light.V1 = glm::vec3(instance.ToWorld * glm::vec4(geometry.Positions[geometry.Indices[i].y], 1.0f));
+            light.V2 = glm::vec3(instance.ToWorld * glm::vec4(geometry.Positions[geometry.Indices[i].z], 1.0f));
+            light.Area = glm::length(glm::cross(light.V1 - light.V0, light.V2 - light.V0)) * 0.5f;
+            lights.push_back(light);
+            lightArea += light.Area;
+        }
+    }
+}
+
+CpuPathTracer::PathSample CpuPathTracer::Trace(unsigned int column, unsigned int row, const glm::vec3 &eye,
+                                               const glm::mat4 &rayRotateMatrix, PathSampler &sampler,
+                                               unsigned int width, unsigned int height) const
+{
+    Ray ray;
+    ray.Origin = eye;
+    ray.Direction = glm::vec3(rayRotateMatrix * glm::vec4(Camera::PixelDirection((float)column, (float)row, width, height), 0.0f));
+
+    PathSample sample;
+    sample.Rays = 1;
+    Hit hit;
+    SurfacePoint surface;
+    if (!scene.Intersect(ray, hit) || !scene.GetSurface(ray, hit, surface))
+        return sample;
+
+    sample.Color = Shade(ray, hit, surface, sampler, sample.Rays);
+    sample.Albedo = surface.Kd;
+    sample.Normal = surface.Normal;
+    sample.Distance = hit.Distance;
+    return sample;
+}
+
+void CpuPathTracer::Render(TileResult &result, const glm::vec3 &eye, const glm::mat4 &rayRotateMatrix,
+                           unsigned int width, unsigned int height) const
+{
+    const Tile &tile = result.Region;
+    result.Resize();
+
+    ThreadPool::Instance().ParallelFor(0, tile.Height, 1, [&](size_t y) {
+        for (unsigned int x = 0; x < tile.Width; x++)
+        {
+            size_t i = y * tile.Width + x;
+            unsigned int column = tile.X + x;
+            unsigned int row = tile.Y + (unsigned int)y;
+            uint32_t pixel = row * width + column;
+
+            for (unsigned int s = 0; s < result.Samples; s++)
+            {
+                PathSampler sampler(Global::SampleSeed, pixel, result.FirstSample + s);
+                PathSample sample = Trace(column, row, eye, rayRotateMatrix, sampler, width, height);
+
+                float weight = 1.0f / (s + 1);
+                float luminance = 0.2126f * sample.Color.r + 0.7152f * sample.Color.g + 0.0722f * sample.Color.b;
+                for (int c = 0; c < 3; c++)
+                    result.Color[3 * i + c] += (sample.Color[c] - result.Color[3 * i + c]) * weight;
+                result.Moment[i] += (luminance * luminance - result.Moment[i]) * weight;
+
+                // the primary hit is the same for every sample of the pixel center
+                if (s == 0)
+                {
+                    for (int c = 0; c < 3; c++)
+                    {
+                        result.Albedo[3 * i + c] = sample.Albedo[c];
+                        result.NormalDepth[4 * i + c] = sample.Normal[c];
+                    }
+                    result.NormalDepth[4 * i + 3] = sample.Distance;
+                }
+            }
+        }
+    });
+}
+
+glm::vec3 CpuPathTracer::Shade(const Ray &ray, const Hit &primary, const SurfacePoint &surface, PathSampler &sampler,
+                               unsigned int &rays) const
+{
+    const glm::vec3 lightColor(1.0f);
+    const glm::vec3 emit = 2.0f * (8.0f * glm::vec3(0.747f + 0.058f, 0.747f + 0.258f, 0.747f) +
+                                   15.6f * glm::vec3(0.740f + 0.287f, 0.740f + 0.160f, 0.740f) +
+                                   18.4f * glm::vec3(0.737f + 0.642f, 0.737f + 0.159f, 0.737f));
+
+    if (!primary.Happened)
+        return glm::vec3(0.0f);
+    if (surface.IsLight)
+        return lightColor;
+
+    // direct terms fill colorBuffer from the front, indirect throughputs from the back
+    glm::vec3 colorBuffer[MaxBounceTerms] = {};
+    int dirLightIndex = 0;
+    int indirLightIndex = MaxBounceTerms - 1;
+    float pdfLight = 0.0f;
+
+    glm::vec3 wo = glm::normalize(-ray.Direction); // the primary ray's, at every bounce, as in the shader
+    SurfacePoint inter = surface;
+
+    while (true)
+    {
+        glm::vec3 p = inter.Coords;
+        glm::vec3 N = glm::normalize(inter.Normal);
+
+        glm::vec3 x, NN;
+        if (SampleLight(sampler, x, NN, pdfLight))
+        {
+            glm::vec3 ws = glm::normalize(x - p);
+            Ray shadowRay{p, ws};
+            Hit shadow;
+            rays++;
+            bool block = !scene.Intersect(shadowRay, shadow) || glm::length(p + ws * shadow.Distance - x) > SCENE_EPSILON;
+
+            if (!block)
+            {
+                float distance2 = glm::dot(x - p, x - p);
+                colorBuffer[dirLightIndex++] = emit * BRDF(wo, ws, N, inter.Kd) * glm::dot(ws, N) * glm::dot(-ws, NN) /
+                                               (distance2 * pdfLight);
+            }
+        }
+
+        if (sampler.Next() >= Global::RussianRoulette || indirLightIndex - dirLightIndex <= 2)
+        {
+            colorBuffer[indirLightIndex--] = glm::vec3(0.0f);
+            break;
+        }
+
+        glm::vec3 wi = glm::normalize(SampleHemisphere(N, sampler));
+        Ray reflectRay{p, wi};
+        Hit reflect;
+        SurfacePoint reflectSurface;
+        rays++;
+        if (!scene.Intersect(reflectRay, reflect) || !scene.GetSurface(reflectRay, reflect, reflectSurface))
+            break;
+
+        if (!reflectSurface.IsLight)
+            colorBuffer[indirLightIndex--] = Global::IndirLightContributionRate * BRDF(wo, wi, N, inter.Kd) * glm::dot(wi, N) /
+                                             (PDFHemisphere(wo, wi, N) * Global::RussianRoulette);
+        inter = reflectSurface;
+    }
+
+    glm::vec3 result(0.0f);
+    for (int i = dirLightIndex; i >= 0; i--)
+        result += colorBuffer[i] + colorBuffer[MaxBounceTerms - 1 - i] * result;
+    return result;
+}
+
+bool CpuPathTracer::SampleLight(PathSampler &sampler, glm::vec3 &coords, glm::vec3 &normal, float &pdfLight) const
+{
+    if (lights.empty())
+        return false;
+
+    float p = sampler.Next() * lightArea;
+    float areaSum = 0.0f;
+    for (const Light &light : lights)
+    {
+        areaSum += light.Area;
+        if (p > areaSum && &light != &lights.back())
+            continue;
+
+        float x = std::sqrt(sampler.Next());
+        float y = sampler.Next();
+        coords = light.V0 * (1.0f - x) + light.V1 * (x * (1.0f - y)) + light.V2 * (x * y);
+        normal = glm::normalize(glm::cross(light.V1 - light.V0, light.V2 - light.V0));
+        pdfLight += 1.0f / light.Area;
+        return true;
+    }
+    return false;
+}
+
+glm::vec3 CpuPathTracer::BRDF(const glm::vec3 &/*wi*/, const glm::vec3 &wo, const glm::vec3 &N, const glm::vec3 &Kd)
+{
+    return glm::dot(N, wo) > 0.0f ? Kd / Global::Pi : glm::vec3(0.0f);
+}
+
+float CpuPathTracer::PDFHemisphere(const glm::vec3 &/*wi*/, const glm::vec3 &wo, const glm::vec3 &N)
+{
+    return glm::dot(wo, N) > 0.0f ? 0.5f * Global::Pi : 0.0f;
+}
+
+// Uniform over the hemisphere around N, SampleTriangle() in the shader.
+glm::vec3 CpuPathTracer::SampleHemisphere(const glm::vec3 &N, PathSampler &sampler)
+{
+    float x1 = sampler.Next(), x2 = sampler.Next();
+    float z = std::abs(1.0f - 2.0f * x1);
+    float r = std::sqrt(1.0f - z * z), phi = 2.0f * Global::Pi * x2;
+    glm::vec3 local(r * std::cos(phi), r * std::sin(phi), z);
+
+    glm::vec3 B, C;
+    if (std::abs(N.x) > std::abs(N.y))
+    {
+        float invLen = 1.0f / std::sqrt(N.x * N.x + N.z * N.z);
+        C = glm::vec3(N.z * invLen, 0.0f, -N.x * invLen);
+    }
+    else
+    {
+        float invLen = 1.0f / std::sqrt(N.y * N.y + N.z * N.z);
+        C = glm::vec3(0.0f, N.z * invLen, -N.y * invLen);
+    }
+    B = glm::cross(C, N);
+
+    return local.x * B + local.y * C + local.z * N;
+}
+
+#endif
@@ -0,0 +1,448 @@
+#ifndef DENOISER_HPP
+#define DENOISER_HPP
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include <vector>
+#include <memory>
+#include <cmath>
+#include <algorithm>
+#include <string>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define DENOISER_SSE
+#include <emmintrin.h>
+#endif
+
+#include "Global.hpp"
+#include "ThreadPool.hpp"
+#include "shader.hpp"
+
+// Primary hit data the denoiser uses to find edges, one entry per pixel in glReadPixels order
+// (rows bottom up). Pixels that hit nothing have zero albedo, normal and depth.
+struct DenoiseGuides
+{
+    unsigned int Width = 0;
+    unsigned int Height = 0;
+    std::vector<glm::vec3> Albedo;
+    std::vector<glm::vec3> Normal;
+    std::vector<float> Depth; // distance from the eye
+
+    void Resize(unsigned int width, unsigned int height);
+};
+
+enum class DenoiserBackend
+{
+    Cpu,
+    Gl
+};
+
+// Edge avoiding a-trous wavelet filter (Dammertz et al. 2010). Every pass spreads a 5x5 B3 spline
+// kernel over taps StepSize apart, doubling StepSize each pass, and weighs each tap by how close its
+// color, normal and depth are to the center. Color is divided by albedo first so texture and
+// material edges survive, and multiplied back at the end.
+//
+// The CPU backend works on planar copies with a border wide enough for the largest step, so four
+// neighbouring pixels are filtered per SSE instruction without bounds checks. The GL backend runs
+// the same passes in Atrous.fs and must be used on the thread owning the context.
+class Denoiser
+{
+public:
+    static const int NormalPower = 128; // power of two, the CPU backend squares its way there
+
+    int Iterations = 5;
+    float SigmaColor = 4.0f;  // at one sample per pixel, shrinks with the noise and halves every pass
+    float SigmaDepth = 0.05f; // relative to the depth of the center and the step size
+
+    explicit Denoiser(DenoiserBackend backend = DenoiserBackend::Cpu) : backend(backend) {}
+
+    DenoiserBackend Backend() const { return backend; }
+
+    // color and result hold width * height RGB triples in display units (1 is white), they may be the same buffer.
+    // samples is the number of frames averaged into color, the noise falls with its square root.
+    void Denoise(const float *color, const DenoiseGuides &guides, float *result, unsigned int samples = 1);
+
+private:
+    struct Planes
+    {
+        unsigned int width = 0;
+        unsigned int height = 0;
+        unsigned int border = 0;
+        unsigned int stride = 0; // padded row length
+        std::vector<float> color[2][3];
+        std::vector<float> normal[3];
+        std::vector<float> depth;
+
+        float *Row(std::vector<float> &plane, unsigned int y) { return plane.data() + (size_t)(y + border) * stride + border; }
+    };
+
+    static constexpr float AlbedoEpsilon = 0.01f;
+    static constexpr float Kernel[3] = {3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f};
+
+    DenoiserBackend backend;
+    Planes planes;
+
+    // GL resources, created on first use and left to the context like every other GL object
+    std::unique_ptr<Shader> atrousShader;
+    unsigned int vao = 0;
+    unsigned int framebuffer = 0;
+    unsigned int colorTextures[2] = {0, 0};
+    unsigned int normalDepthTexture = 0;
+    unsigned int textureWidth = 0;
+    unsigned int textureHeight = 0;
+
+    static glm::vec3 Demodulation(const glm::vec3 &albedo);
+
+    void FilterCpu(std::vector<glm::vec3> &irradiance, const DenoiseGuides &guides, float sigmaColor);
+    void PreparePlanes(const std::vector<glm::vec3> &irradiance, const DenoiseGuides &guides);
+    void FilterRowScalar(int source, unsigned int y, int step, float sigmaColor);
+#ifdef DENOISER_SSE
+    void FilterRowSse(int source, unsigned int y, int step, float sigmaColor);
+    static __m128 Exp(__m128 x);
+#endif
+
+    void FilterGl(std::vector<glm::vec3> &irradiance, const DenoiseGuides &guides, float sigmaColor);
+    void CreateGlResources(unsigned int width, unsigned int height);
+};
+
+constexpr float Denoiser::Kernel[3];
+
+// DenoiseGuides----------------------------------------------------------------------------------------
+
+void DenoiseGuides::Resize(unsigned int width, unsigned int height)
+{
+    Width = width;
+    Height = height;
+    Albedo.assign((size_t)width * height, glm::vec3(0.0f));
+    Normal.assign((size_t)width * height, glm::vec3(0.0f));
+    Depth.assign((size_t)width * height, 0.0f);
+}
+
+// Denoiser---------------------------------------------------------------------------------------------
+
+glm::vec3 Denoiser::Demodulation(const glm::vec3 &albedo)
+{
+    return glm::max(albedo, glm::vec3(AlbedoEpsilon));
+}
+
+void Denoiser::Denoise(const float *color, const DenoiseGuides &guides, float *result, unsigned int samples)
+{
+    size_t pixelCount = (size_t)guides.Width * guides.Height;
+    ThreadPool &pool = ThreadPool::Instance();
+
+    std::vector<glm::vec3> irradiance(pixelCount);
+    pool.ParallelFor(0, pixelCount, 4096, [&](size_t i) {
+        glm::vec3 albedo = guides.Depth[i] > 0.0f ? Demodulation(guides.Albedo[i]) : glm::vec3(1.0f);
+        irradiance[i] = glm::vec3(color[3 * i], color[3 * i + 1], color[3 * i + 2]) / albedo;
+    });
+
+    float sigmaColor = SigmaColor / std::sqrt((float)std::max(samples, 1u));
+    if (backend == DenoiserBackend::Gl)
+        FilterGl(irradiance, guides, sigmaColor);
+    else
+        FilterCpu(irradiance, guides, sigmaColor);
+
+    pool.ParallelFor(0, pixelCount, 4096, [&](size_t i) {
+        glm::vec3 albedo = guides.Depth[i] > 0.0f ? Demodulation(guides.Albedo[i]) : glm::vec3(1.0f);
+        glm::vec3 filtered = irradiance[i] * albedo;
+        result[3 * i] = filtered.r;
+        result[3 * i + 1] = filtered.g;
+        result[3 * i + 2] = filtered.b;
+    });
+}
+
+void Denoiser::FilterCpu(std::vector<glm::vec3> &irradiance, const DenoiseGuides &guides, float sigmaColor)
+{
+    PreparePlanes(irradiance, guides);
+
+    int source = 0;
+    for (int i = 0; i < Iterations; i++)
+    {
+        int step = 1 << i;
+        ThreadPool::Instance().ParallelFor(0, planes.height, 8, [&](size_t y) {
+#ifdef DENOISER_SSE
+            FilterRowSse(source, (unsigned int)y, step, sigmaColor);
+#else
+            FilterRowScalar(source, (unsigned int)y, step, sigmaColor);
+#endif
+        });
+        source = 1 - source;
+        sigmaColor *= 0.5f;
+    }
+
+    for (unsigned int y = 0; y < planes.height; y++)
+    {
+        const float *r = planes.Row(planes.color[source][0], y);
+        const float *g = planes.Row(planes.color[source][1], y);
+        const float *b = planes.Row(planes.color[source][2], y);
+        for (unsigned int x = 0; x < planes.width; x++)
+            irradiance[(size_t)y * planes.width + x] = glm::vec3(r[x], g[x], b[x]);
+    }
+}
+
+// The border is zero, and a zero normal gives a tap no weight, so taps outside the image drop out
+// exactly like the ones the GL backend skips.
+void Denoiser::PreparePlanes(const std::vector<glm::vec3> &irradiance, const DenoiseGuides &guides)
+{
+    unsigned int border = 2 * (1u << (Iterations - 1)) + 4; // 2 taps of the largest step, plus a vector tail
+    unsigned int stride = guides.Width + 2 * border;
+    size_t size = (size_t)stride * (guides.Height + 2 * border);
+
+    planes.width = guides.Width;
+    planes.height = guides.Height;
+    planes.border = border;
+    planes.stride = stride;
+    for (int c = 0; c < 3; c++)
+    {
+        planes.color[0][c].assign(size, 0.0f);
+        planes.color[1][c].assign(size, 0.0f);
+        planes.normal[c].assign(size, 0.0f);
+    }
+    planes.depth.assign(size, 0.0f);
+
+    ThreadPool::Instance().ParallelFor(0, planes.height, 16, [&](size_t y) {
+        for (int c = 0; c < 3; c++)
+        {
+            float *color = planes.Row(planes.color[0][c], (unsigned int)y);
+            float *normal = planes.Row(planes.normal[c], (unsigned int)y);
+            for (unsigned int x = 0; x < planes.width; x++)
+            {
+                size_t pixel = y * planes.width + x;
+                color[x] = irradiance[pixel][c];
+                normal[x] = guides.Normal[pixel][c];
+            }
+        }
+
+        float *depth = planes.Row(planes.depth, (unsigned int)y);
+        std::copy(guides.Depth.begin() + y * planes.width, guides.Depth.begin() + (y + 1) * planes.width, depth);
+    });
+}
+
+void Denoiser::FilterRowScalar(int source, unsigned int y, int step, float sigmaColor)
+{
+    const int stride = (int)planes.stride;
+    const float invSigmaColor2 = 1.0f / (sigmaColor * sigmaColor);
+
+    const float *inR = planes.Row(planes.color[source][0], y);
+    const float *inG = planes.Row(planes.color[source][1], y);
+    const float *inB = planes.Row(planes.color[source][2], y);
+    const float *nx = planes.Row(planes.normal[0], y);
+    const float *ny = planes.Row(planes.normal[1], y);
+    const float *nz = planes.Row(planes.normal[2], y);
+    const float *depth = planes.Row(planes.depth, y);
+    float *outR = planes.Row(planes.color[1 - source][0], y);
+    float *outG = planes.Row(planes.color[1 - source][1], y);
+    float *outB = planes.Row(planes.color[1 - source][2], y);
+
+    for (int x = 0; x < (int)planes.width; x++)
+    {
+        float center = Kernel[0] * Kernel[0];
+        float r = inR[x] * center, g = inG[x] * center, b = inB[x] * center;
+        float weights = center;
+        float invDepth = 1.0f / (SigmaDepth * step * depth[x] + 1e-6f);
+
+        for (int dy = -2; dy <= 2; dy++)
+            for (int dx = -2; dx <= 2; dx++)
+            {
+                if (dx == 0 && dy == 0)
+                    continue;
+
+                int q = x + (dy * stride + dx) * step;
+                float dr = inR[x] - inR[q], dg = inG[x] - inG[q], db = inB[x] - inB[q];
+                float colorWeight = std::exp(-(dr * dr + dg * dg + db * db) * invSigmaColor2);
+
+                float normalWeight = std::max(nx[x] * nx[q] + ny[x] * ny[q] + nz[x] * nz[q], 0.0f);
+                for (int k = 1; k < NormalPower; k *= 2)
+                    normalWeight *= normalWeight;
+
+                float depthWeight = std::exp(-std::abs(depth[x] - depth[q]) * invDepth);
+
+                float w = Kernel[std::abs(dx)] * Kernel[std::abs(dy)] * colorWeight * normalWeight * depthWeight;
+                r += inR[q] * w;
+                g += inG[q] * w;
+                b += inB[q] * w;
+                weights += w;
+            }
+
+        outR[x] = r / weights;
+        outG[x] = g / weights;
+        outB[x] = b / weights;
+    }
+}
+
+#ifdef DENOISER_SSE
+// Same as FilterRowScalar(), four pixels at a time. The last vector may run into the border.
+void Denoiser::FilterRowSse(int source, unsigned int y, int step, float sigmaColor)
+{
+    const int stride = (int)planes.stride;
+    const __m128 invSigmaColor2 = _mm_set1_ps(-1.0f / (sigmaColor * sigmaColor));
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+    const __m128 depthScale = _mm_set1_ps(SigmaDepth * step);
+    const __m128 depthBias = _mm_set1_ps(1e-6f);
+    const __m128 center = _mm_set1_ps(Kernel[0] * Kernel[0]);
+
+    const float *inR = planes.Row(planes.color[source][0], y);
+    const float *inG = planes.Row(planes.color[source][1], y);
+    const float *inB = planes.Row(planes.color[source][2], y);
+    const float *nx = planes.Row(planes.normal[0], y);
+    const float *ny = planes.Row(planes.normal[1], y);
+    const float *nz = planes.Row(planes.normal[2], y);
+    const float *depth = planes.Row(planes.depth, y);
+    float *outR = planes.Row(planes.color[1 - source][0], y);
+    float *outG = planes.Row(planes.color[1 - source][1], y);
+    float *outB = planes.Row(planes.color[1 - source][2], y);
+
+    for (int x = 0; x < (int)planes.width; x += 4)
+    {
+        __m128 pr = _mm_loadu_ps(inR + x), pg = _mm_loadu_ps(inG + x), pb = _mm_loadu_ps(inB + x);
+        __m128 pnx = _mm_loadu_ps(nx + x), pny = _mm_loadu_ps(ny + x), pnz = _mm_loadu_ps(nz + x);
+        __m128 pz = _mm_loadu_ps(depth + x);
+        __m128 invDepth = _mm_div_ps(_mm_set1_ps(-1.0f), _mm_add_ps(_mm_mul_ps(depthScale, pz), depthBias));
+
+        __m128 r = _mm_mul_ps(pr, center), g = _mm_mul_ps(pg, center), b = _mm_mul_ps(pb, center);
+        __m128 weights = center;
+
+        for (int dy = -2; dy <= 2; dy++)
+            for (int dx = -2; dx <= 2; dx++)
+            {
+                if (dx == 0 && dy == 0)
+                    continue;
+
+                int q = x + (dy * stride + dx) * step;
+                __m128 qr = _mm_loadu_ps(inR + q), qg = _mm_loadu_ps(inG + q), qb = _mm_loadu_ps(inB + q);
+
+                __m128 dr = _mm_sub_ps(pr, qr), dg = _mm_sub_ps(pg, qg), db = _mm_sub_ps(pb, qb);
+                __m128 distance2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dr, dr), _mm_mul_ps(dg, dg)), _mm_mul_ps(db, db));
+                __m128 w = Exp(_mm_mul_ps(distance2, invSigmaColor2));
+
+                __m128 cosine = _mm_add_ps(_mm_add_ps(_mm_mul_ps(pnx, _mm_loadu_ps(nx + q)), _mm_mul_ps(pny, _mm_loadu_ps(ny + q))),
+                                           _mm_mul_ps(pnz, _mm_loadu_ps(nz + q)));
+                __m128 normalWeight = _mm_max_ps(cosine, zero);
+                for (int k = 1; k < NormalPower; k *= 2)
+                    normalWeight = _mm_mul_ps(normalWeight, normalWeight);
+                w = _mm_mul_ps(w, normalWeight);
+
+                __m128 depthDifference = _mm_and_ps(_mm_sub_ps(pz, _mm_loadu_ps(depth + q)), absMask);
+                w = _mm_mul_ps(w, Exp(_mm_mul_ps(depthDifference, invDepth)));
+                w = _mm_mul_ps(w, _mm_set1_ps(Kernel[std::abs(dx)] * Kernel[std::abs(dy)]));
+
+                r = _mm_add_ps(r, _mm_mul_ps(qr, w));
+                g = _mm_add_ps(g, _mm_mul_ps(qg, w));
+                b = _mm_add_ps(b, _mm_mul_ps(qb, w));
+                weights = _mm_add_ps(weights, w);
+            }
+
+        _mm_storeu_ps(outR + x, _mm_div_ps(r, weights));
+        _mm_storeu_ps(outG + x, _mm_div_ps(g, weights));
+        _mm_storeu_ps(outB + x, _mm_div_ps(b, weights));
+    }
+}
+
+// e^x for x <= 0, as 2^i * 2^f with a degree 5 polynomial for 2^f. Relative error below 1e-5.
+__m128 Denoiser::Exp(__m128 x)
+{
+    const __m128 one = _mm_set1_ps(1.0f);
+
+    __m128 t = _mm_mul_ps(_mm_max_ps(x, _mm_set1_ps(-87.0f)), _mm_set1_ps(1.44269504f));
+    __m128 whole = _mm_cvtepi32_ps(_mm_cvttps_epi32(t));
+    whole = _mm_sub_ps(whole, _mm_and_ps(_mm_cmpgt_ps(whole, t), one)); // floor
+    __m128 f = _mm_sub_ps(t, whole);
+
+    __m128 p = _mm_set1_ps(1.33335581e-3f);
+    p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(9.61812911e-3f));
+    p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(5.55041087e-2f));
+    p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(2.40226507e-1f));
+    p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(6.93147182e-1f));
+    p = _mm_add_ps(_mm_mul_ps(p, f), one);
+
+    __m128i exponent = _mm_slli_epi32(_mm_add_epi32(_mm_cvttps_epi32(whole), _mm_set1_epi32(127)), 23);
+    return _mm_mul_ps(p, _mm_castsi128_ps(exponent));
+}
+#endif
+
+// Ping-pongs between two float textures, restoring the default framebuffer and viewport afterwards.
+void Denoiser::FilterGl(std::vector<glm::vec3> &irradiance, const DenoiseGuides &guides, float sigmaColor)
+{
+    CreateGlResources(guides.Width, guides.Height);
+
+    std::vector<glm::vec4> normalDepth(irradiance.size());
+    for (size_t i = 0; i < normalDepth.size(); i++)
+        normalDepth[i] = glm::vec4(guides.Normal[i], guides.Depth[i]);
+
+    glBindTexture(GL_TEXTURE_2D, colorTextures[0]);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, guides.Width, guides.Height, GL_RGB, GL_FLOAT, irradiance.data());
+    glBindTexture(GL_TEXTURE_2D, normalDepthTexture);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, guides.Width, guides.Height, GL_RGBA, GL_FLOAT, normalDepth.data());
+
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+    glViewport(0, 0, guides.Width, guides.Height);
+    glBindVertexArray(vao);
+
+    atrousShader->use();
+    atrousShader->setInt("Color", 0);
+    atrousShader->setInt("NormalDepth", 1);
+    atrousShader->setInt("NormalPower", NormalPower);
+    atrousShader->setFloat("SigmaDepth", SigmaDepth);
+
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, normalDepthTexture);
+    glActiveTexture(GL_TEXTURE0);
+
+    int source = 0;
+    for (int i = 0; i < Iterations; i++)
+    {
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, colorTextures[1 - source], 0);
+        glBindTexture(GL_TEXTURE_2D, colorTextures[source]);
+        atrousShader->setInt("StepSize", 1 << i);
+        atrousShader->setFloat("SigmaColor", sigmaColor);
+        glDrawArrays(GL_TRIANGLES, 0, 3);
+
+        source = 1 - source;
+        sigmaColor *= 0.5f;
+    }
+
+    glReadBuffer(GL_COLOR_ATTACHMENT0);
+    glPixelStorei(GL_PACK_ALIGNMENT, 4);
+    glReadPixels(0, 0, guides.Width, guides.Height, GL_RGB, GL_FLOAT, irradiance.data());
+
+    glBindVertexArray(0);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glViewport(0, 0, Global::WindowWidth, Global::WindowHeight);
+}
+
+void Denoiser::CreateGlResources(unsigned int width, unsigned int height)
+{
+    if (!atrousShader)
+    {
+        atrousShader.reset(new Shader("FullScreen.vs", "Atrous.fs"));
+        glGenVertexArrays(1, &vao); // the full screen triangle comes from gl_VertexID
+        glGenFramebuffers(1, &framebuffer);
+    }
+
+    if (width == textureWidth && height == textureHeight)
+        return;
+
+    if (textureWidth > 0)
+    {
+        glDeleteTextures(2, colorTextures);
+        glDeleteTextures(1, &normalDepthTexture);
+    }
+
+    glGenTextures(2, colorTextures);
+    glGenTextures(1, &normalDepthTexture);
+    for (unsigned int texture : {colorTextures[0], colorTextures[1], normalDepthTexture})
+    {
+        glBindTexture(GL_TEXTURE_2D, texture);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, width, height, 0, GL_RGBA, GL_FLOAT, nullptr);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    }
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    textureWidth = width;
+    textureHeight = height;
+}
+
+#endif
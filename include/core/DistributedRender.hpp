@@ -0,0 +1,399 @@
+#ifndef DISTRIBUTEDRENDER_HPP
+#define DISTRIBUTEDRENDER_HPP
+
+#include <glm/glm.hpp>
+
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <vector>
+
+#include "FrameSaver.hpp"
+#include "Socket.hpp"
+#include "Tile.hpp"
+#include "TileRenderer.hpp"
+
+// Rendering one frame tile by tile over worker processes, with a coordinator handing out the tiles.
+//
+// Workers (main --worker) load the scene once, connect, and then render whatever pass over whatever
+// tile they are sent, streaming each result back as soon as it is done. The coordinator deals the
+// tiles out in contiguous runs, one run per worker; a worker that has finished its run steals from the
+// back of the longest one left, so fast and slow workers end together. A tile whose TileError() is
+// still above Global::TileNoiseThreshold after a pass goes back to the queue for another pass of as
+// many samples as it has, until Global::TileMaxSamples. Passes are added to a FrameSaver by sample
+// count, so the order they come back in does not matter, nor which backend rendered them.
+//
+// The transport is a loopback TCP socket, standing in for whatever connects the machines of a cluster.
+namespace TilePacket
+{
+    enum Type : uint32_t
+    {
+        Hello = 1, // worker: backend
+        View,      // coordinator: resolution, eye, ray rotation
+        Job,       // coordinator: tile and sample range
+        Result,    // worker: the job, then color, moment, albedo and normal-depth of the tile
+        Done       // coordinator: nothing left
+    };
+
+    struct JobHeader
+    {
+        uint32_t TileIndex;
+        uint32_t X, Y, Width, Height;
+        uint32_t FirstSample;
+        uint32_t Samples;
+    };
+
+    struct ViewHeader
+    {
+        uint32_t Width, Height;
+        float Eye[3];
+        float RayRotateMatrix[16];
+    };
+}
+
+class TileCoordinator
+{
+public:
+    TileCoordinator(FrameSaver &image, const glm::vec3 &eye, const glm::mat4 &rayRotateMatrix);
+
+    // Waits for workers to connect on port, renders the frame into the FrameSaver and sends the workers
+    // home. False when every worker was lost before the frame was done.
+    bool Run(unsigned short port, unsigned int workers);
+
+    size_t Steals() const { return steals; }
+    size_t ExtraPasses() const { return extraPasses; }
+
+private:
+    struct WorkItem
+    {
+        unsigned int TileIndex;
+        unsigned int FirstSample;
+        unsigned int Samples;
+    };
+
+    struct Worker
+    {
+        Socket Connection;
+        std::deque<WorkItem> Queue;
+        bool Busy = false;
+        WorkItem Current;
+        size_t Passes = 0;
+    };
+
+    FrameSaver &image;
+    TilePacket::ViewHeader view;
+
+    std::vector<Tile> tiles;
+    std::vector<unsigned int> tileSamples; // samples handed out per tile
+    std::vector<Worker> workers;
+    size_t passesDone = 0;
+    size_t passesTotal = 0;
+    size_t steals = 0;
+    size_t extraPasses = 0;
+
+    void MakeTiles();
+    void Dispatch(size_t worker);
+    void Receive(size_t worker);
+    void Drop(size_t worker);
+    bool Finished() const;
+};
+
+class TileWorker
+{
+public:
+    // Connects to the coordinator on port and renders what it sends until it is done.
+    static bool Run(unsigned short port, TileRenderer &renderer);
+};
+
+TileCoordinator::TileCoordinator(FrameSaver &image, const glm::vec3 &eye, const glm::mat4 &rayRotateMatrix) : image(image)
+{
+    view.Width = Global::WindowWidth;
+    view.Height = Global::WindowHeight;
+    std::memcpy(view.Eye, &eye[0], sizeof(view.Eye));
+    std::memcpy(view.RayRotateMatrix, &rayRotateMatrix[0][0], sizeof(view.RayRotateMatrix));
+}
+
+void TileCoordinator::MakeTiles()
+{
+    tiles.clear();
+    for (unsigned int y = 0; y < Global::WindowHeight; y += Global::TileSize)
+        for (unsigned int x = 0; x < Global::WindowWidth; x += Global::TileSize)
+        {
+            Tile tile;
+            tile.X = x;
+            tile.Y = y;
+            tile.Width = std::min(Global::TileSize, Global::WindowWidth - x);
+            tile.Height = std::min(Global::TileSize, Global::WindowHeight - y);
+            tiles.push_back(tile);
+        }
+    tileSamples.assign(tiles.size(), Global::spp);
+}
+
+bool TileCoordinator::Run(unsigned short port, unsigned int workerCount)
+{
+    if (workerCount == 0)
+        return false;
+    if (!Socket::Startup())
+        return false;
+    Socket listener = Socket::Listen(port);
+    if (!listener.Valid())
+        return false;
+
+    std::cout << "TileCoordinator: waiting for " << workerCount << " workers on port " << port << std::endl;
+    workers.resize(workerCount);
+    for (Worker &worker : workers)
+    {
+        worker.Connection = listener.Accept();
+        uint32_t type;
+        std::vector<char> hello;
+        if (!worker.Connection.Valid() || !worker.Connection.ReceivePacket(type, hello) || type != TilePacket::Hello ||
+            !worker.Connection.SendPacket(TilePacket::View, &view, sizeof(view)))
+        {
+            std::cout << "ERROR::TILECOORDINATOR:: A worker failed to join" << std::endl;
+            worker.Connection.Close();
+        }
+    }
+
+    // contiguous runs keep each worker on a coherent part of the scene until it has to steal
+    MakeTiles();
+    passesTotal = tiles.size();
+    for (size_t i = 0; i < tiles.size(); i++)
+        workers[i * workerCount / tiles.size()].Queue.push_back({(unsigned int)i, 0, (unsigned int)Global::spp});
+
+    for (size_t w = 0; w < workers.size(); w++)
+        Dispatch(w);
+
+    while (!Finished())
+    {
+        fd_set readable;
+        FD_ZERO(&readable);
+        Socket::Handle highest = 0;
+        bool anyone = false;
+        for (const Worker &worker : workers)
+            if (worker.Connection.Valid() && worker.Busy)
+            {
+                FD_SET(worker.Connection.Native(), &readable);
+                highest = std::max(highest, worker.Connection.Native());
+                anyone = true;
+            }
+
+        if (!anyone)
+        {
+            std::cout << "ERROR::TILECOORDINATOR:: Every worker is gone, " << passesTotal - passesDone << " passes are left" << std::endl;
+            return false;
+        }
+
+        if (select((int)highest + 1, &readable, nullptr, nullptr, nullptr) < 0)
+        {
+            std::cout << "ERROR::TILECOORDINATOR:: select failed" << std::endl;
+            return false;
+        }
+
+        for (size_t w = 0; w < workers.size(); w++)
+            if (workers[w].Connection.Valid() && FD_ISSET(workers[w].Connection.Native(), &readable))
+                Receive(w);
+    }
+
+    for (Worker &worker : workers)
+        if (worker.Connection.Valid())
+            worker.Connection.SendPacket(TilePacket::Done, nullptr, 0);
+
+    std::cout << "TileCoordinator: " << tiles.size() << " tiles, " << passesDone << " passes (" << extraPasses
+              << " for noise), " << steals << " stolen" << std::endl;
+    return true;
+}
+
+bool TileCoordinator::Finished() const
+{
+    for (const Worker &worker : workers)
+        if (worker.Busy || !worker.Queue.empty())
+            return false;
+    return true;
+}
+
+void TileCoordinator::Dispatch(size_t w)
+{
+    Worker &worker = workers[w];
+    if (!worker.Connection.Valid())
+        return;
+
+    if (worker.Queue.empty())
+    {
+        // the victim is whoever has the most left, lost workers included
+        size_t victim = w;
+        for (size_t v = 0; v < workers.size(); v++)
+            if (workers[v].Queue.size() > workers[victim].Queue.size())
+                victim = v;
+        if (victim == w)
+        {
+            worker.Busy = false;
+            return;
+        }
+        worker.Queue.push_back(workers[victim].Queue.back());
+        workers[victim].Queue.pop_back();
+        steals++;
+    }
+
+    worker.Current = worker.Queue.front();
+    worker.Queue.pop_front();
+
+    const Tile &tile = tiles[worker.Current.TileIndex];
+    TilePacket::JobHeader job = {worker.Current.TileIndex, tile.X, tile.Y, tile.Width, tile.Height,
+                                 worker.Current.FirstSample, worker.Current.Samples};
+    worker.Busy = true;
+    if (!worker.Connection.SendPacket(TilePacket::Job, &job, sizeof(job)))
+        Drop(w);
+}
+
+void TileCoordinator::Receive(size_t w)
+{
+    Worker &worker = workers[w];
+    uint32_t type;
+    std::vector<char> payload;
+    if (!worker.Busy)
+    {
+        Drop(w);
+        return;
+    }
+    size_t expected = sizeof(TilePacket::JobHeader) + 11 * tiles[worker.Current.TileIndex].PixelCount() * sizeof(float);
+    if (!worker.Connection.ReceivePacket(type, payload, expected) || type != TilePacket::Result || payload.size() != expected)
+    {
+        Drop(w);
+        return;
+    }
+
+    // the result has to be of the job the worker was sent
+    TilePacket::JobHeader job;
+    std::memcpy(&job, payload.data(), sizeof(job));
+    const Tile &sent = tiles[worker.Current.TileIndex];
+    if (job.TileIndex != worker.Current.TileIndex || job.FirstSample != worker.Current.FirstSample ||
+        job.Samples != worker.Current.Samples || job.X != sent.X || job.Y != sent.Y || job.Width != sent.Width || job.Height != sent.Height)
+    {
+        Drop(w);
+        return;
+    }
+
+    TileResult result;
+    result.Region = tiles[job.TileIndex];
+    result.FirstSample = job.FirstSample;
+    result.Samples = job.Samples;
+    result.Resize();
+
+    const char *data = payload.data() + sizeof(job);
+    for (std::vector<float> *channel : {&result.Color, &result.Moment, &result.Albedo, &result.NormalDepth})
+    {
+        std::memcpy(channel->data(), data, channel->size() * sizeof(float));
+        data += channel->size() * sizeof(float);
+    }
+
+    image.AddTile(result);
+    worker.Busy = false;
+    worker.Passes++;
+    passesDone++;
+
+    // another pass as large as the tile has had halves its variance
+    unsigned int &samples = tileSamples[job.TileIndex];
+    if (samples < (unsigned int)Global::TileMaxSamples && image.TileError(result.Region) > Global::TileNoiseThreshold)
+    {
+        unsigned int extra = std::min(samples, (unsigned int)Global::TileMaxSamples - samples);
+        worker.Queue.push_back({job.TileIndex, samples, extra});
+        samples += extra;
+        passesTotal++;
+        extraPasses++;
+    }
+
+    if (passesDone * 10 / passesTotal != (passesDone - 1) * 10 / passesTotal)
+        std::cout << "TileCoordinator: " << passesDone << "/" << passesTotal << " passes" << std::endl;
+
+    // the new pass may be what an idle worker waits for
+    Dispatch(w);
+    for (size_t v = 0; v < workers.size(); v++)
+        if (!workers[v].Busy)
+            Dispatch(v);
+}
+
+// A lost worker's job goes back to the front of its queue, which the others steal from.
+void TileCoordinator::Drop(size_t w)
+{
+    Worker &worker = workers[w];
+    std::cout << "ERROR::TILECOORDINATOR:: Lost worker " << w << std::endl;
+    if (worker.Busy)
+        worker.Queue.push_front(worker.Current);
+    worker.Busy = false;
+    worker.Connection.Close();
+
+    for (size_t v = 0; v < workers.size(); v++)
+        if (!workers[v].Busy)
+            Dispatch(v);
+}
+
+bool TileWorker::Run(unsigned short port, TileRenderer &renderer)
+{
+    if (!Socket::Startup())
+        return false;
+    Socket connection = Socket::Connect("127.0.0.1", port);
+    if (!connection.Valid())
+        return false;
+
+    uint32_t backend = (uint32_t)renderer.Backend();
+    uint32_t type;
+    std::vector<char> payload;
+    if (!connection.SendPacket(TilePacket::Hello, &backend, sizeof(backend)) || !connection.ReceivePacket(type, payload) ||
+        type != TilePacket::View || payload.size() != sizeof(TilePacket::ViewHeader))
+    {
+        std::cout << "ERROR::TILEWORKER:: The coordinator did not answer" << std::endl;
+        return false;
+    }
+
+    TilePacket::ViewHeader view;
+    std::memcpy(&view, payload.data(), sizeof(view));
+    if (view.Width != Global::WindowWidth || view.Height != Global::WindowHeight)
+    {
+        std::cout << "ERROR::TILEWORKER:: The coordinator renders " << view.Width << "x" << view.Height << std::endl;
+        return false;
+    }
+    glm::vec3 eye;
+    glm::mat4 rayRotateMatrix;
+    std::memcpy(&eye[0], view.Eye, sizeof(view.Eye));
+    std::memcpy(&rayRotateMatrix[0][0], view.RayRotateMatrix, sizeof(view.RayRotateMatrix));
+
+    TileResult result;
+    std::vector<char> reply;
+    size_t passes = 0;
+    while (connection.ReceivePacket(type, payload))
+    {
+        if (type == TilePacket::Done)
+        {
+            std::cout << "TileWorker: " << passes << " passes rendered" << std::endl;
+            return true;
+        }
+        if (type != TilePacket::Job || payload.size() != sizeof(TilePacket::JobHeader))
+            break;
+
+        TilePacket::JobHeader job;
+        std::memcpy(&job, payload.data(), sizeof(job));
+        if (job.Width == 0 || job.Height == 0 || (uint64_t)job.X + job.Width > Global::WindowWidth ||
+            (uint64_t)job.Y + job.Height > Global::WindowHeight)
+        {
+            std::cout << "ERROR::TILEWORKER:: Tile " << job.TileIndex << " is outside the frame" << std::endl;
+            return false;
+        }
+        result.Region = {job.X, job.Y, job.Width, job.Height};
+        result.FirstSample = job.FirstSample;
+        result.Samples = job.Samples;
+        renderer.Render(result, eye, rayRotateMatrix);
+
+        reply.assign((const char *)&job, (const char *)&job + sizeof(job));
+        for (const std::vector<float> *channel : {&result.Color, &result.Moment, &result.Albedo, &result.NormalDepth})
+            reply.insert(reply.end(), (const char *)channel->data(), (const char *)(channel->data() + channel->size()));
+        if (!connection.SendPacket(TilePacket::Result, reply))
+            break;
+        passes++;
+    }
+
+    std::cout << "ERROR::TILEWORKER:: Lost the coordinator" << std::endl;
+    return false;
+}
+
+#endif
@@ -0,0 +1,139 @@
+#ifndef DYNAMICRESOLUTION_HPP
+#define DYNAMICRESOLUTION_HPP
+
+#include <glad/glad.h>
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "Global.hpp"
+#include "Camera.hpp"
+#include "Utility.hpp"
+
+// Picks the resolution of the path tracing pass so it holds a frame time target while the view moves.
+//
+// Every level is a grid of screen rays of its own, drawn into the lower left corner of the
+// RenderTarget; ProgressiveDisplay upscales that corner back to the window. The pass is timed on
+// the GPU with two queries in flight, so reading one back rarely stalls. Its cost per pixel drives
+// the choice of the finest level predicted to fit the target. Going finer needs some headroom,
+// so a pass close to the target does not flip between two levels.
+//
+// A view that has not changed for RestFrames frames is traced at native resolution, whatever it costs.
+class DynamicResolution
+{
+public:
+    static const int LevelCount = 5;
+    static constexpr float Scales[LevelCount] = {1.0f, 0.75f, 0.5f, 0.375f, 0.25f};
+    static const int RestFrames = 4;          // unchanged frames before snapping back to native
+    static constexpr float Headroom = 0.8f;   // part of the target a finer level must fit in
+    static constexpr float CostBlend = 0.25f; // exponential smoothing of the measured cost
+
+    // nativeVAO holds the full resolution rays of Camera::GenerateRay(). A target of zero keeps native.
+    DynamicResolution(unsigned int nativeVAO, float targetMilliseconds);
+
+    unsigned int Width() const { return levels[level].Width; }
+    unsigned int Height() const { return levels[level].Height; }
+    bool Native() const { return level == 0; }
+
+    // Chooses the level of the next pass.
+    void Update(bool viewChanged);
+
+    // Draws the rays of the current level, timed.
+    void Draw();
+
+private:
+    struct Level
+    {
+        unsigned int Width;
+        unsigned int Height;
+        unsigned int VAO;
+    };
+
+    std::vector<Level> levels;
+    int level = 0;
+    float targetMilliseconds;
+    int restingFrames = RestFrames;
+    float costPerPixel = 0.0f; // milliseconds, zero until the first measurement
+
+    unsigned int queries[2];
+    int queryLevel[2] = {-1, -1}; // level timed by each query, -1 when none is pending
+    int currentQuery = 0;
+
+    void ReadTiming(int query);
+};
+
+constexpr float DynamicResolution::Scales[LevelCount];
+constexpr float DynamicResolution::Headroom;
+constexpr float DynamicResolution::CostBlend;
+
+DynamicResolution::DynamicResolution(unsigned int nativeVAO, float targetMilliseconds) : targetMilliseconds(targetMilliseconds)
+{
+    levels.push_back({Global::WindowWidth, Global::WindowHeight, nativeVAO});
+
+    std::vector<float> vertices;
+    for (int i = 1; i < LevelCount; i++)
+    {
+        unsigned int width = std::max(1u, (unsigned int)std::lround(Global::WindowWidth * Scales[i]));
+        unsigned int height = std::max(1u, (unsigned int)std::lround(Global::WindowHeight * Scales[i]));
+
+        vertices.resize(5 * width * height);
+        Camera::GenerateRay(vertices.data(), width, height);
+        levels.push_back({width, height, std::get<0>(Utility::SetVAOVBO(vertices.data(), width * height))});
+    }
+    glBindVertexArray(0);
+
+    glGenQueries(2, queries);
+}
+
+void DynamicResolution::Update(bool viewChanged)
+{
+    restingFrames = viewChanged ? 0 : std::min(restingFrames + 1, (int)RestFrames);
+    if (restingFrames >= RestFrames || targetMilliseconds <= 0.0f || costPerPixel <= 0.0f)
+    {
+        level = 0;
+        return;
+    }
+
+    // finest level predicted to fit, the current one and coarser only need to fit the target itself
+    int chosen = LevelCount - 1;
+    for (int i = 0; i < LevelCount; i++)
+    {
+        float predicted = costPerPixel * levels[i].Width * levels[i].Height;
+        if (predicted <= (i < level ? Headroom : 1.0f) * targetMilliseconds)
+        {
+            chosen = i;
+            break;
+        }
+    }
+    level = chosen;
+}
+
+void DynamicResolution::Draw()
+{
+    glBeginQuery(GL_TIME_ELAPSED, queries[currentQuery]);
+    glBindVertexArray(levels[level].VAO);
+    glDrawArrays(GL_POINTS, 0, levels[level].Width * levels[level].Height);
+    glEndQuery(GL_TIME_ELAPSED);
+    queryLevel[currentQuery] = level;
+
+    // the other query was issued a frame ago
+    currentQuery = 1 - currentQuery;
+    ReadTiming(currentQuery);
+}
+
+void DynamicResolution::ReadTiming(int query)
+{
+    if (queryLevel[query] < 0)
+        return;
+
+    // a frame old, normally ready; if not, waiting beats reusing a query still in flight
+    GLuint64 nanoseconds = 0;
+    glGetQueryObjectui64v(queries[query], GL_QUERY_RESULT, &nanoseconds);
+    const Level &timed = levels[queryLevel[query]];
+    float cost = (float)(nanoseconds * 1e-6) / (timed.Width * timed.Height);
+    costPerPixel = costPerPixel > 0.0f ? costPerPixel + (cost - costPerPixel) * CostBlend : cost;
+    queryLevel[query] = -1;
+}
+
+#endif
@@ -5,88 +5,742 @@
 #include "Global.hpp"
 #include <fstream>
 #include <cstring>
+#include <limits>
 #include <stbi/stb_image_write.hpp>
+#include "Camera.hpp"
+#include "Denoiser.hpp"
+#include "RenderTarget.hpp"
+#include "HdrWriter.hpp"
+#include "PngWriter.hpp"
+#include "Tile.hpp"
+#include "FrameTimer.hpp"
 
+// Copy of what FrameSaver writes out, in glReadPixels order. Nothing changes it after
+// FrameSaver::Snapshot() returns, so it may be encoded on another thread while rendering goes on.
+struct FrameSnapshot
+{
+    std::vector<float> Color;        // denoised when FrameSaver::Denoise() ran, the average otherwise
+    std::vector<float> Albedo;       // AOVs, empty unless asked for
+    std::vector<float> NormalDepth;
+    std::vector<unsigned int> ID;
+    float Samples = 0.0f;
+
+    bool HasAovs() const { return !ID.empty(); }
+
+    size_t Bytes() const
+    {
+        return (Color.size() + Albedo.size() + NormalDepth.size()) * sizeof(float) + ID.size() * sizeof(unsigned int);
+    }
+};
+
+// Accumulates the frames of the path tracing pass, and the primary hit AOVs of the same pass,
+// and writes their average out. Buffers are in glReadPixels order, rows bottom up.
+//
+// Color is a running average per pixel. When the camera moves, the history is reprojected into the
+// new view through the primary hit depth, so surfaces that stay visible keep their samples. A
+// history tap is rejected when its depth or normal disagree with the new frame, which drops
+// disocclusions and silhouettes back to zero samples.
+//
+// Writing goes through FrameSnapshot: SaveImage() and SaveAov() take one and encode it in place,
+// AsyncImageWriter takes one and encodes it on its own thread.
 class FrameSaver
 {
+public:
+    enum class Aov
+    {
+        Albedo,
+        Normal,
+        Depth,
+        Triangle, // false color per triangle reference
+        Material  // false color per material
+    };
+
+    static constexpr float ReprojectionDepthTolerance = 0.02f; // relative to the distance from the eye
+    static constexpr float ReprojectionNormalTolerance = 0.9f; // cosine between old and new normal
+
 private:
     bool bufferIsSaved;
+    bool imageIsFinal; // denoisedBuffer holds the image to save
+
+    float *denoisedBuffer;
+    float *frameColor;        // readback of the current frame
+    float *frameNormal;
+    float *multiSampleBuffer; // running average color per pixel, unclamped
+    float *sampleCounts;      // samples behind each pixel, fractional after a reprojection
+    float *historyBuffer;     // reprojection target, swapped with multiSampleBuffer
+    float *historyCounts;
+    float *momentBuffer;      // running average of the squared luminance, reprojected with the color
+    float *historyMoments;
+    float *albedoBuffer;      // running average of the primary hit Kd since the camera last moved
+    float *normalBuffer;      // same for the primary hit normal, distance in w
+    unsigned int *idBuffer;   // IDs of the last frame, they do not average
+
+    unsigned int sampleLimit;   // samples each pixel takes, Global::spp unless the frame is split
+    unsigned int counter;       // frames since the camera last moved
+    unsigned int pendingPixels; // pixels below sampleLimit samples
 
-    unsigned char *colorBuffer;
-    float *multiSampleBuffer;
+    glm::vec3 eye;
+    glm::mat4 rayRotateMatrix;
 
-    unsigned int counter;
+    void Reproject(const glm::vec3 &newEye, const glm::mat4 &newRayRotateMatrix);
+    bool HistoryMatches(int pixel, const glm::vec3 &position, const glm::vec3 &normal) const;
 
-    void WriteAuthor(std::ofstream &outStream);
+    static float Luminance(const float *rgb) { return 0.2126f * rgb[0] + 0.7152f * rgb[1] + 0.0722f * rgb[2]; }
 
-    void WritePNG(const char *fileName);
-    void WriteJPG(const char *fileName);
-    void WritePPM(const char *fileName);
+    static void WriteAuthor(std::ofstream &outStream);
+
+    static bool Write(const char *fileName, Global::ImageType type, const unsigned char *pixels);
+    static bool WritePNG(const char *fileName, const unsigned char *pixels);
+    static bool WriteJPG(const char *fileName, const unsigned char *pixels);
+    static bool WritePPM(const char *fileName, const unsigned char *pixels);
+    template <typename T>
+    static bool WriteNetpbm(const char *fileName, const T *pixels, int channels);
+
+    static bool IsFloat(Global::ImageType type) { return type == Global::EXR || type == Global::PFM || type == Global::HDR; }
+    // snapshot supplies the AOV channels when withAovs is set
+    static bool WriteFloat(const char *fileName, Global::ImageType type, const float *rgb,
+                           const FrameSnapshot *snapshot = nullptr);
+    // Clamps count values, stride floats apart, to [0, 1] and scales them to the full range of T.
+    template <typename T>
+    static void Quantize(const float *values, int stride, T *samples, size_t count);
+
+    static glm::vec3 FalseColor(unsigned int id);
 
 public:
-    FrameSaver();
+    explicit FrameSaver(unsigned int sampleLimit = Global::spp);
     ~FrameSaver();
 
-    void SaveBuffer();
-    void SaveImage(const char *fileName, Global::ImageType type);
+    // Average number of samples per pixel.
+    float Samples() const;
+    // Frames accumulated since the camera last moved.
+    unsigned int Frames() const { return counter; }
+    // Every pixel has its samples.
+    bool Done() const { return pendingPixels == 0; }
+
+    // Adds the frame just drawn into target from the given camera, until every pixel has sampleLimit samples.
+    // With a timer, the readback and the averaging go to its Readback and Accumulate stages.
+    // True when a moved camera started the frame count over, its history reprojected.
+    bool SaveBuffer(const RenderTarget &target, const glm::vec3 &eye, const glm::mat4 &rayRotateMatrix, FrameTimer *timer = nullptr);
+    // Averages of the AOVs, what the denoiser is guided by.
+    void GetGuides(DenoiseGuides &guides) const;
+    // Replaces the saved image by the denoised average of the frames accumulated so far.
+    void Denoise(Denoiser &denoiser, const DenoiseGuides &guides);
+    // withAovs adds the AOVs as channels of the same file, EXR only.
+    void SaveImage(const char *fileName, Global::ImageType type, bool withAovs = false);
+    void SaveAov(const char *fileName, Aov aov, Global::ImageType type);
+
+    // Sample variance of the luminance of the mean, per pixel, from the second moments. Zero below two samples.
+    float Variance(int pixel) const;
+
+    // Everything accumulated so far, raw, for Checkpoint. ReadState() fails, leaving the
+    // accumulation as it was, on a stream that is short or from another resolution.
+    void WriteState(std::ostream &out) const;
+    bool ReadState(std::istream &in);
+    // The bytes WriteState() writes at the current resolution.
+    static size_t StateBytes();
+
+    // Adds the samples of other, rendered from the same camera with seeds of its own: colors and
+    // second moments average weighted by sample counts, the AOVs by frames. False, changing nothing,
+    // when the cameras differ.
+    bool Merge(const FrameSaver &other);
+
+    // Adds a pass over a tile, weighted by sample counts like Merge(). Tiles carry no IDs.
+    void AddTile(const TileResult &result);
+    // Average over the tile of the standard error of each pixel relative to its luminance, how
+    // much more a tile would gain from another pass than the others.
+    float TileError(const Tile &tile) const;
+
+    // Copy of the image to save, and of the AOVs with withAovs. Null before the first frame.
+    std::shared_ptr<const FrameSnapshot> Snapshot(bool withAovs) const;
+
+    // Encoders behind SaveImage() and SaveAov(), they only read the snapshot. SaveAov needs its AOVs.
+    // False when the file could not be written.
+    static bool WriteImage(const FrameSnapshot &snapshot, const char *fileName, Global::ImageType type, bool withAovs = false);
+    static bool WriteAov(const FrameSnapshot &snapshot, const char *fileName, Aov aov, Global::ImageType type);
 };
 
-FrameSaver::FrameSaver() : bufferIsSaved(false), counter(0)
+constexpr float FrameSaver::ReprojectionDepthTolerance;
+constexpr float FrameSaver::ReprojectionNormalTolerance;
+
+FrameSaver::FrameSaver(unsigned int sampleLimit)
+    : bufferIsSaved(false), imageIsFinal(false), sampleLimit(sampleLimit), counter(0), pendingPixels(Global::PixelCount)
 {
-    colorBuffer = new unsigned char[3 * Global::PixelCount];
-    multiSampleBuffer = new float[3 * Global::PixelCount];
+    denoisedBuffer = new float[3 * Global::PixelCount];
+    frameColor = new float[3 * Global::PixelCount];
+    frameNormal = new float[4 * Global::PixelCount];
+    multiSampleBuffer = new float[3 * Global::PixelCount]();
+    sampleCounts = new float[Global::PixelCount]();
+    historyBuffer = new float[3 * Global::PixelCount];
+    historyCounts = new float[Global::PixelCount];
+    momentBuffer = new float[Global::PixelCount]();
+    historyMoments = new float[Global::PixelCount];
+    albedoBuffer = new float[3 * Global::PixelCount]();
+    normalBuffer = new float[4 * Global::PixelCount]();
+    idBuffer = new unsigned int[4 * Global::PixelCount]();
 }
 
 FrameSaver::~FrameSaver()
 {
-    delete[] colorBuffer;
+    delete[] denoisedBuffer;
+    delete[] frameColor;
+    delete[] frameNormal;
     delete[] multiSampleBuffer;
+    delete[] sampleCounts;
+    delete[] historyBuffer;
+    delete[] historyCounts;
+    delete[] momentBuffer;
+    delete[] historyMoments;
+    delete[] albedoBuffer;
+    delete[] normalBuffer;
+    delete[] idBuffer;
 }
 
-void FrameSaver::SaveBuffer()
+float FrameSaver::Samples() const
 {
-    if (counter > Global::spp)
-        return;
+    double total = 0.0;
+    for (int i = 0; i < Global::PixelCount; i++)
+        total += sampleCounts[i];
+    return (float)(total / Global::PixelCount);
+}
+
+bool FrameSaver::SaveBuffer(const RenderTarget &target, const glm::vec3 &newEye, const glm::mat4 &newRayRotateMatrix, FrameTimer *timer)
+{
+    bool moved = bufferIsSaved && (newEye != eye || newRayRotateMatrix != rayRotateMatrix);
+    if (!moved && pendingPixels == 0)
+        return false;
 
-    if (counter == Global::spp)
+    FrameTimer::Scope stage(timer, FrameTimer::Readback);
+    target.Read(RenderTarget::Color, GL_RGB, frameColor);
+    target.Read(RenderTarget::NormalDepth, GL_RGBA, frameNormal);
+    stage.Switch(FrameTimer::Accumulate);
+
+    // the history is matched against the AOVs of the old view, so it goes first
+    if (moved)
     {
-        for (int i = 0; i < 3 * Global::PixelCount; i++)
-            colorBuffer[i] = (unsigned char)multiSampleBuffer[i];
-        return;
+        Reproject(newEye, newRayRotateMatrix);
+        counter = 0;
     }
-
+    eye = newEye;
+    rayRotateMatrix = newRayRotateMatrix;
     counter++;
-    glReadBuffer(GL_FRONT);
-	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
-    glReadPixels(0, 0, Global::WindowWidth, Global::WindowHeight, GL_RGB, GL_UNSIGNED_BYTE, colorBuffer);
 
+    std::atomic<unsigned int> pending{0};
+    ThreadPool::Instance().ParallelFor(0, Global::PixelCount, 4096, [&](size_t i) {
+        if (sampleCounts[i] >= sampleLimit)
+            return;
+
+        sampleCounts[i] = std::min(sampleCounts[i] + 1.0f, (float)sampleLimit);
+        float weight = 1.0f / std::max(sampleCounts[i], 1.0f);
+        for (int c = 0; c < 3; c++)
+            multiSampleBuffer[3 * i + c] += (frameColor[3 * i + c] - multiSampleBuffer[3 * i + c]) * weight;
+        float luminance = Luminance(&frameColor[3 * i]);
+        momentBuffer[i] += (luminance * luminance - momentBuffer[i]) * weight;
+
+        if (sampleCounts[i] < sampleLimit)
+            pending++;
+    });
+    pendingPixels = pending.load();
+
+    // the AOVs only depend on the camera, they restart with it
+    float aovWeight = 1.0f / counter;
+    for (int i = 0; i < 4 * Global::PixelCount; i++)
+        normalBuffer[i] += (frameNormal[i] - normalBuffer[i]) * aovWeight;
+
+    stage.Switch(FrameTimer::Readback);
+    target.Read(RenderTarget::Albedo, GL_RGB, frameColor);
+    stage.Switch(FrameTimer::Accumulate);
     for (int i = 0; i < 3 * Global::PixelCount; i++)
-        multiSampleBuffer[i] += ((float)colorBuffer[i] / (float)Global::spp);
+        albedoBuffer[i] += (frameColor[i] - albedoBuffer[i]) * aovWeight;
+
+    stage.Switch(FrameTimer::Readback);
+    target.ReadID(idBuffer);
 
     bufferIsSaved = true;
+    imageIsFinal = false;
+    return moved;
+}
+
+// Every new pixel finds its primary hit in the old view and takes the bilinear blend of the old
+// pixels around it that saw the same surface. Counts are blended with the same weights.
+void FrameSaver::Reproject(const glm::vec3 &newEye, const glm::mat4 &newRayRotateMatrix)
+{
+    glm::mat3 newRotate(newRayRotateMatrix);
+    glm::mat3 toOldCamera = glm::transpose(glm::mat3(rayRotateMatrix));
+
+    ThreadPool::Instance().ParallelFor(0, Global::WindowHeight, 8, [&](size_t row) {
+        for (int column = 0; column < (int)Global::WindowWidth; column++)
+        {
+            int pixel = (int)row * Global::WindowWidth + column;
+            glm::vec3 color(0.0f);
+            float count = 0.0f;
+            float moment = 0.0f;
+            float weights = 0.0f;
+
+            float depth = frameNormal[4 * pixel + 3];
+            float oldColumn, oldRow;
+            glm::vec3 position = newEye + newRotate * Camera::PixelDirection((float)column, (float)row) * depth;
+
+            if (depth > 0.0f && Camera::ProjectDirection(toOldCamera * (position - eye), oldColumn, oldRow))
+            {
+                glm::vec3 normal(frameNormal[4 * pixel], frameNormal[4 * pixel + 1], frameNormal[4 * pixel + 2]);
+                int x0 = (int)std::floor(oldColumn);
+                int y0 = (int)std::floor(oldRow);
+                float fx = oldColumn - x0;
+                float fy = oldRow - y0;
+
+                for (int tap = 0; tap < 4; tap++)
+                {
+                    int x = x0 + (tap & 1);
+                    int y = y0 + (tap >> 1);
+                    if (x < 0 || y < 0 || x >= (int)Global::WindowWidth || y >= (int)Global::WindowHeight)
+                        continue;
+
+                    int old = y * Global::WindowWidth + x;
+                    if (!HistoryMatches(old, position, normal))
+                        continue;
+
+                    float w = ((tap & 1) ? fx : 1.0f - fx) * ((tap >> 1) ? fy : 1.0f - fy);
+                    color += w * glm::vec3(multiSampleBuffer[3 * old], multiSampleBuffer[3 * old + 1], multiSampleBuffer[3 * old + 2]);
+                    count += w * sampleCounts[old];
+                    moment += w * momentBuffer[old];
+                    weights += w;
+                }
+            }
+
+            // a sliver of a valid tap would carry its history at full weight
+            if (weights < 0.01f)
+            {
+                color = glm::vec3(0.0f);
+                count = 0.0f;
+                moment = 0.0f;
+                weights = 1.0f;
+            }
+
+            for (int c = 0; c < 3; c++)
+                historyBuffer[3 * pixel + c] = color[c] / weights;
+            historyCounts[pixel] = count / weights;
+            historyMoments[pixel] = moment / weights;
+        }
+    });
+
+    std::swap(multiSampleBuffer, historyBuffer);
+    std::swap(sampleCounts, historyCounts);
+    std::swap(momentBuffer, historyMoments);
+}
+
+bool FrameSaver::HistoryMatches(int pixel, const glm::vec3 &position, const glm::vec3 &normal) const
+{
+    float oldDepth = normalBuffer[4 * pixel + 3];
+    if (oldDepth <= 0.0f)
+        return false;
+
+    float expectedDepth = glm::length(position - eye);
+    if (std::abs(oldDepth - expectedDepth) > ReprojectionDepthTolerance * expectedDepth)
+        return false;
+
+    glm::vec3 oldNormal(normalBuffer[4 * pixel], normalBuffer[4 * pixel + 1], normalBuffer[4 * pixel + 2]);
+    return glm::dot(oldNormal, normal) >= ReprojectionNormalTolerance * glm::length(oldNormal);
+}
+
+float FrameSaver::Variance(int pixel) const
+{
+    float n = sampleCounts[pixel];
+    if (n < 2.0f)
+        return 0.0f;
+    float mean = Luminance(&multiSampleBuffer[3 * pixel]);
+    // n / (n - 1) for the sample variance, 1 / n for the variance of the mean
+    return std::max(momentBuffer[pixel] - mean * mean, 0.0f) / (n - 1.0f);
+}
+
+void FrameSaver::WriteState(std::ostream &out) const
+{
+    unsigned int header[4] = {Global::WindowWidth, Global::WindowHeight, counter, pendingPixels};
+    unsigned char saved = bufferIsSaved ? 1 : 0;
+    out.write((const char *)header, sizeof(header));
+    out.write((const char *)&saved, 1);
+    out.write((const char *)&eye[0], sizeof(eye));
+    out.write((const char *)&rayRotateMatrix[0][0], sizeof(rayRotateMatrix));
+
+    out.write((const char *)multiSampleBuffer, 3 * Global::PixelCount * sizeof(float));
+    out.write((const char *)sampleCounts, Global::PixelCount * sizeof(float));
+    out.write((const char *)momentBuffer, Global::PixelCount * sizeof(float));
+    out.write((const char *)albedoBuffer, 3 * Global::PixelCount * sizeof(float));
+    out.write((const char *)normalBuffer, 4 * Global::PixelCount * sizeof(float));
+    out.write((const char *)idBuffer, 4 * Global::PixelCount * sizeof(unsigned int));
+}
+
+size_t FrameSaver::StateBytes()
+{
+    return 4 * sizeof(unsigned int) + 1 + sizeof(glm::vec3) + sizeof(glm::mat4) +
+           (size_t)Global::PixelCount * ((3 + 1 + 1 + 3 + 4) * sizeof(float) + 4 * sizeof(unsigned int));
+}
+
+bool FrameSaver::ReadState(std::istream &in)
+{
+    unsigned int header[4];
+    unsigned char saved;
+    glm::vec3 savedEye;
+    glm::mat4 savedRotate;
+    in.read((char *)header, sizeof(header));
+    in.read((char *)&saved, 1);
+    in.read((char *)&savedEye[0], sizeof(savedEye));
+    in.read((char *)&savedRotate[0][0], sizeof(savedRotate));
+    if (!in || header[0] != Global::WindowWidth || header[1] != Global::WindowHeight)
+    {
+        std::cout << "ERROR::FRAMESAVER:: Saved state does not match a " << Global::WindowWidth << "x"
+                  << Global::WindowHeight << " frame" << std::endl;
+        return false;
+    }
+
+    // the history buffers are free between frames, the state lands there until it is all read
+    std::vector<float> albedo(3 * Global::PixelCount);
+    std::vector<float> normal(4 * Global::PixelCount);
+    std::vector<unsigned int> id(4 * Global::PixelCount);
+    in.read((char *)historyBuffer, 3 * Global::PixelCount * sizeof(float));
+    in.read((char *)historyCounts, Global::PixelCount * sizeof(float));
+    in.read((char *)historyMoments, Global::PixelCount * sizeof(float));
+    in.read((char *)albedo.data(), albedo.size() * sizeof(float));
+    in.read((char *)normal.data(), normal.size() * sizeof(float));
+    in.read((char *)id.data(), id.size() * sizeof(unsigned int));
+    if (!in)
+    {
+        std::cout << "ERROR::FRAMESAVER:: Saved state is truncated" << std::endl;
+        return false;
+    }
+
+    std::swap(multiSampleBuffer, historyBuffer);
+    std::swap(sampleCounts, historyCounts);
+    std::swap(momentBuffer, historyMoments);
+    std::copy(albedo.begin(), albedo.end(), albedoBuffer);
+    std::copy(normal.begin(), normal.end(), normalBuffer);
+    std::copy(id.begin(), id.end(), idBuffer);
+
+    counter = header[2];
+    pendingPixels = header[3];
+    bufferIsSaved = saved != 0;
+    eye = savedEye;
+    rayRotateMatrix = savedRotate;
+    imageIsFinal = false;
+    return true;
+}
+
+bool FrameSaver::Merge(const FrameSaver &other)
+{
+    if (!other.bufferIsSaved)
+        return true;
+    if (bufferIsSaved && (other.eye != eye || other.rayRotateMatrix != rayRotateMatrix))
+    {
+        std::cout << "ERROR::FRAMESAVER:: Merged samples come from another camera" << std::endl;
+        return false;
+    }
+
+    ThreadPool::Instance().ParallelFor(0, Global::PixelCount, 4096, [&](size_t i) {
+        float count = sampleCounts[i] + other.sampleCounts[i];
+        if (count <= 0.0f)
+            return;
+        float weight = other.sampleCounts[i] / count;
+        for (int c = 0; c < 3; c++)
+            multiSampleBuffer[3 * i + c] += (other.multiSampleBuffer[3 * i + c] - multiSampleBuffer[3 * i + c]) * weight;
+        momentBuffer[i] += (other.momentBuffer[i] - momentBuffer[i]) * weight;
+        sampleCounts[i] = count;
+    });
+
+    float aovWeight = (float)other.counter / std::max(counter + other.counter, 1u);
+    for (int i = 0; i < 4 * Global::PixelCount; i++)
+        normalBuffer[i] += (other.normalBuffer[i] - normalBuffer[i]) * aovWeight;
+    for (int i = 0; i < 3 * Global::PixelCount; i++)
+        albedoBuffer[i] += (other.albedoBuffer[i] - albedoBuffer[i]) * aovWeight;
+    if (!bufferIsSaved)
+    {
+        std::copy(other.idBuffer, other.idBuffer + 4 * Global::PixelCount, idBuffer);
+        pendingPixels = other.pendingPixels;
+    }
+    else
+        pendingPixels = std::max(pendingPixels, other.pendingPixels);
+
+    counter += other.counter;
+    eye = other.eye;
+    rayRotateMatrix = other.rayRotateMatrix;
+    bufferIsSaved = true;
+    imageIsFinal = false;
+    return true;
+}
+
+void FrameSaver::AddTile(const TileResult &result)
+{
+    const Tile &tile = result.Region;
+    ThreadPool::Instance().ParallelFor(0, tile.Height, 8, [&](size_t y) {
+        for (unsigned int x = 0; x < tile.Width; x++)
+        {
+            size_t i = y * tile.Width + x;
+            size_t pixel = (tile.Y + y) * Global::WindowWidth + tile.X + x;
+
+            float count = sampleCounts[pixel] + result.Samples;
+            float weight = result.Samples / std::max(count, 1.0f);
+            for (int c = 0; c < 3; c++)
+            {
+                multiSampleBuffer[3 * pixel + c] += (result.Color[3 * i + c] - multiSampleBuffer[3 * pixel + c]) * weight;
+                albedoBuffer[3 * pixel + c] += (result.Albedo[3 * i + c] - albedoBuffer[3 * pixel + c]) * weight;
+            }
+            for (int c = 0; c < 4; c++)
+                normalBuffer[4 * pixel + c] += (result.NormalDepth[4 * i + c] - normalBuffer[4 * pixel + c]) * weight;
+            momentBuffer[pixel] += (result.Moment[i] - momentBuffer[pixel]) * weight;
+            sampleCounts[pixel] = count;
+        }
+    });
+
+    bufferIsSaved = true;
+    imageIsFinal = false;
+}
+
+float FrameSaver::TileError(const Tile &tile) const
+{
+    // the floor keeps black pixels from counting as infinitely noisy
+    const float luminanceFloor = 0.01f;
+
+    double error = 0.0;
+    for (unsigned int y = tile.Y; y < tile.Y + tile.Height; y++)
+        for (unsigned int x = tile.X; x < tile.X + tile.Width; x++)
+        {
+            int pixel = y * Global::WindowWidth + x;
+            error += std::sqrt(Variance(pixel)) / (Luminance(&multiSampleBuffer[3 * pixel]) + luminanceFloor);
+        }
+    return (float)(error / std::max(tile.PixelCount(), (size_t)1));
+}
+
+void FrameSaver::GetGuides(DenoiseGuides &guides) const
+{
+    guides.Resize(Global::WindowWidth, Global::WindowHeight);
+    if (!bufferIsSaved)
+        return;
+
+    for (int i = 0; i < Global::PixelCount; i++)
+    {
+        glm::vec3 normal(normalBuffer[4 * i], normalBuffer[4 * i + 1], normalBuffer[4 * i + 2]);
+        guides.Albedo[i] = glm::vec3(albedoBuffer[3 * i], albedoBuffer[3 * i + 1], albedoBuffer[3 * i + 2]);
+        guides.Normal[i] = glm::dot(normal, normal) > 0.0f ? glm::normalize(normal) : glm::vec3(0.0f);
+        guides.Depth[i] = normalBuffer[4 * i + 3];
+    }
+}
+
+void FrameSaver::Denoise(Denoiser &denoiser, const DenoiseGuides &guides)
+{
+    if (!bufferIsSaved)
+        return;
+
+    denoiser.Denoise(multiSampleBuffer, guides, denoisedBuffer, (unsigned int)std::max(Samples(), 1.0f));
+    imageIsFinal = true;
+}
+
+void FrameSaver::SaveImage(const char *fileName, Global::ImageType type, bool withAovs)
+{
+    if (!bufferIsSaved)
+        return;
+
+    WriteImage(*Snapshot(withAovs), fileName, type, withAovs);
 }
 
-void FrameSaver::SaveImage(const char *fileName, Global::ImageType type)
+void FrameSaver::SaveAov(const char *fileName, Aov aov, Global::ImageType type)
 {
     if (!bufferIsSaved)
         return;
 
+    WriteAov(*Snapshot(true), fileName, aov, type);
+}
+
+std::shared_ptr<const FrameSnapshot> FrameSaver::Snapshot(bool withAovs) const
+{
+    if (!bufferIsSaved)
+        return nullptr;
+
+    std::shared_ptr<FrameSnapshot> snapshot = std::make_shared<FrameSnapshot>();
+    const float *image = imageIsFinal ? denoisedBuffer : multiSampleBuffer;
+    snapshot->Color.assign(image, image + 3 * Global::PixelCount);
+    snapshot->Samples = Samples();
+
+    if (withAovs)
+    {
+        snapshot->Albedo.assign(albedoBuffer, albedoBuffer + 3 * Global::PixelCount);
+        snapshot->NormalDepth.assign(normalBuffer, normalBuffer + 4 * Global::PixelCount);
+        snapshot->ID.assign(idBuffer, idBuffer + 4 * Global::PixelCount);
+    }
+    return snapshot;
+}
+
+bool FrameSaver::WriteImage(const FrameSnapshot &snapshot, const char *fileName, Global::ImageType type, bool withAovs)
+{
+    const float *image = snapshot.Color.data();
+    if (IsFloat(type))
+        return WriteFloat(fileName, type, image, withAovs && snapshot.HasAovs() ? &snapshot : nullptr);
+
+    if (type == Global::PPM16)
+    {
+        std::vector<unsigned short> samples(3 * Global::PixelCount);
+        Quantize(image, 1, samples.data(), samples.size());
+        return WriteNetpbm(fileName, samples.data(), 3);
+    }
+
+    std::vector<unsigned char> pixels(3 * Global::PixelCount);
+    Quantize(image, 1, pixels.data(), pixels.size());
+    return Write(fileName, type, pixels.data());
+}
+
+bool FrameSaver::WriteAov(const FrameSnapshot &snapshot, const char *fileName, Aov aov, Global::ImageType type)
+{
+    if (!snapshot.HasAovs())
+        return false;
+
+    const float *albedoBuffer = snapshot.Albedo.data();
+    const float *normalBuffer = snapshot.NormalDepth.data();
+    const unsigned int *idBuffer = snapshot.ID.data();
+
+    float maxDepth = 0.0f;
+    for (int i = 0; i < Global::PixelCount; i++)
+        maxDepth = std::max(maxDepth, normalBuffer[4 * i + 3]);
+
+    // float formats get the values themselves, depth in scene units and normals in [-1, 1]
+    bool raw = IsFloat(type);
+
+    std::vector<float> values(3 * Global::PixelCount);
+    for (int i = 0; i < Global::PixelCount; i++)
+    {
+        glm::vec3 value(0.0f);
+        bool hit = idBuffer[4 * i] != 0;
+
+        switch (aov)
+        {
+        case Aov::Albedo:
+            value = glm::vec3(albedoBuffer[3 * i], albedoBuffer[3 * i + 1], albedoBuffer[3 * i + 2]);
+            break;
+        case Aov::Normal:
+            if (hit)
+            {
+                value = glm::normalize(glm::vec3(normalBuffer[4 * i], normalBuffer[4 * i + 1], normalBuffer[4 * i + 2]));
+                if (!raw)
+                    value = value * 0.5f + 0.5f;
+            }
+            break;
+        case Aov::Depth:
+            if (hit && raw)
+                value = glm::vec3(normalBuffer[4 * i + 3]);
+            else if (hit && maxDepth > 0.0f)
+                value = glm::vec3(1.0f - normalBuffer[4 * i + 3] / maxDepth); // near is bright
+            break;
+        case Aov::Triangle:
+            if (hit)
+                value = FalseColor(idBuffer[4 * i + 1]);
+            break;
+        case Aov::Material:
+            if (hit)
+                value = FalseColor(idBuffer[4 * i + 2]);
+            break;
+        }
+
+        for (int c = 0; c < 3; c++)
+            values[3 * i + c] = value[c];
+    }
+
+    if (raw)
+        return WriteFloat(fileName, type, values.data());
+
+    // depth goes out as a graymap where the format has one
+    int channels = aov == Aov::Depth && (type == Global::PPM || type == Global::PPM16) ? 1 : 3;
+    if (type == Global::PPM16)
+    {
+        std::vector<unsigned short> samples(channels * Global::PixelCount);
+        Quantize(values.data(), 3 / channels, samples.data(), samples.size());
+        return WriteNetpbm(fileName, samples.data(), channels);
+    }
+
+    std::vector<unsigned char> pixels(channels * Global::PixelCount);
+    Quantize(values.data(), 3 / channels, pixels.data(), pixels.size());
+    if (channels == 1)
+        return WriteNetpbm(fileName, pixels.data(), 1);
+    return Write(fileName, type, pixels.data());
+}
+
+template <typename T>
+void FrameSaver::Quantize(const float *values, int stride, T *samples, size_t count)
+{
+    const float maxValue = (float)std::numeric_limits<T>::max();
+    for (size_t i = 0; i < count; i++)
+        samples[i] = (T)(Global::clamp(0.0f, 1.0f, values[i * stride]) * maxValue + 0.5f);
+}
+
+glm::vec3 FrameSaver::FalseColor(unsigned int id)
+{
+    // integer hash, so neighbouring IDs get unrelated colors
+    id = (id ^ 61u) ^ (id >> 16);
+    id *= 9u;
+    id ^= id >> 4;
+    id *= 0x27d4eb2du;
+    id ^= id >> 15;
+    return glm::vec3(id & 0xFFu, (id >> 8) & 0xFFu, (id >> 16) & 0xFFu) / 255.0f;
+}
+
+bool FrameSaver::Write(const char *fileName, Global::ImageType type, const unsigned char *pixels)
+{
     switch (type)
     {
     case Global::ImageType::PNG:
-        WritePNG(fileName);
-        break;
+        return WritePNG(fileName, pixels);
     case Global::ImageType::JPG:
-        WriteJPG(fileName);
-        break;
+        return WriteJPG(fileName, pixels);
     case Global::ImageType::PPM:
-        WritePPM(fileName);
-        break;
+        return WritePPM(fileName, pixels);
+
+    default:
+        return WritePPM(fileName, pixels);
+    }
+}
 
+bool FrameSaver::WriteFloat(const char *fileName, Global::ImageType type, const float *rgb, const FrameSnapshot *snapshot)
+{
+    switch (type)
+    {
+    case Global::ImageType::PFM:
+        return HdrWriter::WritePFM(fileName, Global::WindowWidth, Global::WindowHeight, rgb);
+    case Global::ImageType::HDR:
+        return HdrWriter::WriteRGBE(fileName, Global::WindowWidth, Global::WindowHeight, rgb);
     default:
-        WritePPM(fileName);
         break;
     }
+
+    std::vector<HdrChannel> channels = {{"R", HdrChannel::Float, rgb, 3},
+                                        {"G", HdrChannel::Float, rgb + 1, 3},
+                                        {"B", HdrChannel::Float, rgb + 2, 3}};
+
+    // normals are averages, they go out normalized
+    std::vector<float> normals;
+    if (snapshot)
+    {
+        const float *albedoBuffer = snapshot->Albedo.data();
+        const float *normalBuffer = snapshot->NormalDepth.data();
+        const unsigned int *idBuffer = snapshot->ID.data();
+
+        normals.resize(3 * Global::PixelCount, 0.0f);
+        for (int i = 0; i < Global::PixelCount; i++)
+        {
+            glm::vec3 normal(normalBuffer[4 * i], normalBuffer[4 * i + 1], normalBuffer[4 * i + 2]);
+            if (glm::dot(normal, normal) > 0.0f)
+                normal = glm::normalize(normal);
+            for (int c = 0; c < 3; c++)
+                normals[3 * i + c] = normal[c];
+        }
+
+        channels.insert(channels.end(), {{"albedo.R", HdrChannel::Float, albedoBuffer, 3},
+                                         {"albedo.G", HdrChannel::Float, albedoBuffer + 1, 3},
+                                         {"albedo.B", HdrChannel::Float, albedoBuffer + 2, 3},
+                                         {"normal.X", HdrChannel::Float, normals.data(), 3},
+                                         {"normal.Y", HdrChannel::Float, normals.data() + 1, 3},
+                                         {"normal.Z", HdrChannel::Float, normals.data() + 2, 3},
+                                         {"Z", HdrChannel::Float, normalBuffer + 3, 4},
+                                         {"id.instance", HdrChannel::Uint, idBuffer, 4},
+                                         {"id.triangle", HdrChannel::Uint, idBuffer + 1, 4},
+                                         {"id.material", HdrChannel::Uint, idBuffer + 2, 4}});
+    }
+
+    return HdrWriter::WriteEXR(fileName, Global::WindowWidth, Global::WindowHeight, channels);
 }
 
 void FrameSaver::WriteAuthor(std::ofstream &outStream)
@@ -97,61 +751,71 @@ void FrameSaver::WriteAuthor(std::ofstream &outStream)
     outStream << Global::Author << std::endl;
 }
 
-void FrameSaver::WritePNG(const char *fileName)
+bool FrameSaver::WritePNG(const char *fileName, const unsigned char *pixels)
 {
-    stbi_flip_vertically_on_write(true);
-    stbi_write_png(fileName, Global::WindowWidth, Global::WindowHeight, 3, colorBuffer, Global::WindowWidth * 3);
+    return PngWriter::Write(fileName, Global::WindowWidth, Global::WindowHeight, 3, pixels, true);
 }
 
-void FrameSaver::WriteJPG(const char *fileName)
+bool FrameSaver::WriteJPG(const char *fileName, const unsigned char *pixels)
 {
     stbi_flip_vertically_on_write(true);
-    stbi_write_jpg(fileName, Global::WindowWidth, Global::WindowHeight, 3, colorBuffer, 100);
+    return stbi_write_jpg(fileName, Global::WindowWidth, Global::WindowHeight, 3, pixels, 100) != 0;
 }
 
-/* PPM output image format:
- * P3
- * Global::WindowWidth Global::WindowHeight
- * 255
- * 0 0 0
- * 0 0 0
- * 255 255 255
- * ...
+/* PPM output image format, binary:
+ * P6                  (P5 for a single channel)
  * # Author: ...
+ * Global::WindowWidth Global::WindowHeight
+ * 255                 (65535 for 16 bit samples, most significant byte first)
+ * raw samples, rows top down
  */
-void FrameSaver::WritePPM(const char *fileName)
+bool FrameSaver::WritePPM(const char *fileName, const unsigned char *pixels)
+{
+    return WriteNetpbm(fileName, pixels, 3);
+}
+
+template <typename T>
+bool FrameSaver::WriteNetpbm(const char *fileName, const T *pixels, int channels)
 {
     std::ofstream outStream;
-    outStream.open(fileName);
+    outStream.open(fileName, std::ios::binary);
     if (!outStream.is_open())
-        return;
+        return false;
 
-    outStream << "P3" << std::endl
-              << Global::WindowWidth << " " << Global::WindowHeight << std::endl
-              << "255" << std::endl;
+    outStream << (channels == 1 ? "P5" : "P6") << "\n";
+    WriteAuthor(outStream);
+    outStream << Global::WindowWidth << " " << Global::WindowHeight << "\n"
+              << (unsigned int)std::numeric_limits<T>::max() << "\n";
 
     // Framebuffer starts from the lower left to the upper right
     // PPM Image starts from the upper left to the lower right
-    for (int row = Global::WindowHeight - 1; row > -1; row--)
+    // Rows are flipped, and byte swapped for 16 bits, into a staging buffer written out in large blocks.
+    const size_t rowBytes = (size_t)Global::WindowWidth * channels * sizeof(T);
+    const size_t rowsPerBlock = std::max<size_t>(1, ((size_t)1 << 20) / rowBytes);
+    std::vector<unsigned char> block(rowsPerBlock * rowBytes);
+
+    int row = Global::WindowHeight - 1;
+    while (row > -1)
     {
-        for (int column = 0; column < Global::WindowWidth; column++)
+        size_t rows = std::min(rowsPerBlock, (size_t)row + 1);
+        for (size_t i = 0; i < rows; i++, row--)
         {
-            int preIndex = row * Global::WindowWidth * 3;
-            int curIndex = preIndex + column * 3;
-            outStream << (unsigned int)colorBuffer[curIndex] << " "
-                      << (unsigned int)colorBuffer[curIndex + 1] << " "
-                      << (unsigned int)colorBuffer[curIndex + 2];
-
-            if (column == Global::WindowWidth - 1)
-                outStream << std::endl;
+            const unsigned char *source = reinterpret_cast<const unsigned char *>(pixels + (size_t)row * Global::WindowWidth * channels);
+            unsigned char *target = &block[i * rowBytes];
+            if (sizeof(T) == 1)
+                std::memcpy(target, source, rowBytes);
             else
-                outStream << " ";
+                for (size_t b = 0; b < rowBytes; b += 2)
+                {
+                    target[b] = source[b + 1];
+                    target[b + 1] = source[b];
+                }
         }
+        outStream.write((const char *)block.data(), rows * rowBytes);
     }
 
-    WriteAuthor(outStream);
-
     outStream.close();
+    return !outStream.fail();
 }
 
 #endif
\ No newline at end of file
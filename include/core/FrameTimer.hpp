@@ -0,0 +1,239 @@
+#ifndef FRAMETIMER_HPP
+#define FRAMETIMER_HPP
+
+#include <glad/glad.h>
+
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+
+// Where the frames of the render loop go. Every frame is one entry of a ring buffer holding the
+// milliseconds of each stage; Report() prints percentiles per stage over the frames it holds.
+//
+// CPU stages are timed with Begin() and End() and add up, so a stage may be entered more than once
+// a frame. The path tracing pass is timed on the GPU between two timestamp queries, which nest inside
+// the elapsed time query of DynamicResolution. Its result is collected QueryFrames frames later, when
+// it is normally ready, and written back to the entry of the frame that issued it.
+class FrameTimer
+{
+public:
+    enum Stage
+    {
+        Input,      // time step, keys, window events
+        Upload,     // scene update, resolution choice, uniforms
+        PathTrace,  // GPU time of the path tracing draw
+        Display,    // progressive accumulation, blit and swap
+        Readback,   // FrameSaver::SaveBuffer() reading the render target back
+        Accumulate, // FrameSaver::SaveBuffer() averaging the frame in
+        Frame,      // the whole frame on the CPU
+        StageCount
+    };
+
+    static const int QueryFrames = 4; // GPU frames in flight before a result is waited for
+
+    // Times a stage for as long as it lives, or until it switches to the next; nothing without a timer.
+    class Scope
+    {
+    public:
+        Scope(FrameTimer *timer, Stage stage) : timer(timer), stage(stage)
+        {
+            if (timer)
+                timer->Begin(stage);
+        }
+        ~Scope()
+        {
+            if (timer)
+                timer->End(stage);
+        }
+        void Switch(Stage next)
+        {
+            if (timer)
+            {
+                timer->End(stage);
+                timer->Begin(next);
+            }
+            stage = next;
+        }
+        Scope(const Scope &) = delete;
+        Scope &operator=(const Scope &) = delete;
+
+    private:
+        FrameTimer *timer;
+        Stage stage;
+    };
+
+    explicit FrameTimer(size_t capacity);
+
+    void BeginFrame();
+    void EndFrame();
+
+    void Begin(Stage stage);
+    void End(Stage stage);
+
+    // Around the path tracing draw, on the thread owning the context.
+    void BeginGpu();
+    void EndGpu();
+
+    size_t Frames() const { return frames; }
+
+    // Median milliseconds of a stage over the frames since the last call with reset, for the
+    // rate-limited frame stats; negative when there is none.
+    float RecentMedian(Stage stage, bool reset);
+
+    // 50th, 90th and 99th percentile and maximum per stage over the ring buffer.
+    void Report(std::ostream &out) const;
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    struct Entry
+    {
+        float Milliseconds[StageCount];
+        bool GpuTimed; // the PathTrace query has come back
+    };
+
+    std::vector<Entry> ring;
+    size_t frames = 0; // frames begun, frame f is ring[(f - 1) % size]
+    bool frameOpen = false;
+    size_t recentLast = 0; // last frame RecentMedian() reset at
+    Clock::time_point started[StageCount];
+
+    unsigned int queries[QueryFrames][2];
+    size_t queryFrame[QueryFrames]; // frame that issued each pair, -1 when none is pending
+    bool queriesCreated = false;
+
+    Entry &Current() { return ring[(frames - 1) % ring.size()]; }
+    size_t Closed() const { return frameOpen ? frames - 1 : frames; }
+    void CollectGpu(int slot);
+    static float Percentile(std::vector<float> &values, float percent);
+};
+
+FrameTimer::FrameTimer(size_t capacity) : ring(std::max<size_t>(capacity, 1))
+{
+    std::fill(queryFrame, queryFrame + QueryFrames, (size_t)-1);
+}
+
+void FrameTimer::BeginFrame()
+{
+    frames++;
+    frameOpen = true;
+    Entry &entry = Current();
+    std::fill(entry.Milliseconds, entry.Milliseconds + StageCount, 0.0f);
+    entry.GpuTimed = false;
+    Begin(Frame);
+}
+
+void FrameTimer::EndFrame()
+{
+    End(Frame);
+    frameOpen = false;
+}
+
+void FrameTimer::Begin(Stage stage)
+{
+    started[stage] = Clock::now();
+}
+
+void FrameTimer::End(Stage stage)
+{
+    Current().Milliseconds[stage] += std::chrono::duration<float, std::milli>(Clock::now() - started[stage]).count();
+}
+
+void FrameTimer::BeginGpu()
+{
+    if (!queriesCreated)
+    {
+        glGenQueries(2 * QueryFrames, &queries[0][0]);
+        queriesCreated = true;
+    }
+
+    // the pair was issued QueryFrames frames ago; if it is not back, waiting beats reusing it in flight
+    int slot = (int)(frames % QueryFrames);
+    CollectGpu(slot);
+    glQueryCounter(queries[slot][0], GL_TIMESTAMP);
+}
+
+void FrameTimer::EndGpu()
+{
+    int slot = (int)(frames % QueryFrames);
+    glQueryCounter(queries[slot][1], GL_TIMESTAMP);
+    queryFrame[slot] = frames;
+}
+
+void FrameTimer::CollectGpu(int slot)
+{
+    size_t frame = queryFrame[slot];
+    if (frame == (size_t)-1)
+        return;
+
+    GLuint64 begin = 0, end = 0;
+    glGetQueryObjectui64v(queries[slot][0], GL_QUERY_RESULT, &begin);
+    glGetQueryObjectui64v(queries[slot][1], GL_QUERY_RESULT, &end);
+    queryFrame[slot] = (size_t)-1;
+
+    // the entry may have been overwritten by a ring buffer shorter than QueryFrames
+    if (frames - frame >= ring.size())
+        return;
+    Entry &entry = ring[(frame - 1) % ring.size()];
+    entry.Milliseconds[PathTrace] = (float)((end - begin) * 1e-6);
+    entry.GpuTimed = true;
+}
+
+float FrameTimer::RecentMedian(Stage stage, bool reset)
+{
+    size_t last = Closed();
+    size_t first = std::max(recentLast, last > ring.size() ? last - ring.size() : (size_t)0);
+    std::vector<float> values;
+    for (size_t frame = first + 1; frame <= last; frame++)
+    {
+        const Entry &entry = ring[(frame - 1) % ring.size()];
+        if (stage != PathTrace || entry.GpuTimed)
+            values.push_back(entry.Milliseconds[stage]);
+    }
+    if (reset)
+        recentLast = last;
+    return values.empty() ? -1.0f : Percentile(values, 50.0f);
+}
+
+void FrameTimer::Report(std::ostream &out) const
+{
+    static const char *const names[StageCount] = {"input", "upload", "path trace (GPU)", "display", "readback", "accumulate", "frame"};
+
+    size_t last = Closed();
+    size_t count = std::min(last, ring.size());
+    std::streamsize precision = out.precision();
+    out << "FrameTimer: last " << count << " frames, milliseconds\n"
+        << std::setw(18) << "stage" << std::setw(10) << "p50" << std::setw(10) << "p90" << std::setw(10) << "p99" << std::setw(10) << "max"
+        << "\n";
+
+    std::vector<float> values;
+    for (int stage = 0; stage < StageCount; stage++)
+    {
+        values.clear();
+        for (size_t frame = last - count + 1; frame <= last; frame++)
+        {
+            const Entry &entry = ring[(frame - 1) % ring.size()];
+            if (stage != PathTrace || entry.GpuTimed)
+                values.push_back(entry.Milliseconds[stage]);
+        }
+        if (values.empty())
+            continue;
+
+        float maximum = *std::max_element(values.begin(), values.end());
+        out << std::setw(18) << names[stage] << std::fixed << std::setprecision(3) << std::setw(10) << Percentile(values, 50.0f)
+            << std::setw(10) << Percentile(values, 90.0f) << std::setw(10) << Percentile(values, 99.0f) << std::setw(10) << maximum << "\n";
+    }
+    out << std::defaultfloat << std::setprecision(precision) << std::flush;
+}
+
+// Nearest rank, reorders values.
+float FrameTimer::Percentile(std::vector<float> &values, float percent)
+{
+    size_t rank = std::min(values.size() - 1, (size_t)(percent / 100.0f * values.size()));
+    std::nth_element(values.begin(), values.begin() + rank, values.end());
+    return values[rank];
+}
+
+#endif
@@ -0,0 +1,131 @@
+#ifndef GEOMETRY_HPP
+#define GEOMETRY_HPP
+
+#include <glm/glm.hpp>
+#include <glm/packing.hpp>
+
+#include <vector>
+#include <cstdint>
+#include <cmath>
+
+// Compact geometry layout used by path tracing.
+//
+// hot stream  : vertex positions and triangle indices, read by every intersection test.
+// cold stream : per-vertex attributes and per-triangle material, read only at the closest hit.
+//
+// A vertex costs 12 bytes of hot data plus 8 bytes of cold data, compared with 88 bytes for
+// the rasterization Vertex in mesh.hpp.
+
+struct VertexAttribute
+{
+    uint32_t Normal;    // octahedral encoded, 2 x snorm16
+    uint32_t TexCoords; // 2 x half float
+};
+
+struct Material
+{
+    glm::vec3 Kd;
+    float Emission; // 1.0 for lights, 0.0 otherwise
+};
+
+namespace Packing
+{
+    // Octahedral normal encoding------------------------------------------------------------------
+
+    inline float SignNotZero(float v) { return v >= 0.0f ? 1.0f : -1.0f; }
+
+    inline uint32_t OctEncode(const glm::vec3 &n)
+    {
+        float l1 = std::abs(n.x) + std::abs(n.y) + std::abs(n.z);
+        if (l1 <= 0.0f)
+            return glm::packSnorm2x16(glm::vec2(0.0f));
+
+        glm::vec2 p = glm::vec2(n.x, n.y) / l1;
+        if (n.z < 0.0f)
+            p = glm::vec2((1.0f - std::abs(p.y)) * SignNotZero(p.x),
+                          (1.0f - std::abs(p.x)) * SignNotZero(p.y));
+
+        return glm::packSnorm2x16(p);
+    }
+
+    inline glm::vec3 OctDecode(uint32_t encoded)
+    {
+        glm::vec2 p = glm::unpackSnorm2x16(encoded);
+        glm::vec3 n = glm::vec3(p.x, p.y, 1.0f - std::abs(p.x) - std::abs(p.y));
+        float t = std::max(-n.z, 0.0f);
+        n.x += n.x >= 0.0f ? -t : t;
+        n.y += n.y >= 0.0f ? -t : t;
+
+        return glm::normalize(n);
+    }
+
+    // Half precision texture coordinates----------------------------------------------------------
+
+    inline uint32_t PackTexCoords(const glm::vec2 &uv) { return glm::packHalf2x16(uv); }
+
+    inline glm::vec2 UnpackTexCoords(uint32_t packed) { return glm::unpackHalf2x16(packed); }
+}
+
+class TraceGeometry
+{
+public:
+    // hot stream
+    std::vector<glm::vec3> Positions;
+    std::vector<glm::uvec3> Indices;
+
+    // cold stream
+    std::vector<VertexAttribute> Attributes;
+    std::vector<unsigned int> MaterialIDs;
+
+    void Reserve(size_t vertexCount, size_t triangleCount);
+
+    unsigned int AddVertex(const glm::vec3 &position, const glm::vec3 &normal, const glm::vec2 &texCoords);
+
+    void AddTriangle(unsigned int a, unsigned int b, unsigned int c, unsigned int materialID = 0);
+
+    size_t VertexCount() const { return Positions.size(); }
+
+    size_t TriangleCount() const { return Indices.size(); }
+
+    size_t MemoryUsage() const;
+
+    void Clear();
+};
+
+void TraceGeometry::Reserve(size_t vertexCount, size_t triangleCount)
+{
+    Positions.reserve(vertexCount);
+    Attributes.reserve(vertexCount);
+    Indices.reserve(triangleCount);
+    MaterialIDs.reserve(triangleCount);
+}
+
+unsigned int TraceGeometry::AddVertex(const glm::vec3 &position, const glm::vec3 &normal, const glm::vec2 &texCoords)
+{
+    Positions.push_back(position);
+    Attributes.push_back({Packing::OctEncode(normal), Packing::PackTexCoords(texCoords)});
+
+    return (unsigned int)Positions.size() - 1;
+}
+
+void TraceGeometry::AddTriangle(unsigned int a, unsigned int b, unsigned int c, unsigned int materialID)
+{
+    Indices.push_back(glm::uvec3(a, b, c));
+    MaterialIDs.push_back(materialID);
+}
+
+size_t TraceGeometry::MemoryUsage() const
+{
+    return Positions.size() * sizeof(glm::vec3) + Indices.size() * sizeof(glm::uvec3) +
+           Attributes.size() * sizeof(VertexAttribute) + MaterialIDs.size() * sizeof(unsigned int);
+}
+
+void TraceGeometry::Clear()
+{
+    Positions.clear();
+    Indices.clear();
+    Attributes.clear();
+    MaterialIDs.clear();
+}
+
+#endif
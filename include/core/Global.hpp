@@ -9,6 +9,9 @@ namespace Global
     const float RussianRoulette = 0.8f;
     const float IndirLightContributionRate = 1;
 
+    // the seeds of sample k of a frame only depend on this and k, so split renders add up (see SampleSplit)
+    const unsigned int SampleSeed = 1;
+
     // constants-----------------------------------------------------------------------------------
 
     const float Pi = 3.1415926535897f;
@@ -21,13 +24,73 @@ namespace Global
 
     // image configuration-------------------------------------------------------------------------
 
-    enum ImageType { PNG, JPG, PPM };
-    const std::string EnumString[] = { "png", "jpg", "ppm"};
+    // EXR, PFM and HDR keep the unclamped float average, PPM is binary and PPM16 has 16 bits per component
+    enum ImageType { PNG, JPG, PPM, EXR, PFM, HDR, PPM16 };
+    const std::string EnumString[] = { "png", "jpg", "ppm", "exr", "pfm", "hdr", "ppm"};
     const std::string ImagePath = ".\\image\\";
     const std::string Author = "# Author: zionFisher GitHub: https://github.com/zionFisher\n# 2021";
     const ImageType ImageFileType = PNG;
     const std::string ImageName = ImagePath + "result_spp_" + std::to_string(spp) + "." + EnumString[ImageFileType];
 
+    // edge avoiding denoising of the saved image, the GL denoiser runs on the window's context
+    enum DenoiserType { NoDenoise, CPUDenoise, GLDenoise };
+    const DenoiserType ImageDenoiser = CPUDenoise;
+
+    // images are encoded on a writer thread; snapshots waiting for it are capped in number and bytes,
+    // and a full queue either stalls the render loop or drops its oldest snapshots
+    const size_t SaveQueueJobs = 16;
+    const size_t SaveQueueBytes = (size_t)256 << 20;
+    const bool SaveQueueDropsOldest = true;
+
+    // a progress image every this many seconds while rendering, zero to disable
+    const float SnapshotSeconds = 0.0f;
+
+    // the accumulation, camera and seed generator are checkpointed to this file every CheckpointSeconds,
+    // and a render starting next to one resumes from it; empty to disable
+    const std::string CheckpointPath = "";
+    const float CheckpointSeconds = 300.0f;
+
+    // primary hit albedo, normal, depth, triangle and material images, written next to the result,
+    // or as extra channels of the result itself when it is an EXR
+    const bool SaveAOVs = false;
+
+    // scene configuration-------------------------------------------------------------------------
+
+    const std::string ModelPath = ""; // optional Assimp model placed in the Cornell box, empty to disable
+
+    // LBVH builds fastest, SBVH traces fastest on long thin triangles, see BvhBuildMode
+    enum BvhType { LBVH, SAH, SBVH };
+    const BvhType SceneBvhType = SAH;
+
+    // out-of-core geometry: a directory the model meshes are streamed from, empty to keep them in memory,
+    // and the memory the streamed chunks may take at once
+    const std::string GeometryStreamPath = "";
+    const size_t GeometryBudget = (size_t)512 << 20;
+
+    // distributed rendering---------------------------------------------------------------------
+
+    // coordinator renders a frame tile by tile over workers (main --worker cpu|gl) on this loopback port;
+    // a tile gets passes of as many samples as it has while its relative error is above the threshold
+    const unsigned short CoordinatorPort = 47017;
+    const unsigned int TileSize = 64;
+    const float TileNoiseThreshold = 0.1f;
+    const int TileMaxSamples = 4 * spp;
+
+    // render daemon-----------------------------------------------------------------------------
+
+    // main --daemon cpu|gl keeps scenes loaded and renders the jobs sent to this Unix socket (see RenderDaemon),
+    // this many samples at a time, so a job of higher priority or a cancel waits for one pass at most
+    const std::string DaemonSocketPath = "sspt_daemon.sock";
+    const unsigned int DaemonPassSamples = 8;
+
+    // a client that stalls halfway through a packet this long, or sends one above the cap, is dropped,
+    // so it cannot hold up the jobs; a job above the resolution cap on either side, or beyond the job caps, fails
+    const unsigned int DaemonTimeoutMilliseconds = 2000;
+    const unsigned int DaemonMaxPacketBytes = 1 << 16;
+    const unsigned int DaemonMaxResolution = 8192;
+    const unsigned int DaemonMaxJobs = 64;      // queued, over all clients
+    const unsigned int DaemonMaxClientJobs = 8; // queued, per client
+
     // camera configuration------------------------------------------------------------------------
 
     const float OriginX = 278;
@@ -57,6 +120,14 @@ namespace Global
     const unsigned int FOV = 40;
     const float Scale = std::tan(deg2rad(FOV * 0.5));
 
+    // while the view moves, the path tracing pass drops resolution to hold this GPU time, zero to disable
+    const float TargetFrameMilliseconds = 33.3f;
+
+    // the stage timings of this many frames are kept for the percentiles printed at exit and on P,
+    // and a line of frame stats is printed every FrameStatsSeconds, zero to disable
+    const size_t FrameTimerFrames = 1024;
+    const float FrameStatsSeconds = 1.0f;
+
 }
 
 #endif
\ No newline at end of file
@@ -0,0 +1,400 @@
+#ifndef HDRWRITER_HPP
+#define HDRWRITER_HPP
+
+#include <zlib.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "ThreadPool.hpp"
+
+// One channel of a float image, Data[Stride * pixel] for every pixel in glReadPixels order.
+struct HdrChannel
+{
+    enum Type
+    {
+        Uint = 0, // EXR pixel type codes
+        Float = 2
+    };
+
+    std::string Name;
+    Type PixelType;
+    const void *Data;
+    unsigned int Stride;
+};
+
+// Unclamped float image files. Every format takes pixels in glReadPixels order, rows bottom up, and
+// flips them itself where the format wants them top down.
+//
+// EXR : scanline OpenEXR 2.0 with any number of channels, ZIP compressed in blocks of 16 lines
+// PFM : portable float map, RGB, uncompressed
+// HDR : Radiance RGBE with run length encoded scanlines
+//
+// EXR blocks and HDR scanlines are encoded on ThreadPool and written out in order. PFM can be read
+// back, which is how reference images are stored.
+class HdrWriter
+{
+public:
+    static const int ExrLinesPerBlock = 16;
+
+    static bool WriteEXR(const char *fileName, unsigned int width, unsigned int height, std::vector<HdrChannel> channels);
+    static bool WritePFM(const char *fileName, unsigned int width, unsigned int height, const float *rgb);
+    static bool WriteRGBE(const char *fileName, unsigned int width, unsigned int height, const float *rgb);
+
+    // RGB PFM of either byte order, into glReadPixels order like the writers take it.
+    static bool ReadPFM(const char *fileName, unsigned int &width, unsigned int &height, std::vector<float> &rgb);
+
+private:
+    template <typename T>
+    static void Put(std::vector<unsigned char> &out, T value);
+    static void PutString(std::vector<unsigned char> &out, const std::string &value);
+    static void PutAttribute(std::vector<unsigned char> &out, const char *name, const char *type, const std::vector<unsigned char> &value);
+
+    static void EncodeExrBlock(const std::vector<HdrChannel> &channels, unsigned int width, unsigned int height,
+                               unsigned int firstLine, std::vector<unsigned char> &out);
+    static void ZipExr(const std::vector<unsigned char> &raw, std::vector<unsigned char> &out);
+
+    static void EncodeRgbeLine(const float *rgb, unsigned int width, std::vector<unsigned char> &out);
+    static void RunLengthEncode(const unsigned char *data, unsigned int count, std::vector<unsigned char> &out);
+
+    static bool Open(std::ofstream &outStream, const char *fileName);
+};
+
+template <typename T>
+void HdrWriter::Put(std::vector<unsigned char> &out, T value)
+{
+    // every format here is little endian, like the machines this runs on
+    const unsigned char *bytes = reinterpret_cast<const unsigned char *>(&value);
+    out.insert(out.end(), bytes, bytes + sizeof(T));
+}
+
+void HdrWriter::PutString(std::vector<unsigned char> &out, const std::string &value)
+{
+    out.insert(out.end(), value.begin(), value.end());
+    out.push_back(0);
+}
+
+void HdrWriter::PutAttribute(std::vector<unsigned char> &out, const char *name, const char *type, const std::vector<unsigned char> &value)
+{
+    PutString(out, name);
+    PutString(out, type);
+    Put<int32_t>(out, (int32_t)value.size());
+    out.insert(out.end(), value.begin(), value.end());
+}
+
+bool HdrWriter::Open(std::ofstream &outStream, const char *fileName)
+{
+    outStream.open(fileName, std::ios::binary);
+    if (!outStream.is_open())
+        std::cout << "ERROR::HDRWRITER:: Failed to open " << fileName << std::endl;
+    return outStream.is_open();
+}
+
+/* EXR layout:
+ * magic, version
+ * header attributes, each name\0 type\0 size value, closed by \0
+ * offset table, one uint64 per block of ExrLinesPerBlock lines
+ * blocks, each first line, size and the zipped lines; a line holds every channel in name order
+ */
+bool HdrWriter::WriteEXR(const char *fileName, unsigned int width, unsigned int height, std::vector<HdrChannel> channels)
+{
+    // readers expect the channel list sorted by name
+    std::sort(channels.begin(), channels.end(), [](const HdrChannel &a, const HdrChannel &b) { return a.Name < b.Name; });
+
+    std::vector<unsigned char> header;
+    Put<uint32_t>(header, 20000630u); // magic
+    Put<uint32_t>(header, 2u);        // version 2, single part scanline
+
+    std::vector<unsigned char> value;
+    for (const HdrChannel &channel : channels)
+    {
+        PutString(value, channel.Name);
+        Put<int32_t>(value, channel.PixelType);
+        Put<uint32_t>(value, 0u); // pLinear and reserved
+        Put<int32_t>(value, 1);   // x and y sampling
+        Put<int32_t>(value, 1);
+    }
+    value.push_back(0);
+    PutAttribute(header, "channels", "chlist", value);
+
+    PutAttribute(header, "compression", "compression", {3}); // ZIP_COMPRESSION
+
+    value.clear();
+    for (int32_t bound : {0, 0, (int32_t)width - 1, (int32_t)height - 1})
+        Put<int32_t>(value, bound);
+    PutAttribute(header, "dataWindow", "box2i", value);
+    PutAttribute(header, "displayWindow", "box2i", value);
+
+    PutAttribute(header, "lineOrder", "lineOrder", {0}); // INCREASING_Y
+
+    value.clear();
+    Put<float>(value, 1.0f);
+    PutAttribute(header, "pixelAspectRatio", "float", value);
+
+    value.clear();
+    Put<float>(value, 0.0f);
+    Put<float>(value, 0.0f);
+    PutAttribute(header, "screenWindowCenter", "v2f", value);
+
+    value.clear();
+    Put<float>(value, 1.0f);
+    PutAttribute(header, "screenWindowWidth", "float", value);
+
+    header.push_back(0);
+
+    unsigned int blockCount = (height + ExrLinesPerBlock - 1) / ExrLinesPerBlock;
+    std::vector<std::vector<unsigned char>> blocks(blockCount);
+    ThreadPool::Instance().ParallelFor(0, blockCount, 1, [&](size_t block) {
+        EncodeExrBlock(channels, width, height, (unsigned int)block * ExrLinesPerBlock, blocks[block]);
+    });
+
+    uint64_t offset = header.size() + blockCount * sizeof(uint64_t);
+    for (const std::vector<unsigned char> &block : blocks)
+    {
+        Put<uint64_t>(header, offset);
+        offset += block.size();
+    }
+
+    std::ofstream outStream;
+    if (!Open(outStream, fileName))
+        return false;
+
+    outStream.write((const char *)header.data(), header.size());
+    for (const std::vector<unsigned char> &block : blocks)
+        outStream.write((const char *)block.data(), block.size());
+    return outStream.good();
+}
+
+void HdrWriter::EncodeExrBlock(const std::vector<HdrChannel> &channels, unsigned int width, unsigned int height,
+                               unsigned int firstLine, std::vector<unsigned char> &out)
+{
+    unsigned int lastLine = std::min(firstLine + ExrLinesPerBlock, height);
+
+    std::vector<unsigned char> raw;
+    raw.reserve((size_t)(lastLine - firstLine) * width * channels.size() * 4);
+    for (unsigned int line = firstLine; line < lastLine; line++)
+    {
+        // EXR lines go top down
+        size_t rowStart = (size_t)(height - 1 - line) * width;
+        for (const HdrChannel &channel : channels)
+            for (unsigned int x = 0; x < width; x++)
+            {
+                size_t index = (rowStart + x) * channel.Stride;
+                if (channel.PixelType == HdrChannel::Uint)
+                    Put<uint32_t>(raw, static_cast<const uint32_t *>(channel.Data)[index]);
+                else
+                    Put<float>(raw, static_cast<const float *>(channel.Data)[index]);
+            }
+    }
+
+    Put<int32_t>(out, (int32_t)firstLine);
+    Put<int32_t>(out, 0); // size, patched below
+
+    size_t start = out.size();
+    ZipExr(raw, out);
+    int32_t size = (int32_t)(out.size() - start);
+    std::memcpy(&out[start - sizeof(int32_t)], &size, sizeof(int32_t));
+}
+
+// Splits even and odd bytes apart and delta codes them before deflating, like OpenEXR's ZIP
+// compressor. A block that does not shrink is stored raw, which readers tell apart by its size.
+void HdrWriter::ZipExr(const std::vector<unsigned char> &raw, std::vector<unsigned char> &out)
+{
+    size_t size = raw.size();
+    std::vector<unsigned char> shuffled(size);
+    size_t half = (size + 1) / 2;
+    for (size_t i = 0; i < size; i++)
+        shuffled[(i & 1) ? half + i / 2 : i / 2] = raw[i];
+
+    int previous = size > 0 ? shuffled[0] : 0;
+    for (size_t i = 1; i < size; i++)
+    {
+        int current = shuffled[i];
+        shuffled[i] = (unsigned char)(current - previous + (128 + 256));
+        previous = current;
+    }
+
+    uLongf packedSize = compressBound((uLong)size);
+    std::vector<unsigned char> packed(packedSize);
+    if (compress2(packed.data(), &packedSize, shuffled.data(), (uLong)size, Z_DEFAULT_COMPRESSION) == Z_OK && packedSize < size)
+        out.insert(out.end(), packed.begin(), packed.begin() + packedSize);
+    else
+        out.insert(out.end(), raw.begin(), raw.end());
+}
+
+/* PFM layout:
+ * PF
+ * width height
+ * -1.0             (negative scale for little endian)
+ * RGB floats, rows bottom up
+ */
+bool HdrWriter::WritePFM(const char *fileName, unsigned int width, unsigned int height, const float *rgb)
+{
+    std::ofstream outStream;
+    if (!Open(outStream, fileName))
+        return false;
+
+    outStream << "PF\n"
+              << width << " " << height << "\n"
+              << "-1.0\n";
+
+    // glReadPixels order is already bottom up
+    outStream.write((const char *)rgb, (std::streamsize)width * height * 3 * sizeof(float));
+    return outStream.good();
+}
+
+bool HdrWriter::ReadPFM(const char *fileName, unsigned int &width, unsigned int &height, std::vector<float> &rgb)
+{
+    std::ifstream inStream(fileName, std::ios::binary);
+    std::string magic;
+    float scale = 0.0f;
+    inStream >> magic >> width >> height >> scale;
+    inStream.get(); // the single whitespace before the pixels
+    if (!inStream || magic != "PF" || width == 0 || height == 0 || scale == 0.0f)
+    {
+        std::cout << "ERROR::HDRWRITER:: " << fileName << " is not an RGB PFM" << std::endl;
+        return false;
+    }
+
+    rgb.resize((size_t)width * height * 3);
+    inStream.read((char *)rgb.data(), (std::streamsize)rgb.size() * sizeof(float));
+    if (!inStream)
+    {
+        std::cout << "ERROR::HDRWRITER:: " << fileName << " is truncated" << std::endl;
+        return false;
+    }
+
+    // a positive scale means big endian
+    const uint16_t probe = 1;
+    bool littleEndian = *(const unsigned char *)&probe == 1;
+    if ((scale < 0.0f) != littleEndian)
+        for (float &value : rgb)
+        {
+            unsigned char *bytes = (unsigned char *)&value;
+            std::swap(bytes[0], bytes[3]);
+            std::swap(bytes[1], bytes[2]);
+        }
+    return true;
+}
+
+/* Radiance HDR layout:
+ * #?RADIANCE
+ * FORMAT=32-bit_rle_rgbe
+ *
+ * -Y height +X width
+ * scanlines top down, each 2 2 width as two bytes, then the R, G, B and E bytes run length encoded in turn
+ */
+bool HdrWriter::WriteRGBE(const char *fileName, unsigned int width, unsigned int height, const float *rgb)
+{
+    std::vector<std::vector<unsigned char>> lines(height);
+    ThreadPool::Instance().ParallelFor(0, height, 16, [&](size_t line) {
+        EncodeRgbeLine(rgb + (size_t)(height - 1 - line) * width * 3, width, lines[line]);
+    });
+
+    std::ofstream outStream;
+    if (!Open(outStream, fileName))
+        return false;
+
+    outStream << "#?RADIANCE\n"
+              << "FORMAT=32-bit_rle_rgbe\n\n"
+              << "-Y " << height << " +X " << width << "\n";
+
+    for (const std::vector<unsigned char> &line : lines)
+        outStream.write((const char *)line.data(), line.size());
+    return outStream.good();
+}
+
+void HdrWriter::EncodeRgbeLine(const float *rgb, unsigned int width, std::vector<unsigned char> &out)
+{
+    std::vector<unsigned char> rgbe(4 * width);
+    for (unsigned int x = 0; x < width; x++)
+    {
+        float r = std::max(rgb[3 * x], 0.0f);
+        float g = std::max(rgb[3 * x + 1], 0.0f);
+        float b = std::max(rgb[3 * x + 2], 0.0f);
+        float brightest = std::max(r, std::max(g, b));
+
+        unsigned char *pixel = &rgbe[4 * x];
+        if (brightest < 1e-32f)
+        {
+            pixel[0] = pixel[1] = pixel[2] = pixel[3] = 0;
+            continue;
+        }
+
+        int exponent;
+        float scale = std::frexp(brightest, &exponent) * 256.0f / brightest;
+        pixel[0] = (unsigned char)(r * scale);
+        pixel[1] = (unsigned char)(g * scale);
+        pixel[2] = (unsigned char)(b * scale);
+        pixel[3] = (unsigned char)(exponent + 128);
+    }
+
+    // the run length scheme only covers these widths, other lines go out flat
+    if (width < 8 || width > 0x7FFF)
+    {
+        out = std::move(rgbe);
+        return;
+    }
+
+    out.push_back(2);
+    out.push_back(2);
+    out.push_back((unsigned char)(width >> 8));
+    out.push_back((unsigned char)(width & 0xFF));
+
+    std::vector<unsigned char> component(width);
+    for (int c = 0; c < 4; c++)
+    {
+        for (unsigned int x = 0; x < width; x++)
+            component[x] = rgbe[4 * x + c];
+        RunLengthEncode(component.data(), width, out);
+    }
+}
+
+// Runs of 4 to 127 equal bytes go out as 128 + length and the byte, everything in between as
+// literal packets of up to 128 bytes.
+void HdrWriter::RunLengthEncode(const unsigned char *data, unsigned int count, std::vector<unsigned char> &out)
+{
+    const unsigned int MinRun = 4;
+    const unsigned int MaxRun = 127;
+    const unsigned int MaxLiteral = 128;
+
+    unsigned int i = 0;
+    while (i < count)
+    {
+        unsigned int runStart = i;
+        unsigned int runLength = 0;
+        while (runStart < count)
+        {
+            runLength = 1;
+            while (runStart + runLength < count && runLength < MaxRun && data[runStart + runLength] == data[runStart])
+                runLength++;
+            if (runLength >= MinRun)
+                break;
+            runStart += runLength;
+            runLength = 0;
+        }
+
+        while (i < runStart)
+        {
+            unsigned int literal = std::min(MaxLiteral, runStart - i);
+            out.push_back((unsigned char)literal);
+            out.insert(out.end(), data + i, data + i + literal);
+            i += literal;
+        }
+
+        if (runLength >= MinRun)
+        {
+            out.push_back((unsigned char)(128 + runLength));
+            out.push_back(data[runStart]);
+            i = runStart + runLength;
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,310 @@
+#ifndef IMAGEMETRICS_HPP
+#define IMAGEMETRICS_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define IMAGEMETRICS_SSE
+#include <emmintrin.h>
+#endif
+
+#include "Global.hpp"
+#include "ThreadPool.hpp"
+
+// How far a render is from a reference of the same view, both RGB floats in glReadPixels order.
+struct ImageError
+{
+    double Mse = 0.0;    // per component, unclamped
+    double RelMse = 0.0; // per component, the squared error over the squared reference plus RelMseEpsilon
+    double Ssim = 1.0;   // mean structural similarity of the luminance clamped to [0, 1], 1 when equal
+    double BiasZ = 0.0;  // mean luminance difference over its standard error, signed
+};
+
+// Error metrics for convergence tests. Rows are spread over ThreadPool; MSE and relMSE take four
+// components per SSE instruction, SSIM and BiasZ four pixels, with scalar loops for what is left over
+// and for builds without SSE2.
+//
+// SSIM (Wang et al. 2004) is taken over SsimRadius box windows of the luminance, away from the border.
+// BiasZ tells noise from bias: the per-pixel luminance differences of an unbiased render average out
+// as it converges, so their mean stays within a few standard errors of zero, where a biased one keeps
+// drifting away.
+class ImageMetrics
+{
+public:
+    static constexpr float RelMseEpsilon = 0.01f;
+    static const int SsimRadius = 3; // 7 x 7 windows
+
+    static ImageError Compare(const float *image, const float *reference, unsigned int width, unsigned int height);
+
+    static double Mse(const float *image, const float *reference, unsigned int width, unsigned int height);
+    static double RelMse(const float *image, const float *reference, unsigned int width, unsigned int height);
+    static double Ssim(const float *image, const float *reference, unsigned int width, unsigned int height);
+    static double BiasZ(const float *image, const float *reference, unsigned int width, unsigned int height);
+
+private:
+    static constexpr float SsimC1 = 0.01f * 0.01f;
+    static constexpr float SsimC2 = 0.03f * 0.03f;
+    static constexpr float LumaR = 0.2126f, LumaG = 0.7152f, LumaB = 0.0722f;
+
+    static float Luminance(const float *rgb) { return LumaR * rgb[0] + LumaG * rgb[1] + LumaB * rgb[2]; }
+
+    // Sums body(row) over the rows, in parallel, in double.
+    template <typename F>
+    static double SumRows(size_t rows, F body);
+};
+
+constexpr float ImageMetrics::RelMseEpsilon;
+constexpr float ImageMetrics::SsimC1;
+constexpr float ImageMetrics::SsimC2;
+constexpr float ImageMetrics::LumaR;
+constexpr float ImageMetrics::LumaG;
+constexpr float ImageMetrics::LumaB;
+
+template <typename F>
+double ImageMetrics::SumRows(size_t rows, F body)
+{
+    std::vector<double> sums(rows, 0.0);
+    ThreadPool::Instance().ParallelFor(0, rows, 8, [&](size_t row) { sums[row] = body(row); });
+    double total = 0.0;
+    for (double sum : sums)
+        total += sum;
+    return total;
+}
+
+ImageError ImageMetrics::Compare(const float *image, const float *reference, unsigned int width, unsigned int height)
+{
+    ImageError error;
+    error.Mse = Mse(image, reference, width, height);
+    error.RelMse = RelMse(image, reference, width, height);
+    error.Ssim = Ssim(image, reference, width, height);
+    error.BiasZ = BiasZ(image, reference, width, height);
+    return error;
+}
+
+double ImageMetrics::Mse(const float *image, const float *reference, unsigned int width, unsigned int height)
+{
+    size_t rowFloats = (size_t)width * 3;
+    double sum = SumRows(height, [&](size_t row) {
+        const float *a = image + row * rowFloats;
+        const float *b = reference + row * rowFloats;
+        size_t i = 0;
+        float rowSum = 0.0f;
+#ifdef IMAGEMETRICS_SSE
+        __m128 lanes = _mm_setzero_ps();
+        for (; i + 4 <= rowFloats; i += 4)
+        {
+            __m128 difference = _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+            lanes = _mm_add_ps(lanes, _mm_mul_ps(difference, difference));
+        }
+        float partial[4];
+        _mm_storeu_ps(partial, lanes);
+        rowSum = partial[0] + partial[1] + partial[2] + partial[3];
+#endif
+        for (; i < rowFloats; i++)
+            rowSum += (a[i] - b[i]) * (a[i] - b[i]);
+        return (double)rowSum;
+    });
+    return sum / ((double)rowFloats * height);
+}
+
+double ImageMetrics::RelMse(const float *image, const float *reference, unsigned int width, unsigned int height)
+{
+    size_t rowFloats = (size_t)width * 3;
+    double sum = SumRows(height, [&](size_t row) {
+        const float *a = image + row * rowFloats;
+        const float *b = reference + row * rowFloats;
+        size_t i = 0;
+        float rowSum = 0.0f;
+#ifdef IMAGEMETRICS_SSE
+        const __m128 epsilon = _mm_set1_ps(RelMseEpsilon);
+        __m128 lanes = _mm_setzero_ps();
+        for (; i + 4 <= rowFloats; i += 4)
+        {
+            __m128 expected = _mm_loadu_ps(b + i);
+            __m128 difference = _mm_sub_ps(_mm_loadu_ps(a + i), expected);
+            __m128 scale = _mm_add_ps(_mm_mul_ps(expected, expected), epsilon);
+            lanes = _mm_add_ps(lanes, _mm_div_ps(_mm_mul_ps(difference, difference), scale));
+        }
+        float partial[4];
+        _mm_storeu_ps(partial, lanes);
+        rowSum = partial[0] + partial[1] + partial[2] + partial[3];
+#endif
+        for (; i < rowFloats; i++)
+            rowSum += (a[i] - b[i]) * (a[i] - b[i]) / (b[i] * b[i] + RelMseEpsilon);
+        return (double)rowSum;
+    });
+    return sum / ((double)rowFloats * height);
+}
+
+double ImageMetrics::Ssim(const float *image, const float *reference, unsigned int width, unsigned int height)
+{
+    const int r = SsimRadius;
+    if (width <= 2u * r || height <= 2u * r)
+        return 1.0;
+
+    // luminance x and y and their products, summed over the window width along each row
+    unsigned int columns = width - 2 * r;
+    std::vector<float> planes[5];
+    for (std::vector<float> &plane : planes)
+        plane.resize((size_t)columns * height);
+
+    ThreadPool::Instance().ParallelFor(0, height, 8, [&](size_t row) {
+        std::vector<float> x(width), y(width);
+        for (unsigned int column = 0; column < width; column++)
+        {
+            size_t pixel = row * width + column;
+            x[column] = Global::clamp(0.0f, 1.0f, Luminance(image + 3 * pixel));
+            y[column] = Global::clamp(0.0f, 1.0f, Luminance(reference + 3 * pixel));
+        }
+
+        float sums[5] = {};
+        for (int column = 0; column < (int)width; column++)
+        {
+            sums[0] += x[column];
+            sums[1] += y[column];
+            sums[2] += x[column] * x[column];
+            sums[3] += y[column] * y[column];
+            sums[4] += x[column] * y[column];
+            int out = column - 2 * r;
+            if (out < 0)
+                continue;
+
+            for (int p = 0; p < 5; p++)
+                planes[p][row * columns + out] = sums[p];
+            sums[0] -= x[out];
+            sums[1] -= y[out];
+            sums[2] -= x[out] * x[out];
+            sums[3] -= y[out] * y[out];
+            sums[4] -= x[out] * y[out];
+        }
+    });
+
+    // and over the window height down each column, then the SSIM of every window
+    const float n = (float)((2 * r + 1) * (2 * r + 1));
+    double sum = SumRows(height - 2 * r, [&](size_t first) {
+        auto window = [&](int p, unsigned int column) {
+            float total = 0.0f;
+            for (int k = 0; k <= 2 * r; k++)
+                total += planes[p][(first + k) * columns + column];
+            return total / n;
+        };
+        auto ssim = [](float mx, float my, float xx, float yy, float xy) {
+            float vx = xx - mx * mx, vy = yy - my * my, cxy = xy - mx * my;
+            return (2.0f * mx * my + SsimC1) * (2.0f * cxy + SsimC2) / ((mx * mx + my * my + SsimC1) * (vx + vy + SsimC2));
+        };
+
+        unsigned int column = 0;
+        float rowSum = 0.0f;
+#ifdef IMAGEMETRICS_SSE
+        const __m128 invN = _mm_set1_ps(1.0f / n);
+        const __m128 two = _mm_set1_ps(2.0f);
+        const __m128 c1 = _mm_set1_ps(SsimC1), c2 = _mm_set1_ps(SsimC2);
+        __m128 lanes = _mm_setzero_ps();
+        for (; column + 4 <= columns; column += 4)
+        {
+            __m128 m[5];
+            for (int p = 0; p < 5; p++)
+            {
+                __m128 total = _mm_setzero_ps();
+                for (int k = 0; k <= 2 * r; k++)
+                    total = _mm_add_ps(total, _mm_loadu_ps(&planes[p][(first + k) * columns + column]));
+                m[p] = _mm_mul_ps(total, invN);
+            }
+            __m128 mxmy = _mm_mul_ps(m[0], m[1]);
+            __m128 vx = _mm_sub_ps(m[2], _mm_mul_ps(m[0], m[0]));
+            __m128 vy = _mm_sub_ps(m[3], _mm_mul_ps(m[1], m[1]));
+            __m128 cxy = _mm_sub_ps(m[4], mxmy);
+            __m128 numerator = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(two, mxmy), c1), _mm_add_ps(_mm_mul_ps(two, cxy), c2));
+            __m128 denominator = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(m[0], m[0]), _mm_mul_ps(m[1], m[1])), c1),
+                                            _mm_add_ps(_mm_add_ps(vx, vy), c2));
+            lanes = _mm_add_ps(lanes, _mm_div_ps(numerator, denominator));
+        }
+        float partial[4];
+        _mm_storeu_ps(partial, lanes);
+        rowSum = partial[0] + partial[1] + partial[2] + partial[3];
+#endif
+        for (; column < columns; column++)
+            rowSum += ssim(window(0, column), window(1, column), window(2, column), window(3, column), window(4, column));
+        return (double)rowSum;
+    });
+    return sum / ((double)columns * (height - 2 * r));
+}
+
+// Two passes, the luminance differences and their sum, then the squared deviations from the mean.
+double ImageMetrics::BiasZ(const float *image, const float *reference, unsigned int width, unsigned int height)
+{
+    size_t pixels = (size_t)width * height;
+    std::vector<float> differences(pixels);
+
+    double sum = SumRows(height, [&](size_t row) {
+        const float *a = image + 3 * row * width;
+        const float *b = reference + 3 * row * width;
+        float *d = differences.data() + row * width;
+        unsigned int column = 0;
+        float rowSum = 0.0f;
+#ifdef IMAGEMETRICS_SSE
+        // four pixels are three vectors of interleaved RGB; their weighted components are gathered
+        // into one vector per channel, which add up to the four luminances
+        const __m128 w0 = _mm_setr_ps(LumaR, LumaG, LumaB, LumaR);
+        const __m128 w1 = _mm_setr_ps(LumaG, LumaB, LumaR, LumaG);
+        const __m128 w2 = _mm_setr_ps(LumaB, LumaR, LumaG, LumaB);
+        __m128 lanes = _mm_setzero_ps();
+        for (; column + 4 <= width; column += 4)
+        {
+            const float *pa = a + 3 * column, *pb = b + 3 * column;
+            __m128 p0 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(pa), _mm_loadu_ps(pb)), w0);
+            __m128 p1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(pa + 4), _mm_loadu_ps(pb + 4)), w1);
+            __m128 p2 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(pa + 8), _mm_loadu_ps(pb + 8)), w2);
+            __m128 r = _mm_shuffle_ps(_mm_shuffle_ps(p0, p0, _MM_SHUFFLE(0, 3, 0, 0)), _mm_shuffle_ps(p1, p2, _MM_SHUFFLE(0, 1, 0, 2)),
+                                      _MM_SHUFFLE(2, 0, 2, 0));
+            __m128 g = _mm_shuffle_ps(_mm_shuffle_ps(p0, p1, _MM_SHUFFLE(0, 0, 0, 1)), _mm_shuffle_ps(p1, p2, _MM_SHUFFLE(0, 2, 0, 3)),
+                                      _MM_SHUFFLE(2, 0, 2, 0));
+            __m128 bl = _mm_shuffle_ps(_mm_shuffle_ps(p0, p1, _MM_SHUFFLE(0, 1, 0, 2)), _mm_shuffle_ps(p2, p2, _MM_SHUFFLE(0, 3, 0, 0)),
+                                       _MM_SHUFFLE(2, 0, 2, 0));
+            __m128 luminance = _mm_add_ps(_mm_add_ps(r, g), bl);
+            _mm_storeu_ps(d + column, luminance);
+            lanes = _mm_add_ps(lanes, luminance);
+        }
+        float partial[4];
+        _mm_storeu_ps(partial, lanes);
+        rowSum = partial[0] + partial[1] + partial[2] + partial[3];
+#endif
+        for (; column < width; column++)
+        {
+            d[column] = Luminance(a + 3 * column) - Luminance(b + 3 * column);
+            rowSum += d[column];
+        }
+        return (double)rowSum;
+    });
+    double mean = sum / pixels;
+
+    double squares = SumRows(height, [&](size_t row) {
+        const float *d = differences.data() + row * width;
+        unsigned int column = 0;
+        float rowSum = 0.0f;
+#ifdef IMAGEMETRICS_SSE
+        const __m128 center = _mm_set1_ps((float)mean);
+        __m128 lanes = _mm_setzero_ps();
+        for (; column + 4 <= width; column += 4)
+        {
+            __m128 deviation = _mm_sub_ps(_mm_loadu_ps(d + column), center);
+            lanes = _mm_add_ps(lanes, _mm_mul_ps(deviation, deviation));
+        }
+        float partial[4];
+        _mm_storeu_ps(partial, lanes);
+        rowSum = partial[0] + partial[1] + partial[2] + partial[3];
+#endif
+        for (; column < width; column++)
+            rowSum += (d[column] - (float)mean) * (d[column] - (float)mean);
+        return (double)rowSum;
+    });
+
+    double variance = squares / pixels;
+    if (variance == 0.0)
+        return mean == 0.0 ? 0.0 : (mean > 0.0 ? 1e9 : -1e9);
+    return mean / std::sqrt(variance / pixels);
+}
+
+#endif
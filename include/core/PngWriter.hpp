@@ -0,0 +1,248 @@
+#ifndef PNGWRITER_HPP
+#define PNGWRITER_HPP
+
+#include <zlib.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <vector>
+
+#include "ThreadPool.hpp"
+
+// 8 bit PNG encoder that spreads both halves of the work over ThreadPool.
+//
+// Rows are filtered in parallel, each with the filter whose output has the smallest sum of absolute
+// values. The filtered image is then cut into ChunkBytes pieces that are deflated concurrently, the
+// way pigz does: every piece is primed with the 32 KB before it as a dictionary and ends in a sync
+// flush, so the raw deflate outputs concatenate into one valid stream. Each piece becomes an IDAT
+// chunk of its own, and the Adler-32 of the pieces are combined for the zlib trailer.
+class PngWriter
+{
+public:
+    static const size_t ChunkBytes = (size_t)256 << 10;
+    static const size_t WindowBytes = (size_t)32 << 10; // deflate window, the dictionary of each piece
+
+    // pixels hold height rows of width * channels bytes, channels 1 (gray), 3 (RGB) or 4 (RGBA).
+    // flip writes the last row first, for buffers in glReadPixels order.
+    static bool Write(const char *fileName, unsigned int width, unsigned int height, int channels,
+                      const unsigned char *pixels, bool flip, int level = Z_DEFAULT_COMPRESSION);
+
+private:
+    struct Piece
+    {
+        std::vector<unsigned char> Chunk; // IDAT chunk, length and CRC filled in last
+        uLong Adler;
+        size_t Size;                      // uncompressed bytes
+        bool Ok;
+    };
+
+    template <int Filter>
+    static unsigned long ApplyFilter(const unsigned char *row, const unsigned char *above, size_t rowBytes, int channels, unsigned char *out);
+    static void FilterRow(const unsigned char *row, const unsigned char *above, size_t rowBytes, int channels, unsigned char *out);
+    static void DeflatePiece(const unsigned char *data, size_t begin, size_t end, size_t total, int level, Piece &piece);
+
+    static void PutBigEndian(std::vector<unsigned char> &out, uint32_t value);
+    static void PutChunk(std::vector<unsigned char> &out, const char *type, const unsigned char *data, size_t size);
+    static void BeginChunk(std::vector<unsigned char> &out, const char *type);
+    static void EndChunk(std::vector<unsigned char> &out, size_t start);
+};
+
+bool PngWriter::Write(const char *fileName, unsigned int width, unsigned int height, int channels,
+                      const unsigned char *pixels, bool flip, int level)
+{
+    const unsigned char colorTypes[5] = {0, 0, 4, 2, 6};
+    size_t rowBytes = (size_t)width * channels;
+    size_t filteredBytes = rowBytes + 1;
+
+    std::vector<unsigned char> filtered(filteredBytes * height);
+    ThreadPool::Instance().ParallelFor(0, height, 16, [&](size_t y) {
+        size_t source = flip ? height - 1 - y : y;
+        const unsigned char *row = pixels + source * rowBytes;
+        const unsigned char *above = y == 0 ? nullptr : pixels + (flip ? source + 1 : source - 1) * rowBytes;
+        FilterRow(row, above, rowBytes, channels, &filtered[y * filteredBytes]);
+    });
+
+    size_t total = filtered.size();
+    size_t pieceCount = std::max<size_t>(1, (total + ChunkBytes - 1) / ChunkBytes);
+    std::vector<Piece> pieces(pieceCount);
+    ThreadPool::Instance().ParallelFor(0, pieceCount, 1, [&](size_t i) {
+        DeflatePiece(filtered.data(), i * ChunkBytes, std::min(total, (i + 1) * ChunkBytes), total, level, pieces[i]);
+    });
+
+    for (const Piece &piece : pieces)
+        if (!piece.Ok)
+        {
+            std::cout << "ERROR::PNGWRITER:: Deflate failed for " << fileName << std::endl;
+            return false;
+        }
+
+    uLong adler = adler32(0L, Z_NULL, 0);
+    for (const Piece &piece : pieces)
+        adler = adler32_combine(adler, piece.Adler, (z_off_t)piece.Size);
+
+    // the zlib trailer closes the last IDAT, so the CRCs wait for it
+    PutBigEndian(pieces.back().Chunk, (uint32_t)adler);
+    ThreadPool::Instance().ParallelFor(0, pieceCount, 1, [&](size_t i) {
+        std::vector<unsigned char> &chunk = pieces[i].Chunk;
+        uint32_t length = (uint32_t)(chunk.size() - 8);
+        for (int b = 0; b < 4; b++)
+            chunk[b] = (unsigned char)(length >> (24 - 8 * b));
+        EndChunk(chunk, 0);
+    });
+
+    std::vector<unsigned char> header = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+    std::vector<unsigned char> ihdr;
+    PutBigEndian(ihdr, width);
+    PutBigEndian(ihdr, height);
+    ihdr.insert(ihdr.end(), {8, colorTypes[channels], 0, 0, 0}); // depth, color type, deflate, adaptive filters, no interlace
+    PutChunk(header, "IHDR", ihdr.data(), ihdr.size());
+
+    std::vector<unsigned char> end;
+    PutChunk(end, "IEND", nullptr, 0);
+
+    std::ofstream outStream;
+    outStream.open(fileName, std::ios::binary);
+    if (!outStream.is_open())
+    {
+        std::cout << "ERROR::PNGWRITER:: Failed to open " << fileName << std::endl;
+        return false;
+    }
+
+    outStream.write((const char *)header.data(), header.size());
+    for (const Piece &piece : pieces)
+        outStream.write((const char *)piece.Chunk.data(), piece.Chunk.size());
+    outStream.write((const char *)end.data(), end.size());
+    return outStream.good();
+}
+
+template <int Filter>
+unsigned long PngWriter::ApplyFilter(const unsigned char *row, const unsigned char *above, size_t rowBytes, int channels, unsigned char *out)
+{
+    unsigned long cost = 0;
+    for (size_t i = 0; i < rowBytes; i++)
+    {
+        int a = i >= (size_t)channels ? row[i - channels] : 0;
+        int b = above[i];
+        int c = i >= (size_t)channels ? above[i - channels] : 0;
+
+        int predicted = 0;
+        if (Filter == 1)
+            predicted = a;
+        else if (Filter == 2)
+            predicted = b;
+        else if (Filter == 3)
+            predicted = (a + b) >> 1;
+        else if (Filter == 4)
+        {
+            int p = a + b - c;
+            int pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+            predicted = pa <= pb && pa <= pc ? a : (pb <= pc ? b : c);
+        }
+
+        unsigned char value = (unsigned char)(row[i] - predicted);
+        out[i] = value;
+        cost += (unsigned long)std::abs((int)(signed char)value);
+    }
+    return cost;
+}
+
+void PngWriter::FilterRow(const unsigned char *row, const unsigned char *above, size_t rowBytes, int channels, unsigned char *out)
+{
+    typedef unsigned long (*Filter)(const unsigned char *, const unsigned char *, size_t, int, unsigned char *);
+    static const Filter filters[5] = {ApplyFilter<0>, ApplyFilter<1>, ApplyFilter<2>, ApplyFilter<3>, ApplyFilter<4>};
+
+    // above the first row is a row of zeros, where Up and Paeth add nothing over None and Sub
+    std::vector<unsigned char> zeros;
+    if (!above)
+    {
+        zeros.assign(rowBytes, 0);
+        above = zeros.data();
+    }
+
+    std::vector<unsigned char> candidate(rowBytes);
+    unsigned long bestCost = ~0ul;
+    for (int filter = 0; filter < 5; filter++)
+    {
+        unsigned long cost = filters[filter](row, above, rowBytes, channels, candidate.data());
+        if (cost < bestCost)
+        {
+            bestCost = cost;
+            out[0] = (unsigned char)filter;
+            std::memcpy(out + 1, candidate.data(), rowBytes);
+        }
+    }
+}
+
+void PngWriter::DeflatePiece(const unsigned char *data, size_t begin, size_t end, size_t total, int level, Piece &piece)
+{
+    bool first = begin == 0;
+    bool last = end == total;
+    piece.Size = end - begin;
+    piece.Adler = adler32(adler32(0L, Z_NULL, 0), data + begin, (uInt)piece.Size);
+    piece.Ok = false;
+
+    z_stream stream;
+    std::memset(&stream, 0, sizeof(stream));
+    if (deflateInit2(&stream, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return;
+
+    if (!first)
+    {
+        size_t dictionary = std::min((size_t)WindowBytes, begin);
+        deflateSetDictionary(&stream, data + begin - dictionary, (uInt)dictionary);
+    }
+
+    std::vector<unsigned char> &chunk = piece.Chunk;
+    BeginChunk(chunk, "IDAT");
+    if (first)
+        chunk.insert(chunk.end(), {0x78, 0x9C}); // zlib header, 32 KB window
+
+    size_t start = chunk.size();
+    chunk.resize(start + deflateBound(&stream, (uLong)piece.Size) + 16);
+    stream.next_in = const_cast<Bytef *>(data + begin);
+    stream.avail_in = (uInt)piece.Size;
+    stream.next_out = &chunk[start];
+    stream.avail_out = (uInt)(chunk.size() - start);
+
+    // a sync flush ends the piece on a byte boundary without ending the stream
+    int result = deflate(&stream, last ? Z_FINISH : Z_SYNC_FLUSH);
+    piece.Ok = last ? result == Z_STREAM_END : (result == Z_OK && stream.avail_in == 0 && stream.avail_out > 0);
+    chunk.resize(start + stream.total_out);
+    deflateEnd(&stream);
+}
+
+void PngWriter::PutBigEndian(std::vector<unsigned char> &out, uint32_t value)
+{
+    for (int shift = 24; shift >= 0; shift -= 8)
+        out.push_back((unsigned char)(value >> shift));
+}
+
+// Chunks are length, type, data and the CRC of type and data.
+void PngWriter::BeginChunk(std::vector<unsigned char> &out, const char *type)
+{
+    PutBigEndian(out, 0); // length, filled in by whoever knows it
+    out.insert(out.end(), type, type + 4);
+}
+
+void PngWriter::EndChunk(std::vector<unsigned char> &out, size_t start)
+{
+    uLong crc = crc32(0L, Z_NULL, 0);
+    crc = crc32(crc, &out[start + 4], (uInt)(out.size() - start - 4));
+    PutBigEndian(out, (uint32_t)crc);
+}
+
+void PngWriter::PutChunk(std::vector<unsigned char> &out, const char *type, const unsigned char *data, size_t size)
+{
+    size_t start = out.size();
+    PutBigEndian(out, (uint32_t)size);
+    out.insert(out.end(), type, type + 4);
+    if (size > 0)
+        out.insert(out.end(), data, data + size);
+    EndChunk(out, start);
+}
+
+#endif
@@ -0,0 +1,137 @@
+#ifndef PROGRESSIVEDISPLAY_HPP
+#define PROGRESSIVEDISPLAY_HPP
+
+#include <glad/glad.h>
+
+#include <algorithm>
+#include <iostream>
+#include <memory>
+
+#include "RenderTarget.hpp"
+#include "shader.hpp"
+
+// What the window shows: the running average of the frames traced since the view last changed,
+// kept on the GPU. Each frame is blended in with a constant alpha of 1/n, so the picture converges
+// while the camera rests.
+//
+// While the camera or scene moves, the count restarts every frame and alpha stays at MotionBlend,
+// a short exponential average that smooths the noise without smearing much. Once motion stops, alpha
+// keeps MotionBlend until 1/n drops below it, then follows 1/n, so what is left of the moving frames
+// fades as 1/n.
+//
+// A frame traced below window resolution (see DynamicResolution) is upscaled on the way in, guided by
+// its depth and normals.
+class ProgressiveDisplay
+{
+public:
+    static constexpr float MotionBlend = 0.25f;
+    static constexpr float UpscaleSigmaDepth = 0.05f;  // relative to the depth of the nearest traced pixel
+    static constexpr float UpscaleNormalPower = 32.0f;
+
+    ProgressiveDisplay(unsigned int width, unsigned int height);
+
+    // Frames averaged since the view last changed.
+    unsigned int Frames() const { return frames; }
+
+    // Blends the Color attachment of target in. viewChanged restarts the average.
+    void Accumulate(const RenderTarget &target, bool viewChanged);
+    // Same, for a frame traced into the lower left traceWidth x traceHeight pixels of target only.
+    void Accumulate(const RenderTarget &target, bool viewChanged, unsigned int traceWidth, unsigned int traceHeight);
+
+    // Copies the average to the back buffer of the window, clamped, and rebinds the window.
+    void BlitToWindow(int windowWidth, int windowHeight) const;
+
+private:
+    unsigned int width;
+    unsigned int height;
+    unsigned int frames = 0;
+    bool empty = true; // nothing to blend with yet
+
+    // GL resources, left to the context like every other GL object
+    std::unique_ptr<Shader> blendShader;
+    unsigned int vao;
+    unsigned int framebuffer;
+    unsigned int texture;
+};
+
+constexpr float ProgressiveDisplay::MotionBlend;
+constexpr float ProgressiveDisplay::UpscaleSigmaDepth;
+constexpr float ProgressiveDisplay::UpscaleNormalPower;
+
+ProgressiveDisplay::ProgressiveDisplay(unsigned int width, unsigned int height) : width(width), height(height)
+{
+    blendShader.reset(new Shader("FullScreen.vs", "Progressive.fs"));
+    glGenVertexArrays(1, &vao); // the full screen triangle comes from gl_VertexID
+
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, width, height, 0, GL_RGBA, GL_FLOAT, nullptr);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    glGenFramebuffers(1, &framebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, texture, 0);
+
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+        std::cout << "ERROR::FRAMEBUFFER:: Progressive display is not complete" << std::endl;
+
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+void ProgressiveDisplay::Accumulate(const RenderTarget &target, bool viewChanged)
+{
+    Accumulate(target, viewChanged, target.Width(), target.Height());
+}
+
+void ProgressiveDisplay::Accumulate(const RenderTarget &target, bool viewChanged, unsigned int traceWidth, unsigned int traceHeight)
+{
+    if (viewChanged)
+        frames = 0;
+    frames++;
+
+    float alpha = empty ? 1.0f : std::min(MotionBlend, 1.0f / frames);
+    empty = false;
+
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+    glDrawBuffer(GL_COLOR_ATTACHMENT0);
+    glViewport(0, 0, width, height);
+
+    // average += alpha * (frame - average), done by the blender
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_CONSTANT_ALPHA, GL_ONE_MINUS_CONSTANT_ALPHA);
+    glBlendColor(0.0f, 0.0f, 0.0f, alpha);
+
+    blendShader->use();
+    blendShader->setInt("Color", 0);
+    blendShader->setInt("NormalDepth", 1);
+    blendShader->setIVec2("Resolution", traceWidth, traceHeight);
+    blendShader->setFloat("SigmaDepth", UpscaleSigmaDepth);
+    blendShader->setFloat("NormalPower", UpscaleNormalPower);
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, target.Texture(RenderTarget::NormalDepth));
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, target.Texture(RenderTarget::Color));
+
+    glBindVertexArray(vao);
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+    glBindVertexArray(0);
+
+    glDisable(GL_BLEND);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+void ProgressiveDisplay::BlitToWindow(int windowWidth, int windowHeight) const
+{
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffer);
+    glReadBuffer(GL_COLOR_ATTACHMENT0);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+    glDrawBuffer(GL_BACK);
+    glBlitFramebuffer(0, 0, width, height, 0, 0, windowWidth, windowHeight, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glViewport(0, 0, windowWidth, windowHeight);
+}
+
+#endif
@@ -0,0 +1,425 @@
+#ifndef RENDERDAEMON_HPP
+#define RENDERDAEMON_HPP
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "Camera.hpp"
+#include "CpuPathTracer.hpp"
+#include "HdrWriter.hpp"
+#include "PngWriter.hpp"
+#include "Scene.hpp"
+#include "SceneBuffer.hpp"
+#include "Socket.hpp"
+#include "TileRenderer.hpp"
+
+// A render service that stays up between renders (main --daemon), so a job only pays for its samples.
+//
+// Scenes are loaded the first time a job names them and stay resident with their BVH, the CPU tracer
+// over it and, for the GL backend, their scene buffers; the shader is compiled once. Clients connect to
+// a Unix domain socket and submit jobs: scene, camera, resolution, samples, priority and the file the
+// image goes to, or none to have the pixels sent back. Packets, the time a client may stall in the
+// middle of one, job resolutions and the jobs queued, per client and in all, are capped (Global::Daemon*),
+// and the image of a job is only allocated once it is rendered, so no client can stall or exhaust the
+// service.
+//
+// Jobs wait in order of priority, then of arrival. The job in front is rendered Global::DaemonPassSamples
+// samples at a time, and the socket is served between passes, so a job of higher priority that arrives
+// takes over after the current pass, and a cancel takes effect after it. A preempted job keeps its
+// samples. The GL backend renders the jobs at the window resolution, the CPU tracer every other size.
+namespace DaemonPacket
+{
+    enum Type : uint32_t
+    {
+        Submit = 1, // client: JobHeader, scene ID, output path
+        Accepted,   // daemon: uint32_t job ID
+        Cancel,     // client: uint32_t job ID; daemon: the job ID and 1 when it was queued, 0 otherwise
+        Finished,   // daemon: FinishedHeader, then the RGB floats when the job has no output path
+        Quit        // client: the daemon exits once the current pass is done
+    };
+
+    enum Status : uint32_t
+    {
+        Done,
+        Cancelled,
+        Failed
+    };
+
+    struct JobHeader
+    {
+        int32_t Priority; // larger first
+        uint32_t Width, Height;
+        uint32_t Samples;
+        float Position[3];
+        float Yaw, Pitch; // degrees, as Camera takes them
+        uint32_t SceneBytes, OutputBytes;
+    };
+
+    struct FinishedHeader
+    {
+        uint32_t Job;
+        uint32_t Status;
+        uint32_t Width, Height;
+        uint32_t Samples;
+        float Milliseconds; // from submission
+    };
+}
+
+class RenderDaemon
+{
+public:
+    // Fills an empty scene with the scene of an ID, false when there is no such scene.
+    typedef std::function<bool(const std::string &id, Scene &scene)> SceneLoader;
+
+    // CPU backend.
+    explicit RenderDaemon(SceneLoader loader);
+    // GL backend, for the thread owning the context; vao draws the rays of Camera::GenerateRay().
+    RenderDaemon(SceneLoader loader, Shader &shader, const RenderTarget &target, unsigned int vao);
+
+    // Serves the socket at path until a client sends Quit. False when it cannot listen.
+    bool Run(const std::string &path);
+
+private:
+    struct ResidentScene
+    {
+        Scene Geometry;
+        std::unique_ptr<CpuPathTracer> Tracer;
+        std::unique_ptr<SceneBuffer> Buffer;
+    };
+
+    struct Job
+    {
+        uint32_t Id;
+        uint32_t Client;
+        std::string SceneId;
+        std::string Output;
+        unsigned int Width, Height;
+        unsigned int Samples;
+        glm::vec3 Eye;
+        glm::mat4 RayRotateMatrix;
+
+        unsigned int Rendered = 0;
+        std::vector<float> Color; // allocated by the first pass
+        std::chrono::steady_clock::time_point Submitted;
+    };
+
+    // queue order: priority descending, then job ID; the priority is negated in 64 bits, INT32_MIN included
+    typedef std::pair<int64_t, uint32_t> JobKey;
+
+    SceneLoader loader;
+    std::unique_ptr<TileRenderer> glRenderer;
+    Shader *shader = nullptr;
+    const ResidentScene *boundScene = nullptr;
+
+    std::map<std::string, std::unique_ptr<ResidentScene>> scenes;
+    std::map<JobKey, Job> jobs;
+    std::map<uint32_t, Socket> clients;
+    uint32_t nextJob = 1;
+    uint32_t nextClient = 1;
+    bool quitting = false;
+
+    void Serve(const Socket &listener, bool wait);
+    void Receive(uint32_t client);
+    void Submit(uint32_t client, const std::vector<char> &payload);
+    bool Cancel(uint32_t job);
+
+    const ResidentScene *Resident(const std::string &id);
+    void RenderPass(Job &job, const ResidentScene &scene);
+    void Finish(const Job &job, DaemonPacket::Status status);
+
+    // By extension: .pfm, .hdr and .exr keep the floats, anything else is an 8 bit PNG.
+    static bool WriteImage(const std::string &fileName, unsigned int width, unsigned int height, const std::vector<float> &rgb);
+};
+
+RenderDaemon::RenderDaemon(SceneLoader loader) : loader(loader)
+{
+}
+
+RenderDaemon::RenderDaemon(SceneLoader loader, Shader &shader, const RenderTarget &target, unsigned int vao)
+    : loader(loader), glRenderer(new TileRenderer(shader, target, vao)), shader(&shader)
+{
+}
+
+bool RenderDaemon::Run(const std::string &path)
+{
+    if (!Socket::Startup())
+        return false;
+    Socket listener = Socket::ListenLocal(path);
+    if (!listener.Valid())
+        return false;
+
+    std::cout << "RenderDaemon: serving " << path << " with the " << (glRenderer ? "GL" : "CPU") << " backend" << std::endl;
+    while (!quitting)
+    {
+        // block while idle, only look in between passes
+        Serve(listener, jobs.empty());
+        if (quitting || jobs.empty())
+            continue;
+
+        Job &job = jobs.begin()->second;
+        const ResidentScene *scene = Resident(job.SceneId);
+        if (!scene)
+        {
+            Finish(job, DaemonPacket::Failed);
+            jobs.erase(jobs.begin());
+            continue;
+        }
+
+        RenderPass(job, *scene);
+        if (job.Rendered == job.Samples)
+        {
+            Finish(job, WriteImage(job.Output, job.Width, job.Height, job.Color) ? DaemonPacket::Done : DaemonPacket::Failed);
+            jobs.erase(jobs.begin());
+        }
+    }
+
+    for (auto &entry : jobs)
+        Finish(entry.second, DaemonPacket::Cancelled);
+    listener.Close();
+    std::remove(path.c_str());
+    return true;
+}
+
+void RenderDaemon::Serve(const Socket &listener, bool wait)
+{
+    fd_set readable;
+    FD_ZERO(&readable);
+    FD_SET(listener.Native(), &readable);
+    Socket::Handle highest = listener.Native();
+    for (const auto &entry : clients)
+    {
+        FD_SET(entry.second.Native(), &readable);
+        highest = std::max(highest, entry.second.Native());
+    }
+
+    timeval poll = {0, 0};
+    if (select((int)highest + 1, &readable, nullptr, nullptr, wait ? nullptr : &poll) <= 0)
+        return;
+
+    std::vector<uint32_t> ready;
+    for (const auto &entry : clients)
+        if (FD_ISSET(entry.second.Native(), &readable))
+            ready.push_back(entry.first);
+    for (uint32_t client : ready)
+        Receive(client);
+
+    if (FD_ISSET(listener.Native(), &readable))
+    {
+        Socket client = listener.Accept();
+        if (client.Valid() && client.SetTimeout(Global::DaemonTimeoutMilliseconds))
+            clients[nextClient++] = std::move(client);
+    }
+}
+
+void RenderDaemon::Receive(uint32_t client)
+{
+    const Socket &connection = clients[client];
+    uint32_t type;
+    std::vector<char> payload;
+    if (!connection.ReceivePacket(type, payload, Global::DaemonMaxPacketBytes))
+    {
+        // gone, stalled or too large; its jobs still run, their images are written all the same
+        clients.erase(client);
+        return;
+    }
+
+    switch (type)
+    {
+    case DaemonPacket::Submit:
+        Submit(client, payload);
+        break;
+    case DaemonPacket::Cancel:
+    {
+        uint32_t reply[2] = {0, 0};
+        if (payload.size() == sizeof(uint32_t))
+        {
+            std::memcpy(&reply[0], payload.data(), sizeof(uint32_t));
+            reply[1] = Cancel(reply[0]) ? 1 : 0;
+        }
+        // the cancelled job may have been this client's, and the client gone with its Finished
+        if (clients.count(client))
+            connection.SendPacket(DaemonPacket::Cancel, reply, sizeof(reply));
+        break;
+    }
+    case DaemonPacket::Quit:
+        quitting = true;
+        break;
+    default:
+        std::cout << "ERROR::RENDERDAEMON:: Unknown packet " << type << " from client " << client << std::endl;
+        clients.erase(client);
+        break;
+    }
+}
+
+void RenderDaemon::Submit(uint32_t client, const std::vector<char> &payload)
+{
+    DaemonPacket::JobHeader header;
+    if (payload.size() < sizeof(header))
+    {
+        clients.erase(client);
+        return;
+    }
+    std::memcpy(&header, payload.data(), sizeof(header));
+    if (payload.size() != sizeof(header) + (size_t)header.SceneBytes + header.OutputBytes)
+    {
+        std::cout << "ERROR::RENDERDAEMON:: Malformed job from client " << client << std::endl;
+        clients.erase(client);
+        return;
+    }
+
+    Job job;
+    job.Id = nextJob++;
+    job.Client = client;
+    job.SceneId.assign(payload.data() + sizeof(header), header.SceneBytes);
+    job.Output.assign(payload.data() + sizeof(header) + header.SceneBytes, header.OutputBytes);
+    job.Width = header.Width;
+    job.Height = header.Height;
+    job.Samples = header.Samples;
+    job.Submitted = std::chrono::steady_clock::now();
+
+    Camera camera;
+    camera.SetView(glm::vec3(header.Position[0], header.Position[1], header.Position[2]), header.Yaw, header.Pitch);
+    job.Eye = camera.Position;
+    job.RayRotateMatrix = camera.GetRotateMatrix();
+
+    clients[client].SendPacket(DaemonPacket::Accepted, &job.Id, sizeof(job.Id));
+
+    size_t clientJobs = 0;
+    for (const auto &entry : jobs)
+        clientJobs += entry.second.Client == client;
+
+    if (job.Width == 0 || job.Height == 0 || job.Samples == 0 ||
+        job.Width > Global::DaemonMaxResolution || job.Height > Global::DaemonMaxResolution ||
+        jobs.size() >= Global::DaemonMaxJobs || clientJobs >= Global::DaemonMaxClientJobs)
+    {
+        Finish(job, DaemonPacket::Failed);
+        return;
+    }
+    jobs.emplace(JobKey(-(int64_t)header.Priority, job.Id), std::move(job));
+}
+
+bool RenderDaemon::Cancel(uint32_t id)
+{
+    for (auto entry = jobs.begin(); entry != jobs.end(); ++entry)
+        if (entry->second.Id == id)
+        {
+            Finish(entry->second, DaemonPacket::Cancelled);
+            jobs.erase(entry);
+            return true;
+        }
+    return false;
+}
+
+const RenderDaemon::ResidentScene *RenderDaemon::Resident(const std::string &id)
+{
+    auto found = scenes.find(id);
+    if (found != scenes.end())
+        return found->second.get();
+
+    std::unique_ptr<ResidentScene> scene(new ResidentScene);
+    auto start = std::chrono::steady_clock::now();
+    if (!loader(id, scene->Geometry))
+    {
+        std::cout << "ERROR::RENDERDAEMON:: No scene " << id << std::endl;
+        return nullptr;
+    }
+    scene->Geometry.Build();
+    scene->Tracer.reset(new CpuPathTracer(scene->Geometry));
+    // a scene the shader cannot take, one with streamed meshes, is traced on the CPU
+    if (glRenderer)
+    {
+        scene->Buffer.reset(new SceneBuffer);
+        if (!scene->Buffer->Upload(scene->Geometry))
+            scene->Buffer.reset();
+    }
+
+    std::cout << "RenderDaemon: loaded " << id << " in "
+              << std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count() << " ms" << std::endl;
+    return (scenes[id] = std::move(scene)).get();
+}
+
+void RenderDaemon::RenderPass(Job &job, const ResidentScene &scene)
+{
+    TileResult pass;
+    pass.Region.Width = job.Width;
+    pass.Region.Height = job.Height;
+    pass.FirstSample = job.Rendered;
+    pass.Samples = std::min(Global::DaemonPassSamples, job.Samples - job.Rendered);
+
+    if (glRenderer && scene.Buffer && job.Width == Global::WindowWidth && job.Height == Global::WindowHeight)
+    {
+        if (boundScene != &scene)
+        {
+            scene.Buffer->Bind(*shader);
+            boundScene = &scene;
+        }
+        glRenderer->Render(pass, job.Eye, job.RayRotateMatrix);
+    }
+    else
+        scene.Tracer->Render(pass, job.Eye, job.RayRotateMatrix, job.Width, job.Height);
+
+    job.Color.resize(pass.Color.size(), 0.0f);
+    job.Rendered += pass.Samples;
+    float weight = (float)pass.Samples / job.Rendered;
+    for (size_t i = 0; i < job.Color.size(); i++)
+        job.Color[i] += (pass.Color[i] - job.Color[i]) * weight;
+}
+
+void RenderDaemon::Finish(const Job &job, DaemonPacket::Status status)
+{
+    DaemonPacket::FinishedHeader header;
+    header.Job = job.Id;
+    header.Status = status;
+    header.Width = job.Width;
+    header.Height = job.Height;
+    header.Samples = job.Rendered;
+    header.Milliseconds = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - job.Submitted).count();
+
+    std::cout << "RenderDaemon: job " << job.Id << " " << (status == DaemonPacket::Done ? "done" : status == DaemonPacket::Cancelled ? "cancelled" : "failed")
+              << " after " << header.Milliseconds << " ms" << std::endl;
+
+    auto client = clients.find(job.Client);
+    if (client == clients.end())
+        return;
+
+    std::vector<char> payload(sizeof(header));
+    std::memcpy(payload.data(), &header, sizeof(header));
+    if (status == DaemonPacket::Done && job.Output.empty())
+        payload.insert(payload.end(), (const char *)job.Color.data(), (const char *)(job.Color.data() + job.Color.size()));
+    if (!client->second.SendPacket(DaemonPacket::Finished, payload))
+        clients.erase(client);
+}
+
+bool RenderDaemon::WriteImage(const std::string &fileName, unsigned int width, unsigned int height, const std::vector<float> &rgb)
+{
+    if (fileName.empty())
+        return true;
+
+    std::string extension = fileName.substr(fileName.find_last_of('.') + 1);
+    if (extension == "pfm")
+        return HdrWriter::WritePFM(fileName.c_str(), width, height, rgb.data());
+    if (extension == "hdr")
+        return HdrWriter::WriteRGBE(fileName.c_str(), width, height, rgb.data());
+    if (extension == "exr")
+        return HdrWriter::WriteEXR(fileName.c_str(), width, height,
+                                   {{"R", HdrChannel::Float, rgb.data(), 3},
+                                    {"G", HdrChannel::Float, rgb.data() + 1, 3},
+                                    {"B", HdrChannel::Float, rgb.data() + 2, 3}});
+
+    std::vector<unsigned char> pixels(rgb.size());
+    for (size_t i = 0; i < rgb.size(); i++)
+        pixels[i] = (unsigned char)(Global::clamp(0.0f, 1.0f, rgb[i]) * 255.0f + 0.5f);
+    return PngWriter::Write(fileName.c_str(), width, height, 3, pixels.data(), true);
+}
+
+#endif
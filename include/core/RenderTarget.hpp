@@ -0,0 +1,122 @@
+#ifndef RENDERTARGET_HPP
+#define RENDERTARGET_HPP
+
+#include <glad/glad.h>
+
+#include <iostream>
+
+// Off screen target of the path tracing pass, one MRT attachment per output of SimplePathTracing.fs:
+//
+// Color       : RGBA32F, radiance of this frame, unclamped
+// Albedo      : RGBA16F, Kd of the primary hit
+// NormalDepth : RGBA32F, world space normal of the primary hit + distance from the eye
+// ID          : RGBA32UI, instance + 1, triangle reference and material of the primary hit
+//
+// Pixels whose primary ray hits nothing are zero in every AOV.
+class RenderTarget
+{
+public:
+    enum Attachment
+    {
+        Color,
+        Albedo,
+        NormalDepth,
+        ID,
+        AttachmentCount
+    };
+
+    RenderTarget(unsigned int width, unsigned int height);
+
+    unsigned int Width() const { return width; }
+    unsigned int Height() const { return height; }
+    unsigned int Texture(Attachment attachment) const { return textures[attachment]; }
+
+    // Binds every attachment for drawing and clears it.
+    void Bind() const;
+    // Same, with the viewport on the lower left viewportWidth x viewportHeight pixels only.
+    void Bind(unsigned int viewportWidth, unsigned int viewportHeight) const;
+
+    // Reads an attachment back in glReadPixels order, with components of GL_RGB or GL_RGBA.
+    void Read(Attachment attachment, GLenum format, float *pixels) const;
+    // Same, for the width x height pixels from (x, y) only.
+    void Read(Attachment attachment, GLenum format, int x, int y, int width, int height, float *pixels) const;
+    void ReadID(unsigned int *pixels) const;
+
+private:
+    unsigned int width;
+    unsigned int height;
+    unsigned int framebuffer;
+    unsigned int textures[AttachmentCount];
+};
+
+RenderTarget::RenderTarget(unsigned int width, unsigned int height) : width(width), height(height)
+{
+    const GLenum formats[AttachmentCount] = {GL_RGBA32F, GL_RGBA16F, GL_RGBA32F, GL_RGBA32UI};
+    const GLenum layouts[AttachmentCount] = {GL_RGBA, GL_RGBA, GL_RGBA, GL_RGBA_INTEGER};
+    const GLenum types[AttachmentCount] = {GL_FLOAT, GL_FLOAT, GL_FLOAT, GL_UNSIGNED_INT};
+
+    glGenFramebuffers(1, &framebuffer);
+    glGenTextures(AttachmentCount, textures);
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+
+    for (int i = 0; i < AttachmentCount; i++)
+    {
+        glBindTexture(GL_TEXTURE_2D, textures[i]);
+        glTexImage2D(GL_TEXTURE_2D, 0, formats[i], width, height, 0, layouts[i], types[i], nullptr);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 + i, GL_TEXTURE_2D, textures[i], 0);
+    }
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+        std::cout << "ERROR::FRAMEBUFFER:: Render target is not complete" << std::endl;
+
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+void RenderTarget::Bind() const
+{
+    Bind(width, height);
+}
+
+void RenderTarget::Bind(unsigned int viewportWidth, unsigned int viewportHeight) const
+{
+    const GLenum drawBuffers[AttachmentCount] = {GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1, GL_COLOR_ATTACHMENT2, GL_COLOR_ATTACHMENT3};
+    const float clearColor[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+    const unsigned int clearID[4] = {0, 0, 0, 0};
+
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+    glDrawBuffers(AttachmentCount, drawBuffers);
+    glViewport(0, 0, viewportWidth, viewportHeight);
+
+    // integer attachments must not be cleared through glClear
+    for (int i = 0; i < ID; i++)
+        glClearBufferfv(GL_COLOR, i, clearColor);
+    glClearBufferuiv(GL_COLOR, ID, clearID);
+}
+
+void RenderTarget::Read(Attachment attachment, GLenum format, float *pixels) const
+{
+    Read(attachment, format, 0, 0, width, height, pixels);
+}
+
+void RenderTarget::Read(Attachment attachment, GLenum format, int x, int y, int width, int height, float *pixels) const
+{
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffer);
+    glReadBuffer(GL_COLOR_ATTACHMENT0 + attachment);
+    glPixelStorei(GL_PACK_ALIGNMENT, 4);
+    glReadPixels(x, y, width, height, format, GL_FLOAT, pixels);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+}
+
+void RenderTarget::ReadID(unsigned int *pixels) const
+{
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffer);
+    glReadBuffer(GL_COLOR_ATTACHMENT0 + ID);
+    glPixelStorei(GL_PACK_ALIGNMENT, 4);
+    glReadPixels(0, 0, width, height, GL_RGBA_INTEGER, GL_UNSIGNED_INT, pixels);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+}
+
+#endif
@@ -0,0 +1,120 @@
+#ifndef SAMPLESPLIT_HPP
+#define SAMPLESPLIT_HPP
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+
+#include "Global.hpp"
+#include "FrameSaver.hpp"
+
+// Splitting the samples of one frame over processes that never talk to each other.
+//
+// Node i of n renders the sample indices [Begin, End) of the frame, a contiguous share of Global::spp,
+// and the seeds of sample k only depend on Global::SampleSeed and k. The nodes together thus trace
+// exactly the samples one process would, and the partial accumulations they write are merged by
+// sample count (see FrameSaver::Merge() and source/merge.cpp) into the same image.
+struct SampleRange
+{
+    unsigned int Node = 0;
+    unsigned int Nodes = 1;
+    unsigned int Begin = 0;
+    unsigned int End = Global::spp;
+
+    static SampleRange ForNode(unsigned int node, unsigned int nodes, unsigned int samples = Global::spp);
+
+    unsigned int Count() const { return End - Begin; }
+    bool IsSplit() const { return Nodes > 1; }
+};
+
+// Restarts sampler at sample index, the seeds of the frame are what it draws next.
+inline void SeedSample(std::mt19937 &sampler, uint32_t seed, unsigned int index)
+{
+    std::seed_seq sequence{seed, (uint32_t)index};
+    sampler.seed(sequence);
+}
+
+// The file a node leaves behind: its range and the raw FrameSaver state, named after the node.
+class PartialRender
+{
+public:
+    static const uint32_t Version = 1;
+
+    static std::string FileName(const SampleRange &range);
+
+    static bool Save(const std::string &fileName, const FrameSaver &image, const SampleRange &range);
+    static bool Load(const std::string &fileName, FrameSaver &image, SampleRange &range);
+};
+
+SampleRange SampleRange::ForNode(unsigned int node, unsigned int nodes, unsigned int samples)
+{
+    SampleRange range;
+    range.Nodes = std::max(nodes, 1u);
+    range.Node = std::min(node, range.Nodes - 1);
+    // shares differ by one sample at most
+    range.Begin = (unsigned int)((uint64_t)samples * range.Node / range.Nodes);
+    range.End = (unsigned int)((uint64_t)samples * (range.Node + 1) / range.Nodes);
+    return range;
+}
+
+std::string PartialRender::FileName(const SampleRange &range)
+{
+    return Global::ImagePath + "partial_" + std::to_string(range.Node) + "_of_" + std::to_string(range.Nodes) + ".sptp";
+}
+
+bool PartialRender::Save(const std::string &fileName, const FrameSaver &image, const SampleRange &range)
+{
+    std::ofstream outStream(fileName, std::ios::binary);
+    if (!outStream.is_open())
+    {
+        std::cout << "ERROR::PARTIALRENDER:: Failed to open " << fileName << std::endl;
+        return false;
+    }
+
+    uint32_t header[6] = {Version, Global::SampleSeed, range.Node, range.Nodes, range.Begin, range.End};
+    outStream.write("SPTP", 4);
+    outStream.write((const char *)header, sizeof(header));
+    image.WriteState(outStream);
+    if (!outStream.good())
+    {
+        std::cout << "ERROR::PARTIALRENDER:: Failed to write " << fileName << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool PartialRender::Load(const std::string &fileName, FrameSaver &image, SampleRange &range)
+{
+    std::ifstream inStream(fileName, std::ios::binary);
+    if (!inStream.is_open())
+    {
+        std::cout << "ERROR::PARTIALRENDER:: Failed to open " << fileName << std::endl;
+        return false;
+    }
+
+    char magic[4];
+    uint32_t header[6];
+    inStream.read(magic, 4);
+    inStream.read((char *)header, sizeof(header));
+    if (!inStream || std::memcmp(magic, "SPTP", 4) != 0 || header[0] != Version)
+    {
+        std::cout << "ERROR::PARTIALRENDER:: " << fileName << " is not a partial render of this version" << std::endl;
+        return false;
+    }
+    if (header[1] != Global::SampleSeed)
+        std::cout << "PartialRender: " << fileName << " was seeded with " << header[1] << ", not " << Global::SampleSeed << std::endl;
+
+    if (!image.ReadState(inStream))
+        return false;
+
+    range.Node = header[2];
+    range.Nodes = header[3];
+    range.Begin = header[4];
+    range.End = header[5];
+    return true;
+}
+
+#endif
@@ -0,0 +1,532 @@
+#ifndef SCENE_HPP
+#define SCENE_HPP
+
+#include <glm/glm.hpp>
+
+#include <vector>
+#include <map>
+#include <cmath>
+#include <chrono>
+#include <memory>
+#include <iostream>
+
+#include "Geometry.hpp"
+#include "Bvh.hpp"
+#include "CompressedBvh.hpp"
+#include "StreamedGeometry.hpp"
+
+#define SCENE_EPSILON 0.0001f // same as EPSILON in SimplePathTracing.fs
+
+struct Ray
+{
+    glm::vec3 Origin;
+    glm::vec3 Direction;
+};
+
+struct Hit
+{
+    bool Happened = false;
+    float Distance = FLT_MAX;
+    glm::vec2 Barycentric;
+    unsigned int Instance = 0;
+    unsigned int Triangle = 0;
+};
+
+// Shading data of a hit, what FetchHitAttributes() produces in the shader.
+struct SurfacePoint
+{
+    glm::vec3 Coords;
+    glm::vec3 Normal;
+    glm::vec2 TexCoords;
+    glm::vec3 Kd;
+    bool IsLight;
+};
+
+struct Instance
+{
+    glm::mat4 ToWorld;
+    glm::mat4 ToObject;
+    unsigned int Mesh;
+};
+
+// What Scene::Update() changed, so SceneBuffer can re-upload only that.
+struct SceneUpdate
+{
+    struct MeshChange
+    {
+        unsigned int Mesh;
+        bool Rebuilt = false;
+        std::vector<unsigned int> Vertices; // moved vertices, sorted
+        std::vector<unsigned int> Nodes;    // re-quantized compressed bottom level nodes, sorted
+    };
+
+    std::vector<MeshChange> Meshes;
+    std::vector<unsigned int> Instances;     // instances with new world bounds, sorted
+    std::vector<unsigned int> InstanceNodes; // refit top level nodes, sorted
+    bool InstanceBvhRebuilt = false;
+
+    bool Empty() const { return Meshes.empty() && Instances.empty(); }
+};
+
+// Two level acceleration structure.
+// Every unique mesh owns a bottom level BVH over its triangles, built once. Rays trace its
+// compressed copy; the binary one is kept for refitting.
+// Instances place a mesh in the world, the top level BVH is built over their world bounds.
+// Rays are moved into the object space of an instance before descending into its mesh.
+// A streamed mesh keeps an empty entry in Meshes and its bottom level in StreamedMeshes.
+class Scene
+{
+public:
+    std::vector<TraceGeometry> Meshes;
+    std::vector<Bvh> MeshBvhs;
+    std::vector<CompressedBvh> CompressedMeshBvhs;
+    std::vector<std::shared_ptr<StreamedGeometry>> StreamedMeshes; // null for resident meshes
+    std::vector<Instance> Instances;
+    std::vector<Material> Materials;
+    Bvh InstanceBvh;
+
+    // Linear trades trace speed for build speed, for scenes that are rebuilt often.
+    BvhBuildMode BuildMode = BvhBuildMode::Sah;
+
+    unsigned int AddMesh(TraceGeometry geometry);
+
+    // Adds an opened chunk file, which brings its own BVH. Streamed meshes are static.
+    unsigned int AddStreamedMesh(std::shared_ptr<StreamedGeometry> geometry);
+
+    unsigned int AddInstance(unsigned int mesh, const glm::mat4 &toWorld);
+
+    // Builds the missing bottom level BVHs in parallel, then the top level one,
+    // and reports the build time and SAH costs.
+    void Build();
+
+    // Moves an instance. Takes effect on the next Update().
+    void SetInstanceTransform(unsigned int instance, const glm::mat4 &toWorld);
+
+    // Call after editing Meshes[mesh].Positions, with the triangles whose vertices moved.
+    void MarkTrianglesMoved(unsigned int mesh, const std::vector<unsigned int> &triangles);
+
+    // Refits the BVHs above everything that moved since the last call, bottom level first.
+    // A BVH whose SAH cost degraded past Bvh::RebuildThreshold is rebuilt instead.
+    SceneUpdate Update();
+
+    bool Intersect(const Ray &ray, Hit &hit) const;
+
+    // False when the chunk of a streamed triangle can no longer be read, which callers treat as no hit.
+    bool GetSurface(const Ray &ray, const Hit &hit, SurfacePoint &surface) const;
+
+    size_t TriangleCount() const;
+
+    size_t InstancedTriangleCount() const;
+
+    // Resident memory only, streamed chunks are accounted for by ChunkCache.
+    size_t MemoryUsage() const;
+
+    // Triangle weighted average over the resident mesh BVHs.
+    float MeshSahCost() const;
+
+    double BuildMilliseconds() const { return buildMilliseconds; }
+
+private:
+    double buildMilliseconds = 0.0;
+
+    std::vector<unsigned int> movedInstances;
+    std::map<unsigned int, std::vector<unsigned int>> movedTriangles;
+
+    Aabb TriangleBounds(unsigned int mesh, unsigned int triangle) const;
+    void SplitTriangle(unsigned int mesh, unsigned int triangle, int axis, float position, Aabb &left, Aabb &right) const;
+    Aabb InstanceBounds(unsigned int instance) const;
+
+    void BuildMeshBvh(unsigned int mesh);
+    void BuildInstanceBvh();
+
+    static void SortUnique(std::vector<unsigned int> &values);
+};
+
+// Moller-Trumbore with back face culling, mirrors IntersectTriangle() in the shader.
+inline bool IntersectTriangle(const Ray &ray, const glm::vec3 &v0, const glm::vec3 &v1, const glm::vec3 &v2,
+                              float &distance, glm::vec2 &barycentric)
+{
+    glm::vec3 e1 = v1 - v0;
+    glm::vec3 e2 = v2 - v0;
+
+    if (glm::dot(ray.Direction, glm::cross(e1, e2)) > 0.0f)
+        return false;
+
+    glm::vec3 pvec = glm::cross(ray.Direction, e2);
+    float det = glm::dot(e1, pvec);
+    if (std::abs(det) < SCENE_EPSILON)
+        return false;
+
+    float detInv = 1.0f / det;
+    glm::vec3 tvec = ray.Origin - v0;
+    float u = glm::dot(tvec, pvec) * detInv;
+    if (u < 0.0f || u > 1.0f)
+        return false;
+
+    glm::vec3 qvec = glm::cross(tvec, e1);
+    float v = glm::dot(ray.Direction, qvec) * detInv;
+    if (v < 0.0f || u + v > 1.0f)
+        return false;
+
+    float t = glm::dot(e2, qvec) * detInv;
+    if (t < 0.0f)
+        return false;
+
+    distance = t;
+    barycentric = glm::vec2(u, v);
+    return true;
+}
+
+unsigned int Scene::AddMesh(TraceGeometry geometry)
+{
+    Meshes.push_back(std::move(geometry));
+    StreamedMeshes.push_back(nullptr);
+    return (unsigned int)Meshes.size() - 1;
+}
+
+unsigned int Scene::AddStreamedMesh(std::shared_ptr<StreamedGeometry> geometry)
+{
+    Meshes.emplace_back();
+    StreamedMeshes.push_back(std::move(geometry));
+    return (unsigned int)Meshes.size() - 1;
+}
+
+unsigned int Scene::AddInstance(unsigned int mesh, const glm::mat4 &toWorld)
+{
+    Instances.push_back({toWorld, glm::inverse(toWorld), mesh});
+    return (unsigned int)Instances.size() - 1;
+}
+
+void Scene::Build()
+{
+    auto start = std::chrono::steady_clock::now();
+
+    size_t built = MeshBvhs.size();
+    MeshBvhs.resize(Meshes.size());
+    CompressedMeshBvhs.resize(Meshes.size());
+    ThreadPool::Instance().ParallelFor(built, Meshes.size(), 1, [this](size_t i) { BuildMeshBvh((unsigned int)i); });
+
+    BuildInstanceBvh();
+
+    buildMilliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+    std::cout << "BVH build (" << BvhBuildModeName(BuildMode) << "): " << buildMilliseconds << " ms, "
+              << TriangleCount() << " triangles, " << Instances.size() << " instances, SAH cost "
+              << MeshSahCost() << " (meshes) " << InstanceBvh.SahCost() << " (instances)" << std::endl;
+
+    size_t binarySize = 0, compressedSize = 0;
+    for (size_t i = 0; i < Meshes.size(); i++)
+    {
+        binarySize += MeshBvhs[i].Nodes.size() * sizeof(BvhNode);
+        compressedSize += CompressedMeshBvhs[i].Nodes.size() * sizeof(CompressedBvhNode);
+    }
+    std::cout << "Mesh BVH nodes: " << binarySize / 1024 << " KB binary, " << compressedSize / 1024 << " KB compressed" << std::endl;
+}
+
+void Scene::SetInstanceTransform(unsigned int instance, const glm::mat4 &toWorld)
+{
+    Instances[instance].ToWorld = toWorld;
+    Instances[instance].ToObject = glm::inverse(toWorld);
+    movedInstances.push_back(instance);
+}
+
+void Scene::MarkTrianglesMoved(unsigned int mesh, const std::vector<unsigned int> &triangles)
+{
+    std::vector<unsigned int> &moved = movedTriangles[mesh];
+    moved.insert(moved.end(), triangles.begin(), triangles.end());
+}
+
+SceneUpdate Scene::Update()
+{
+    SceneUpdate update;
+    std::vector<unsigned int> instances;
+    instances.swap(movedInstances);
+
+    for (auto &entry : movedTriangles)
+    {
+        unsigned int mesh = entry.first;
+        std::vector<unsigned int> &triangles = entry.second;
+        SortUnique(triangles);
+
+        SceneUpdate::MeshChange change;
+        change.Mesh = mesh;
+
+        const TraceGeometry &geometry = Meshes[mesh];
+        for (unsigned int triangle : triangles)
+            for (int k = 0; k < 3; k++)
+                change.Vertices.push_back(geometry.Indices[triangle][k]);
+        SortUnique(change.Vertices);
+
+        Bvh &bvh = MeshBvhs[mesh];
+        Aabb before = bvh.Bounds();
+        std::vector<unsigned int> binaryNodes;
+        bvh.Refit(triangles, [this, mesh](unsigned int triangle) { return TriangleBounds(mesh, triangle); }, binaryNodes);
+
+        if (bvh.Degraded())
+        {
+            BuildMeshBvh(mesh);
+            change.Rebuilt = true;
+        }
+        else
+            CompressedMeshBvhs[mesh].Refit(bvh, binaryNodes, change.Nodes);
+
+        // instances of a mesh whose bounds changed must be refit in the top level too
+        Aabb after = bvh.Bounds();
+        if (before.Min != after.Min || before.Max != after.Max)
+            for (unsigned int i = 0; i < Instances.size(); i++)
+                if (Instances[i].Mesh == mesh)
+                    instances.push_back(i);
+
+        update.Meshes.push_back(std::move(change));
+    }
+    movedTriangles.clear();
+
+    SortUnique(instances);
+    if (!instances.empty())
+    {
+        InstanceBvh.Refit(instances, [this](unsigned int instance) { return InstanceBounds(instance); }, update.InstanceNodes);
+        SortUnique(update.InstanceNodes);
+
+        if (InstanceBvh.Degraded())
+        {
+            BuildInstanceBvh();
+            update.InstanceBvhRebuilt = true;
+            update.InstanceNodes.clear();
+        }
+    }
+    update.Instances = std::move(instances);
+
+    return update;
+}
+
+Aabb Scene::TriangleBounds(unsigned int mesh, unsigned int triangle) const
+{
+    const TraceGeometry &geometry = Meshes[mesh];
+    const glm::uvec3 &face = geometry.Indices[triangle];
+
+    Aabb box;
+    box.Grow(geometry.Positions[face.x]);
+    box.Grow(geometry.Positions[face.y]);
+    box.Grow(geometry.Positions[face.z]);
+    return box;
+}
+
+// Every vertex goes to its side of the plane, every edge crossing it adds the crossing point to both.
+void Scene::SplitTriangle(unsigned int mesh, unsigned int triangle, int axis, float position, Aabb &left, Aabb &right) const
+{
+    const TraceGeometry &geometry = Meshes[mesh];
+    const glm::uvec3 &face = geometry.Indices[triangle];
+
+    for (int k = 0; k < 3; k++)
+    {
+        const glm::vec3 &a = geometry.Positions[face[k]];
+        const glm::vec3 &b = geometry.Positions[face[(k + 1) % 3]];
+
+        if (a[axis] <= position)
+            left.Grow(a);
+        if (a[axis] >= position)
+            right.Grow(a);
+
+        if ((a[axis] < position && b[axis] > position) || (a[axis] > position && b[axis] < position))
+        {
+            glm::vec3 crossing = glm::mix(a, b, (position - a[axis]) / (b[axis] - a[axis]));
+            crossing[axis] = position;
+            left.Grow(crossing);
+            right.Grow(crossing);
+        }
+    }
+}
+
+Aabb Scene::InstanceBounds(unsigned int instance) const
+{
+    unsigned int mesh = Instances[instance].Mesh;
+    Aabb bounds = StreamedMeshes[mesh] ? StreamedMeshes[mesh]->Bounds() : MeshBvhs[mesh].Bounds();
+    return bounds.Transform(Instances[instance].ToWorld);
+}
+
+void Scene::BuildMeshBvh(unsigned int mesh)
+{
+    std::vector<Aabb> bounds(Meshes[mesh].TriangleCount());
+    for (size_t i = 0; i < bounds.size(); i++)
+        bounds[i] = TriangleBounds(mesh, (unsigned int)i);
+
+    if (BuildMode == BvhBuildMode::Spatial)
+        MeshBvhs[mesh].BuildSpatial(bounds, [this, mesh](unsigned int triangle, int axis, float position, Aabb &left, Aabb &right) {
+            SplitTriangle(mesh, triangle, axis, position, left, right);
+        });
+    else
+        MeshBvhs[mesh].Build(bounds, BuildMode);
+
+    CompressedMeshBvhs[mesh].Build(MeshBvhs[mesh]);
+}
+
+void Scene::BuildInstanceBvh()
+{
+    std::vector<Aabb> bounds(Instances.size());
+    for (size_t i = 0; i < bounds.size(); i++)
+        bounds[i] = InstanceBounds((unsigned int)i);
+
+    InstanceBvh.Build(bounds, BuildMode);
+}
+
+void Scene::SortUnique(std::vector<unsigned int> &values)
+{
+    std::sort(values.begin(), values.end());
+    values.erase(std::unique(values.begin(), values.end()), values.end());
+}
+
+bool Scene::Intersect(const Ray &ray, Hit &hit) const
+{
+    hit.Happened = false;
+    float closest = FLT_MAX;
+
+    InstanceBvh.Traverse(ray.Origin, ray.Direction, closest, [&](unsigned int instanceIndex, float &tMax) {
+        const Instance &instance = Instances[instanceIndex];
+        const TraceGeometry &geometry = Meshes[instance.Mesh];
+
+        // the direction is not normalized, so distances stay comparable between instances
+        Ray local;
+        local.Origin = glm::vec3(instance.ToObject * glm::vec4(ray.Origin, 1.0f));
+        local.Direction = glm::vec3(instance.ToObject * glm::vec4(ray.Direction, 0.0f));
+
+        if (StreamedMeshes[instance.Mesh])
+        {
+            StreamedMeshes[instance.Mesh]->Traverse(local.Origin, local.Direction, tMax,
+                                                    [&](const StreamedChunk &chunk, unsigned int localTriangle, unsigned int triangle, float &tMesh) {
+                const glm::uvec3 &face = chunk.Indices[localTriangle];
+                float distance;
+                glm::vec2 barycentric;
+                if (IntersectTriangle(local, chunk.Positions[face.x], chunk.Positions[face.y], chunk.Positions[face.z],
+                                      distance, barycentric) &&
+                    distance < tMesh)
+                {
+                    tMesh = distance;
+                    hit.Happened = true;
+                    hit.Distance = distance;
+                    hit.Barycentric = barycentric;
+                    hit.Instance = instanceIndex;
+                    hit.Triangle = triangle;
+                }
+            });
+            return;
+        }
+
+        CompressedMeshBvhs[instance.Mesh].Traverse(local.Origin, local.Direction, tMax, [&](unsigned int triangle, float &tMesh) {
+            const glm::uvec3 &face = geometry.Indices[triangle];
+            float distance;
+            glm::vec2 barycentric;
+            if (IntersectTriangle(local, geometry.Positions[face.x], geometry.Positions[face.y], geometry.Positions[face.z],
+                                  distance, barycentric) &&
+                distance < tMesh)
+            {
+                tMesh = distance;
+                hit.Happened = true;
+                hit.Distance = distance;
+                hit.Barycentric = barycentric;
+                hit.Instance = instanceIndex;
+                hit.Triangle = triangle;
+            }
+        });
+    });
+
+    return hit.Happened;
+}
+
+bool Scene::GetSurface(const Ray &ray, const Hit &hit, SurfacePoint &surface) const
+{
+    const Instance &instance = Instances[hit.Instance];
+
+    // a streamed triangle is read from its chunk, which is held until the end of the call
+    ChunkCache::Handle chunk;
+    const glm::uvec3 *face;
+    const VertexAttribute *attributes;
+    unsigned int materialID;
+
+    if (StreamedMeshes[instance.Mesh])
+    {
+        const StreamedGeometry &streamed = *StreamedMeshes[instance.Mesh];
+        unsigned int localTriangle = 0;
+        chunk = streamed.FindTriangle(hit.Triangle, localTriangle);
+        if (!chunk || localTriangle >= chunk->Indices.size())
+            return false;
+        face = &chunk->Indices[localTriangle];
+        attributes = chunk->Attributes.data();
+        materialID = chunk->MaterialIDs[localTriangle] + streamed.MaterialOffset;
+    }
+    else
+    {
+        const TraceGeometry &geometry = Meshes[instance.Mesh];
+        face = &geometry.Indices[hit.Triangle];
+        attributes = geometry.Attributes.data();
+        materialID = geometry.MaterialIDs[hit.Triangle];
+    }
+
+    const Material &material = Materials[materialID];
+
+    float u = hit.Barycentric.x;
+    float v = hit.Barycentric.y;
+    float w = 1.0f - u - v;
+
+    glm::vec3 normal = w * Packing::OctDecode(attributes[face->x].Normal) +
+                       u * Packing::OctDecode(attributes[face->y].Normal) +
+                       v * Packing::OctDecode(attributes[face->z].Normal);
+
+    surface.Coords = ray.Origin + ray.Direction * hit.Distance;
+    surface.Normal = glm::normalize(glm::transpose(glm::mat3(instance.ToObject)) * normal);
+    surface.TexCoords = w * Packing::UnpackTexCoords(attributes[face->x].TexCoords) +
+                        u * Packing::UnpackTexCoords(attributes[face->y].TexCoords) +
+                        v * Packing::UnpackTexCoords(attributes[face->z].TexCoords);
+    surface.Kd = material.Kd;
+    surface.IsLight = std::abs(material.Emission - 1.0f) < SCENE_EPSILON;
+
+    return true;
+}
+
+size_t Scene::TriangleCount() const
+{
+    size_t count = 0;
+    for (size_t i = 0; i < Meshes.size(); i++)
+        count += StreamedMeshes[i] ? StreamedMeshes[i]->TriangleCount() : Meshes[i].TriangleCount();
+    return count;
+}
+
+size_t Scene::InstancedTriangleCount() const
+{
+    size_t count = 0;
+    for (const Instance &instance : Instances)
+        count += StreamedMeshes[instance.Mesh] ? StreamedMeshes[instance.Mesh]->TriangleCount() : Meshes[instance.Mesh].TriangleCount();
+    return count;
+}
+
+size_t Scene::MemoryUsage() const
+{
+    size_t size = InstanceBvh.MemoryUsage() + Instances.size() * sizeof(Instance) + Materials.size() * sizeof(Material);
+    for (const TraceGeometry &geometry : Meshes)
+        size += geometry.MemoryUsage();
+    for (const Bvh &bvh : MeshBvhs)
+        size += bvh.MemoryUsage();
+    for (const CompressedBvh &bvh : CompressedMeshBvhs)
+        size += bvh.MemoryUsage();
+    for (const std::shared_ptr<StreamedGeometry> &streamed : StreamedMeshes)
+        if (streamed)
+            size += streamed->ResidentMemory();
+    return size;
+}
+
+float Scene::MeshSahCost() const
+{
+    size_t triangles = 0;
+    double cost = 0.0;
+    for (size_t i = 0; i < MeshBvhs.size(); i++)
+    {
+        triangles += Meshes[i].TriangleCount();
+        cost += (double)MeshBvhs[i].SahCost() * Meshes[i].TriangleCount();
+    }
+
+    if (triangles == 0)
+        return 0.0f;
+
+    return (float)(cost / triangles);
+}
+
+#endif
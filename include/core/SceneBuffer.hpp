@@ -0,0 +1,458 @@
+#ifndef SCENEBUFFER_HPP
+#define SCENEBUFFER_HPP
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include <vector>
+#include <algorithm>
+#include <iostream>
+#include <string>
+
+#include "Geometry.hpp"
+#include "Scene.hpp"
+#include "shader.hpp"
+
+// Feeds a scene to the path tracing shader through buffer textures.
+//
+// Vertices      : RGBA32F, position per vertex, all meshes back to back        (hot)
+// Indices       : RGBA32UI, vertex indices and material per triangle reference (hot)
+// MeshNodes     : RGBA32UI, 5 texels per compressed 8 wide bottom level node    (hot)
+// InstanceNodes : RGBA32UI, 2 texels per top level node                         (hot)
+// Instances     : RGBA32UI, 3 rows of the world to object matrix + root node   (hot)
+// Attributes    : RG32UI, octahedral normal and half uv per vertex             (cold)
+// Materials     : RGBA32F, Kd and emission per material                        (cold)
+// Lights        : RGBA32F, 3 world space vertices per emissive triangle
+//
+// Node and instance texels hold float bits in an integer texture, so the indices packed next to
+// the bounds are never flushed as denormals. Triangles are stored in bottom level BVH order and
+// instances in top level BVH order, which lets leaves address contiguous ranges.
+//
+// Streamed meshes stay on the CPU, so a scene with any is refused and has to go to CpuPathTracer.
+//
+// Update() streams only what a Scene::Update() touched: refit nodes, moved vertices, moved instances
+// and their emitters, each as runs of consecutive elements.
+class SceneBuffer
+{
+private:
+    struct BufferTexture
+    {
+        unsigned int buffer = 0;
+        unsigned int texture = 0;
+    };
+
+    struct PackedNode
+    {
+        glm::uvec4 Min; // bounds min + left child or first primitive
+        glm::uvec4 Max; // bounds max + primitive count
+    };
+
+    struct PackedInstance
+    {
+        glm::uvec4 Rows[3]; // world to object
+        glm::uvec4 Root;    // root node of the mesh BVH
+    };
+
+    struct PackedLight
+    {
+        glm::vec4 Vertices[3];
+    };
+
+    // where a mesh lives in the shared buffers
+    struct MeshSlot
+    {
+        unsigned int firstVertex;
+        unsigned int firstTriangle;
+        unsigned int firstNode;
+        unsigned int root;             // firstNode, or NoNode when the mesh has no nodes on the GPU
+        unsigned int nodeCapacity;
+        unsigned int triangleCapacity; // triangle references, above the triangle count after a spatial split build
+    };
+
+    static const unsigned int NoLights = 0xFFFFFFFFu;
+    static const unsigned int NoNode = 0xFFFFFFFFu;
+
+    BufferTexture vertices;
+    BufferTexture indices;
+    BufferTexture meshNodes;
+    BufferTexture instanceNodes;
+    BufferTexture instances;
+    BufferTexture attributes;
+    BufferTexture materials;
+    BufferTexture lights;
+
+    int instanceCount;
+    int lightCount;
+
+    std::vector<MeshSlot> meshSlots;
+    std::vector<std::vector<unsigned int>> meshEmitters; // emissive triangles of each mesh
+    std::vector<unsigned int> instanceLights;            // first light of each instance, or NoLights
+
+    void UploadBuffer(BufferTexture &target, GLenum internalFormat, size_t size, const void *data);
+    void WriteBuffer(BufferTexture &target, size_t offset, size_t size, const void *data);
+    void BindBuffer(Shader &shader, const char *name, const BufferTexture &target, int unit);
+
+    void UploadInstances(const Scene &scene);
+    void WriteMesh(const Scene &scene, unsigned int mesh);
+    void WriteLights(const Scene &scene, unsigned int instance);
+
+    // Packs and writes the elements at the given sorted slots, one glBufferSubData per run of consecutive slots.
+    template <typename T, typename F>
+    void WriteRuns(BufferTexture &target, const std::vector<unsigned int> &slots, F pack);
+
+    static PackedNode PackNode(const BvhNode &node, unsigned int nodeOffset, unsigned int primOffset);
+    static CompressedBvhNode PackNode(const CompressedBvhNode &node, unsigned int nodeOffset, unsigned int primOffset);
+    static PackedInstance PackInstance(const Instance &instance, unsigned int root);
+    static PackedLight PackLight(const Scene &scene, const Instance &instance, unsigned int triangle);
+
+public:
+    SceneBuffer();
+
+    // Expects scene.Build() to have run. False, with nothing uploaded, when the scene has streamed meshes.
+    bool Upload(const Scene &scene);
+
+    // Re-uploads what the update touched. Falls back to Upload() when a rebuilt mesh BVH outgrew its slot.
+    void Update(const Scene &scene, const SceneUpdate &update);
+
+    void Bind(Shader &shader);
+
+    // The traversal stack the mesh trees of the scene need, to compile the shader with through
+    // ShaderDefines(). A rebuild in Scene::Update() may raise it, the shader is compiled again then.
+    static int MeshStackSize(const Scene &scene);
+    static std::string ShaderDefines(int meshStackSize) { return "#define MESH_STACK_SIZE " + std::to_string(meshStackSize) + "\n"; }
+};
+
+SceneBuffer::SceneBuffer() : instanceCount(0), lightCount(0)
+{
+}
+
+int SceneBuffer::MeshStackSize(const Scene &scene)
+{
+    int stackSize = 1;
+    for (const CompressedBvh &bvh : scene.CompressedMeshBvhs)
+        stackSize = std::max(stackSize, bvh.StackSize);
+    return stackSize;
+}
+
+bool SceneBuffer::Upload(const Scene &scene)
+{
+    size_t streamed = std::count_if(scene.StreamedMeshes.begin(), scene.StreamedMeshes.end(),
+                                    [](const std::shared_ptr<StreamedGeometry> &mesh) { return mesh != nullptr; });
+    if (streamed > 0)
+    {
+        std::cout << "ERROR::SCENEBUFFER:: " << streamed << " streamed meshes can only be traced on the CPU" << std::endl;
+        return false;
+    }
+
+    // RGB32F/RGB32UI buffer textures need GL 4.0, so the hot streams are padded to 4 components.
+    // The padding of the index stream carries the material ID for free.
+    std::vector<glm::vec4> vertexData;
+    std::vector<glm::uvec4> indexData;
+    std::vector<VertexAttribute> attributeData;
+    std::vector<CompressedBvhNode> meshNodeData;
+
+    size_t vertexCount = 0;
+    for (const TraceGeometry &geometry : scene.Meshes)
+        vertexCount += geometry.VertexCount();
+    vertexData.reserve(vertexCount);
+    attributeData.reserve(vertexCount);
+    indexData.reserve(scene.TriangleCount());
+
+    meshSlots.resize(scene.Meshes.size());
+    meshEmitters.assign(scene.Meshes.size(), std::vector<unsigned int>());
+
+    for (size_t m = 0; m < scene.Meshes.size(); m++)
+    {
+        const TraceGeometry &geometry = scene.Meshes[m];
+        const CompressedBvh &bvh = scene.CompressedMeshBvhs[m];
+
+        MeshSlot &slot = meshSlots[m];
+        slot.firstVertex = (unsigned int)vertexData.size();
+        slot.firstTriangle = (unsigned int)indexData.size();
+        slot.firstNode = (unsigned int)meshNodeData.size();
+        slot.root = bvh.Empty() ? (unsigned int)NoNode : slot.firstNode;
+        slot.nodeCapacity = (unsigned int)bvh.Nodes.size();
+        slot.triangleCapacity = (unsigned int)bvh.PrimIndices.size();
+
+        for (size_t i = 0; i < geometry.VertexCount(); i++)
+            vertexData.push_back(glm::vec4(geometry.Positions[i], 1.0f));
+        attributeData.insert(attributeData.end(), geometry.Attributes.begin(), geometry.Attributes.end());
+
+        for (const CompressedBvhNode &node : bvh.Nodes)
+            meshNodeData.push_back(PackNode(node, slot.firstNode, slot.firstTriangle));
+
+        for (unsigned int triangle : bvh.PrimIndices)
+            indexData.push_back(glm::uvec4(geometry.Indices[triangle] + slot.firstVertex, geometry.MaterialIDs[triangle]));
+
+        for (unsigned int i = 0; i < geometry.TriangleCount(); i++)
+            if (scene.Materials[geometry.MaterialIDs[i]].Emission > 0.0f)
+                meshEmitters[m].push_back(i);
+    }
+
+    // emissive triangles are few, so they are flattened to world space
+    std::vector<PackedLight> lightData;
+    instanceLights.assign(scene.Instances.size(), (unsigned int)NoLights);
+    for (unsigned int i = 0; i < scene.Instances.size(); i++)
+    {
+        const Instance &instance = scene.Instances[i];
+        if (meshEmitters[instance.Mesh].empty())
+            continue;
+
+        instanceLights[i] = (unsigned int)lightData.size();
+        for (unsigned int triangle : meshEmitters[instance.Mesh])
+            lightData.push_back(PackLight(scene, instance, triangle));
+    }
+
+    std::vector<glm::vec4> materialData(scene.Materials.size());
+    for (size_t i = 0; i < scene.Materials.size(); i++)
+        materialData[i] = glm::vec4(scene.Materials[i].Kd, scene.Materials[i].Emission);
+
+    UploadBuffer(vertices, GL_RGBA32F, vertexData.size() * sizeof(glm::vec4), vertexData.data());
+    UploadBuffer(indices, GL_RGBA32UI, indexData.size() * sizeof(glm::uvec4), indexData.data());
+    UploadBuffer(meshNodes, GL_RGBA32UI, meshNodeData.size() * sizeof(CompressedBvhNode), meshNodeData.data());
+    UploadBuffer(attributes, GL_RG32UI, attributeData.size() * sizeof(VertexAttribute), attributeData.data());
+    UploadBuffer(materials, GL_RGBA32F, materialData.size() * sizeof(glm::vec4), materialData.data());
+    UploadBuffer(lights, GL_RGBA32F, lightData.size() * sizeof(PackedLight), lightData.data());
+    UploadInstances(scene);
+
+    instanceCount = (int)scene.Instances.size();
+    lightCount = (int)lightData.size();
+    return true;
+}
+
+void SceneBuffer::Update(const Scene &scene, const SceneUpdate &update)
+{
+    if (update.Empty())
+        return;
+
+    std::vector<unsigned int> movedInstances = update.Instances;
+
+    for (const SceneUpdate::MeshChange &change : update.Meshes)
+    {
+        const MeshSlot &slot = meshSlots[change.Mesh];
+        const TraceGeometry &geometry = scene.Meshes[change.Mesh];
+
+        const CompressedBvh &rebuilt = scene.CompressedMeshBvhs[change.Mesh];
+        if (change.Rebuilt && (rebuilt.Nodes.size() > slot.nodeCapacity || rebuilt.PrimIndices.size() > slot.triangleCapacity))
+        {
+            Upload(scene);
+            return;
+        }
+
+        std::vector<unsigned int> vertexSlots(change.Vertices.size());
+        for (size_t i = 0; i < change.Vertices.size(); i++)
+            vertexSlots[i] = slot.firstVertex + change.Vertices[i];
+        WriteRuns<glm::vec4>(vertices, vertexSlots, [&](unsigned int v) { return glm::vec4(geometry.Positions[v - slot.firstVertex], 1.0f); });
+
+        if (change.Rebuilt)
+            WriteMesh(scene, change.Mesh);
+        else
+        {
+            const CompressedBvh &bvh = scene.CompressedMeshBvhs[change.Mesh];
+            std::vector<unsigned int> nodeSlots(change.Nodes.size());
+            for (size_t i = 0; i < change.Nodes.size(); i++)
+                nodeSlots[i] = slot.firstNode + change.Nodes[i];
+            WriteRuns<CompressedBvhNode>(meshNodes, nodeSlots, [&](unsigned int n) {
+                return PackNode(bvh.Nodes[n - slot.firstNode], slot.firstNode, slot.firstTriangle);
+            });
+        }
+
+        // emitters of a deformed mesh move even when its bounds do not
+        if (!meshEmitters[change.Mesh].empty())
+            for (unsigned int i = 0; i < scene.Instances.size(); i++)
+                if (scene.Instances[i].Mesh == change.Mesh)
+                    movedInstances.push_back(i);
+    }
+
+    if (update.InstanceBvhRebuilt)
+        UploadInstances(scene);
+    else if (!update.Instances.empty())
+    {
+        const Bvh &bvh = scene.InstanceBvh;
+        WriteRuns<PackedNode>(instanceNodes, update.InstanceNodes, [&](unsigned int n) { return PackNode(bvh.Nodes[n], 0, 0); });
+
+        // instances are stored in top level order, so their slots are found through the primitive order
+        std::vector<unsigned int> instanceSlots;
+        std::vector<bool> moved(scene.Instances.size(), false);
+        for (unsigned int i : update.Instances)
+            moved[i] = true;
+        for (unsigned int slot = 0; slot < bvh.PrimIndices.size(); slot++)
+            if (moved[bvh.PrimIndices[slot]])
+                instanceSlots.push_back(slot);
+
+        WriteRuns<PackedInstance>(instances, instanceSlots, [&](unsigned int slot) {
+            const Instance &instance = scene.Instances[bvh.PrimIndices[slot]];
+            return PackInstance(instance, meshSlots[instance.Mesh].root);
+        });
+    }
+
+    std::sort(movedInstances.begin(), movedInstances.end());
+    movedInstances.erase(std::unique(movedInstances.begin(), movedInstances.end()), movedInstances.end());
+    for (unsigned int i : movedInstances)
+        WriteLights(scene, i);
+}
+
+void SceneBuffer::UploadInstances(const Scene &scene)
+{
+    const Bvh &bvh = scene.InstanceBvh;
+
+    std::vector<PackedNode> nodeData;
+    nodeData.reserve(bvh.Nodes.size());
+    for (const BvhNode &node : bvh.Nodes)
+        nodeData.push_back(PackNode(node, 0, 0));
+
+    std::vector<PackedInstance> instanceData;
+    instanceData.reserve(bvh.PrimIndices.size());
+    for (unsigned int index : bvh.PrimIndices)
+    {
+        const Instance &instance = scene.Instances[index];
+        instanceData.push_back(PackInstance(instance, meshSlots[instance.Mesh].root));
+    }
+
+    UploadBuffer(instanceNodes, GL_RGBA32UI, nodeData.size() * sizeof(PackedNode), nodeData.data());
+    UploadBuffer(instances, GL_RGBA32UI, instanceData.size() * sizeof(PackedInstance), instanceData.data());
+}
+
+// Rewrites the nodes and the triangle order of a mesh whose BVH was rebuilt in place.
+void SceneBuffer::WriteMesh(const Scene &scene, unsigned int mesh)
+{
+    const MeshSlot &slot = meshSlots[mesh];
+    const TraceGeometry &geometry = scene.Meshes[mesh];
+    const CompressedBvh &bvh = scene.CompressedMeshBvhs[mesh];
+
+    std::vector<CompressedBvhNode> nodeData;
+    nodeData.reserve(bvh.Nodes.size());
+    for (const CompressedBvhNode &node : bvh.Nodes)
+        nodeData.push_back(PackNode(node, slot.firstNode, slot.firstTriangle));
+
+    std::vector<glm::uvec4> indexData;
+    indexData.reserve(bvh.PrimIndices.size());
+    for (unsigned int triangle : bvh.PrimIndices)
+        indexData.push_back(glm::uvec4(geometry.Indices[triangle] + slot.firstVertex, geometry.MaterialIDs[triangle]));
+
+    WriteBuffer(meshNodes, slot.firstNode * sizeof(CompressedBvhNode), nodeData.size() * sizeof(CompressedBvhNode), nodeData.data());
+    WriteBuffer(indices, slot.firstTriangle * sizeof(glm::uvec4), indexData.size() * sizeof(glm::uvec4), indexData.data());
+}
+
+void SceneBuffer::WriteLights(const Scene &scene, unsigned int instance)
+{
+    if (instanceLights[instance] == NoLights)
+        return;
+
+    const Instance &target = scene.Instances[instance];
+    std::vector<PackedLight> lightData;
+    for (unsigned int triangle : meshEmitters[target.Mesh])
+        lightData.push_back(PackLight(scene, target, triangle));
+
+    WriteBuffer(lights, instanceLights[instance] * sizeof(PackedLight), lightData.size() * sizeof(PackedLight), lightData.data());
+}
+
+template <typename T, typename F>
+void SceneBuffer::WriteRuns(BufferTexture &target, const std::vector<unsigned int> &slots, F pack)
+{
+    std::vector<T> run;
+    for (size_t i = 0; i < slots.size(); i++)
+    {
+        run.push_back(pack(slots[i]));
+
+        if (i + 1 == slots.size() || slots[i + 1] != slots[i] + 1)
+        {
+            size_t first = slots[i] + 1 - run.size();
+            WriteBuffer(target, first * sizeof(T), run.size() * sizeof(T), run.data());
+            run.clear();
+        }
+    }
+}
+
+// Interior children and leaf ranges are rebased so the shader can index the shared buffers directly.
+SceneBuffer::PackedNode SceneBuffer::PackNode(const BvhNode &node, unsigned int nodeOffset, unsigned int primOffset)
+{
+    unsigned int leftFirst = node.IsLeaf() ? node.LeftFirst + primOffset : node.LeftFirst + nodeOffset;
+
+    PackedNode packed;
+    packed.Min = glm::uvec4(glm::floatBitsToUint(node.Min), leftFirst);
+    packed.Max = glm::uvec4(glm::floatBitsToUint(node.Max), node.Count);
+    return packed;
+}
+
+CompressedBvhNode SceneBuffer::PackNode(const CompressedBvhNode &node, unsigned int nodeOffset, unsigned int primOffset)
+{
+    CompressedBvhNode packed = node;
+    packed.ChildBase += nodeOffset;
+    packed.PrimBase += primOffset;
+    return packed;
+}
+
+SceneBuffer::PackedInstance SceneBuffer::PackInstance(const Instance &instance, unsigned int root)
+{
+    glm::mat4 rows = glm::transpose(instance.ToObject);
+
+    PackedInstance packed;
+    for (int r = 0; r < 3; r++)
+        packed.Rows[r] = glm::floatBitsToUint(rows[r]);
+    packed.Root = glm::uvec4(root, 0, 0, 0);
+    return packed;
+}
+
+SceneBuffer::PackedLight SceneBuffer::PackLight(const Scene &scene, const Instance &instance, unsigned int triangle)
+{
+    const TraceGeometry &geometry = scene.Meshes[instance.Mesh];
+
+    PackedLight packed;
+    for (int k = 0; k < 3; k++)
+        packed.Vertices[k] = instance.ToWorld * glm::vec4(geometry.Positions[geometry.Indices[triangle][k]], 1.0f);
+    return packed;
+}
+
+void SceneBuffer::Bind(Shader &shader)
+{
+    shader.use();
+    BindBuffer(shader, "Vertices", vertices, 0);
+    BindBuffer(shader, "Indices", indices, 1);
+    BindBuffer(shader, "MeshNodes", meshNodes, 2);
+    BindBuffer(shader, "InstanceNodes", instanceNodes, 3);
+    BindBuffer(shader, "Instances", instances, 4);
+    BindBuffer(shader, "Attributes", attributes, 5);
+    BindBuffer(shader, "Materials", materials, 6);
+    BindBuffer(shader, "Lights", lights, 7);
+    shader.setInt("InstanceCount", instanceCount);
+    shader.setInt("LightCount", lightCount);
+}
+
+void SceneBuffer::UploadBuffer(BufferTexture &target, GLenum internalFormat, size_t size, const void *data)
+{
+    if (target.buffer == 0)
+    {
+        glGenBuffers(1, &target.buffer);
+        glGenTextures(1, &target.texture);
+    }
+
+    glBindBuffer(GL_TEXTURE_BUFFER, target.buffer);
+    glBufferData(GL_TEXTURE_BUFFER, size, data, GL_STATIC_DRAW);
+
+    glBindTexture(GL_TEXTURE_BUFFER, target.texture);
+    glTexBuffer(GL_TEXTURE_BUFFER, internalFormat, target.buffer);
+
+    glBindBuffer(GL_TEXTURE_BUFFER, 0);
+    glBindTexture(GL_TEXTURE_BUFFER, 0);
+}
+
+void SceneBuffer::WriteBuffer(BufferTexture &target, size_t offset, size_t size, const void *data)
+{
+    if (size == 0)
+        return;
+
+    glBindBuffer(GL_TEXTURE_BUFFER, target.buffer);
+    glBufferSubData(GL_TEXTURE_BUFFER, offset, size, data);
+    glBindBuffer(GL_TEXTURE_BUFFER, 0);
+}
+
+void SceneBuffer::BindBuffer(Shader &shader, const char *name, const BufferTexture &target, int unit)
+{
+    glActiveTexture(GL_TEXTURE0 + unit);
+    glBindTexture(GL_TEXTURE_BUFFER, target.texture);
+    shader.setInt(name, unit);
+    glActiveTexture(GL_TEXTURE0);
+}
+
+#endif
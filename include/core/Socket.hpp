@@ -0,0 +1,300 @@
+#ifndef SOCKET_HPP
+#define SOCKET_HPP
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <afunix.h>
+#else
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Blocking stream socket, just enough for the render workers and their coordinator to talk over
+// the loopback interface, and for clients to reach the render daemon over a Unix domain socket.
+// Owns its handle, closes it on destruction, moves but does not copy.
+//
+// Packets are a type and a byte count, then the bytes; both ends run on the same architecture,
+// so numbers go as they are in memory.
+class Socket
+{
+public:
+#ifdef _WIN32
+    typedef SOCKET Handle;
+#else
+    typedef int Handle;
+#endif
+
+    Socket() = default;
+    explicit Socket(Handle handle) : handle(handle) {}
+    Socket(Socket &&other) : handle(other.handle) { other.handle = Invalid(); }
+    Socket &operator=(Socket &&other);
+    Socket(const Socket &) = delete;
+    Socket &operator=(const Socket &) = delete;
+    ~Socket() { Close(); }
+
+    // Once per process before the first socket, WSAStartup on Windows.
+    static bool Startup();
+
+    // Listens on the loopback interface.
+    static Socket Listen(unsigned short port, int backlog = 16);
+    static Socket Connect(const std::string &host, unsigned short port);
+    // Unix domain socket at path, a stale socket file left there is replaced.
+    static Socket ListenLocal(const std::string &path, int backlog = 16);
+    static Socket ConnectLocal(const std::string &path);
+    Socket Accept() const;
+
+    bool Valid() const { return handle != Invalid(); }
+    Handle Native() const { return handle; }
+    void Close();
+
+    // Sends and receives that make no progress for this long fail, instead of blocking; 0 blocks.
+    bool SetTimeout(unsigned int milliseconds) const;
+
+    bool SendAll(const void *data, size_t size) const;
+    bool ReceiveAll(void *data, size_t size) const;
+
+    bool SendPacket(uint32_t type, const void *payload, size_t size) const;
+    bool SendPacket(uint32_t type, const std::vector<char> &payload) const { return SendPacket(type, payload.data(), payload.size()); }
+    // False when the peer has gone, or announces a payload above maxSize, which is not read.
+    bool ReceivePacket(uint32_t &type, std::vector<char> &payload, size_t maxSize = SIZE_MAX) const;
+
+private:
+#ifdef _WIN32
+    static Handle Invalid() { return INVALID_SOCKET; }
+#else
+    static Handle Invalid() { return -1; }
+#endif
+
+    static bool LocalAddress(const std::string &path, sockaddr_un &address);
+
+    Handle handle = Invalid();
+};
+
+Socket &Socket::operator=(Socket &&other)
+{
+    if (this != &other)
+    {
+        Close();
+        handle = other.handle;
+        other.handle = Invalid();
+    }
+    return *this;
+}
+
+bool Socket::Startup()
+{
+#ifdef _WIN32
+    WSADATA data;
+    if (WSAStartup(MAKEWORD(2, 2), &data) != 0)
+    {
+        std::cout << "ERROR::SOCKET:: WSAStartup failed" << std::endl;
+        return false;
+    }
+#endif
+    return true;
+}
+
+Socket Socket::Listen(unsigned short port, int backlog)
+{
+    Socket socket(::socket(AF_INET, SOCK_STREAM, IPPROTO_TCP));
+    if (!socket.Valid())
+        return socket;
+
+    int reuse = 1;
+    setsockopt(socket.handle, SOL_SOCKET, SO_REUSEADDR, (const char *)&reuse, sizeof(reuse));
+
+    sockaddr_in address;
+    std::memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (bind(socket.handle, (const sockaddr *)&address, sizeof(address)) != 0 || listen(socket.handle, backlog) != 0)
+    {
+        std::cout << "ERROR::SOCKET:: Failed to listen on port " << port << std::endl;
+        socket.Close();
+    }
+    return socket;
+}
+
+Socket Socket::Connect(const std::string &host, unsigned short port)
+{
+    Socket socket(::socket(AF_INET, SOCK_STREAM, IPPROTO_TCP));
+    if (!socket.Valid())
+        return socket;
+
+    sockaddr_in address;
+    std::memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    inet_pton(AF_INET, host.c_str(), &address.sin_addr);
+
+    if (connect(socket.handle, (const sockaddr *)&address, sizeof(address)) != 0)
+    {
+        std::cout << "ERROR::SOCKET:: Failed to connect to " << host << ":" << port << std::endl;
+        socket.Close();
+        return socket;
+    }
+
+    // requests are small and answered at once
+    int noDelay = 1;
+    setsockopt(socket.handle, IPPROTO_TCP, TCP_NODELAY, (const char *)&noDelay, sizeof(noDelay));
+    return socket;
+}
+
+bool Socket::LocalAddress(const std::string &path, sockaddr_un &address)
+{
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(address.sun_path))
+    {
+        std::cout << "ERROR::SOCKET:: Bad socket path " << path << std::endl;
+        return false;
+    }
+    std::memcpy(address.sun_path, path.c_str(), path.size());
+    return true;
+}
+
+Socket Socket::ListenLocal(const std::string &path, int backlog)
+{
+    sockaddr_un address;
+    if (!LocalAddress(path, address))
+        return Socket();
+
+    Socket socket(::socket(AF_UNIX, SOCK_STREAM, 0));
+    if (!socket.Valid())
+        return socket;
+
+    std::remove(path.c_str());
+    if (bind(socket.handle, (const sockaddr *)&address, sizeof(address)) != 0 || listen(socket.handle, backlog) != 0)
+    {
+        std::cout << "ERROR::SOCKET:: Failed to listen on " << path << std::endl;
+        socket.Close();
+    }
+    return socket;
+}
+
+Socket Socket::ConnectLocal(const std::string &path)
+{
+    sockaddr_un address;
+    if (!LocalAddress(path, address))
+        return Socket();
+
+    Socket socket(::socket(AF_UNIX, SOCK_STREAM, 0));
+    if (!socket.Valid())
+        return socket;
+
+    if (connect(socket.handle, (const sockaddr *)&address, sizeof(address)) != 0)
+    {
+        std::cout << "ERROR::SOCKET:: Failed to connect to " << path << std::endl;
+        socket.Close();
+    }
+    return socket;
+}
+
+Socket Socket::Accept() const
+{
+    Socket accepted(accept(handle, nullptr, nullptr));
+    // fails harmlessly on a Unix domain socket
+    if (accepted.Valid())
+    {
+        int noDelay = 1;
+        setsockopt(accepted.handle, IPPROTO_TCP, TCP_NODELAY, (const char *)&noDelay, sizeof(noDelay));
+    }
+    return accepted;
+}
+
+void Socket::Close()
+{
+    if (!Valid())
+        return;
+#ifdef _WIN32
+    closesocket(handle);
+#else
+    close(handle);
+#endif
+    handle = Invalid();
+}
+
+bool Socket::SetTimeout(unsigned int milliseconds) const
+{
+#ifdef _WIN32
+    DWORD timeout = milliseconds;
+#else
+    timeval timeout = {(time_t)(milliseconds / 1000), (suseconds_t)(milliseconds % 1000 * 1000)};
+#endif
+    return setsockopt(handle, SOL_SOCKET, SO_RCVTIMEO, (const char *)&timeout, sizeof(timeout)) == 0 &&
+           setsockopt(handle, SOL_SOCKET, SO_SNDTIMEO, (const char *)&timeout, sizeof(timeout)) == 0;
+}
+
+bool Socket::SendAll(const void *data, size_t size) const
+{
+    // a peer that has gone is an error to report, not a SIGPIPE
+#ifdef MSG_NOSIGNAL
+    const int flags = MSG_NOSIGNAL;
+#else
+    const int flags = 0;
+#endif
+
+    const char *bytes = (const char *)data;
+    while (size > 0)
+    {
+        int sent = (int)send(handle, bytes, (int)std::min(size, (size_t)1 << 30), flags);
+        if (sent <= 0)
+            return false;
+        bytes += sent;
+        size -= sent;
+    }
+    return true;
+}
+
+bool Socket::ReceiveAll(void *data, size_t size) const
+{
+    char *bytes = (char *)data;
+    while (size > 0)
+    {
+        int received = (int)recv(handle, bytes, (int)std::min(size, (size_t)1 << 30), 0);
+        if (received <= 0)
+            return false;
+        bytes += received;
+        size -= received;
+    }
+    return true;
+}
+
+bool Socket::SendPacket(uint32_t type, const void *payload, size_t size) const
+{
+    uint32_t header[2] = {type, (uint32_t)size};
+    return SendAll(header, sizeof(header)) && SendAll(payload, size);
+}
+
+bool Socket::ReceivePacket(uint32_t &type, std::vector<char> &payload, size_t maxSize) const
+{
+    uint32_t header[2];
+    if (!ReceiveAll(header, sizeof(header)))
+        return false;
+    if (header[1] > maxSize)
+    {
+        std::cout << "ERROR::SOCKET:: A packet of " << header[1] << " bytes is over the limit of " << maxSize << std::endl;
+        return false;
+    }
+    type = header[0];
+    payload.resize(header[1]);
+    return ReceiveAll(payload.data(), payload.size());
+}
+
+#endif
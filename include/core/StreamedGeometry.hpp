@@ -0,0 +1,602 @@
+#ifndef STREAMEDGEOMETRY_HPP
+#define STREAMEDGEOMETRY_HPP
+
+#include <glm/glm.hpp>
+
+#include <string>
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <memory>
+#include <future>
+#include <mutex>
+#include <atomic>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+#include "Geometry.hpp"
+#include "Bvh.hpp"
+
+// A BVH clustered piece of a streamed mesh: one subtree and the triangles of its leaves.
+// Node leaves index Indices directly, vertices are local to the chunk.
+struct StreamedChunk
+{
+    std::vector<BvhNode> Nodes;
+    std::vector<glm::vec3> Positions;
+    std::vector<glm::uvec3> Indices;
+    std::vector<VertexAttribute> Attributes;
+    std::vector<unsigned int> MaterialIDs;
+
+    size_t MemoryUsage() const
+    {
+        return Nodes.size() * sizeof(BvhNode) + Positions.size() * sizeof(glm::vec3) + Indices.size() * sizeof(glm::uvec3) +
+               Attributes.size() * sizeof(VertexAttribute) + MaterialIDs.size() * sizeof(unsigned int);
+    }
+};
+
+// LRU cache of streamed chunks under a byte budget, shared by every streamed mesh.
+// Chunks are loaded outside the lock; a chunk requested by several threads at once is read once.
+// Evicted chunks stay alive until the last handle to them is dropped.
+class ChunkCache
+{
+public:
+    typedef std::shared_ptr<const StreamedChunk> Handle;
+
+    static const size_t DefaultBudget = (size_t)512 << 20;
+
+    explicit ChunkCache(size_t budget = DefaultBudget) : budget(budget), usage(0), hits(0), misses(0), evictions(0) {}
+
+    void SetBudget(size_t bytes);
+
+    size_t Budget() const { return budget; }
+    size_t Usage() const { return usage; }
+
+    // Returns the cached chunk for key, or calls load() to read it. load() returns null on failure.
+    template <typename F>
+    Handle Get(uint64_t key, F load);
+
+    void PrintStats() const;
+
+    static ChunkCache &Instance();
+
+private:
+    struct Entry
+    {
+        std::shared_future<Handle> chunk;
+        std::list<uint64_t>::iterator position;
+        size_t size; // 0 while loading
+    };
+
+    mutable std::mutex mutex;
+    std::unordered_map<uint64_t, Entry> entries;
+    std::list<uint64_t> lru; // most recent first
+    size_t budget;
+    size_t usage;
+    size_t hits;
+    size_t misses;
+    size_t evictions;
+
+    void EvictLocked();
+};
+
+// Out-of-core mesh. The file holds page aligned chunks, each a subtree of the mesh BVH small enough
+// for ChunkBytes, under a resident top tree whose leaves name the chunks. Open() reads only the top
+// tree and the chunk table; chunks are streamed in through ChunkCache on first touch.
+//
+// Triangle IDs are positions in chunk order, so they differ from those of the source geometry.
+// Streamed meshes are static and traced on the CPU only.
+class StreamedGeometry
+{
+public:
+    static const size_t ChunkBytes = 64 << 10;
+    static const size_t PageSize = 4 << 10;
+
+    unsigned int MaterialOffset = 0; // added to the stored material IDs
+
+    // Clusters the geometry along its BVH and writes it to path. Returns false on I/O errors.
+    static bool Write(const std::string &path, const TraceGeometry &geometry, const Bvh &bvh, size_t chunkBytes = ChunkBytes);
+
+    bool Open(const std::string &path, ChunkCache &cache = ChunkCache::Instance());
+
+    Aabb Bounds() const;
+
+    size_t TriangleCount() const { return header.TriangleCount; }
+
+    size_t ChunkCount() const { return chunks.size(); }
+
+    // Top tree and chunk table, the part that never leaves memory.
+    size_t ResidentMemory() const { return topNodes.size() * sizeof(BvhNode) + chunks.size() * sizeof(ChunkRecord); }
+
+    // Calls intersect(chunk, localTriangle, triangle, tMax) for every triangle whose leaf the ray
+    // reaches, nearest first. Chunks that fail to load are skipped.
+    template <typename F>
+    void Traverse(const glm::vec3 &origin, const glm::vec3 &direction, float &tMax, F intersect) const;
+
+    // The chunk holding a triangle, loading it again if it was evicted.
+    ChunkCache::Handle FindTriangle(unsigned int triangle, unsigned int &localTriangle) const;
+
+private:
+    struct FileHeader
+    {
+        char Magic[4];
+        uint32_t Version;
+        uint32_t TriangleCount;
+        uint32_t ChunkCount;
+        uint32_t TopNodeCount;
+        uint32_t Reserved;
+        glm::vec3 Min;
+        glm::vec3 Max;
+    };
+
+    struct ChunkRecord
+    {
+        uint64_t Offset;
+        uint32_t Size;
+        uint32_t FirstTriangle;
+    };
+
+    struct ChunkHeader
+    {
+        uint32_t NodeCount;
+        uint32_t TriangleCount;
+        uint32_t VertexCount;
+        uint32_t Reserved;
+    };
+
+    static const uint32_t Version = 1;
+    static const size_t EstimatedTriangleBytes = 96; // indices, material, about 1.5 vertices and half a node
+
+    FileHeader header = {};
+    std::vector<BvhNode> topNodes; // leaves: LeftFirst is the chunk, Count is 1
+    std::vector<ChunkRecord> chunks;
+
+    std::string path;
+    mutable std::ifstream file;
+    mutable std::mutex fileMutex;
+    mutable std::atomic<bool> reportedFailure{false};
+    ChunkCache *cache = nullptr;
+    uint64_t id = 0;
+
+    ChunkCache::Handle Acquire(unsigned int chunk) const;
+    std::shared_ptr<StreamedChunk> Load(unsigned int chunk) const;
+
+    static bool ValidNodes(const std::vector<BvhNode> &nodes, uint64_t leafLimit);
+    static void BuildChunk(const TraceGeometry &geometry, const Bvh &bvh, unsigned int root, StreamedChunk &chunk);
+    static std::vector<char> Serialize(const StreamedChunk &chunk);
+
+    static uint64_t NextID();
+};
+
+// ChunkCache-------------------------------------------------------------------------------------------
+
+void ChunkCache::SetBudget(size_t bytes)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    budget = bytes;
+    EvictLocked();
+}
+
+template <typename F>
+ChunkCache::Handle ChunkCache::Get(uint64_t key, F load)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    auto found = entries.find(key);
+    if (found != entries.end())
+    {
+        hits++;
+        lru.splice(lru.begin(), lru, found->second.position);
+        std::shared_future<Handle> pending = found->second.chunk;
+        lock.unlock();
+        return pending.get();
+    }
+
+    misses++;
+    std::promise<Handle> promise;
+    lru.push_front(key);
+    entries[key] = {promise.get_future().share(), lru.begin(), 0};
+    lock.unlock();
+
+    Handle chunk = load();
+    promise.set_value(chunk);
+
+    lock.lock();
+    found = entries.find(key);
+    if (found != entries.end())
+    {
+        if (!chunk)
+        {
+            // forget failures so a later request tries again
+            lru.erase(found->second.position);
+            entries.erase(found);
+        }
+        else
+        {
+            found->second.size = chunk->MemoryUsage();
+            usage += found->second.size;
+            EvictLocked();
+        }
+    }
+
+    return chunk;
+}
+
+// Chunks still loading have no size yet and are skipped.
+void ChunkCache::EvictLocked()
+{
+    auto position = lru.end();
+    while (usage > budget && position != lru.begin())
+    {
+        --position;
+        auto found = entries.find(*position);
+        if (found->second.size == 0)
+            continue;
+
+        usage -= found->second.size;
+        evictions++;
+        entries.erase(found);
+        position = lru.erase(position);
+    }
+}
+
+void ChunkCache::PrintStats() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    std::cout << "Chunk cache: " << usage / 1024 << " KB of " << budget / 1024 << " KB, " << entries.size() << " chunks, "
+              << hits << " hits, " << misses << " misses, " << evictions << " evictions" << std::endl;
+}
+
+ChunkCache &ChunkCache::Instance()
+{
+    static ChunkCache cache;
+    return cache;
+}
+
+// StreamedGeometry-------------------------------------------------------------------------------------
+
+bool StreamedGeometry::Write(const std::string &path, const TraceGeometry &geometry, const Bvh &bvh, size_t chunkBytes)
+{
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    if (!out)
+    {
+        std::cout << "StreamedGeometry: cannot write " << path << std::endl;
+        return false;
+    }
+
+    // primitive references below every node, children always follow their parent in Nodes
+    std::vector<size_t> subtreeCounts(bvh.Nodes.size(), 0);
+    for (size_t i = bvh.Nodes.size(); i-- > 0;)
+    {
+        const BvhNode &node = bvh.Nodes[i];
+        subtreeCounts[i] = node.IsLeaf() ? node.Count : subtreeCounts[node.LeftFirst] + subtreeCounts[node.LeftFirst + 1];
+    }
+
+    // cut the tree where a subtree fits a chunk; the nodes above become the resident top tree,
+    // renumbered so siblings stay adjacent
+    std::vector<BvhNode> topNodes;
+    std::vector<unsigned int> chunkRoots;
+    if (!bvh.Empty())
+    {
+        std::vector<std::pair<unsigned int, unsigned int>> pending; // source node, top node
+        topNodes.push_back(bvh.Nodes[0]);
+        pending.push_back({0, 0});
+
+        while (!pending.empty())
+        {
+            unsigned int source = pending.back().first;
+            unsigned int target = pending.back().second;
+            pending.pop_back();
+
+            const BvhNode &node = bvh.Nodes[source];
+            if (node.IsLeaf() || subtreeCounts[source] * EstimatedTriangleBytes <= chunkBytes)
+            {
+                topNodes[target].LeftFirst = (unsigned int)chunkRoots.size();
+                topNodes[target].Count = 1;
+                chunkRoots.push_back(source);
+                continue;
+            }
+
+            unsigned int left = (unsigned int)topNodes.size();
+            topNodes.push_back(bvh.Nodes[node.LeftFirst]);
+            topNodes.push_back(bvh.Nodes[node.LeftFirst + 1]);
+            topNodes[target].LeftFirst = left;
+            topNodes[target].Count = 0;
+            pending.push_back({node.LeftFirst + 1, left + 1});
+            pending.push_back({node.LeftFirst, left});
+        }
+    }
+
+    FileHeader fileHeader = {};
+    std::memcpy(fileHeader.Magic, "SPTC", 4);
+    fileHeader.Version = Version;
+    fileHeader.ChunkCount = (uint32_t)chunkRoots.size();
+    fileHeader.TopNodeCount = (uint32_t)topNodes.size();
+    Aabb bounds = bvh.Bounds();
+    fileHeader.Min = bounds.Min;
+    fileHeader.Max = bounds.Max;
+
+    size_t tableEnd = sizeof(FileHeader) + topNodes.size() * sizeof(BvhNode) + chunkRoots.size() * sizeof(ChunkRecord);
+    uint64_t offset = (tableEnd + PageSize - 1) / PageSize * PageSize;
+
+    // chunks are built and written one at a time, only the table is kept
+    std::vector<ChunkRecord> records(chunkRoots.size());
+    out.seekp(offset);
+    for (size_t i = 0; i < chunkRoots.size(); i++)
+    {
+        StreamedChunk chunk;
+        BuildChunk(geometry, bvh, chunkRoots[i], chunk);
+        std::vector<char> blob = Serialize(chunk);
+
+        records[i] = {offset, (uint32_t)blob.size(), fileHeader.TriangleCount};
+        fileHeader.TriangleCount += (uint32_t)chunk.Indices.size();
+
+        blob.resize((blob.size() + PageSize - 1) / PageSize * PageSize, 0);
+        out.write(blob.data(), blob.size());
+        offset += blob.size();
+    }
+
+    out.seekp(0);
+    out.write((const char *)&fileHeader, sizeof(fileHeader));
+    out.write((const char *)topNodes.data(), topNodes.size() * sizeof(BvhNode));
+    out.write((const char *)records.data(), records.size() * sizeof(ChunkRecord));
+
+    if (!out)
+    {
+        std::cout << "StreamedGeometry: failed writing " << path << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Copies the subtree under root with siblings adjacent, its leaf triangles in leaf order and the
+// vertices they use.
+void StreamedGeometry::BuildChunk(const TraceGeometry &geometry, const Bvh &bvh, unsigned int root, StreamedChunk &chunk)
+{
+    std::unordered_map<unsigned int, unsigned int> localVertices;
+    auto localVertex = [&](unsigned int vertex) {
+        auto inserted = localVertices.emplace(vertex, (unsigned int)chunk.Positions.size());
+        if (inserted.second)
+        {
+            chunk.Positions.push_back(geometry.Positions[vertex]);
+            chunk.Attributes.push_back(geometry.Attributes[vertex]);
+        }
+        return inserted.first->second;
+    };
+
+    std::vector<std::pair<unsigned int, unsigned int>> pending;
+    chunk.Nodes.push_back(bvh.Nodes[root]);
+    pending.push_back({root, 0});
+
+    while (!pending.empty())
+    {
+        unsigned int source = pending.back().first;
+        unsigned int target = pending.back().second;
+        pending.pop_back();
+
+        const BvhNode &node = bvh.Nodes[source];
+        if (node.IsLeaf())
+        {
+            chunk.Nodes[target].LeftFirst = (unsigned int)chunk.Indices.size();
+            for (unsigned int k = 0; k < node.Count; k++)
+            {
+                unsigned int triangle = bvh.PrimIndices[node.LeftFirst + k];
+                const glm::uvec3 &face = geometry.Indices[triangle];
+                chunk.Indices.push_back(glm::uvec3(localVertex(face.x), localVertex(face.y), localVertex(face.z)));
+                chunk.MaterialIDs.push_back(geometry.MaterialIDs[triangle]);
+            }
+            continue;
+        }
+
+        unsigned int left = (unsigned int)chunk.Nodes.size();
+        chunk.Nodes.push_back(bvh.Nodes[node.LeftFirst]);
+        chunk.Nodes.push_back(bvh.Nodes[node.LeftFirst + 1]);
+        chunk.Nodes[target].LeftFirst = left;
+        pending.push_back({node.LeftFirst + 1, left + 1});
+        pending.push_back({node.LeftFirst, left});
+    }
+}
+
+// Both levels are written parent before children, which bounds the depth the traversal stack has to hold
+bool StreamedGeometry::ValidNodes(const std::vector<BvhNode> &nodes, uint64_t leafLimit)
+{
+    std::vector<int> depths(nodes.size(), 0);
+    for (size_t i = 0; i < nodes.size(); i++)
+    {
+        const BvhNode &node = nodes[i];
+        if (node.IsLeaf())
+        {
+            if (node.LeftFirst + (uint64_t)node.Count > leafLimit)
+                return false;
+            continue;
+        }
+        if (node.LeftFirst <= i || node.LeftFirst + (uint64_t)1 >= nodes.size() || depths[i] + 1 >= Bvh::MaxDepth)
+            return false;
+        depths[node.LeftFirst] = std::max(depths[node.LeftFirst], depths[i] + 1);
+        depths[node.LeftFirst + 1] = std::max(depths[node.LeftFirst + 1], depths[i] + 1);
+    }
+    return true;
+}
+
+std::vector<char> StreamedGeometry::Serialize(const StreamedChunk &chunk)
+{
+    ChunkHeader chunkHeader = {(uint32_t)chunk.Nodes.size(), (uint32_t)chunk.Indices.size(), (uint32_t)chunk.Positions.size(), 0};
+
+    std::vector<char> blob(sizeof(ChunkHeader) + chunk.MemoryUsage());
+    char *cursor = blob.data();
+    auto append = [&cursor](const void *data, size_t size) {
+        std::memcpy(cursor, data, size);
+        cursor += size;
+    };
+
+    append(&chunkHeader, sizeof(chunkHeader));
+    append(chunk.Nodes.data(), chunk.Nodes.size() * sizeof(BvhNode));
+    append(chunk.Positions.data(), chunk.Positions.size() * sizeof(glm::vec3));
+    append(chunk.Indices.data(), chunk.Indices.size() * sizeof(glm::uvec3));
+    append(chunk.Attributes.data(), chunk.Attributes.size() * sizeof(VertexAttribute));
+    append(chunk.MaterialIDs.data(), chunk.MaterialIDs.size() * sizeof(unsigned int));
+
+    return blob;
+}
+
+bool StreamedGeometry::Open(const std::string &filename, ChunkCache &chunkCache)
+{
+    std::lock_guard<std::mutex> lock(fileMutex);
+
+    path = filename;
+    cache = &chunkCache;
+    id = NextID();
+
+    file.close();
+    file.clear();
+    file.open(path, std::ios::binary);
+    if (!file || !file.read((char *)&header, sizeof(header)) || std::memcmp(header.Magic, "SPTC", 4) != 0 || header.Version != Version)
+    {
+        std::cout << "StreamedGeometry: " << path << " is missing or not a chunk file" << std::endl;
+        header = FileHeader();
+        return false;
+    }
+
+    // counts are checked against the file before anything is sized from them
+    file.seekg(0, std::ios::end);
+    uint64_t fileSize = (uint64_t)file.tellg();
+    file.seekg(sizeof(header));
+    bool valid = sizeof(header) + (uint64_t)header.TopNodeCount * sizeof(BvhNode) + (uint64_t)header.ChunkCount * sizeof(ChunkRecord) <= fileSize;
+
+    if (valid)
+    {
+        topNodes.resize(header.TopNodeCount);
+        chunks.resize(header.ChunkCount);
+        file.read((char *)topNodes.data(), topNodes.size() * sizeof(BvhNode));
+        file.read((char *)chunks.data(), chunks.size() * sizeof(ChunkRecord));
+        valid = (bool)file;
+    }
+    valid = valid && ValidNodes(topNodes, chunks.size());
+    for (size_t i = 0; valid && i < chunks.size(); i++)
+        valid = chunks[i].Size >= sizeof(ChunkHeader) && chunks[i].Offset + chunks[i].Size <= fileSize &&
+                chunks[i].FirstTriangle < header.TriangleCount && (i == 0 || chunks[i].FirstTriangle > chunks[i - 1].FirstTriangle);
+
+    if (!valid)
+    {
+        std::cout << "StreamedGeometry: " << path << " is truncated or damaged" << std::endl;
+        topNodes.clear();
+        chunks.clear();
+        header = FileHeader();
+        return false;
+    }
+    return true;
+}
+
+Aabb StreamedGeometry::Bounds() const
+{
+    Aabb box;
+    if (!topNodes.empty())
+    {
+        box.Min = header.Min;
+        box.Max = header.Max;
+    }
+    return box;
+}
+
+ChunkCache::Handle StreamedGeometry::Acquire(unsigned int chunk) const
+{
+    return cache->Get((id << 32) | chunk, [this, chunk]() { return Load(chunk); });
+}
+
+std::shared_ptr<StreamedChunk> StreamedGeometry::Load(unsigned int chunk) const
+{
+    const ChunkRecord &record = chunks[chunk];
+    std::vector<char> blob(record.Size);
+    {
+        std::lock_guard<std::mutex> lock(fileMutex);
+        file.clear();
+        file.seekg(record.Offset);
+        file.read(blob.data(), blob.size());
+        if (!file)
+            blob.clear();
+    }
+
+    auto fail = [this]() {
+        if (!reportedFailure.exchange(true))
+            std::cout << "StreamedGeometry: failed reading chunks of " << path << ", they are skipped" << std::endl;
+        return nullptr;
+    };
+
+    // the counts of the header have to account for the blob exactly
+    ChunkHeader chunkHeader;
+    if (blob.size() < sizeof(ChunkHeader))
+        return fail();
+    std::memcpy(&chunkHeader, blob.data(), sizeof(chunkHeader));
+    uint64_t expected = sizeof(ChunkHeader) + (uint64_t)chunkHeader.NodeCount * sizeof(BvhNode) +
+                        (uint64_t)chunkHeader.VertexCount * (sizeof(glm::vec3) + sizeof(VertexAttribute)) +
+                        (uint64_t)chunkHeader.TriangleCount * (sizeof(glm::uvec3) + sizeof(unsigned int));
+    if (expected != blob.size() || chunkHeader.NodeCount == 0)
+        return fail();
+
+    std::shared_ptr<StreamedChunk> result = std::make_shared<StreamedChunk>();
+    result->Nodes.resize(chunkHeader.NodeCount);
+    result->Positions.resize(chunkHeader.VertexCount);
+    result->Indices.resize(chunkHeader.TriangleCount);
+    result->Attributes.resize(chunkHeader.VertexCount);
+    result->MaterialIDs.resize(chunkHeader.TriangleCount);
+
+    const char *cursor = blob.data() + sizeof(ChunkHeader);
+    auto extract = [&cursor](void *data, size_t size) {
+        std::memcpy(data, cursor, size);
+        cursor += size;
+    };
+    extract(result->Nodes.data(), result->Nodes.size() * sizeof(BvhNode));
+    extract(result->Positions.data(), result->Positions.size() * sizeof(glm::vec3));
+    extract(result->Indices.data(), result->Indices.size() * sizeof(glm::uvec3));
+    extract(result->Attributes.data(), result->Attributes.size() * sizeof(VertexAttribute));
+    extract(result->MaterialIDs.data(), result->MaterialIDs.size() * sizeof(unsigned int));
+
+    // and what they index has to be inside the chunk
+    if (!ValidNodes(result->Nodes, chunkHeader.TriangleCount))
+        return fail();
+    for (const glm::uvec3 &face : result->Indices)
+        if (face.x >= chunkHeader.VertexCount || face.y >= chunkHeader.VertexCount || face.z >= chunkHeader.VertexCount)
+            return fail();
+
+    return result;
+}
+
+template <typename F>
+void StreamedGeometry::Traverse(const glm::vec3 &origin, const glm::vec3 &direction, float &tMax, F intersect) const
+{
+    if (topNodes.empty())
+        return;
+
+    TraverseNodes<Bvh::MaxDepth>(topNodes.data(), origin, direction, tMax, [&](const BvhNode &top, float &tTop) {
+        ChunkCache::Handle chunk = Acquire(top.LeftFirst);
+        if (!chunk)
+            return;
+
+        unsigned int firstTriangle = chunks[top.LeftFirst].FirstTriangle;
+        TraverseNodes<Bvh::MaxDepth>(chunk->Nodes.data(), origin, direction, tTop, [&](const BvhNode &leaf, float &tLeaf) {
+            for (unsigned int i = leaf.LeftFirst; i < leaf.LeftFirst + leaf.Count; i++)
+                intersect(*chunk, i, firstTriangle + i, tLeaf);
+        });
+    });
+}
+
+ChunkCache::Handle StreamedGeometry::FindTriangle(unsigned int triangle, unsigned int &localTriangle) const
+{
+    auto next = std::upper_bound(chunks.begin(), chunks.end(), triangle,
+                                 [](unsigned int value, const ChunkRecord &record) { return value < record.FirstTriangle; });
+    if (next == chunks.begin())
+        return nullptr;
+
+    unsigned int chunk = (unsigned int)(next - chunks.begin()) - 1;
+    localTriangle = triangle - chunks[chunk].FirstTriangle;
+    return Acquire(chunk);
+}
+
+uint64_t StreamedGeometry::NextID()
+{
+    static std::atomic<uint64_t> next{0};
+    return next++;
+}
+
+#endif
@@ -0,0 +1,157 @@
+#ifndef TEXTURECACHE_HPP
+#define TEXTURECACHE_HPP
+
+#include <glad/glad.h>
+#include <stbi/stb_image.hpp>
+
+#include <string>
+#include <cstring>
+#include <iostream>
+#include <future>
+#include <unordered_map>
+#include <vector>
+
+#include "ThreadPool.hpp"
+
+// Path keyed texture cache.
+// Request() runs on the GL thread: it reserves a texture name and starts decoding on the worker pool.
+// Upload() also runs on the GL thread and streams every decoded image through a ring of PBOs.
+class TextureCache
+{
+public:
+    struct Image
+    {
+        unsigned char *data = nullptr;
+        int width = 0;
+        int height = 0;
+        int components = 0;
+    };
+
+    TextureCache();
+
+    // Returns the texture name for the file, decoding it in the background the first time it is seen.
+    unsigned int Request(const std::string &filename);
+
+    // Waits for the pending decodes and uploads them, in request order.
+    void Upload();
+
+    size_t Size() const { return entries.size(); }
+
+    static Image Decode(const std::string &filename);
+    static void UploadImage(unsigned int textureID, const Image &image, unsigned int pixelBuffer = 0);
+
+private:
+    static const int PixelBufferCount = 3;
+
+    struct Pending
+    {
+        unsigned int textureID;
+        std::string filename;
+        std::future<Image> image;
+    };
+
+    std::unordered_map<std::string, unsigned int> entries;
+    std::vector<Pending> pending;
+    unsigned int pixelBuffers[PixelBufferCount];
+    int nextPixelBuffer;
+};
+
+TextureCache::TextureCache() : nextPixelBuffer(0)
+{
+    std::memset(pixelBuffers, 0, sizeof(pixelBuffers));
+}
+
+unsigned int TextureCache::Request(const std::string &filename)
+{
+    auto found = entries.find(filename);
+    if (found != entries.end())
+        return found->second;
+
+    unsigned int textureID;
+    glGenTextures(1, &textureID);
+    entries.emplace(filename, textureID);
+
+    pending.push_back({textureID, filename, ThreadPool::Instance().Enqueue([filename]() { return Decode(filename); })});
+
+    return textureID;
+}
+
+void TextureCache::Upload()
+{
+    if (pending.empty())
+        return;
+
+    if (pixelBuffers[0] == 0)
+        glGenBuffers(PixelBufferCount, pixelBuffers);
+
+    for (Pending &entry : pending)
+    {
+        Image image = entry.image.get();
+        if (image.data)
+        {
+            UploadImage(entry.textureID, image, pixelBuffers[nextPixelBuffer]);
+            nextPixelBuffer = (nextPixelBuffer + 1) % PixelBufferCount;
+        }
+        else
+            std::cout << "Texture failed to load at path: " << entry.filename << std::endl;
+
+        stbi_image_free(image.data);
+    }
+
+    pending.clear();
+}
+
+TextureCache::Image TextureCache::Decode(const std::string &filename)
+{
+    Image image;
+    image.data = stbi_load(filename.c_str(), &image.width, &image.height, &image.components, 0);
+
+    return image;
+}
+
+// With a pixel buffer the copy into driver memory is an orphaned, write-only mapping, so the
+// transfer of one texture overlaps the copy of the next. Without one the upload is synchronous.
+void TextureCache::UploadImage(unsigned int textureID, const Image &image, unsigned int pixelBuffer)
+{
+    GLenum format = GL_RGB;
+    if (image.components == 1)
+        format = GL_RED;
+    else if (image.components == 3)
+        format = GL_RGB;
+    else if (image.components == 4)
+        format = GL_RGBA;
+
+    glBindTexture(GL_TEXTURE_2D, textureID);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+    if (pixelBuffer != 0)
+    {
+        size_t size = (size_t)image.width * image.height * image.components;
+
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pixelBuffer);
+        glBufferData(GL_PIXEL_UNPACK_BUFFER, size, NULL, GL_STREAM_DRAW);
+        void *mapped = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+        if (mapped)
+        {
+            std::memcpy(mapped, image.data, size);
+            glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+            glTexImage2D(GL_TEXTURE_2D, 0, format, image.width, image.height, 0, format, GL_UNSIGNED_BYTE, (void *)0);
+        }
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+        if (!mapped)
+            glTexImage2D(GL_TEXTURE_2D, 0, format, image.width, image.height, 0, format, GL_UNSIGNED_BYTE, image.data);
+    }
+    else
+        glTexImage2D(GL_TEXTURE_2D, 0, format, image.width, image.height, 0, format, GL_UNSIGNED_BYTE, image.data);
+
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glGenerateMipmap(GL_TEXTURE_2D);
+
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+}
+
+#endif
@@ -0,0 +1,163 @@
+#ifndef THREADPOOL_HPP
+#define THREADPOOL_HPP
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <functional>
+#include <memory>
+#include <atomic>
+#include <queue>
+#include <vector>
+#include <algorithm>
+
+// Fixed size worker pool shared by the loaders and the CPU side passes.
+// Tasks must not touch the GL context, which stays on the main thread.
+class ThreadPool
+{
+private:
+    std::vector<std::thread> workers;
+    std::queue<std::function<void()>> tasks;
+    std::mutex mutex;
+    std::condition_variable condition;
+    bool stopping;
+
+    void WorkerLoop();
+
+public:
+    explicit ThreadPool(unsigned int threadCount = 0);
+    ~ThreadPool();
+
+    unsigned int Size() const { return (unsigned int)workers.size(); }
+
+    template <typename F>
+    auto Enqueue(F task) -> std::future<decltype(task())>;
+
+    // Calls body(i) for every i in [begin, end), handing out chunks of grain indices.
+    // The calling thread takes chunks as well, so this is safe to call from inside a task.
+    template <typename F>
+    void ParallelFor(size_t begin, size_t end, size_t grain, F body);
+
+    static ThreadPool &Instance();
+};
+
+ThreadPool::ThreadPool(unsigned int threadCount) : stopping(false)
+{
+    if (threadCount == 0)
+        threadCount = std::max(1u, std::thread::hardware_concurrency());
+
+    for (unsigned int i = 0; i < threadCount; i++)
+        workers.emplace_back(&ThreadPool::WorkerLoop, this);
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    condition.notify_all();
+
+    for (std::thread &worker : workers)
+        worker.join();
+}
+
+void ThreadPool::WorkerLoop()
+{
+    while (true)
+    {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            condition.wait(lock, [this] { return stopping || !tasks.empty(); });
+
+            if (stopping && tasks.empty())
+                return;
+
+            task = std::move(tasks.front());
+            tasks.pop();
+        }
+        task();
+    }
+}
+
+template <typename F>
+auto ThreadPool::Enqueue(F task) -> std::future<decltype(task())>
+{
+    using Result = decltype(task());
+
+    auto packaged = std::make_shared<std::packaged_task<Result()>>(std::move(task));
+    std::future<Result> result = packaged->get_future();
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        tasks.emplace([packaged] { (*packaged)(); });
+    }
+    condition.notify_one();
+
+    return result;
+}
+
+template <typename F>
+void ThreadPool::ParallelFor(size_t begin, size_t end, size_t grain, F body)
+{
+    if (end <= begin)
+        return;
+
+    grain = std::max<size_t>(grain, 1);
+    size_t chunkCount = (end - begin + grain - 1) / grain;
+
+    if (chunkCount == 1 || workers.empty())
+    {
+        for (size_t i = begin; i < end; i++)
+            body(i);
+        return;
+    }
+
+    struct State
+    {
+        std::atomic<size_t> next{0};
+        std::atomic<size_t> done{0};
+        std::mutex mutex;
+        std::condition_variable finished;
+    };
+    auto state = std::make_shared<State>();
+
+    auto run = [state, begin, end, grain, chunkCount, body]() {
+        size_t chunk;
+        while ((chunk = state->next.fetch_add(1)) < chunkCount)
+        {
+            size_t first = begin + chunk * grain;
+            size_t last = std::min(end, first + grain);
+            for (size_t i = first; i < last; i++)
+                body(i);
+
+            if (state->done.fetch_add(1) + 1 == chunkCount)
+            {
+                std::lock_guard<std::mutex> lock(state->mutex);
+                state->finished.notify_all();
+            }
+        }
+    };
+
+    size_t helperCount = std::min<size_t>(workers.size(), chunkCount - 1);
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (size_t i = 0; i < helperCount; i++)
+            tasks.emplace(run);
+    }
+    condition.notify_all();
+
+    run();
+
+    std::unique_lock<std::mutex> lock(state->mutex);
+    state->finished.wait(lock, [&state, chunkCount] { return state->done.load() == chunkCount; });
+}
+
+ThreadPool &ThreadPool::Instance()
+{
+    static ThreadPool pool;
+    return pool;
+}
+
+#endif
@@ -0,0 +1,40 @@
+#ifndef TILE_HPP
+#define TILE_HPP
+
+#include <vector>
+
+// A rectangle of window pixels, counted from the lower left like glReadPixels.
+struct Tile
+{
+    unsigned int X = 0;
+    unsigned int Y = 0;
+    unsigned int Width = 0;
+    unsigned int Height = 0;
+
+    size_t PixelCount() const { return (size_t)Width * Height; }
+};
+
+// One pass over a tile: the sample indices [FirstSample, FirstSample + Samples) of every pixel,
+// averaged. Rows are bottom up, like the FrameSaver buffers the pass is added to.
+struct TileResult
+{
+    Tile Region;
+    unsigned int FirstSample = 0;
+    unsigned int Samples = 0;
+
+    std::vector<float> Color;       // RGB average, unclamped
+    std::vector<float> Moment;      // average of the squared luminance
+    std::vector<float> Albedo;      // RGB, primary hit Kd
+    std::vector<float> NormalDepth; // primary hit normal + distance from the eye
+
+    void Resize()
+    {
+        size_t pixels = Region.PixelCount();
+        Color.assign(3 * pixels, 0.0f);
+        Moment.assign(pixels, 0.0f);
+        Albedo.assign(3 * pixels, 0.0f);
+        NormalDepth.assign(4 * pixels, 0.0f);
+    }
+};
+
+#endif
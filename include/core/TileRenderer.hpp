@@ -0,0 +1,130 @@
+#ifndef TILERENDERER_HPP
+#define TILERENDERER_HPP
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include "CpuPathTracer.hpp"
+#include "RenderTarget.hpp"
+#include "SampleSplit.hpp"
+#include "Tile.hpp"
+#include "shader.hpp"
+
+enum class TileBackend
+{
+    Cpu,
+    Gl
+};
+
+// Renders passes over tiles of the frame, what a distributed render worker does with a TileResult.
+//
+// The CPU backend traces the pixels of the tile with CpuPathTracer. The GL backend draws the points
+// of the tile rows only, once per sample, blending them additively into the float Color attachment:
+// color sums in RGB and squared luminance in alpha. The tile is read back once per pass and divided
+// by the sample count; sample k is seeded as SampleSplit seeds it. It must be used on the thread
+// owning the context, with the scene already bound to the shader.
+class TileRenderer
+{
+public:
+    // CPU backend.
+    explicit TileRenderer(const Scene &scene);
+    // GL backend, vao draws the rays of Camera::GenerateRay() as points.
+    TileRenderer(Shader &shader, const RenderTarget &target, unsigned int vao);
+
+    TileBackend Backend() const { return backend; }
+
+    // Renders result.Samples samples from result.FirstSample over result.Region.
+    void Render(TileResult &result, const glm::vec3 &eye, const glm::mat4 &rayRotateMatrix);
+
+private:
+    TileBackend backend;
+
+    std::unique_ptr<CpuPathTracer> tracer;
+
+    Shader *shader = nullptr;
+    const RenderTarget *target = nullptr;
+    unsigned int vao = 0;
+    std::mt19937 sampler;
+    std::vector<float> frame;
+    std::vector<GLint> rowFirsts;
+    std::vector<GLsizei> rowCounts;
+
+    void RenderGl(TileResult &result, const glm::vec3 &eye, const glm::mat4 &rayRotateMatrix);
+};
+
+TileRenderer::TileRenderer(const Scene &scene) : backend(TileBackend::Cpu), tracer(new CpuPathTracer(scene))
+{
+}
+
+TileRenderer::TileRenderer(Shader &shader, const RenderTarget &target, unsigned int vao)
+    : backend(TileBackend::Gl), shader(&shader), target(&target), vao(vao)
+{
+}
+
+void TileRenderer::Render(TileResult &result, const glm::vec3 &eye, const glm::mat4 &rayRotateMatrix)
+{
+    if (backend == TileBackend::Cpu)
+        tracer->Render(result, eye, rayRotateMatrix);
+    else
+        RenderGl(result, eye, rayRotateMatrix);
+}
+
+void TileRenderer::RenderGl(TileResult &result, const glm::vec3 &eye, const glm::mat4 &rayRotateMatrix)
+{
+    const Tile &tile = result.Region;
+    size_t pixels = tile.PixelCount();
+    result.Resize();
+    frame.resize(4 * pixels);
+
+    // a row of points per tile row; SimplePathTracing.vs mirrors the window horizontally, so the
+    // points of pixel columns [X, X + Width) run backwards from the right edge
+    rowFirsts.resize(tile.Height);
+    rowCounts.assign(tile.Height, (GLsizei)tile.Width);
+    for (unsigned int row = 0; row < tile.Height; row++)
+        rowFirsts[row] = (GLint)((tile.Y + row) * Global::WindowWidth + Global::WindowWidth - tile.X - tile.Width);
+
+    shader->use();
+    shader->setMat4("RayRotateMatrix", rayRotateMatrix);
+    shader->setVec3("Eye", eye);
+
+    target->Bind();
+    glEnablei(GL_BLEND, RenderTarget::Color);
+    glBlendFunc(GL_ONE, GL_ONE);
+    glBindVertexArray(vao);
+
+    for (unsigned int s = 0; s < result.Samples; s++)
+    {
+        SeedSample(sampler, Global::SampleSeed, result.FirstSample + s);
+        float seed[4];
+        for (int i = 0; i < 4; i++)
+            seed[i] = std::generate_canonical<float, 24>(sampler);
+        shader->setArray("rdSeed", 4, seed);
+
+        glMultiDrawArrays(GL_POINTS, rowFirsts.data(), rowCounts.data(), (GLsizei)tile.Height);
+    }
+
+    glDisablei(GL_BLEND, RenderTarget::Color);
+    glBindVertexArray(0);
+
+    target->Read(RenderTarget::Color, GL_RGBA, tile.X, tile.Y, tile.Width, tile.Height, frame.data());
+    float scale = 1.0f / std::max(result.Samples, 1u);
+    for (size_t i = 0; i < pixels; i++)
+    {
+        for (int c = 0; c < 3; c++)
+            result.Color[3 * i + c] = frame[4 * i + c] * scale;
+        result.Moment[i] = frame[4 * i + 3] * scale;
+    }
+
+    // the primary hit does not change between samples, the last frame's will do
+    target->Read(RenderTarget::Albedo, GL_RGB, tile.X, tile.Y, tile.Width, tile.Height, result.Albedo.data());
+    target->Read(RenderTarget::NormalDepth, GL_RGBA, tile.X, tile.Y, tile.Width, tile.Height, result.NormalDepth.data());
+
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+#endif
@@ -45,7 +45,7 @@ namespace Utility
 
 	bool InitGlad();
 
-	std::tuple<unsigned int, unsigned int> SetVAOVBO(float *vertices);
+	std::tuple<unsigned int, unsigned int> SetVAOVBO(float *vertices, unsigned int pointCount = Global::PixelCount);
 
 	void PathTracingShaderSetup(Shader &shader);
 
@@ -63,6 +63,9 @@ namespace Utility
 	// Other Utility
 	unsigned int LoadTexture(char const *path);
 
+	// the Cornell box, with the Assimp model at modelPath in it unless that is empty; not built yet
+	void LoadScene(Scene &scene, const std::string &modelPath);
+
 	// Implementations-------------------------------------------------------------
 
 	// Set Up functions
@@ -129,7 +132,7 @@ namespace Utility
 			return true;
 	}
 
-	std::tuple<unsigned int, unsigned int> SetVAOVBO(float *vertices)
+	std::tuple<unsigned int, unsigned int> SetVAOVBO(float *vertices, unsigned int pointCount)
 	{
 		unsigned int VAO;
 		unsigned int VBO;
@@ -138,7 +141,7 @@ namespace Utility
 		glGenBuffers(1, &VBO);
 
 		glBindBuffer(GL_ARRAY_BUFFER, VBO);
-		glBufferData(GL_ARRAY_BUFFER, Global::WindowHeight * Global::WindowWidth * sizeof(float) * 5, vertices, GL_STATIC_DRAW);
+		glBufferData(GL_ARRAY_BUFFER, pointCount * sizeof(float) * 5, vertices, GL_STATIC_DRAW);
 
 		glBindVertexArray(VAO);
 		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 5 * sizeof(float), (void *)0);
@@ -239,6 +242,22 @@ namespace Utility
 
 		return textureID;
 	}
+
+	void LoadScene(Scene &scene, const std::string &modelPath)
+	{
+		const BvhBuildMode buildModes[] = {BvhBuildMode::Linear, BvhBuildMode::Sah, BvhBuildMode::Spatial};
+		scene.BuildMode = buildModes[Global::SceneBvhType];
+		TraceGeometry cornellBox;
+		LoadCornellBox(cornellBox, scene.Materials);
+		scene.AddInstance(scene.AddMesh(std::move(cornellBox)), glm::mat4(1.0f));
+
+		if (!modelPath.empty())
+		{
+			ChunkCache::Instance().SetBudget(Global::GeometryBudget);
+			Model model(modelPath, false, Global::GeometryStreamPath);
+			model.AddToScene(scene);
+		}
+	}
 }
 
 #endif
\ No newline at end of file
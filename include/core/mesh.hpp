@@ -7,6 +7,7 @@
 #include <glm/gtc/matrix_transform.hpp>
 
 #include <shader.hpp>
+#include <Geometry.hpp>
 
 #include <string>
 #include <vector>
@@ -47,13 +48,29 @@ public:
     vector<unsigned int> indices;
     vector<Texture> textures;
     unsigned int VAO;
+    // compact hot/cold streams read by the path tracer.
+    TraceGeometry trace;
 
-    // constructor
-    Mesh(vector<Vertex> vertices, vector<unsigned int> indices, vector<Texture> textures)
-    : vertices(vertices), indices(indices), textures(textures)
+    // constructor, takes ownership of the data. Pass upload = false to build the mesh off the GL thread,
+    // and call upload() later on the thread that owns the context.
+    Mesh(vector<Vertex> vertices, vector<unsigned int> indices, vector<Texture> textures, bool upload = true)
+    : vertices(std::move(vertices)), indices(std::move(indices)), textures(std::move(textures)), VAO(0), VBO(0), EBO(0)
+    {
+        indexCount = this->indices.size();
+        setupTraceGeometry();
+        if (upload)
+            this->upload();
+    }
+
+    // creates the GL buffers. Must run on the thread owning the GL context.
+    void upload()
     {
         // now that we have all the required data, set the vertex buffers and its attribute pointers.
         setupMesh();
+        // the full vertex data now lives in the GPU buffers and in the compact trace streams,
+        // so the CPU side copies are released.
+        vector<Vertex>().swap(vertices);
+        vector<unsigned int>().swap(indices);
     }
 
     // render the mesh
@@ -87,7 +104,7 @@ public:
 
         // draw mesh
         glBindVertexArray(VAO);
-        glDrawElements(GL_TRIANGLES, indices.size(), GL_UNSIGNED_INT, 0);
+        glDrawElements(GL_TRIANGLES, indexCount, GL_UNSIGNED_INT, 0);
         glBindVertexArray(0);
 
         // always good practice to set everything back to defaults once configured.
@@ -97,6 +114,7 @@ public:
 private:
     // render data
     unsigned int VBO, EBO;
+    unsigned int indexCount;
 
     // initializes all the buffer objects/arrays
     void setupMesh()
@@ -142,5 +160,17 @@ private:
         glVertexAttribPointer(6, 4, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void *)offsetof(Vertex, m_Weights));
         glBindVertexArray(0);
     }
+
+    // splits the vertices into a position stream and an octahedral normal / half uv attribute stream.
+    void setupTraceGeometry()
+    {
+        trace.Reserve(vertices.size(), indices.size() / 3);
+
+        for (unsigned int i = 0; i < vertices.size(); i++)
+            trace.AddVertex(vertices[i].Position, vertices[i].Normal, vertices[i].TexCoords);
+
+        for (unsigned int i = 0; i + 2 < indices.size(); i += 3)
+            trace.AddTriangle(indices[i], indices[i + 1], indices[i + 2]);
+    }
 };
 #endif
\ No newline at end of file
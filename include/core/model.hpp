@@ -5,8 +5,10 @@
 
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
+// the one place stb_image is compiled; headers including it after this one only get its declarations
 #define STB_IMAGE_IMPLEMENTATION
 #include <stbi/stb_image.hpp>
+#undef STB_IMAGE_IMPLEMENTATION
 
 #include <assimp/Importer.hpp>
 #include <assimp/scene.h>
@@ -14,6 +16,10 @@
 
 #include <mesh.hpp>
 #include <shader.hpp>
+#include <ThreadPool.hpp>
+#include <TextureCache.hpp>
+#include <Scene.hpp>
+#include <StreamedGeometry.hpp>
 
 #include <string>
 #include <fstream>
@@ -25,29 +31,74 @@ using namespace std;
 
 unsigned int TextureFromFile(const char *path, const string &directory, bool gamma = false);
 
+// a placement of one of the model's meshes, from the node hierarchy.
+struct MeshInstance
+{
+    unsigned int mesh;
+    glm::mat4 transform;
+};
+
 class Model
 {
 public:
     // model data
-    vector<Texture> textures_loaded; // stores all the textures loaded so far, optimization to make sure textures aren't loaded more than once.
-    vector<Mesh> meshes;
+    TextureCache textures_loaded; // stores all the textures loaded so far keyed by path, optimization to make sure textures aren't loaded more than once.
+    vector<Mesh> meshes;          // one per unique aiMesh
+    vector<MeshInstance> instances;
+    vector<Material> materials;   // path tracing materials, indexed like the aiScene materials
+    vector<string> streamFiles;   // chunk file of each mesh, empty unless the model is streamed
     string directory;
     bool gammaCorrection;
 
     // constructor, expects a filepath to a 3D model.
-    Model(string const &path, bool gamma = false) : gammaCorrection(gamma)
+    // with a stream directory, every mesh is written there as a chunk file while loading and dropped from
+    // memory, for models larger than RAM. Streamed meshes are traced on the CPU and not drawn.
+    Model(string const &path, bool gamma = false, string const &streamDirectory = "") : gammaCorrection(gamma), streamDirectory(streamDirectory)
     {
         loadModel(path);
     }
 
-    // draws the model, and thus all its meshes
+    // draws the model, and thus all its mesh instances
     void Draw(Shader &shader)
     {
+        for (unsigned int i = 0; i < instances.size(); i++)
+            if (streamFiles[instances[i].mesh].empty())
+                meshes[instances[i].mesh].Draw(shader);
+    }
+
+    // hands the trace geometry of every mesh over to the scene, once, and places an instance per node reference.
+    // the meshes keep their GL buffers, so Draw still works afterwards.
+    void AddToScene(Scene &scene, const glm::mat4 &transform = glm::mat4(1.0f))
+    {
+        unsigned int materialOffset = scene.Materials.size();
+        scene.Materials.insert(scene.Materials.end(), materials.begin(), materials.end());
+
+        vector<unsigned int> sceneMeshes(meshes.size());
         for (unsigned int i = 0; i < meshes.size(); i++)
-            meshes[i].Draw(shader);
+        {
+            if (!streamFiles[i].empty())
+            {
+                std::shared_ptr<StreamedGeometry> streamed = std::make_shared<StreamedGeometry>();
+                streamed->MaterialOffset = materialOffset;
+                // a file that fails to open leaves an empty mesh, so the instances stay valid
+                sceneMeshes[i] = streamed->Open(streamFiles[i]) ? scene.AddStreamedMesh(streamed) : scene.AddMesh(TraceGeometry());
+                continue;
+            }
+
+            TraceGeometry &trace = meshes[i].trace;
+            for (unsigned int &materialID : trace.MaterialIDs)
+                materialID += materialOffset;
+            sceneMeshes[i] = scene.AddMesh(std::move(trace));
+            trace.Clear();
+        }
+
+        for (unsigned int i = 0; i < instances.size(); i++)
+            scene.AddInstance(sceneMeshes[instances[i].mesh], transform * instances[i].transform);
     }
 
 private:
+    string streamDirectory;
+
     // loads a model with supported ASSIMP extensions from file and stores the resulting meshes in the meshes vector.
     void loadModel(string const &path)
     {
@@ -63,39 +114,123 @@ private:
         // retrieve the directory path of the filepath
         directory = path.substr(0, path.find_last_of('/'));
 
-        // process ASSIMP's root node recursively
-        processNode(scene->mRootNode, scene);
+        // process ASSIMP's root node recursively, every aiMesh is kept once however often nodes reference it
+        vector<aiMesh *> nodeMeshes;
+        vector<int> meshSlots(scene->mNumMeshes, -1);
+        processNode(scene->mRootNode, scene, aiMatrix4x4(), meshSlots, nodeMeshes);
+
+        // texture names need the GL context, so they are resolved here, once per material.
+        // the images themselves are decoded on the worker pool meanwhile.
+        vector<vector<Texture>> materialTextures(scene->mNumMaterials);
+        vector<bool> materialLoaded(scene->mNumMaterials, false);
+        materials.resize(scene->mNumMaterials);
+        for (unsigned int i = 0; i < nodeMeshes.size(); i++)
+        {
+            unsigned int materialIndex = nodeMeshes[i]->mMaterialIndex;
+            if (!materialLoaded[materialIndex])
+            {
+                materialTextures[materialIndex] = processMaterial(scene->mMaterials[materialIndex]);
+                materials[materialIndex] = processTraceMaterial(scene->mMaterials[materialIndex]);
+                materialLoaded[materialIndex] = true;
+            }
+        }
+
+        // the meshes are independent, so their vertex data is built on the worker pool.
+        // streamed meshes are also written out there, so only a few are in memory at once.
+        string name = path.substr(path.find_last_of('/') + 1);
+        ThreadPool &pool = ThreadPool::Instance();
+        vector<future<Mesh>> pending;
+        pending.reserve(nodeMeshes.size());
+        for (unsigned int i = 0; i < nodeMeshes.size(); i++)
+        {
+            aiMesh *mesh = nodeMeshes[i];
+            const vector<Texture> &textures = materialTextures[mesh->mMaterialIndex];
+            string streamFile = streamDirectory.empty() ? "" : streamDirectory + '/' + name + '.' + std::to_string(i) + ".chunks";
+            streamFiles.push_back(streamFile);
+            pending.push_back(pool.Enqueue([this, mesh, &textures, streamFile]() {
+                Mesh result = processMesh(mesh, textures);
+                if (!streamFile.empty())
+                    streamMesh(result, streamFile);
+                return result;
+            }));
+        }
+
+        // only the GL uploads stay on the context thread.
+        textures_loaded.Upload();
+        meshes.reserve(meshes.size() + pending.size());
+        for (unsigned int i = 0; i < pending.size(); i++)
+        {
+            meshes.push_back(pending[i].get());
+            if (streamFiles[i].empty())
+                meshes.back().upload();
+        }
     }
 
-    // processes a node in a recursive fashion. Processes each individual mesh located at the node and repeats this process on its children nodes (if any).
-    void processNode(aiNode *node, const aiScene *scene)
+    // writes the trace geometry of a mesh to its chunk file and releases all of its vertex data.
+    // a failed write is reported by StreamedGeometry and leaves the mesh empty.
+    void streamMesh(Mesh &mesh, const string &file) const
     {
-        // process each mesh located at the current node
+        const TraceGeometry &trace = mesh.trace;
+        vector<Aabb> bounds(trace.TriangleCount());
+        for (unsigned int i = 0; i < bounds.size(); i++)
+            for (int k = 0; k < 3; k++)
+                bounds[i].Grow(trace.Positions[trace.Indices[i][k]]);
+
+        Bvh bvh;
+        bvh.Build(bounds);
+        StreamedGeometry::Write(file, trace, bvh);
+
+        mesh.trace = TraceGeometry();
+        vector<Vertex>().swap(mesh.vertices);
+        vector<unsigned int>().swap(mesh.indices);
+    }
+
+    // processes a node in a recursive fashion. Records an instance of each mesh located at the node with the
+    // accumulated node transformation, and repeats this process on its children nodes (if any).
+    // meshes seen for the first time are appended to nodeMeshes, meshSlots maps aiScene mesh indices to them.
+    void processNode(aiNode *node, const aiScene *scene, const aiMatrix4x4 &parentTransform, vector<int> &meshSlots, vector<aiMesh *> &nodeMeshes)
+    {
+        aiMatrix4x4 transform = parentTransform * node->mTransformation;
+
         for (unsigned int i = 0; i < node->mNumMeshes; i++)
         {
             // the node object only contains indices to index the actual objects in the scene.
             // the scene contains all the data, node is just to keep stuff organized (like relations between nodes).
-            aiMesh *mesh = scene->mMeshes[node->mMeshes[i]];
-            meshes.push_back(processMesh(mesh, scene));
+            unsigned int meshIndex = node->mMeshes[i];
+            if (meshSlots[meshIndex] < 0)
+            {
+                meshSlots[meshIndex] = nodeMeshes.size();
+                nodeMeshes.push_back(scene->mMeshes[meshIndex]);
+            }
+
+            // assimp matrices are row major, glm ones column major
+            MeshInstance instance;
+            instance.mesh = meshSlots[meshIndex];
+            instance.transform = glm::mat4(transform.a1, transform.b1, transform.c1, transform.d1,
+                                           transform.a2, transform.b2, transform.c2, transform.d2,
+                                           transform.a3, transform.b3, transform.c3, transform.d3,
+                                           transform.a4, transform.b4, transform.c4, transform.d4);
+            instances.push_back(instance);
         }
         // after we've processed all of the meshes (if any) we then recursively process each of the children nodes
         for (unsigned int i = 0; i < node->mNumChildren; i++)
         {
-            processNode(node->mChildren[i], scene);
+            processNode(node->mChildren[i], scene, transform, meshSlots, nodeMeshes);
         }
     }
 
-    Mesh processMesh(aiMesh *mesh, const aiScene *scene)
+    // builds the CPU side data of a mesh. Runs on a worker thread and must not touch GL.
+    Mesh processMesh(const aiMesh *mesh, const vector<Texture> &textures) const
     {
-        // data to fill
-        vector<Vertex> vertices;
+        // data to fill, presized so the loops below never reallocate
+        vector<Vertex> vertices(mesh->mNumVertices);
         vector<unsigned int> indices;
-        vector<Texture> textures;
+        indices.reserve(mesh->mNumFaces * 3);
 
         // walk through each of the mesh's vertices
         for (unsigned int i = 0; i < mesh->mNumVertices; i++)
         {
-            Vertex vertex;
+            Vertex &vertex = vertices[i];
             glm::vec3 vector; // we declare a placeholder vector since assimp uses its own vector class that doesn't directly convert to glm's vec3 class so we transfer the data to this placeholder glm::vec3 first.
             // positions
             vector.x = mesh->mVertices[i].x;
@@ -132,19 +267,39 @@ private:
             }
             else
                 vertex.TexCoords = glm::vec2(0.0f, 0.0f);
-
-            vertices.push_back(vertex);
         }
         // now wak through each of the mesh's faces (a face is a mesh its triangle) and retrieve the corresponding vertex indices.
         for (unsigned int i = 0; i < mesh->mNumFaces; i++)
         {
-            aiFace face = mesh->mFaces[i];
+            const aiFace &face = mesh->mFaces[i];
             // retrieve all indices of the face and store them in the indices vector
             for (unsigned int j = 0; j < face.mNumIndices; j++)
                 indices.push_back(face.mIndices[j]);
         }
-        // process materials
-        aiMaterial *material = scene->mMaterials[mesh->mMaterialIndex];
+        // return a mesh object created from the extracted mesh data, GL buffers are created later by upload()
+        Mesh result(std::move(vertices), std::move(indices), textures, false);
+        std::fill(result.trace.MaterialIDs.begin(), result.trace.MaterialIDs.end(), mesh->mMaterialIndex);
+        return result;
+    }
+
+    // the path tracer only knows diffuse surfaces and emitters.
+    Material processTraceMaterial(aiMaterial *material) const
+    {
+        aiColor3D diffuse(0.0f, 0.0f, 0.0f);
+        aiColor3D emissive(0.0f, 0.0f, 0.0f);
+        material->Get(AI_MATKEY_COLOR_DIFFUSE, diffuse);
+        material->Get(AI_MATKEY_COLOR_EMISSIVE, emissive);
+
+        Material result;
+        result.Kd = glm::vec3(diffuse.r, diffuse.g, diffuse.b);
+        result.Emission = emissive.IsBlack() ? 0.0f : 1.0f;
+        return result;
+    }
+
+    // loads the textures of a material. Runs on the GL thread.
+    vector<Texture> processMaterial(aiMaterial *material)
+    {
+        vector<Texture> textures;
         // we assume a convention for sampler names in the shaders. Each diffuse texture should be named
         // as 'texture_diffuseN' where N is a sequential number ranging from 1 to MAX_SAMPLER_NUMBER.
         // Same applies to other texture as the following list summarizes:
@@ -165,8 +320,7 @@ private:
         std::vector<Texture> heightMaps = loadMaterialTextures(material, aiTextureType_AMBIENT, "texture_height");
         textures.insert(textures.end(), heightMaps.begin(), heightMaps.end());
 
-        // return a mesh object created from the extracted mesh data
-        return Mesh(vertices, indices, textures);
+        return textures;
     }
 
     // checks all material textures of a given type and loads the textures if they're not loaded yet.
@@ -178,26 +332,12 @@ private:
         {
             aiString str;
             mat->GetTexture(type, i, &str);
-            // check if texture was loaded before and if so, continue to next iteration: skip loading a new texture
-            bool skip = false;
-            for (unsigned int j = 0; j < textures_loaded.size(); j++)
-            {
-                if (std::strcmp(textures_loaded[j].path.data(), str.C_Str()) == 0)
-                {
-                    textures.push_back(textures_loaded[j]);
-                    skip = true; // a texture with the same filepath has already been loaded, continue to next one. (optimization)
-                    break;
-                }
-            }
-            if (!skip)
-            { // if texture hasn't been loaded already, load it
-                Texture texture;
-                texture.id = TextureFromFile(str.C_Str(), this->directory);
-                texture.type = typeName;
-                texture.path = str.C_Str();
-                textures.push_back(texture);
-                textures_loaded.push_back(texture); // store it as texture loaded for entire model, to ensure we won't unnecesery load duplicate textures.
-            }
+            // the cache returns the existing texture if this path was loaded before, otherwise it starts decoding it.
+            Texture texture;
+            texture.id = textures_loaded.Request(this->directory + '/' + str.C_Str());
+            texture.type = typeName;
+            texture.path = str.C_Str();
+            textures.push_back(texture);
         }
         return textures;
     }
@@ -211,34 +351,13 @@ unsigned int TextureFromFile(const char *path, const string &directory, bool gam
     unsigned int textureID;
     glGenTextures(1, &textureID);
 
-    int width, height, nrComponents;
-    unsigned char *data = stbi_load(filename.c_str(), &width, &height, &nrComponents, 0);
-    if (data)
-    {
-        GLenum format;
-        if (nrComponents == 1)
-            format = GL_RED;
-        else if (nrComponents == 3)
-            format = GL_RGB;
-        else if (nrComponents == 4)
-            format = GL_RGBA;
-
-        glBindTexture(GL_TEXTURE_2D, textureID);
-        glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format, GL_UNSIGNED_BYTE, data);
-        glGenerateMipmap(GL_TEXTURE_2D);
-
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-
-        stbi_image_free(data);
-    }
+    TextureCache::Image image = TextureCache::Decode(filename);
+    if (image.data)
+        TextureCache::UploadImage(textureID, image);
     else
-    {
         std::cout << "Texture failed to load at path: " << path << std::endl;
-        stbi_image_free(data);
-    }
+
+    stbi_image_free(image.data);
 
     return textureID;
 }
@@ -15,9 +15,9 @@ class Shader
 {
 public:
     unsigned int ID;
-    // constructor generates the shader on the fly
+    // constructor generates the shader on the fly, defines go right after the #version line of each stage
     // ------------------------------------------------------------------------
-    Shader(const char *vertexPath, const char *fragmentPath, const char *geometryPath = nullptr)
+    Shader(const char *vertexPath, const char *fragmentPath, const char *geometryPath = nullptr, const std::string &defines = "")
     {
         std::string vPath = path + vertexPath;
         std::string fPath = path + fragmentPath;
@@ -62,6 +62,10 @@ public:
         {
             std::cout << "ERROR::SHADER::FILE_NOT_SUCCESFULLY_READ" << std::endl;
         }
+        if (!defines.empty())
+            for (std::string *code : {&vertexCode, &fragmentCode, &geometryCode})
+                if (!code->empty())
+                    code->insert(code->find('\n') + 1, defines);
         const char *vShaderCode = vertexCode.c_str();
         const char *fShaderCode = fragmentCode.c_str();
         // 2. compile shaders
@@ -136,6 +140,10 @@ public:
     {
         glUniform2f(glGetUniformLocation(ID, name.c_str()), x, y);
     }
+    void setIVec2(const std::string &name, int x, int y) const
+    {
+        glUniform2i(glGetUniformLocation(ID, name.c_str()), x, y);
+    }
     // ------------------------------------------------------------------------
     void setVec3(const std::string &name, const glm::vec3 &value) const
     {
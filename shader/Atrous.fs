@@ -0,0 +1,54 @@
+#version 330 core
+
+// One a-trous pass of Denoiser, must match Denoiser::FilterRowScalar().
+
+// Variables-------------------------------------------------------------------
+out vec4 FragColor;                            // Filtered color, divided by albedo
+
+uniform sampler2D Color;                       // Output of the previous pass
+uniform sampler2D NormalDepth;                 // Primary hit normal + distance, zero where nothing was hit
+uniform int       StepSize;                    // Distance between taps, doubles every pass
+uniform int       NormalPower;                 // Denoiser::NormalPower
+uniform float     SigmaColor;                  // Color tolerance of this pass
+uniform float     SigmaDepth;                  // Depth tolerance, relative to depth and step
+
+const float Kernel[3] = float[3](3.0 / 8.0, 1.0 / 4.0, 1.0 / 16.0);
+
+// Main------------------------------------------------------------------------
+void main()
+{
+	ivec2 p = ivec2(gl_FragCoord.xy);
+	ivec2 size = textureSize(Color, 0);
+
+	vec3 color = texelFetch(Color, p, 0).rgb;
+	vec4 normalDepth = texelFetch(NormalDepth, p, 0);
+	float invDepth = 1.0 / (SigmaDepth * float(StepSize) * normalDepth.w + 1e-6);
+	float invSigmaColor2 = 1.0 / (SigmaColor * SigmaColor);
+
+	vec3 sum = color * Kernel[0] * Kernel[0];
+	float weights = Kernel[0] * Kernel[0];
+
+	for (int dy = -2; dy <= 2; dy++)
+	{
+		for (int dx = -2; dx <= 2; dx++)
+		{
+			ivec2 q = p + ivec2(dx, dy) * StepSize;
+			if ((dx == 0 && dy == 0) || any(lessThan(q, ivec2(0))) || any(greaterThanEqual(q, size)))
+				continue;
+
+			vec3 tapColor = texelFetch(Color, q, 0).rgb;
+			vec4 tapNormalDepth = texelFetch(NormalDepth, q, 0);
+
+			vec3 difference = color - tapColor;
+			float colorWeight = exp(-dot(difference, difference) * invSigmaColor2);
+			float normalWeight = pow(max(dot(normalDepth.xyz, tapNormalDepth.xyz), 0.0), float(NormalPower));
+			float depthWeight = exp(-abs(normalDepth.w - tapNormalDepth.w) * invDepth);
+
+			float w = Kernel[abs(dx)] * Kernel[abs(dy)] * colorWeight * normalWeight * depthWeight;
+			sum += tapColor * w;
+			weights += w;
+		}
+	}
+
+	FragColor = vec4(sum / weights, 1.0);
+}
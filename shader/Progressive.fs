@@ -0,0 +1,58 @@
+#version 330 core
+
+// Blends the frame just traced into ProgressiveDisplay, the weight comes from the constant blend alpha.
+// A frame traced below window resolution sits in the lower left Resolution pixels of the target and is
+// upscaled here: bilinear, except that taps whose depth or normal disagree with the nearest tap are
+// dropped, so silhouettes stay sharp instead of bleeding into the background.
+
+// Variables-------------------------------------------------------------------
+out vec4 FragColor;
+
+uniform sampler2D Color;                       // Color attachment of the RenderTarget
+uniform sampler2D NormalDepth;                 // NormalDepth attachment, zero where nothing was hit
+uniform ivec2     Resolution;                  // Traced part of the target
+uniform float     SigmaDepth;                  // Depth tolerance, relative to the depth of the nearest tap
+uniform float     NormalPower;                 // Sharpness of the normal weight
+
+// Main------------------------------------------------------------------------
+void main()
+{
+	ivec2 size = textureSize(Color, 0);
+	if (Resolution == size)
+	{
+		FragColor = vec4(texelFetch(Color, ivec2(gl_FragCoord.xy), 0).rgb, 1.0);
+		return;
+	}
+
+	vec2 source = gl_FragCoord.xy * vec2(Resolution) / vec2(size) - 0.5;
+	ivec2 base = ivec2(floor(source));
+	vec2 f = source - vec2(base);
+
+	// the nearest tap most likely lies on the same surface as this pixel
+	ivec2 nearest = clamp(ivec2(floor(source + 0.5)), ivec2(0), Resolution - 1);
+	vec4 center = texelFetch(NormalDepth, nearest, 0);
+
+	vec3 sum = vec3(0.0);
+	float weights = 0.0;
+	for (int tap = 0; tap < 4; tap++)
+	{
+		ivec2 offset = ivec2(tap & 1, tap >> 1);
+		ivec2 p = clamp(base + offset, ivec2(0), Resolution - 1);
+		vec4 normalDepth = texelFetch(NormalDepth, p, 0);
+
+		float w = (offset.x == 1 ? f.x : 1.0 - f.x) * (offset.y == 1 ? f.y : 1.0 - f.y);
+		if (center.w > 0.0)
+		{
+			w *= exp(-abs(normalDepth.w - center.w) / (SigmaDepth * center.w));
+			w *= pow(max(dot(normalDepth.xyz, center.xyz), 0.0), NormalPower);
+		}
+		else if (normalDepth.w > 0.0)
+			w = 0.0; // background only takes background
+
+		sum += texelFetch(Color, p, 0).rgb * w;
+		weights += w;
+	}
+
+	vec3 color = weights > 1e-4 ? sum / weights : texelFetch(Color, nearest, 0).rgb;
+	FragColor = vec4(color, 1.0);
+}
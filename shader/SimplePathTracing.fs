@@ -3,16 +3,33 @@
 // Variables-------------------------------------------------------------------
 #define EPSILON 0.0001                         // Float EPSILON
 #define PI      3.1415926535897                // PI
+#define INFINITY 1e30                          // Farther than any hit
+#define STACK_SIZE 64                          // Bvh::MaxDepth
+#ifndef MESH_STACK_SIZE                        // the host passes what the trees of its scene need
+#define MESH_STACK_SIZE 504                    // CompressedBvh::MaxStackSize
+#endif
 
 in vec3 rayDirection;                          // Ray Direction
 in vec3 eye;                                   // Position of eye
 in vec2 screen;                                // Width and Height of Screen(window actually)
 
-out vec4 FragColor;                            // Output Color
+layout (location = 0) out vec4  FragColor;     // Output Color
+layout (location = 1) out vec4  FragAlbedo;    // Primary hit Kd                        (RenderTarget::Albedo)
+layout (location = 2) out vec4  FragNormal;    // Primary hit normal + distance         (RenderTarget::NormalDepth)
+layout (location = 3) out uvec4 FragID;        // Instance + 1, triangle, material      (RenderTarget::ID)
 
 uniform int        spp;                        // Samples Per Pixel
 uniform float[4]   rdSeed;                     // Random seed
-uniform float[416] Triangles;                  // 32 Triangles
+uniform samplerBuffer  Vertices;               // Hot:  position per vertex
+uniform usamplerBuffer Indices;                // Hot:  vertex indices + material per triangle
+uniform usamplerBuffer MeshNodes;              // Hot:  compressed 8 wide bottom level BVH nodes, 5 texels each
+uniform usamplerBuffer InstanceNodes;          // Hot:  top level BVH nodes, 2 texels each
+uniform usamplerBuffer Instances;              // Hot:  world to object rows + mesh root node
+uniform usamplerBuffer Attributes;             // Cold: octahedral normal + half uv per vertex
+uniform samplerBuffer  Materials;              // Cold: Kd + emission per material
+uniform samplerBuffer  Lights;                 // World space emissive triangles, 3 texels each
+uniform int        InstanceCount;              // Number of instances
+uniform int        LightCount;                 // Number of emissive triangles
 uniform float      RussianRoulette;            // Russian Roulette
 uniform float      IndirLightContriRate;       // Indirect Light Contribution Rate
 uniform mat4       RayRotateMatrix;
@@ -34,10 +51,14 @@ struct Triangle
     vec3 v0;
     vec3 v1;
     vec3 v2;
-    // vec3 normal;
-    vec3 Kd;
-    // vec3 Ks
-    bool isLight;
+};
+
+struct Node
+{
+    vec3 bmin;
+    uint leftFirst; // left child for interior nodes, first triangle or instance for leaves
+    vec3 bmax;
+    uint count;     // 0 for interior nodes
 };
 
 struct Intersection
@@ -46,9 +67,14 @@ struct Intersection
     bool isLight;
     vec3 coords;
     vec3 normal;
+    vec2 texCoords;
+    vec2 barycentric;
     vec3 Kd;
     // vec3 Ks
     float distance;
+    int instance;
+    int primitive; // triangle reference in Indices
+    int material;
 };
 
 // Declaration-----------------------------------------------------------------
@@ -57,7 +83,7 @@ struct Intersection
 void main();
 
 // Shading
-vec3 Shade (Ray ray);
+vec3 Shade (Ray ray, Intersection scene);
 
 // Random
 float RandXY       (float x, float y);
@@ -67,8 +93,19 @@ float GetRandFloat ();
 // BRDF
 vec3 BRDF (vec3 wi, vec3 wo, vec3 N, vec3 Kd);
 
+// Scene Fetch
+Triangle FetchTriangle     (int index);
+Triangle FetchLight        (int index);
+Node     FetchNode         (usamplerBuffer nodes, int index);
+Ray      ToObjectSpace     (Ray ray, int instance);
+vec3     OctDecode         (uint encoded);
+float    HalfToFloat       (uint bits);
+void     FetchHitAttributes(inout Intersection inter, int index, int instance);
+
 // Intersection
+float        IntersectAabb     (Ray ray, vec3 invDir, vec3 bmin, vec3 bmax, float tMax);
 Intersection IntersectTriangle (Ray ray, Triangle triangle);
+bool         IntersectMesh     (Ray ray, int root, inout float closest, inout int hitIndex, inout vec2 hitBarycentric);
 Intersection IntersectScene    (Ray ray);
 
 // Triangle Process
@@ -84,20 +121,37 @@ void main()
 	vec3 color;
 
     vec4 rayDir = RayRotateMatrix * vec4(rayDirection, 0.0f);
+	Ray ray = Ray(eye, vec3(rayDir.x, rayDir.y, rayDir.z));
+
+	// the primary hit feeds both shading and the AOVs
+	Intersection primary = IntersectScene(ray);
 
-	color = Shade(Ray(eye, vec3(rayDir.x, rayDir.y, rayDir.z)));
+	color = Shade(ray, primary);
 
     // color = vec3(Rand());
 
-	FragColor = vec4(color, 1.0);
+	// alpha carries the squared luminance, which TileRenderer sums for the second moment
+	float luminance = dot(color, vec3(0.2126, 0.7152, 0.0722));
+	FragColor = vec4(color, luminance * luminance);
+
+	if (primary.happened)
+	{
+		FragAlbedo = vec4(primary.Kd, 1.0);
+		FragNormal = vec4(primary.normal, primary.distance);
+		FragID = uvec4(uint(primary.instance + 1), uint(primary.primitive), uint(primary.material), 0u);
+	}
+	else
+	{
+		FragAlbedo = vec4(0.0);
+		FragNormal = vec4(0.0);
+		FragID = uvec4(0u);
+	}
 }
 
 // Shading---------------------------------------------------------------------
-vec3 Shade(Ray ray)
+vec3 Shade(Ray ray, Intersection scene)
 {
     // Special case: inside the scene or is a light.
-	Intersection scene = IntersectScene(ray);
-
     if (scene.happened == false)
 		return vec3(0.0, 0.0, 0.0);
 
@@ -124,12 +178,11 @@ vec3 Shade(Ray ray)
 
         bool flag = true;
 
-        Ray curRay = ray;
+        // every bounce starts from the hit the previous one found, the first from the primary hit
+        Intersection inter = scene;
 
         while (flag)
         {
-            Intersection inter = IntersectScene(curRay);
-
 	        vec3 dirLight = vec3(0.0f, 0.0f, 0.0f);
 
             int depth = 0;
@@ -171,7 +224,7 @@ vec3 Shade(Ray ray)
                                                  (PDFTriangle(wo, wi, N) * RussianRoulette);
             }
 
-            curRay = reflectRay;
+            inter = reflectInter;
             flag = reflectInter.happened;
         }
 
@@ -251,7 +304,123 @@ vec3 BRDF(vec3 wi, vec3 wo, vec3 N, vec3 Kd)
     else return vec3(0.0f);
 }
 
+// Scene Fetch-----------------------------------------------------------------
+// Traversal only touches the hot position and index streams.
+Triangle FetchTriangle(int index)
+{
+    uvec4 face = texelFetch(Indices, index);
+
+    return Triangle(texelFetch(Vertices, int(face.x)).xyz,
+                    texelFetch(Vertices, int(face.y)).xyz,
+                    texelFetch(Vertices, int(face.z)).xyz);
+}
+
+// Lights are stored flattened to world space.
+Triangle FetchLight(int index)
+{
+    return Triangle(texelFetch(Lights, index * 3).xyz,
+                    texelFetch(Lights, index * 3 + 1).xyz,
+                    texelFetch(Lights, index * 3 + 2).xyz);
+}
+
+Node FetchNode(usamplerBuffer nodes, int index)
+{
+    uvec4 a = texelFetch(nodes, index * 2);
+    uvec4 b = texelFetch(nodes, index * 2 + 1);
+
+    return Node(uintBitsToFloat(a.xyz), a.w, uintBitsToFloat(b.xyz), b.w);
+}
+
+// The direction is not normalized, so hit distances stay comparable between instances.
+Ray ToObjectSpace(Ray ray, int instance)
+{
+    vec4 r0 = uintBitsToFloat(texelFetch(Instances, instance * 4));
+    vec4 r1 = uintBitsToFloat(texelFetch(Instances, instance * 4 + 1));
+    vec4 r2 = uintBitsToFloat(texelFetch(Instances, instance * 4 + 2));
+
+    vec4 o = vec4(ray.origin, 1.0);
+    vec4 d = vec4(ray.direction, 0.0);
+
+    return Ray(vec3(dot(r0, o), dot(r1, o), dot(r2, o)),
+               vec3(dot(r0, d), dot(r1, d), dot(r2, d)));
+}
+
+// 2 x snorm16, octahedral mapping (unpackSnorm2x16 needs GLSL 4.20).
+vec3 OctDecode(uint encoded)
+{
+    vec2 p = vec2(int(encoded << 16u) >> 16, int(encoded) >> 16);
+    p = clamp(p / 32767.0, -1.0, 1.0);
+
+    vec3 n = vec3(p.x, p.y, 1.0 - abs(p.x) - abs(p.y));
+    float t = max(-n.z, 0.0);
+    n.x += n.x >= 0.0 ? -t : t;
+    n.y += n.y >= 0.0 ? -t : t;
+
+    return normalize(n);
+}
+
+// IEEE half to float (unpackHalf2x16 needs GLSL 4.20).
+float HalfToFloat(uint bits)
+{
+    uint exponent = (bits >> 10u) & 0x1Fu;
+    uint mantissa = bits & 0x3FFu;
+
+    float value;
+    if (exponent == 0u)
+        value = float(mantissa) * exp2(-24.0);
+    else
+        value = exp2(float(exponent) - 15.0) * (1.0 + float(mantissa) / 1024.0);
+
+    return (bits & 0x8000u) != 0u ? -value : value;
+}
+
+// The cold streams are only read once, for the closest hit.
+void FetchHitAttributes(inout Intersection inter, int index, int instance)
+{
+    uvec4 face = texelFetch(Indices, index);
+    vec4 material = texelFetch(Materials, int(face.w));
+
+    inter.Kd = material.rgb;
+    inter.instance = instance;
+    inter.primitive = index;
+    inter.material = int(face.w);
+    inter.isLight = abs(material.a - 1.0f) < EPSILON;
+
+    uvec2 a0 = texelFetch(Attributes, int(face.x)).rg;
+    uvec2 a1 = texelFetch(Attributes, int(face.y)).rg;
+    uvec2 a2 = texelFetch(Attributes, int(face.z)).rg;
+
+    float u = inter.barycentric.x;
+    float v = inter.barycentric.y;
+    float w = 1.0f - u - v;
+
+    // object to world for normals is the transpose of the world to object rows
+    vec3 n = w * OctDecode(a0.x) + u * OctDecode(a1.x) + v * OctDecode(a2.x);
+    vec3 r0 = uintBitsToFloat(texelFetch(Instances, instance * 4).xyz);
+    vec3 r1 = uintBitsToFloat(texelFetch(Instances, instance * 4 + 1).xyz);
+    vec3 r2 = uintBitsToFloat(texelFetch(Instances, instance * 4 + 2).xyz);
+
+    inter.normal = normalize(r0 * n.x + r1 * n.y + r2 * n.z);
+    inter.texCoords = w * vec2(HalfToFloat(a0.y & 0xFFFFu), HalfToFloat(a0.y >> 16u)) +
+                      u * vec2(HalfToFloat(a1.y & 0xFFFFu), HalfToFloat(a1.y >> 16u)) +
+                      v * vec2(HalfToFloat(a2.y & 0xFFFFu), HalfToFloat(a2.y >> 16u));
+}
+
 // Intersection----------------------------------------------------------------
+// Slab test, returns the entry distance or INFINITY on a miss.
+float IntersectAabb(Ray ray, vec3 invDir, vec3 bmin, vec3 bmax, float tMax)
+{
+    vec3 t0 = (bmin - ray.origin) * invDir;
+    vec3 t1 = (bmax - ray.origin) * invDir;
+    vec3 tNear = min(t0, t1);
+    vec3 tFar = max(t0, t1);
+
+    float enter = max(max(tNear.x, tNear.y), max(tNear.z, 0.0));
+    float exit = min(min(tFar.x, tFar.y), min(tFar.z, tMax));
+
+    return enter <= exit ? enter : INFINITY;
+}
+
 Intersection IntersectTriangle(Ray ray, Triangle triangle)
 {
     Intersection inter;
@@ -287,38 +456,163 @@ Intersection IntersectTriangle(Ray ray, Triangle triangle)
     inter.happened = true;
     inter.coords = ray.origin + ray.direction * t_tmp;
     inter.normal = triangleNormal;
+    inter.barycentric = vec2(u, v);
     inter.distance = t_tmp;
-    inter.Kd = triangle.Kd;
-    inter.isLight = triangle.isLight;
 
     return inter;
 }
 
+// Bottom level traversal over the compressed 8 wide nodes, the ray is already in object space.
+// Child boxes decode as origin + q * 2^exponent per axis; leaf slots are intersected as they are met
+// and interior hits are pushed far to near (see CompressedBvhNode).
+bool IntersectMesh(Ray ray, int root, inout float closest, inout int hitIndex, inout vec2 hitBarycentric)
+{
+    bool happened = false;
+    vec3 invDir = 1.0 / ray.direction;
+
+    int stack[MESH_STACK_SIZE];
+    int top = 0;
+    stack[top++] = root;
+
+    while (top > 0)
+    {
+        int index = stack[--top] * 5;
+        uvec4 header = texelFetch(MeshNodes, index);
+        uvec4 refs   = texelFetch(MeshNodes, index + 1);
+        uvec4 q0     = texelFetch(MeshNodes, index + 2);
+        uvec4 q1     = texelFetch(MeshNodes, index + 3);
+        uvec4 q2     = texelFetch(MeshNodes, index + 4);
+
+        vec3 origin = uintBitsToFloat(header.xyz);
+        vec3 scale = uintBitsToFloat(uvec3(header.w & 0xFFu, (header.w >> 8u) & 0xFFu, (header.w >> 16u) & 0xFFu) << 23u);
+        uint interiorMask = header.w >> 24u;
+
+        int child = int(refs.x);
+        int prim = int(refs.y);
+
+        int hitNodes[8];
+        float hitDistances[8];
+        int hitCount = 0;
+
+        for (int slot = 0; slot < 8; ++slot)
+        {
+            bool high = slot >= 4;
+            uint shift = uint(slot & 3) * 8u;
+            uint meta = ((high ? refs.w : refs.z) >> shift) & 0xFFu;
+            bool interior = ((interiorMask >> uint(slot)) & 1u) != 0u;
+            if (!interior && meta == 0u)
+                continue;
+
+            uvec3 qmin = (uvec3(high ? q0.y : q0.x, high ? q0.w : q0.z, high ? q1.y : q1.x) >> shift) & 0xFFu;
+            uvec3 qmax = (uvec3(high ? q1.w : q1.z, high ? q2.y : q2.x, high ? q2.w : q2.z) >> shift) & 0xFFu;
+            float t = IntersectAabb(ray, invDir, origin + vec3(qmin) * scale, origin + vec3(qmax) * scale, closest);
+
+            if (interior)
+            {
+                if (t < INFINITY)
+                {
+                    int j = hitCount++;
+                    for (; j > 0 && hitDistances[j - 1] < t; --j)
+                    {
+                        hitDistances[j] = hitDistances[j - 1];
+                        hitNodes[j] = hitNodes[j - 1];
+                    }
+                    hitDistances[j] = t;
+                    hitNodes[j] = child;
+                }
+                child++;
+                continue;
+            }
+
+            if (t < INFINITY)
+            {
+                for (int i = prim; i < prim + int(meta); ++i)
+                {
+                    Intersection temp = IntersectTriangle(ray, FetchTriangle(i));
+                    if (temp.happened && temp.distance < closest)
+                    {
+                        closest = temp.distance;
+                        hitIndex = i;
+                        hitBarycentric = temp.barycentric;
+                        happened = true;
+                    }
+                }
+            }
+            prim += int(meta);
+        }
+
+        for (int i = 0; i < hitCount; ++i)
+            stack[top++] = hitNodes[i];
+    }
+
+    return happened;
+}
+
+// Top level traversal over instances, descends into the mesh BVH of every instance reached.
 Intersection IntersectScene(Ray ray)
 {
-	Intersection inter, temp;
+	Intersection inter;
 	inter.happened = false;
 
-	float minDistance = -1;
+	if (InstanceCount == 0)
+		return inter;
 
-	int triangleIndex = 0;
+	float closest = INFINITY;
+	int hitIndex = -1;
+	int hitInstance = -1;
+	vec2 hitBarycentric = vec2(0.0);
+	vec3 invDir = 1.0 / ray.direction;
 
-	for (int i = 0; i < 32; ++i)
-    {
-        Triangle triangle = Triangle(vec3(Triangles[triangleIndex++], Triangles[triangleIndex++], Triangles[triangleIndex++]),
-                                     vec3(Triangles[triangleIndex++], Triangles[triangleIndex++], Triangles[triangleIndex++]),
-                                     vec3(Triangles[triangleIndex++], Triangles[triangleIndex++], Triangles[triangleIndex++]),
-                                     vec3(Triangles[triangleIndex++], Triangles[triangleIndex++], Triangles[triangleIndex++]),
-                                     abs(Triangles[triangleIndex++] - 1.0f) < EPSILON);
-
-        temp = IntersectTriangle(ray, triangle);
-        if (temp.happened && (temp.distance <= minDistance || minDistance < 0))
+	int stack[STACK_SIZE];
+	int top = 0;
+	stack[top++] = 0;
+
+	while (top > 0)
+	{
+		Node node = FetchNode(InstanceNodes, stack[--top]);
+		if (IntersectAabb(ray, invDir, node.bmin, node.bmax, closest) >= INFINITY)
+			continue;
+
+		if (node.count > 0u)
+		{
+			for (int i = int(node.leftFirst); i < int(node.leftFirst + node.count); ++i)
+			{
+				int root = int(texelFetch(Instances, i * 4 + 3).x);
+				if (root < 0) // mesh without nodes
+					continue;
+				if (IntersectMesh(ToObjectSpace(ray, i), root, closest, hitIndex, hitBarycentric))
+					hitInstance = i;
+			}
+			continue;
+		}
+
+		int left = int(node.leftFirst);
+		Node l = FetchNode(InstanceNodes, left);
+		Node r = FetchNode(InstanceNodes, left + 1);
+		float tLeft = IntersectAabb(ray, invDir, l.bmin, l.bmax, closest);
+		float tRight = IntersectAabb(ray, invDir, r.bmin, r.bmax, closest);
+
+		if (tLeft <= tRight)
+		{
+			if (tRight < INFINITY) stack[top++] = left + 1;
+			if (tLeft < INFINITY)  stack[top++] = left;
+		}
+		else
 		{
-			inter = temp;
-			minDistance = temp.distance;
+			if (tLeft < INFINITY)  stack[top++] = left;
+			stack[top++] = left + 1;
 		}
 	}
 
+	if (hitInstance >= 0)
+	{
+		inter.happened = true;
+		inter.distance = closest;
+		inter.coords = ray.origin + ray.direction * closest;
+		inter.barycentric = hitBarycentric;
+		FetchHitAttributes(inter, hitIndex, hitInstance);
+	}
+
 	return inter;
 }
 
@@ -375,40 +669,23 @@ Intersection SampleLight()
 {
     Intersection inter;
     float emitAreaSum = 0;
-    int triangleIndex = 0;
 
-    for (int i = 0; i < 32; ++i)
+    for (int i = 0; i < LightCount; ++i)
     {
-        Triangle triangle = Triangle(vec3(Triangles[triangleIndex++], Triangles[triangleIndex++], Triangles[triangleIndex++]),
-                                     vec3(Triangles[triangleIndex++], Triangles[triangleIndex++], Triangles[triangleIndex++]),
-                                     vec3(Triangles[triangleIndex++], Triangles[triangleIndex++], Triangles[triangleIndex++]),
-                                     vec3(Triangles[triangleIndex++], Triangles[triangleIndex++], Triangles[triangleIndex++]),
-                                     abs(Triangles[triangleIndex++] - 1.0f) < EPSILON);
-        if (triangle.isLight)
-        {
-            emitAreaSum += GetTriangleArea(triangle);
-        }
+        emitAreaSum += GetTriangleArea(FetchLight(i));
     }
 
     float p = GetRandFloat() * emitAreaSum;
     emitAreaSum = 0;
-    triangleIndex = 0;
 
-    for (int i = 0; i < 32; ++i)
+    for (int i = 0; i < LightCount; ++i)
     {
-        Triangle triangle = Triangle(vec3(Triangles[triangleIndex++], Triangles[triangleIndex++], Triangles[triangleIndex++]),
-                                     vec3(Triangles[triangleIndex++], Triangles[triangleIndex++], Triangles[triangleIndex++]),
-                                     vec3(Triangles[triangleIndex++], Triangles[triangleIndex++], Triangles[triangleIndex++]),
-                                     vec3(Triangles[triangleIndex++], Triangles[triangleIndex++], Triangles[triangleIndex++]),
-                                     abs(Triangles[triangleIndex++] - 1.0f) < EPSILON);
-        if (triangle.isLight)
+        Triangle triangle = FetchLight(i);
+        emitAreaSum += GetTriangleArea(triangle);
+        if (p <= emitAreaSum)
         {
-            emitAreaSum += GetTriangleArea(triangle);
-            if (p <= emitAreaSum)
-            {
-                inter = SampleTriangleLight(triangle);
-                break;
-            }
+            inter = SampleTriangleLight(triangle);
+            break;
         }
     }
 
@@ -0,0 +1,380 @@
+#include "Utility.hpp"
+#include "CornellBox.hpp"
+#include "CpuPathTracer.hpp"
+#include "SceneBuffer.hpp"
+#include "RenderTarget.hpp"
+#include "SampleSplit.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <sstream>
+
+using Global::WindowWidth;
+using Global::WindowHeight;
+using Global::PixelCount;
+
+// bench [-o file] [-r width height] [-n spp] [--rmse target] [--reference-spp n] [-m model] [--no-gl]
+//
+// Renders a fixed set of scenes and writes what it measured as JSON, to bench.json by default:
+//
+//   cornell          the Cornell box as main renders it
+//   tessellated_<n>  the same box with every wall triangle cut into 4^n, the same picture from more triangles
+//   lights_<n>       the same box with the ceiling light cut into 2 * 4^n lights of the same total area; the
+//                    shader weighs a light sample by the area of the one light picked, so this one comes out
+//                    darker, and the CPU tracer mirrors that
+//   model            the Assimp model of -m or Global::ModelPath in the box, when there is one and a window
+//
+// Per scene: BVH build time, then for the CPU tracer at 1, 2, 4... threads up to the hardware threads
+// and for the GL path tracing pass, samples/s and Mrays/s over spp samples per pixel. The shader counts
+// no rays, the GL figure takes the rays per sample the CPU tracer measured, its paths being the same.
+// Last, the time the CPU tracer on every thread takes until the RMSE against a reference render of
+// reference-spp samples per pixel, over colors clamped to [0, 1] like the 8 bit images, is down to the
+// target; the curve it went down along is kept. The CPU renders at width x height, 256 x 256 by default,
+// the GL pass at the window size.
+
+struct BenchOptions
+{
+	std::string Output = "bench.json";
+	unsigned int Width = 256;
+	unsigned int Height = 256;
+	unsigned int Samples = 4;
+	float TargetRmse = 0.1f;
+	unsigned int ReferenceSamples = 256;
+	std::string ModelPath = Global::ModelPath;
+	bool Gl = true;
+};
+
+struct CpuRun
+{
+	unsigned int Threads;
+	double Seconds;
+	uint64_t Samples;
+	uint64_t Rays;
+};
+
+struct RmsePoint
+{
+	unsigned int Samples;
+	double Seconds;
+	double Rmse;
+};
+
+// rays of the reference are drawn from sample indices no measured render uses
+const unsigned int ReferenceFirstSample = 1u << 24;
+
+double SecondsSince(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Cuts every light, or every triangle that is not one, into 4 along its edge midpoints, level times.
+void Tessellate(TraceGeometry &geometry, int level, bool lights, const std::vector<Material> &materials)
+{
+	for (int l = 0; l < level; l++)
+	{
+		TraceGeometry cut;
+		for (size_t i = 0; i < geometry.TriangleCount(); i++)
+		{
+			glm::vec3 v[3] = {geometry.Positions[geometry.Indices[i].x], geometry.Positions[geometry.Indices[i].y],
+							  geometry.Positions[geometry.Indices[i].z]};
+			unsigned int material = geometry.MaterialIDs[i];
+			glm::vec3 normal = glm::normalize(glm::cross(v[1] - v[0], v[2] - v[0]));
+
+			auto add = [&](const glm::vec3 &a, const glm::vec3 &b, const glm::vec3 &c) {
+				unsigned int first = cut.AddVertex(a, normal, glm::vec2(0.0f));
+				cut.AddVertex(b, normal, glm::vec2(0.0f));
+				cut.AddVertex(c, normal, glm::vec2(0.0f));
+				cut.AddTriangle(first, first + 1, first + 2, material);
+			};
+
+			if ((materials[material].Emission > 0.0f) != lights)
+			{
+				add(v[0], v[1], v[2]);
+				continue;
+			}
+
+			glm::vec3 m01 = (v[0] + v[1]) * 0.5f, m12 = (v[1] + v[2]) * 0.5f, m20 = (v[2] + v[0]) * 0.5f;
+			add(v[0], m01, m20);
+			add(m01, v[1], m12);
+			add(m20, m12, v[2]);
+			add(m01, m12, m20);
+		}
+		geometry = std::move(cut);
+	}
+}
+
+// Averages samples [firstSample, firstSample + samples) of every pixel into color, rows over pool, or on
+// this thread alone without one. Returns the rays cast.
+uint64_t RenderCpu(const CpuPathTracer &tracer, const BenchOptions &options, unsigned int firstSample, unsigned int samples,
+				   ThreadPool *pool, std::vector<float> &color)
+{
+	color.assign(3 * (size_t)options.Width * options.Height, 0.0f);
+	std::atomic<uint64_t> rays(0);
+	glm::vec3 eye = Global::CameraPos;
+	glm::mat4 rayRotateMatrix(1.0f);
+
+	auto row = [&](size_t y) {
+		uint64_t rowRays = 0;
+		for (unsigned int x = 0; x < options.Width; x++)
+		{
+			size_t i = y * options.Width + x;
+			for (unsigned int s = 0; s < samples; s++)
+			{
+				PathSampler sampler(Global::SampleSeed, (uint32_t)i, firstSample + s);
+				CpuPathTracer::PathSample sample = tracer.Trace(x, (unsigned int)y, eye, rayRotateMatrix, sampler, options.Width, options.Height);
+				rowRays += sample.Rays;
+				for (int c = 0; c < 3; c++)
+					color[3 * i + c] += (sample.Color[c] - color[3 * i + c]) / (s + 1);
+			}
+		}
+		rays += rowRays;
+	};
+
+	if (pool)
+		pool->ParallelFor(0, options.Height, 1, row);
+	else
+		for (size_t y = 0; y < options.Height; y++)
+			row(y);
+	return rays;
+}
+
+double Rmse(const std::vector<float> &image, const std::vector<float> &reference)
+{
+	double sum = 0.0;
+	for (size_t i = 0; i < image.size(); i++)
+	{
+		double difference = Global::clamp(0.0f, 1.0f, image[i]) - Global::clamp(0.0f, 1.0f, reference[i]);
+		sum += difference * difference;
+	}
+	return std::sqrt(sum / image.size());
+}
+
+// Passes of doubling size, the RMSE after each, until it is under the target or reference-spp / 4
+// samples are in.
+std::vector<RmsePoint> TimeToRmse(const CpuPathTracer &tracer, const BenchOptions &options, const std::vector<float> &reference)
+{
+	std::vector<RmsePoint> curve;
+	std::vector<float> image(reference.size(), 0.0f), pass;
+	unsigned int samples = 0;
+	double seconds = 0.0;
+	while (samples < std::max(1u, options.ReferenceSamples / 4))
+	{
+		unsigned int passSamples = std::max(1u, samples);
+		auto start = std::chrono::steady_clock::now();
+		RenderCpu(tracer, options, samples, passSamples, &ThreadPool::Instance(), pass);
+		float weight = (float)passSamples / (samples + passSamples);
+		for (size_t i = 0; i < image.size(); i++)
+			image[i] += (pass[i] - image[i]) * weight;
+		seconds += SecondsSince(start);
+		samples += passSamples;
+
+		curve.push_back({samples, seconds, Rmse(image, reference)});
+		if (curve.back().Rmse <= options.TargetRmse)
+			break;
+	}
+	return curve;
+}
+
+// The path tracing pass of main over the whole window, samples times; the seconds it took.
+double RenderGl(Shader &shader, const RenderTarget &target, unsigned int vao, unsigned int samples)
+{
+	std::mt19937 sampler;
+	shader.use();
+	shader.setMat4("RayRotateMatrix", glm::mat4(1.0f));
+	shader.setVec3("Eye", Global::CameraPos);
+	target.Bind();
+	glBindVertexArray(vao);
+
+	// the first draw pays for state the shader has not touched yet
+	glDrawArrays(GL_POINTS, 0, PixelCount);
+	glFinish();
+
+	auto start = std::chrono::steady_clock::now();
+	for (unsigned int s = 0; s < samples; s++)
+	{
+		SeedSample(sampler, Global::SampleSeed, s);
+		float seed[4];
+		for (int i = 0; i < 4; i++)
+			seed[i] = std::generate_canonical<float, 24>(sampler);
+		shader.setArray("rdSeed", 4, seed);
+		glDrawArrays(GL_POINTS, 0, PixelCount);
+	}
+	glFinish();
+	double seconds = SecondsSince(start);
+
+	glBindVertexArray(0);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	return seconds;
+}
+
+int main(int argc, char **argv)
+{
+	BenchOptions options;
+	bool usage = false;
+	for (int i = 1; i < argc && !usage; i++)
+	{
+		std::string option = argv[i];
+		if (option == "-o" && i + 1 < argc)
+			options.Output = argv[++i];
+		else if (option == "-r" && i + 2 < argc)
+		{
+			options.Width = (unsigned int)std::stoul(argv[++i]);
+			options.Height = (unsigned int)std::stoul(argv[++i]);
+		}
+		else if (option == "-n" && i + 1 < argc)
+			options.Samples = (unsigned int)std::stoul(argv[++i]);
+		else if (option == "--rmse" && i + 1 < argc)
+			options.TargetRmse = std::stof(argv[++i]);
+		else if (option == "--reference-spp" && i + 1 < argc)
+			options.ReferenceSamples = (unsigned int)std::stoul(argv[++i]);
+		else if (option == "-m" && i + 1 < argc)
+			options.ModelPath = argv[++i];
+		else if (option == "--no-gl")
+			options.Gl = false;
+		else
+			usage = true;
+	}
+
+	if (usage || options.Width == 0 || options.Height == 0 || options.Samples == 0)
+	{
+		std::cout << "usage: " << argv[0] << " [-o file] [-r width height] [-n spp] [--rmse target] [--reference-spp n] [-m model] [--no-gl]"
+				  << std::endl;
+		return 1;
+	}
+
+	// the window hosts the GL pass, and the context the model textures are loaded with
+	GLFWwindow *window = options.Gl ? Utility::SetupGlfwAndGlad() : nullptr;
+	std::unique_ptr<Shader> shader;
+	std::unique_ptr<RenderTarget> target;
+	unsigned int vao = 0;
+	if (window)
+	{
+		shader.reset(new Shader("SimplePathTracing.vs", "SimplePathTracing.fs"));
+		target.reset(new RenderTarget(WindowWidth, WindowHeight));
+		Utility::camera.GenerateRay();
+		vao = std::get<0>(Utility::SetVAOVBO(Utility::camera.vertices));
+
+		shader->use();
+		shader->setInt("spp", 1);
+		shader->setVec2("Screen", WindowWidth, WindowHeight);
+		shader->setFloat("RussianRoulette", Global::RussianRoulette);
+		shader->setFloat("IndirLightContriRate", Global::IndirLightContributionRate);
+	}
+
+	std::vector<std::string> sceneNames = {"cornell", "tessellated_4", "tessellated_6", "lights_3", "lights_5"};
+	if (window && !options.ModelPath.empty())
+		sceneNames.push_back("model");
+
+	std::vector<unsigned int> threadCounts;
+	unsigned int hardwareThreads = ThreadPool::Instance().Size();
+	for (unsigned int threads = 1; threads < hardwareThreads; threads *= 2)
+		threadCounts.push_back(threads);
+	threadCounts.push_back(hardwareThreads);
+
+	std::ostringstream json;
+	json << "{\n  \"resolution\": [" << options.Width << ", " << options.Height << "],\n"
+		 << "  \"spp\": " << options.Samples << ",\n"
+		 << "  \"hardware_threads\": " << hardwareThreads << ",\n"
+		 << "  \"scenes\": [";
+
+	for (size_t n = 0; n < sceneNames.size(); n++)
+	{
+		const std::string &name = sceneNames[n];
+		std::cout << "bench: " << name << std::endl;
+
+		Scene scene;
+		const BvhBuildMode buildModes[] = {BvhBuildMode::Linear, BvhBuildMode::Sah, BvhBuildMode::Spatial};
+		scene.BuildMode = buildModes[Global::SceneBvhType];
+		TraceGeometry box;
+		LoadCornellBox(box, scene.Materials);
+		if (name.compare(0, 12, "tessellated_") == 0)
+			Tessellate(box, std::stoi(name.substr(12)), false, scene.Materials);
+		else if (name.compare(0, 7, "lights_") == 0)
+			Tessellate(box, std::stoi(name.substr(7)), true, scene.Materials);
+		scene.AddInstance(scene.AddMesh(std::move(box)), glm::mat4(1.0f));
+		if (name == "model")
+		{
+			ChunkCache::Instance().SetBudget(Global::GeometryBudget);
+			Model model(options.ModelPath, false, Global::GeometryStreamPath);
+			model.AddToScene(scene);
+		}
+		scene.Build();
+
+		CpuPathTracer tracer(scene);
+		json << (n ? "," : "") << "\n    {\n      \"name\": \"" << name << "\",\n"
+			 << "      \"triangles\": " << scene.InstancedTriangleCount() << ",\n"
+			 << "      \"lights\": " << tracer.LightCount() << ",\n"
+			 << "      \"bvh_build_ms\": " << scene.BuildMilliseconds() << ",\n"
+			 << "      \"cpu\": [";
+
+		std::vector<float> color;
+		double raysPerSample = 0.0;
+		for (size_t t = 0; t < threadCounts.size(); t++)
+		{
+			// the calling thread takes rows as well, so a pool of n - 1 makes n
+			std::unique_ptr<ThreadPool> pool(threadCounts[t] > 1 ? new ThreadPool(threadCounts[t] - 1) : nullptr);
+			auto start = std::chrono::steady_clock::now();
+			uint64_t rays = RenderCpu(tracer, options, 0, options.Samples, pool.get(), color);
+			CpuRun run = {threadCounts[t], SecondsSince(start), (uint64_t)options.Width * options.Height * options.Samples, rays};
+			raysPerSample = (double)run.Rays / run.Samples;
+
+			json << (t ? "," : "") << "\n        {\"threads\": " << run.Threads << ", \"seconds\": " << run.Seconds
+				 << ", \"samples_per_s\": " << run.Samples / run.Seconds << ", \"mrays_per_s\": " << run.Rays / run.Seconds * 1e-6
+				 << ", \"rays_per_sample\": " << raysPerSample << "}";
+		}
+		json << "\n      ],\n      \"gl\": ";
+
+		SceneBuffer sceneBuffer;
+		if (window && sceneBuffer.Upload(scene))
+		{
+			sceneBuffer.Bind(*shader);
+			double seconds = RenderGl(*shader, *target, vao, options.Samples);
+			double samples = (double)PixelCount * options.Samples;
+			json << "{\"resolution\": [" << WindowWidth << ", " << WindowHeight << "], \"seconds\": " << seconds
+				 << ", \"samples_per_s\": " << samples / seconds << ", \"mrays_per_s_estimated\": "
+				 << samples * raysPerSample / seconds * 1e-6 << "}";
+		}
+		else
+			json << "null";
+
+		json << ",\n      \"time_to_rmse\": ";
+		if (options.TargetRmse > 0.0f)
+		{
+			std::vector<float> reference;
+			RenderCpu(tracer, options, ReferenceFirstSample, options.ReferenceSamples, &ThreadPool::Instance(), reference);
+			std::vector<RmsePoint> curve = TimeToRmse(tracer, options, reference);
+			bool reached = curve.back().Rmse <= options.TargetRmse;
+
+			json << "{\"target\": " << options.TargetRmse << ", \"reference_spp\": " << options.ReferenceSamples
+				 << ", \"reached\": " << (reached ? "true" : "false") << ", \"seconds\": ";
+			if (reached)
+				json << curve.back().Seconds << ", \"spp\": " << curve.back().Samples;
+			else
+				json << "null, \"spp\": null";
+			json << ",\n        \"curve\": [";
+			for (size_t i = 0; i < curve.size(); i++)
+				json << (i ? ", " : "") << "{\"spp\": " << curve[i].Samples << ", \"seconds\": " << curve[i].Seconds
+					 << ", \"rmse\": " << curve[i].Rmse << "}";
+			json << "]}";
+		}
+		else
+			json << "null";
+		json << "\n    }";
+	}
+	json << "\n  ]\n}\n";
+
+	if (window)
+		glfwTerminate();
+
+	std::ofstream out(options.Output);
+	out << json.str();
+	if (!out)
+	{
+		std::cout << "ERROR::BENCH:: Failed to write " << options.Output << std::endl;
+		return 1;
+	}
+	std::cout << "bench: results in " << options.Output << std::endl;
+	return 0;
+}
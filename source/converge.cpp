@@ -0,0 +1,276 @@
+#include "Utility.hpp"
+#include "CpuPathTracer.hpp"
+#include "SceneBuffer.hpp"
+#include "RenderTarget.hpp"
+#include "TileRenderer.hpp"
+#include "HdrWriter.hpp"
+#include "ImageMetrics.hpp"
+
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <memory>
+
+using Global::WindowWidth;
+using Global::WindowHeight;
+
+// converge [-b cpu|gl] [-s scene] [-r width height] [-n spp | -t seconds] [-z max] [-o file] reference.pfm
+// converge --make-reference spp [-b cpu|gl] [-s scene] [-r width height] reference.pfm
+//
+// Convergence and bias check of the path tracer against a stored float reference of the same view, the
+// start camera over "cornell" or the box with a model in it. The reference is rendered once with many
+// samples by a build that is trusted, from sample indices no test render uses, and kept as a PFM.
+//
+// A test render goes on in passes of half the samples it has, until spp samples or seconds of rendering,
+// and after every pass it is compared with the reference (see ImageMetrics). The curve of MSE, relMSE,
+// SSIM and bias against samples and seconds goes to a JSON file, converge.json by default, along with
+// the slope of log MSE over log spp, -1 for a renderer that only has noise left, and the MSE it levels
+// off at, from a fit of MSE = floor + noise / spp.
+//
+// An unbiased change to Shade (the shader's, and CpuPathTracer's that mirrors it) may be faster or
+// slower to converge, but converges to the reference. A change that trades bias for speed leaves the
+// mean luminance off by more than max (default 5) standard errors at the end; converge then exits with
+// 2, so it can gate changes. The CPU backend renders width x height, 256 x 256 by default, the GL backend
+// the window.
+
+const unsigned int ReferenceFirstSample = 1u << 24;
+
+struct CurvePoint
+{
+	unsigned int Samples;
+	double Seconds;
+	ImageError Error;
+};
+
+// One backend over one scene, rendering passes of samples into a running average.
+class ConvergeRenderer
+{
+public:
+	unsigned int Width, Height;
+
+	ConvergeRenderer(const Scene &scene, unsigned int width, unsigned int height)
+		: Width(width), Height(height), tracer(new CpuPathTracer(scene)) {}
+	ConvergeRenderer(Shader &shader, const RenderTarget &target, unsigned int vao)
+		: Width(WindowWidth), Height(WindowHeight), gl(new TileRenderer(shader, target, vao)) {}
+
+	void Pass(unsigned int firstSample, unsigned int samples, std::vector<float> &image, unsigned int rendered)
+	{
+		TileResult pass;
+		pass.Region.Width = Width;
+		pass.Region.Height = Height;
+		pass.FirstSample = firstSample;
+		pass.Samples = samples;
+		if (gl)
+			gl->Render(pass, eye, rayRotateMatrix);
+		else
+			tracer->Render(pass, eye, rayRotateMatrix, Width, Height);
+
+		image.resize(pass.Color.size(), 0.0f);
+		float weight = (float)samples / (rendered + samples);
+		for (size_t i = 0; i < image.size(); i++)
+			image[i] += (pass.Color[i] - image[i]) * weight;
+	}
+
+private:
+	std::unique_ptr<CpuPathTracer> tracer;
+	std::unique_ptr<TileRenderer> gl;
+	glm::vec3 eye = Global::CameraPos;
+	glm::mat4 rayRotateMatrix = Camera().GetRotateMatrix();
+};
+
+// Least squares fits of log MSE = a + slope log spp, and of MSE = floor + noise / spp.
+void FitCurve(const std::vector<CurvePoint> &curve, double &slope, double &floor)
+{
+	double n = 0, sx = 0, sy = 0, sxx = 0, sxy = 0;
+	double fx = 0, fy = 0, fxx = 0, fxy = 0;
+	for (const CurvePoint &point : curve)
+	{
+		if (point.Error.Mse <= 0.0)
+			continue;
+		double x = std::log((double)point.Samples), y = std::log(point.Error.Mse);
+		double inverse = 1.0 / point.Samples;
+		n++;
+		sx += x, sy += y, sxx += x * x, sxy += x * y;
+		fx += inverse, fy += point.Error.Mse, fxx += inverse * inverse, fxy += inverse * point.Error.Mse;
+	}
+
+	slope = floor = 0.0;
+	if (n < 2 || n * sxx - sx * sx <= 0.0 || n * fxx - fx * fx <= 0.0)
+		return;
+	slope = (n * sxy - sx * sy) / (n * sxx - sx * sx);
+	double noise = (n * fxy - fx * fy) / (n * fxx - fx * fx);
+	floor = std::max((fy - noise * fx) / n, 0.0);
+}
+
+int main(int argc, char **argv)
+{
+	std::string backend = "cpu";
+	std::string sceneId = "cornell";
+	std::string output = "converge.json";
+	std::string referencePath;
+	unsigned int width = 256, height = 256;
+	unsigned int samples = 64;
+	unsigned int referenceSamples = 0;
+	double seconds = 0.0;
+	double maxZ = 5.0;
+
+	bool usage = false;
+	for (int i = 1; i < argc && !usage; i++)
+	{
+		std::string option = argv[i];
+		if (option == "-b" && i + 1 < argc)
+			backend = argv[++i];
+		else if (option == "-s" && i + 1 < argc)
+			sceneId = argv[++i];
+		else if (option == "-r" && i + 2 < argc)
+		{
+			width = (unsigned int)std::stoul(argv[++i]);
+			height = (unsigned int)std::stoul(argv[++i]);
+		}
+		else if (option == "-n" && i + 1 < argc)
+			samples = (unsigned int)std::stoul(argv[++i]);
+		else if (option == "-t" && i + 1 < argc)
+			seconds = std::stod(argv[++i]);
+		else if (option == "-z" && i + 1 < argc)
+			maxZ = std::stod(argv[++i]);
+		else if (option == "-o" && i + 1 < argc)
+			output = argv[++i];
+		else if (option == "--make-reference" && i + 1 < argc)
+			referenceSamples = (unsigned int)std::stoul(argv[++i]);
+		else if (option[0] != '-' && referencePath.empty())
+			referencePath = option;
+		else
+			usage = true;
+	}
+
+	if (usage || referencePath.empty() || (backend != "cpu" && backend != "gl") || width == 0 || height == 0 || samples == 0)
+	{
+		std::cout << "usage: " << argv[0] << " [-b cpu|gl] [-s scene] [-r width height] [-n spp | -t seconds] [-z max] [-o file] reference.pfm\n"
+				  << "       " << argv[0] << " --make-reference spp [-b cpu|gl] [-s scene] [-r width height] reference.pfm" << std::endl;
+		return 1;
+	}
+
+	// the GL backend needs the window's context, and so do the textures of a model
+	GLFWwindow *window = nullptr;
+	if (backend == "gl" || sceneId != "cornell")
+	{
+		window = Utility::SetupGlfwAndGlad();
+		if (window == nullptr)
+			return 1;
+	}
+
+	Scene scene;
+	if (sceneId != "cornell" && !std::ifstream(sceneId))
+	{
+		std::cout << "ERROR::CONVERGE:: No scene " << sceneId << std::endl;
+		return 1;
+	}
+	Utility::LoadScene(scene, sceneId == "cornell" ? "" : sceneId);
+	scene.Build();
+
+	std::unique_ptr<Shader> shader;
+	std::unique_ptr<RenderTarget> target;
+	SceneBuffer sceneBuffer;
+	std::unique_ptr<ConvergeRenderer> renderer;
+	if (backend == "gl")
+	{
+		shader.reset(new Shader("SimplePathTracing.vs", "SimplePathTracing.fs", nullptr,
+								SceneBuffer::ShaderDefines(SceneBuffer::MeshStackSize(scene))));
+		target.reset(new RenderTarget(WindowWidth, WindowHeight));
+		Utility::camera.GenerateRay();
+		unsigned int vao = std::get<0>(Utility::SetVAOVBO(Utility::camera.vertices));
+
+		shader->use();
+		shader->setInt("spp", 1);
+		shader->setVec2("Screen", WindowWidth, WindowHeight);
+		shader->setFloat("RussianRoulette", Global::RussianRoulette);
+		shader->setFloat("IndirLightContriRate", Global::IndirLightContributionRate);
+		if (!sceneBuffer.Upload(scene))
+		{
+			glfwTerminate();
+			return 1;
+		}
+		sceneBuffer.Bind(*shader);
+		renderer.reset(new ConvergeRenderer(*shader, *target, vao));
+	}
+	else
+		renderer.reset(new ConvergeRenderer(scene, width, height));
+
+	std::vector<float> image;
+	if (referenceSamples > 0)
+	{
+		for (unsigned int rendered = 0; rendered < referenceSamples;)
+		{
+			unsigned int pass = std::min(referenceSamples - rendered, 16u);
+			renderer->Pass(ReferenceFirstSample + rendered, pass, image, rendered);
+			rendered += pass;
+			std::cout << "converge: reference " << rendered << "/" << referenceSamples << " spp" << std::endl;
+		}
+		bool written = HdrWriter::WritePFM(referencePath.c_str(), renderer->Width, renderer->Height, image.data());
+		if (window)
+			glfwTerminate();
+		return written ? 0 : 1;
+	}
+
+	unsigned int referenceWidth, referenceHeight;
+	std::vector<float> reference;
+	if (!HdrWriter::ReadPFM(referencePath.c_str(), referenceWidth, referenceHeight, reference))
+		return 1;
+	if (referenceWidth != renderer->Width || referenceHeight != renderer->Height)
+	{
+		std::cout << "ERROR::CONVERGE:: The reference is " << referenceWidth << "x" << referenceHeight << ", the render "
+				  << renderer->Width << "x" << renderer->Height << std::endl;
+		return 1;
+	}
+
+	std::vector<CurvePoint> curve;
+	unsigned int rendered = 0;
+	double elapsed = 0.0;
+	std::cout << std::setw(8) << "spp" << std::setw(12) << "seconds" << std::setw(14) << "MSE" << std::setw(14) << "relMSE"
+			  << std::setw(10) << "SSIM" << std::setw(10) << "bias z" << std::endl;
+	while (seconds > 0.0 ? elapsed < seconds : rendered < samples)
+	{
+		unsigned int pass = std::max(1u, rendered / 2);
+		if (seconds <= 0.0)
+			pass = std::min(pass, samples - rendered);
+
+		auto start = std::chrono::steady_clock::now();
+		renderer->Pass(rendered, pass, image, rendered);
+		elapsed += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		rendered += pass;
+
+		CurvePoint point = {rendered, elapsed, ImageMetrics::Compare(image.data(), reference.data(), renderer->Width, renderer->Height)};
+		curve.push_back(point);
+		std::cout << std::setw(8) << point.Samples << std::setw(12) << point.Seconds << std::setw(14) << point.Error.Mse
+				  << std::setw(14) << point.Error.RelMse << std::setw(10) << point.Error.Ssim << std::setw(10) << point.Error.BiasZ
+				  << std::endl;
+	}
+
+	if (window)
+		glfwTerminate();
+
+	double slope, floor;
+	FitCurve(curve, slope, floor);
+	bool biased = std::abs(curve.back().Error.BiasZ) > maxZ;
+
+	std::ofstream out(output);
+	out << "{\n  \"scene\": \"" << sceneId << "\",\n  \"backend\": \"" << backend << "\",\n"
+		<< "  \"resolution\": [" << renderer->Width << ", " << renderer->Height << "],\n"
+		<< "  \"reference\": \"" << referencePath << "\",\n  \"curve\": [";
+	for (size_t i = 0; i < curve.size(); i++)
+		out << (i ? "," : "") << "\n    {\"spp\": " << curve[i].Samples << ", \"seconds\": " << curve[i].Seconds
+			<< ", \"mse\": " << curve[i].Error.Mse << ", \"relmse\": " << curve[i].Error.RelMse << ", \"ssim\": " << curve[i].Error.Ssim
+			<< ", \"bias_z\": " << curve[i].Error.BiasZ << "}";
+	out << "\n  ],\n  \"mse_slope\": " << slope << ",\n  \"mse_floor\": " << floor << ",\n"
+		<< "  \"max_bias_z\": " << maxZ << ",\n  \"biased\": " << (biased ? "true" : "false") << "\n}\n";
+	if (!out)
+	{
+		std::cout << "ERROR::CONVERGE:: Failed to write " << output << std::endl;
+		return 1;
+	}
+
+	std::cout << "converge: MSE slope " << slope << ", floor " << floor << ", "
+			  << (biased ? "BIASED, the mean is off by " + std::to_string(curve.back().Error.BiasZ) + " standard errors" : "no bias found")
+			  << std::endl;
+	return biased ? 2 : 0;
+}
@@ -0,0 +1,54 @@
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include <cmath>
+#include <iostream>
+#include <string>
+
+#include "FrameSaver.hpp"
+#include "DistributedRender.hpp"
+
+using Global::ImageName;
+using Global::ImageFileType;
+using Global::ImageDenoiser;
+using Global::SaveAOVs;
+
+// coordinator [-o image] workers: renders the frame from the start camera tile by tile over that many
+// workers (main --worker cpu|gl, started on their own), then saves the image main would have saved.
+// Needs no window.
+int main(int argc, char **argv)
+{
+	std::string output = ImageName;
+	unsigned int workers = 0;
+	for (int i = 1; i < argc; i++)
+	{
+		if (std::string(argv[i]) == "-o" && i + 1 < argc)
+			output = argv[++i];
+		else
+			workers = (unsigned int)std::stoul(argv[i]);
+	}
+
+	if (workers == 0)
+	{
+		std::cout << "usage: " << argv[0] << " [-o image] workers" << std::endl;
+		return 1;
+	}
+
+	Camera camera;
+	FrameSaver image;
+	TileCoordinator coordinator(image, camera.Position, camera.GetRotateMatrix());
+	if (!coordinator.Run(Global::CoordinatorPort, workers))
+		return 1;
+
+	// without a window the GL denoiser falls back to the CPU one
+	if (ImageDenoiser != Global::NoDenoise)
+	{
+		DenoiseGuides guides;
+		image.GetGuides(guides);
+		Denoiser denoiser(DenoiserBackend::Cpu);
+		image.Denoise(denoiser, guides);
+	}
+
+	image.SaveImage(output.c_str(), ImageFileType, SaveAOVs && ImageFileType == Global::EXR);
+	return 0;
+}
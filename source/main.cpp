@@ -1,6 +1,15 @@
 #include "Utility.hpp"
 #include "CornellBox.hpp"
 #include "FrameSaver.hpp"
+#include "SceneBuffer.hpp"
+#include "ProgressiveDisplay.hpp"
+#include "DynamicResolution.hpp"
+#include "AsyncImageWriter.hpp"
+#include "Checkpoint.hpp"
+#include "SampleSplit.hpp"
+#include "DistributedRender.hpp"
+#include "RenderDaemon.hpp"
+#include "FrameTimer.hpp"
 
 using Global::WindowWidth;
 using Global::WindowHeight;
@@ -9,9 +18,40 @@ using Global::ImageFileType;
 using Global::spp;
 using Global::RussianRoulette;
 using Global::IndirLightContributionRate;
+using Global::ModelPath;
+using Global::ImageDenoiser;
+using Global::SaveAOVs;
+using Global::TargetFrameMilliseconds;
+using Global::SnapshotSeconds;
+using Global::CheckpointPath;
+using Global::CheckpointSeconds;
+using Global::FrameStatsSeconds;
 
-int main()
+// main [--node i n | --worker cpu|gl | --daemon cpu|gl]: with --node, renders the i-th of n disjoint shares of
+// the samples of the frame from the start camera, writes them as a partial render and exits; merge combines
+// the partials. With --worker, renders the tiles the coordinator hands out with either backend until it is
+// done. With --daemon, serves render jobs (see RenderDaemon and submit) until told to quit.
+int main(int argc, char **argv)
 {
+	SampleRange range;
+	bool worker = false;
+	bool daemon = false;
+	bool glBackend = false;
+	std::string mode = argc > 1 ? argv[1] : "";
+	if (argc == 4 && mode == "--node")
+		range = SampleRange::ForNode((unsigned int)std::stoul(argv[2]), (unsigned int)std::stoul(argv[3]));
+	else if (argc == 3 && (mode == "--worker" || mode == "--daemon") && (std::string(argv[2]) == "cpu" || std::string(argv[2]) == "gl"))
+	{
+		worker = mode == "--worker";
+		daemon = mode == "--daemon";
+		glBackend = std::string(argv[2]) == "gl";
+	}
+	else if (argc != 1)
+	{
+		std::cout << "usage: " << argv[0] << " [--node i n | --worker cpu|gl | --daemon cpu|gl]" << std::endl;
+		return 1;
+	}
+
 	GLFWwindow *window = Utility::SetupGlfwAndGlad();
 
 	if (window == nullptr)
@@ -19,42 +59,147 @@ int main()
 
 	Shader pathTracingShader("SimplePathTracing.vs", "SimplePathTracing.fs");
 
-	FrameSaver image;
+	FrameSaver image(range.Count());
+	RenderTarget renderTarget(WindowWidth, WindowHeight);
+	ProgressiveDisplay display(WindowWidth, WindowHeight);
 
 	Camera &camera = Utility::camera;
 
+	// the nodes of a split frame all render it from where the camera starts
+	if (range.IsSplit())
+	{
+		camera.MovementSpeed = 0.0f;
+		camera.MouseSensitivity = 0.0f;
+	}
+
 	camera.GenerateRay();
 
 	auto tuple = Utility::SetVAOVBO(camera.vertices);
 	unsigned int VAO = std::get<0>(tuple);
 	// unsigned int VBO = std::get<1>(tuple); // uncomment if necessary.
 
-	pathTracingShader.use();
-	pathTracingShader.setInt("spp", 1); // currently, high spp real time rendering is not supported.
-	pathTracingShader.setVec2("Screen", WindowWidth, WindowHeight);
-	pathTracingShader.setArray("Triangles", sizeof(triangleVertices), const_cast<float *>(triangleVertices));
-	pathTracingShader.setFloat("RussianRoulette", RussianRoulette);
-	pathTracingShader.setFloat("IndirLightContriRate", IndirLightContributionRate);
+	// the uniforms of the whole run, set again whenever the shader is compiled for a larger mesh stack
+	auto compileShader = [&pathTracingShader](int meshStackSize) {
+		if (meshStackSize > 0)
+		{
+			glDeleteProgram(pathTracingShader.ID);
+			pathTracingShader = Shader("SimplePathTracing.vs", "SimplePathTracing.fs", nullptr, SceneBuffer::ShaderDefines(meshStackSize));
+		}
+		pathTracingShader.use();
+		pathTracingShader.setInt("spp", 1); // currently, high spp real time rendering is not supported.
+		pathTracingShader.setVec2("Screen", WindowWidth, WindowHeight);
+		pathTracingShader.setFloat("RussianRoulette", RussianRoulette);
+		pathTracingShader.setFloat("IndirLightContriRate", IndirLightContributionRate);
+	};
+	compileShader(0);
+
+	// the daemon loads its scenes as jobs name them: "cornell", or the path of a model to put in the box
+	if (daemon)
+	{
+		RenderDaemon::SceneLoader loader = [](const std::string &id, Scene &scene) {
+			if (id != "cornell" && !std::ifstream(id))
+				return false;
+			Utility::LoadScene(scene, id == "cornell" ? "" : id);
+			return true;
+		};
+		std::unique_ptr<RenderDaemon> service(glBackend ? new RenderDaemon(loader, pathTracingShader, renderTarget, VAO)
+														: new RenderDaemon(loader));
+		bool served = service->Run(Global::DaemonSocketPath);
+		glfwTerminate();
+		return served ? 0 : 1;
+	}
+
+	Scene scene;
+	Utility::LoadScene(scene, ModelPath);
+	scene.Build();
 
-	srand(time(NULL));
+	// only a CPU worker traces a scene with streamed meshes, the shader cannot; the daemon above keeps
+	// the stack any tree fits in, a scene of our own gets a shader with the stack its trees need
+	SceneBuffer sceneBuffer;
+	int meshStackSize = SceneBuffer::MeshStackSize(scene);
+	if (!worker || glBackend)
+	{
+		if (!sceneBuffer.Upload(scene))
+		{
+			glfwTerminate();
+			return 1;
+		}
+		compileShader(meshStackSize);
+	}
+	sceneBuffer.Bind(pathTracingShader);
+
+	// a worker keeps the scene loaded for every tile it is sent, the window only hosts the GL context
+	if (worker)
+	{
+		std::unique_ptr<TileRenderer> renderer(glBackend ? new TileRenderer(pathTracingShader, renderTarget, VAO)
+														: new TileRenderer(scene));
+		bool served = TileWorker::Run(Global::CoordinatorPort, *renderer);
+		glfwTerminate();
+		return served ? 0 : 1;
+	}
+
+	// the k-th frame a view accumulates is seeded as sample Begin + k, split or not, so the nodes of a split
+	// frame trace exactly the samples one process would; frames of earlier views count on, so a moved
+	// camera does not repeat the seeds of the history it reprojects
+	std::mt19937 sampler;
+	unsigned int earlierFrames = 0;
+
+	// the nodes of a split frame checkpoint one file each
+	std::string checkpointPath = CheckpointPath;
+	if (!checkpointPath.empty() && range.IsSplit())
+		checkpointPath += "_node" + std::to_string(range.Node);
+
+	if (!checkpointPath.empty() && Checkpoint::Exists(checkpointPath) &&
+		Checkpoint::Load(checkpointPath, image, camera, sampler, scene))
+		std::cout << "Resumed from " << checkpointPath << " at " << image.Samples() << " spp" << std::endl;
 
 	glm::mat4 rayRotateMatrix = glm::identity<glm::mat4>();
 
-	int counter = 0;
+	unsigned int viewVersion = camera.ViewVersion;
+	DynamicResolution resolution(VAO, TargetFrameMilliseconds);
+
+	AsyncImageWriter writer(Global::SaveQueueBytes, Global::SaveQueueJobs,
+							Global::SaveQueueDropsOldest ? AsyncImageWriter::Overflow::DropOldest : AsyncImageWriter::Overflow::Block);
+	float lastSnapshot = (float)glfwGetTime();
+	float lastCheckpoint = lastSnapshot;
+
+	// P prints the timing report, a line of stats goes out every FrameStatsSeconds
+	FrameTimer timer(Global::FrameTimerFrames);
+	float lastStats = lastSnapshot;
+	size_t lastStatsFrame = 0;
+	bool reportKeyDown = false;
 
 	// render loop=================================================================================
 	while (!glfwWindowShouldClose(window))
 	{
-		std::cout << "Frame count: " << counter << std::endl;
-		counter++;
+		timer.BeginFrame();
+		timer.Begin(FrameTimer::Input);
 		Utility::ProcessTime();
 		Utility::ProcessInput(window);
+		timer.End(FrameTimer::Input);
+
+		timer.Begin(FrameTimer::Upload);
+		// streams refit nodes and moved instances, nothing when the scene is static
+		SceneUpdate sceneUpdate = scene.Update();
+		sceneBuffer.Update(scene, sceneUpdate);
+		if (!sceneUpdate.Empty() && SceneBuffer::MeshStackSize(scene) > meshStackSize)
+		{
+			meshStackSize = SceneBuffer::MeshStackSize(scene);
+			compileShader(meshStackSize);
+			sceneBuffer.Bind(pathTracingShader);
+		}
+
+		bool viewChanged = camera.ViewVersion != viewVersion || !sceneUpdate.Empty();
+		viewVersion = camera.ViewVersion;
 
-		glClearColor(0.05f, 0.05f, 0.05f, 1.0f);
-		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+		resolution.Update(viewChanged);
+		renderTarget.Bind(resolution.Width(), resolution.Height());
 
-		float seed[4] = {(float)rand() / RAND_MAX, (float)rand() / RAND_MAX,
-						 (float)rand() / RAND_MAX, (float)rand() / RAND_MAX};
+		SeedSample(sampler, Global::SampleSeed, range.Begin + earlierFrames + image.Frames());
+
+		float seed[4];
+		for (int i = 0; i < 4; i++)
+			seed[i] = std::generate_canonical<float, 24>(sampler);
 
 		rayRotateMatrix = camera.GetRotateMatrix();
 
@@ -62,19 +207,113 @@ int main()
 		pathTracingShader.setArray("rdSeed", 4, seed);
 		pathTracingShader.setMat4("RayRotateMatrix", rayRotateMatrix);
 		pathTracingShader.setVec3("Eye", camera.Position.x, camera.Position.y, camera.Position.z);
+		timer.End(FrameTimer::Upload);
+
+		timer.BeginGpu();
+		resolution.Draw();
+		timer.EndGpu();
 
-		glBindVertexArray(VAO);
-		glDrawArrays(GL_POINTS, 0, WindowWidth * WindowHeight);
+		timer.Begin(FrameTimer::Display);
+		int framebufferWidth, framebufferHeight;
+		glfwGetFramebufferSize(window, &framebufferWidth, &framebufferHeight);
+		display.Accumulate(renderTarget, viewChanged, resolution.Width(), resolution.Height());
+		display.BlitToWindow(framebufferWidth, framebufferHeight);
 
 		glfwSwapBuffers(window);
+		timer.End(FrameTimer::Display);
+
+		timer.Begin(FrameTimer::Input);
 		glfwPollEvents();
+		timer.End(FrameTimer::Input);
+
+		// the saved image only takes native frames
+		if (resolution.Native())
+		{
+			unsigned int frames = image.Frames();
+			if (image.SaveBuffer(renderTarget, camera.Position, rayRotateMatrix, &timer))
+				earlierFrames += frames;
+		}
+
+		if (SnapshotSeconds > 0.0f && glfwGetTime() - lastSnapshot >= SnapshotSeconds)
+		{
+			lastSnapshot = (float)glfwGetTime();
+			std::shared_ptr<const FrameSnapshot> snapshot = image.Snapshot(false);
+			if (snapshot)
+				writer.SaveImage(snapshot, Global::ImagePath + "progress_spp_" + std::to_string((int)snapshot->Samples) + "." +
+											   Global::EnumString[ImageFileType],
+								 ImageFileType);
+		}
+
+		if (!checkpointPath.empty() && CheckpointSeconds > 0.0f && glfwGetTime() - lastCheckpoint >= CheckpointSeconds)
+		{
+			lastCheckpoint = (float)glfwGetTime();
+			Checkpoint::Save(checkpointPath, image, camera, sampler, scene);
+		}
+
+		if (range.IsSplit() && image.Done())
+			glfwSetWindowShouldClose(window, true);
+
+		bool reportKey = glfwGetKey(window, GLFW_KEY_P) == GLFW_PRESS;
+		if (reportKey && !reportKeyDown)
+			timer.Report(std::cout);
+		reportKeyDown = reportKey;
 
-		image.SaveBuffer();
+		timer.EndFrame();
+
+		float now = (float)glfwGetTime();
+		if (FrameStatsSeconds > 0.0f && now - lastStats >= FrameStatsSeconds)
+		{
+			float fps = (timer.Frames() - lastStatsFrame) / (now - lastStats);
+			float gpu = timer.RecentMedian(FrameTimer::PathTrace, false);
+			std::cout << "Frame " << timer.Frames() << ": " << fps << " fps, frame " << timer.RecentMedian(FrameTimer::Frame, true)
+					  << " ms, path trace " << (gpu >= 0.0f ? std::to_string(gpu) + " ms" : std::string("pending")) << ", "
+					  << image.Samples() << " spp" << std::endl;
+			lastStats = now;
+			lastStatsFrame = timer.Frames();
+		}
 	}
 	//=============================================================================================
 
-	image.SaveImage(ImageName.c_str(), ImageFileType);
+	timer.Report(std::cout);
+
+	// a node leaves its samples raw for merge, the denoiser runs on the merged frame
+	bool written;
+	if (range.IsSplit())
+		written = PartialRender::Save(PartialRender::FileName(range), image, range);
+	else
+	{
+		if (ImageDenoiser != Global::NoDenoise)
+		{
+			DenoiseGuides guides;
+			image.GetGuides(guides);
+			Denoiser denoiser(ImageDenoiser == Global::GLDenoise ? DenoiserBackend::Gl : DenoiserBackend::Cpu);
+			image.Denoise(denoiser, guides);
+		}
+
+		std::shared_ptr<const FrameSnapshot> result = image.Snapshot(SaveAOVs);
+		writer.SaveImage(result, ImageName, ImageFileType, SaveAOVs);
+
+		// an EXR already carries the AOVs
+		if (SaveAOVs && ImageFileType != Global::EXR)
+		{
+			const std::string aovNames[] = {"albedo", "normal", "depth", "triangle", "material"};
+			for (int i = 0; i < 5; i++)
+				writer.SaveAov(result, Global::ImagePath + "aov_" + aovNames[i] + "." + Global::EnumString[ImageFileType],
+							   (FrameSaver::Aov)i, ImageFileType);
+		}
+
+		written = writer.Flush();
+	}
+
+	// the checkpoint is stale once the result is out, and keeps the render when it could not be written
+	if (!checkpointPath.empty())
+	{
+		if (written)
+			Checkpoint::Remove(checkpointPath);
+		else
+			Checkpoint::Save(checkpointPath, image, camera, sampler, scene);
+	}
 
 	glfwTerminate();
-	return 0;
+	return written ? 0 : 1;
 }
\ No newline at end of file
@@ -0,0 +1,75 @@
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "FrameSaver.hpp"
+#include "SampleSplit.hpp"
+
+using Global::ImageName;
+using Global::ImageFileType;
+using Global::ImageDenoiser;
+using Global::SaveAOVs;
+
+// merge [-o image] partial...: adds up the partial renders the nodes of a split frame wrote (main --node i n),
+// weighted by their sample counts, and saves the image main would have saved. Needs no window.
+int main(int argc, char **argv)
+{
+	std::string output = ImageName;
+	std::vector<std::string> partials;
+	for (int i = 1; i < argc; i++)
+	{
+		if (std::string(argv[i]) == "-o" && i + 1 < argc)
+			output = argv[++i];
+		else
+			partials.push_back(argv[i]);
+	}
+
+	if (partials.empty())
+	{
+		std::cout << "usage: " << argv[0] << " [-o image] partial..." << std::endl;
+		return 1;
+	}
+
+	FrameSaver image;
+	std::vector<SampleRange> ranges;
+	for (const std::string &fileName : partials)
+	{
+		FrameSaver partial;
+		SampleRange range;
+		if (!PartialRender::Load(fileName, partial, range) || !image.Merge(partial))
+			return 1;
+		ranges.push_back(range);
+	}
+
+	// the image is still worth saving with a node missing, but not silently
+	std::sort(ranges.begin(), ranges.end(), [](const SampleRange &a, const SampleRange &b) { return a.Begin < b.Begin; });
+	unsigned int next = 0;
+	for (const SampleRange &range : ranges)
+	{
+		if (range.Begin != next)
+			std::cout << "merge: samples [" << std::min(next, range.Begin) << ", " << std::max(next, range.Begin) << ") are "
+					  << (range.Begin > next ? "missing" : "merged twice") << std::endl;
+		next = std::max(next, range.End);
+	}
+	if (next != (unsigned int)Global::spp)
+		std::cout << "merge: samples [" << next << ", " << Global::spp << ") are missing" << std::endl;
+
+	std::cout << "merge: " << partials.size() << " partial renders, " << image.Samples() << " spp" << std::endl;
+
+	// without a window the GL denoiser falls back to the CPU one
+	if (ImageDenoiser != Global::NoDenoise)
+	{
+		DenoiseGuides guides;
+		image.GetGuides(guides);
+		Denoiser denoiser(DenoiserBackend::Cpu);
+		image.Denoise(denoiser, guides);
+	}
+
+	image.SaveImage(output.c_str(), ImageFileType, SaveAOVs && ImageFileType == Global::EXR);
+	return 0;
+}
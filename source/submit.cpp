@@ -0,0 +1,120 @@
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include <cmath>
+#include <iostream>
+#include <string>
+
+#include "RenderDaemon.hpp"
+
+// submit [-p priority] [-s scene] [-e x y z yaw pitch] [-r width height] [-n spp] image: has the render daemon
+// (main --daemon cpu|gl) render a job and waits for it; the daemon writes the image. The scene is "cornell"
+// or the path of a model to put in the box, the rest defaults to the start camera, the window and spp.
+// submit -c job cancels a job, submit -q stops the daemon.
+int main(int argc, char **argv)
+{
+	DaemonPacket::JobHeader header;
+	header.Priority = 0;
+	header.Width = Global::WindowWidth;
+	header.Height = Global::WindowHeight;
+	header.Samples = Global::spp;
+	header.Position[0] = Global::OriginX;
+	header.Position[1] = Global::OriginY;
+	header.Position[2] = Global::OriginZ;
+	header.Yaw = Global::CameraYaw;
+	header.Pitch = Global::CameraPitch;
+
+	std::string scene = "cornell";
+	std::string output;
+	uint32_t cancel = 0;
+	bool quit = false;
+	bool usage = argc < 2;
+	for (int i = 1; i < argc && !usage; i++)
+	{
+		std::string option = argv[i];
+		if (option == "-p" && i + 1 < argc)
+			header.Priority = std::stoi(argv[++i]);
+		else if (option == "-s" && i + 1 < argc)
+			scene = argv[++i];
+		else if (option == "-e" && i + 5 < argc)
+		{
+			for (int c = 0; c < 3; c++)
+				header.Position[c] = std::stof(argv[++i]);
+			header.Yaw = std::stof(argv[++i]);
+			header.Pitch = std::stof(argv[++i]);
+		}
+		else if (option == "-r" && i + 2 < argc)
+		{
+			header.Width = (uint32_t)std::stoul(argv[++i]);
+			header.Height = (uint32_t)std::stoul(argv[++i]);
+		}
+		else if (option == "-n" && i + 1 < argc)
+			header.Samples = (uint32_t)std::stoul(argv[++i]);
+		else if (option == "-c" && i + 1 < argc)
+			cancel = (uint32_t)std::stoul(argv[++i]);
+		else if (option == "-q")
+			quit = true;
+		else if (option[0] != '-' && output.empty())
+			output = option;
+		else
+			usage = true;
+	}
+
+	if (usage || (output.empty() && cancel == 0 && !quit))
+	{
+		std::cout << "usage: " << argv[0] << " [-p priority] [-s scene] [-e x y z yaw pitch] [-r width height] [-n spp] image\n"
+				  << "       " << argv[0] << " -c job | -q" << std::endl;
+		return 1;
+	}
+
+	if (!Socket::Startup())
+		return 1;
+	Socket daemon = Socket::ConnectLocal(Global::DaemonSocketPath);
+	if (!daemon.Valid())
+		return 1;
+
+	if (quit)
+		return daemon.SendPacket(DaemonPacket::Quit, nullptr, 0) ? 0 : 1;
+
+	uint32_t type;
+	std::vector<char> reply;
+	if (cancel != 0)
+	{
+		uint32_t answer[2];
+		if (!daemon.SendPacket(DaemonPacket::Cancel, &cancel, sizeof(cancel)) || !daemon.ReceivePacket(type, reply) ||
+			type != DaemonPacket::Cancel || reply.size() != sizeof(answer))
+			return 1;
+		std::memcpy(answer, reply.data(), sizeof(answer));
+		std::cout << "Job " << cancel << (answer[1] ? " cancelled" : " was not queued") << std::endl;
+		return answer[1] ? 0 : 1;
+	}
+
+	header.SceneBytes = (uint32_t)scene.size();
+	header.OutputBytes = (uint32_t)output.size();
+	std::vector<char> payload((const char *)&header, (const char *)(&header + 1));
+	payload.insert(payload.end(), scene.begin(), scene.end());
+	payload.insert(payload.end(), output.begin(), output.end());
+
+	uint32_t job;
+	if (!daemon.SendPacket(DaemonPacket::Submit, payload) || !daemon.ReceivePacket(type, reply) ||
+		type != DaemonPacket::Accepted || reply.size() != sizeof(job))
+	{
+		std::cout << "ERROR::SUBMIT:: The daemon did not take the job" << std::endl;
+		return 1;
+	}
+	std::memcpy(&job, reply.data(), sizeof(job));
+	std::cout << "Job " << job << " queued" << std::endl;
+
+	DaemonPacket::FinishedHeader finished;
+	if (!daemon.ReceivePacket(type, reply) || type != DaemonPacket::Finished || reply.size() < sizeof(finished))
+	{
+		std::cout << "ERROR::SUBMIT:: Lost the daemon" << std::endl;
+		return 1;
+	}
+	std::memcpy(&finished, reply.data(), sizeof(finished));
+
+	const char *status[] = {"done", "cancelled", "failed"};
+	std::cout << "Job " << job << " " << status[std::min(finished.Status, 2u)] << ", " << finished.Samples << " spp in "
+			  << finished.Milliseconds << " ms" << std::endl;
+	return finished.Status == DaemonPacket::Done ? 0 : 1;
+}